@@ -0,0 +1,179 @@
+/*******************************************************************************
+ *
+ * bidx.c
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "bidx.h"
+#include "castr.h"
+
+#define KEYS_PER_LINE 8         /* 64-byte cache line / 8-byte key */
+
+static size_t eytzinger_next(size_t n, size_t k)
+{
+  if (k == 0 || 2 * k + 1 <= n) {
+
+    /* Leftmost node of the right subtree (or of the whole tree). */
+    k = (k == 0) ? 1 : 2 * k + 1;
+    if (k > n) {
+      return 0;
+    }
+    while (2 * k <= n) {
+      k = 2 * k;
+    }
+    return k;
+  }
+
+  /* Climb while being a right child; the parent is next then. */
+  while (k & 1) {
+    k >>= 1;
+  }
+
+  return k >> 1;
+}
+
+int bidx_write(const char *path, const struct caibx *idx)
+{
+  struct bidx_header header;
+  struct zero_chunks zero;
+  uint64_t *keys = calloc(idx->n + 1, sizeof(uint64_t));
+  struct bidx_record *records = calloc(idx->n + 1, sizeof(struct bidx_record));
+  size_t i = 0;
+  FILE *fp = NULL;
+  int ret = -1;
+
+  if (keys == NULL || records == NULL) {
+    fprintf(stderr, "Failed to allocate sidecar index.\n");
+    goto out;
+  }
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, BIDX_MAGIC, sizeof(header.magic));
+  header.version = BIDX_VERSION;
+  header.record_size = sizeof(struct bidx_record);
+  header.byte_order = BIDX_BYTE_ORDER;
+  header.feature_flags = idx->feature_flags;
+  header.chunk_size_min = idx->chunk_size_min;
+  header.chunk_size_max = idx->chunk_size_max;
+  header.n = idx->n;
+  zero_chunks_init(&zero, caibx_sha512_256(idx),
+                   idx->chunk_size_min, idx->chunk_size_max);
+  for (size_t k = eytzinger_next(idx->n, 0); k; k = eytzinger_next(idx->n, k)) {
+    const struct caibx_chunk *chunk = &idx->chunks[i++];
+    keys[k] = chunk->offset;
+    records[k].size = (uint32_t)chunk->size;
+    memcpy(records[k].id, chunk->id, CHUNK_ID_LEN);
+    if (is_zero_chunk(&zero, chunk)) {
+      records[k].flags |= BIDX_ZERO;
+      header.zero_n++;
+      header.zero_bytes += chunk->size;
+    }
+  }
+  if ((fp = fopen(path, "w")) == NULL) {
+    fprintf(stderr, "Failed to create %s: %s\n", path, strerror(errno));
+    goto out;
+  }
+  if (fwrite(&header, sizeof(header), 1, fp) != 1
+      || fwrite(keys, sizeof(uint64_t), idx->n + 1, fp) != idx->n + 1
+      || fwrite(records, sizeof(struct bidx_record), idx->n + 1, fp)
+         != idx->n + 1) {
+    fprintf(stderr, "Failed to write %s: %s\n", path, strerror(errno));
+    goto out;
+  }
+  ret = 0;
+
+  out:
+    if (fp && fclose(fp)) {
+      ret = -1;
+    }
+    free(keys);
+    free(records);
+
+    return ret;
+}
+
+int bidx_open(const char *path, struct bidx *bx)
+{
+  struct stat st;
+  const struct bidx_header *header;
+  int fd;
+
+  memset(bx, 0, sizeof(struct bidx));
+  if ((fd = open(path, O_RDONLY)) < 0) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  if (fstat(fd, &st) || (size_t)st.st_size < sizeof(struct bidx_header)) {
+    fprintf(stderr, "%s is too short.\n", path);
+    close(fd);
+    return -1;
+  }
+  bx->map_len = st.st_size;
+  bx->map = mmap(NULL, bx->map_len, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (bx->map == MAP_FAILED) {
+    fprintf(stderr, "Failed to mmap %s: %s\n", path, strerror(errno));
+    bx->map = NULL;
+    return -1;
+  }
+  header = bx->map;
+  if (memcmp(header->magic, BIDX_MAGIC, sizeof(header->magic))
+      || header->version != BIDX_VERSION
+      || header->byte_order != BIDX_BYTE_ORDER
+      || header->record_size != sizeof(struct bidx_record)
+      || bx->map_len != sizeof(struct bidx_header)
+         + (header->n + 1) * (sizeof(uint64_t) + sizeof(struct bidx_record))) {
+    fprintf(stderr, "%s isn't a valid sidecar index.\n", path);
+    bidx_close(bx);
+    return -1;
+  }
+  bx->header = header;
+  bx->n = header->n;
+  bx->keys = (const uint64_t *)(header + 1);
+  bx->records = (const struct bidx_record *)(bx->keys + bx->n + 1);
+
+  return 0;
+}
+
+void bidx_close(struct bidx *bx)
+{
+  if (bx->map) {
+    munmap(bx->map, bx->map_len);
+  }
+  memset(bx, 0, sizeof(struct bidx));
+}
+
+size_t bidx_lookup(const struct bidx *bx, uint64_t offset)
+{
+  size_t k = 1, found = 0;
+
+  /* The last node we go right at holds the greatest start <= offset. */
+  while (k <= bx->n) {
+    int right = bx->keys[k] <= offset;
+
+    /* keys[8k..8k+7], the line of k's descendants 3 levels below */
+    __builtin_prefetch(bx->keys + k * KEYS_PER_LINE);
+    found = right ? k : found;
+    k = 2 * k + right;
+  }
+  if (found == 0
+      || offset - bx->keys[found] >= bx->records[found].size) {
+    return 0;
+  }
+
+  return found;
+}
+
+size_t bidx_next(const struct bidx *bx, size_t slot)
+{
+  return eytzinger_next(bx->n, slot);
+}
@@ -0,0 +1,77 @@
+/*******************************************************************************
+ *
+ * bidx.h
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#ifndef BOOTFS_BIDX_H
+#define BOOTFS_BIDX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "caibx.h"
+
+/*
+ * Sidecar chunk index (rootfs.bidx), generated from the caibx by the
+ * converter and mmap'ed as is by boot for its own offset-to-chunk lookups.
+ * desync still parses the caibx for the lazy read path.
+ *
+ *   header (128 bytes, so that keys start on a cache line)
+ *   keys[n + 1]    start offsets in Eytzinger (BFS) order, keys[0] unused
+ *   records[n + 1] size and ID of the chunk in the same slot
+ *
+ * Lookups of an archive offset only walk the dense keys array, in which the
+ * 8 descendants 3 levels below a slot share a cache line, and read a single
+ * record at the end. Fields
+ * are in the converter's byte order; bidx_open() rejects a foreign one
+ * through byte_order.
+ */
+#define BIDX_MAGIC      "BOOTFSIX"
+#define BIDX_VERSION    2
+#define BIDX_BYTE_ORDER 0x01020304
+#define BIDX_ZERO       0x1     /* record flag: all-zero chunk */
+
+struct bidx_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  uint32_t byte_order;
+  uint32_t reserved;
+  uint64_t feature_flags;
+  uint64_t chunk_size_min;
+  uint64_t chunk_size_max;
+  uint64_t n;
+  uint64_t zero_n;
+  uint64_t zero_bytes;
+  uint8_t pad[56];
+};
+
+struct bidx_record {
+  uint32_t size;
+  uint32_t flags;
+  uint8_t id[CHUNK_ID_LEN];
+};
+
+struct bidx {
+  const struct bidx_header *header;
+  const uint64_t *keys;
+  const struct bidx_record *records;
+  size_t n;
+  void *map;
+  size_t map_len;
+};
+
+int bidx_write(const char *path, const struct caibx *idx);
+int bidx_open(const char *path, struct bidx *bx);
+void bidx_close(struct bidx *bx);
+
+/* Slot of the chunk which contains offset, or 0 if out of the archive. */
+size_t bidx_lookup(const struct bidx *bx, uint64_t offset);
+
+/* Slots in archive order (in-order traversal). Start with slot = 0. */
+size_t bidx_next(const struct bidx *bx, size_t slot);
+
+#endif
@@ -0,0 +1,192 @@
+/*******************************************************************************
+ *
+ * bman.c
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "bman.h"
+
+static uint32_t vec_len(const char **vec)
+{
+  uint32_t n = 0;
+
+  while (vec && vec[n]) {
+    n++;
+  }
+
+  return n;
+}
+
+int bman_write(const char *path, const struct bman_spec *spec)
+{
+  struct bman_header *header;
+  uint32_t *offsets;
+  size_t size = sizeof(struct bman_header), pos;
+  char *buf;
+  FILE *fp;
+  int ret = -1;
+
+  /* Size the whole file first, then lay it out in one buffer. */
+  for (int v = 0; v < BMAN_VEC_NUM; v++) {
+    for (uint32_t i = 0; i < vec_len(spec->vec[v]); i++) {
+      size += sizeof(uint32_t) + strlen(spec->vec[v][i]) + 1;
+    }
+  }
+  for (int s = 0; s < BMAN_STR_NUM; s++) {
+    size += spec->str[s] ? strlen(spec->str[s]) + 1 : 0;
+  }
+  if (size > UINT32_MAX || (buf = calloc(1, size)) == NULL) {
+    fprintf(stderr, "Failed to allocate boot manifest.\n");
+    return -1;
+  }
+  header = (struct bman_header *)buf;
+  memcpy(header->magic, BMAN_MAGIC, sizeof(header->magic));
+  header->version = BMAN_VERSION;
+  header->byte_order = BMAN_BYTE_ORDER;
+  header->size = size;
+  header->flags = spec->flags;
+  header->archive_format = spec->archive_format;
+  header->uid = spec->uid;
+  header->gid = spec->gid;
+  pos = sizeof(struct bman_header);
+  for (int v = 0; v < BMAN_VEC_NUM; v++) {
+    header->vec[v].off = pos;
+    header->vec[v].n = vec_len(spec->vec[v]);
+    pos += header->vec[v].n * sizeof(uint32_t);
+  }
+  for (int v = 0; v < BMAN_VEC_NUM; v++) {
+    offsets = (uint32_t *)(buf + header->vec[v].off);
+    for (uint32_t i = 0; i < header->vec[v].n; i++) {
+      offsets[i] = pos;
+      strcpy(buf + pos, spec->vec[v][i]);
+      pos += strlen(spec->vec[v][i]) + 1;
+    }
+  }
+  for (int s = 0; s < BMAN_STR_NUM; s++) {
+    if (spec->str[s]) {
+      header->str[s] = pos;
+      strcpy(buf + pos, spec->str[s]);
+      pos += strlen(spec->str[s]) + 1;
+    }
+  }
+  if ((fp = fopen(path, "w")) == NULL) {
+    fprintf(stderr, "Failed to create %s: %s\n", path, strerror(errno));
+    goto out;
+  }
+  if (fwrite(buf, size, 1, fp) != 1) {
+    fprintf(stderr, "Failed to write %s: %s\n", path, strerror(errno));
+    fclose(fp);
+    goto out;
+  }
+  ret = fclose(fp) ? -1 : 0;
+
+  out:
+    free(buf);
+
+    return ret;
+}
+
+/* Every offset must point into the map; strings end at the file's NUL. */
+static int bman_valid(const struct bman *bm)
+{
+  const struct bman_header *header = bm->header;
+  const char *base = bm->map;
+  uint32_t limit = bm->map_len;
+
+  if (memcmp(header->magic, BMAN_MAGIC, sizeof(header->magic))
+      || header->version != BMAN_VERSION
+      || header->byte_order != BMAN_BYTE_ORDER
+      || header->size != bm->map_len) {
+    return 0;
+  }
+  if (limit > sizeof(struct bman_header) && base[limit - 1] != '\0') {
+    return 0;
+  }
+  for (int v = 0; v < BMAN_VEC_NUM; v++) {
+    const struct bman_vec *vec = &header->vec[v];
+    if (vec->off % sizeof(uint32_t) || vec->off > limit
+        || vec->n > (limit - vec->off) / sizeof(uint32_t)) {
+      return 0;
+    }
+    for (uint32_t i = 0; i < vec->n; i++) {
+      uint32_t off = ((const uint32_t *)(base + vec->off))[i];
+      if (off < sizeof(struct bman_header) || off >= limit) {
+        return 0;
+      }
+    }
+  }
+  for (int s = 0; s < BMAN_STR_NUM; s++) {
+    if (header->str[s] && (header->str[s] < sizeof(struct bman_header)
+                           || header->str[s] >= limit)) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+int bman_open(const char *path, struct bman *bm)
+{
+  struct stat st;
+  int fd;
+
+  memset(bm, 0, sizeof(struct bman));
+  if ((fd = open(path, O_RDONLY)) < 0) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  if (fstat(fd, &st) || (size_t)st.st_size < sizeof(struct bman_header)) {
+    fprintf(stderr, "%s is too short.\n", path);
+    close(fd);
+    return -1;
+  }
+  bm->map_len = st.st_size;
+  bm->map = mmap(NULL, bm->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (bm->map == MAP_FAILED) {
+    fprintf(stderr, "Failed to mmap %s: %s\n", path, strerror(errno));
+    bm->map = NULL;
+    return -1;
+  }
+  bm->header = bm->map;
+  if (!bman_valid(bm)) {
+    fprintf(stderr, "%s isn't a valid boot manifest.\n", path);
+    bman_close(bm);
+    return -1;
+  }
+
+  return 0;
+}
+
+void bman_close(struct bman *bm)
+{
+  if (bm->map) {
+    munmap(bm->map, bm->map_len);
+  }
+  memset(bm, 0, sizeof(struct bman));
+}
+
+const char *bman_str(const struct bman *bm, int which)
+{
+  uint32_t off = bm->header->str[which];
+
+  return off ? (const char *)bm->map + off : NULL;
+}
+
+const char *bman_vec_str(const struct bman *bm, int which, uint32_t i)
+{
+  const uint32_t *offsets
+    = (const uint32_t *)((const char *)bm->map + bm->header->vec[which].off);
+
+  return (const char *)bm->map + offsets[i];
+}
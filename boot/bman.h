@@ -0,0 +1,98 @@
+/*******************************************************************************
+ *
+ * bman.h
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#ifndef BOOTFS_BMAN_H
+#define BOOTFS_BMAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Boot manifest (/.bootfs/boot.bman), generated by the converter from the
+ * original image config and mmap'ed as is by boot.
+ *
+ *   header (fixed size)
+ *   uint32_t offsets[] of the strings of each vector, vector by vector
+ *   NUL-terminated strings
+ *
+ * All offsets are from the top of the file, and 0 means "unset" for single
+ * strings. Like the sidecar index, fields are in the converter's byte order.
+ */
+#define BMAN_MAGIC      "BOOTFSMF"
+#define BMAN_VERSION    2
+#define BMAN_BYTE_ORDER 0x01020304
+
+/* Archive formats */
+#define BMAN_ARCHIVE_ISO9660 1
+#define BMAN_ARCHIVE_CATAR   2
+
+/* Flags */
+#define BMAN_USER 0x1           /* switch to uid/gid before exec */
+
+/* Vectors */
+#define BMAN_ENTRYPOINT 0
+#define BMAN_CMD        1
+#define BMAN_ENV        2
+#define BMAN_VOLUMES    3       /* mountpoints which must exist in rootfs */
+#define BMAN_LAYERS     4       /* caibx of each layer, lowest first */
+#define BMAN_VEC_NUM    5
+
+/* Strings */
+#define BMAN_WORKING_DIR 0
+#define BMAN_INDEX       1      /* caibx */
+#define BMAN_SIDECAR     2      /* bidx */
+#define BMAN_PROFILE     3      /* startup profile used as prefetch hints */
+#define BMAN_STR_NUM     4
+
+struct bman_vec {
+  uint32_t off;
+  uint32_t n;
+};
+
+struct bman_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t size;
+  uint32_t flags;
+  uint32_t archive_format;
+  uint32_t uid;
+  uint32_t gid;
+  uint32_t reserved;
+  struct bman_vec vec[BMAN_VEC_NUM];
+  uint32_t str[BMAN_STR_NUM];
+};
+
+struct bman {
+  const struct bman_header *header;
+  void *map;
+  size_t map_len;
+};
+
+/* What the converter knows; vectors are NULL-terminated or NULL. */
+struct bman_spec {
+  const char **vec[BMAN_VEC_NUM];
+  const char *str[BMAN_STR_NUM];
+  uint32_t flags;
+  uint32_t archive_format;
+  uint32_t uid;
+  uint32_t gid;
+};
+
+int bman_write(const char *path, const struct bman_spec *spec);
+int bman_open(const char *path, struct bman *bm);
+void bman_close(struct bman *bm);
+
+/* String in the map, or NULL if unset. */
+const char *bman_str(const struct bman *bm, int which);
+
+/* Number of strings in a vector, and the i-th one. */
+#define bman_vec_len(bm, which) ((bm)->header->vec[which].n)
+const char *bman_vec_str(const struct bman *bm, int which, uint32_t i);
+
+#endif
@@ -0,0 +1,244 @@
+/*******************************************************************************
+ *
+ * bman_util.c
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "bman.h"
+#include "parson/parson.h"
+
+#define PASSWD_FILE "/etc/passwd"
+#define GROUP_FILE  "/etc/group"
+
+static const char *vec_names[BMAN_VEC_NUM]
+  = { "Entrypoint", "Cmd", "Env", "Volumes", "Layers" };
+static const char *str_names[BMAN_STR_NUM]
+  = { "WorkingDir", "Index", "Sidecar", "Profile" };
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "Usage:\n");
+  fprintf(stderr, "  %s make CONFIG ROOTFS OUT [-a iso9660|catar] [-i INDEX] "
+          "[-b SIDECAR] [-p PROFILE]\n"
+          "          [-l LAYER_INDEX]...\n", name);
+  fprintf(stderr, "      Generate boot manifest from image config json. "
+          "-l gives the index of\n"
+          "      each layer, lowest first, to overlay at boot instead of "
+          "INDEX\n");
+  fprintf(stderr, "  %s dump MANIFEST\n", name);
+  fprintf(stderr, "      Print boot manifest\n");
+}
+
+/* Strings of a JSON array (or names of a JSON object), NULL-terminated. */
+static const char **json_strv(const JSON_Object *config, const char *name)
+{
+  JSON_Array *array = json_object_dotget_array(config, name);
+  JSON_Object *object = json_object_dotget_object(config, name);
+  size_t n = array ? json_array_get_count(array)
+    : object ? json_object_get_count(object) : 0;
+  const char **vec = calloc(n + 1, sizeof(char *));
+
+  for (size_t i = 0; vec && i < n; i++) {
+    vec[i] = array ? json_array_get_string(array, i)
+      : json_object_get_name(object, i);
+    if (vec[i] == NULL) {
+      vec[i] = "";
+    }
+  }
+
+  return vec;
+}
+
+/* Look a name (or number) up in a passwd-like file of the original rootfs. */
+static int lookup_id(const char *rootfs, const char *file, const char *name,
+                     uint32_t *id, uint32_t *primary_gid)
+{
+  char path[PATH_MAX], line[1024], *fields[4], *p;
+  char *end;
+  unsigned long num = strtoul(name, &end, 10);
+  int numeric = *name && *end == '\0';
+  FILE *fp;
+
+  snprintf(path, sizeof(path), "%s%s", rootfs, file);
+  if ((fp = fopen(path, "r")) != NULL) {
+    while (fgets(line, sizeof(line), fp)) {
+      int n = 0;
+      for (p = line; n < 4; n++) {
+        fields[n] = p;
+        if ((p = strchr(p, ':')) == NULL) {
+          break;
+        }
+        *p++ = '\0';
+      }
+      if (n < 3) {
+        continue;
+      }
+      if (numeric ? strtoul(fields[2], NULL, 10) == num
+                  : strcmp(fields[0], name) == 0) {
+        *id = strtoul(fields[2], NULL, 10);
+        if (primary_gid) {
+          *primary_gid = n > 3 ? strtoul(fields[3], NULL, 10) : *id;
+        }
+        fclose(fp);
+        return 0;
+      }
+    }
+    fclose(fp);
+  }
+  if (numeric) {
+    *id = num;
+    return 0;
+  }
+  fprintf(stderr, "%s isn't found in %s.\n", name, path);
+
+  return -1;
+}
+
+/* "user", "uid", "user:group" or "uid:gid", as docker accepts. */
+static int resolve_user(const char *rootfs, const char *user,
+                        struct bman_spec *spec)
+{
+  char name[256], *group;
+
+  if (user == NULL || *user == '\0') {
+    return 0;
+  }
+  snprintf(name, sizeof(name), "%s", user);
+  if ((group = strchr(name, ':'))) {
+    *group++ = '\0';
+  }
+  spec->gid = 0;
+  if (lookup_id(rootfs, PASSWD_FILE, name, &spec->uid, &spec->gid)
+      || (group && lookup_id(rootfs, GROUP_FILE, group, &spec->gid, NULL))) {
+    return -1;
+  }
+  spec->flags |= BMAN_USER;
+
+  return 0;
+}
+
+static int make(int argc, char *argv[])
+{
+  const char *config_path = argv[2], *rootfs = argv[3], *out = argv[4];
+  struct bman_spec spec;
+  JSON_Value *root_value;
+  JSON_Object *config;
+  const char **layers;
+  int opt, nlayers = 0, ret = 1;
+
+  /* Every -l fits in what's left of argv. */
+  if ((layers = calloc(argc, sizeof(char *))) == NULL) {
+    fprintf(stderr, "Failed to allocate layers.\n");
+    return 1;
+  }
+  memset(&spec, 0, sizeof(spec));
+  spec.archive_format = BMAN_ARCHIVE_ISO9660;
+  optind = 5;
+  while ((opt = getopt(argc, argv, "a:i:b:p:l:")) != -1) {
+    switch (opt) {
+    case 'a':
+      if (strcmp(optarg, "iso9660") == 0) {
+        spec.archive_format = BMAN_ARCHIVE_ISO9660;
+      } else if (strcmp(optarg, "catar") == 0) {
+        spec.archive_format = BMAN_ARCHIVE_CATAR;
+      } else {
+        fprintf(stderr, "Unknown archive format %s.\n", optarg);
+        free(layers);
+        return 1;
+      }
+      break;
+    case 'i': spec.str[BMAN_INDEX] = optarg; break;
+    case 'b': spec.str[BMAN_SIDECAR] = optarg; break;
+    case 'p': spec.str[BMAN_PROFILE] = optarg; break;
+    case 'l': layers[nlayers++] = optarg; break;
+    default:
+      free(layers);
+      return 1;
+    }
+  }
+  if (nlayers && spec.archive_format != BMAN_ARCHIVE_ISO9660) {
+    fprintf(stderr, "Layers are overlaid only as iso9660.\n");
+    free(layers);
+    return 1;
+  }
+  if ((root_value = json_parse_file(config_path)) == NULL
+      || (config = json_object_get_object(json_value_get_object(root_value),
+                                          "config")) == NULL) {
+    fprintf(stderr, "%s isn't an image config.\n", config_path);
+    json_value_free(root_value);
+    free(layers);
+    return 1;
+  }
+  spec.vec[BMAN_LAYERS] = layers;
+  for (int v = 0; v < BMAN_LAYERS; v++) {
+    if ((spec.vec[v] = json_strv(config, vec_names[v])) == NULL) {
+      fprintf(stderr, "Failed to allocate %s.\n", vec_names[v]);
+      goto out;
+    }
+  }
+  spec.str[BMAN_WORKING_DIR] = json_object_get_string(config, "WorkingDir");
+  if (spec.str[BMAN_WORKING_DIR] && *spec.str[BMAN_WORKING_DIR] == '\0') {
+    spec.str[BMAN_WORKING_DIR] = NULL;
+  }
+  if (resolve_user(rootfs, json_object_get_string(config, "User"), &spec)) {
+    goto out;
+  }
+  ret = bman_write(out, &spec) ? 1 : 0;
+
+  out:
+    for (int v = 0; v < BMAN_VEC_NUM; v++) {
+      free(spec.vec[v]);
+    }
+    json_value_free(root_value);
+
+    return ret;
+}
+
+static int dump(const char *path)
+{
+  struct bman bm;
+
+  if (bman_open(path, &bm)) {
+    return 1;
+  }
+  printf("Archive: %s\n",
+         bm.header->archive_format == BMAN_ARCHIVE_CATAR ? "catar" : "iso9660");
+  if (bm.header->flags & BMAN_USER) {
+    printf("User: %u:%u\n", bm.header->uid, bm.header->gid);
+  }
+  for (int s = 0; s < BMAN_STR_NUM; s++) {
+    if (bman_str(&bm, s)) {
+      printf("%s: %s\n", str_names[s], bman_str(&bm, s));
+    }
+  }
+  for (int v = 0; v < BMAN_VEC_NUM; v++) {
+    printf("%s:", vec_names[v]);
+    for (uint32_t i = 0; i < bman_vec_len(&bm, v); i++) {
+      printf(" \"%s\"", bman_vec_str(&bm, v, i));
+    }
+    printf("\n");
+  }
+  bman_close(&bm);
+
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc >= 5 && strcmp(argv[1], "make") == 0) {
+    return make(argc, argv);
+  } else if (argc == 3 && strcmp(argv[1], "dump") == 0) {
+    return dump(argv[2]);
+  }
+  usage(argv[0]);
+
+  return 1;
+}
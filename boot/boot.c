@@ -9,26 +9,102 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <grp.h>
 #include <limits.h>
 #include <linux/loop.h>
-#include <mntent.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mount.h>
+#include <sys/socket.h>
 #include <sys/sysmacros.h>
 #include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
+#include "bidx.h"
+#include "bman.h"
+#include "bootfsd.h"
+#include "caibx.h"
+#include "castr.h"
+#include "chunkio.h"
+#include "mntapi.h"
 #include "parson/parson.h"
 #include "path.h"
+#include "stage.h"
+#include "tune.h"
 
 /* Limit configuration */
 #define EXISTENCE_CHECK_LIMIT    1000000
 #define MAX_FILENAME_PATH_LENGTH 1000000
 
+/* Prefetch-only mode: boot --warm [PROFILE] */
+#define WARM_OPTION              "--warm"
+
+/* Store configuration */
+#define STORE_CONCURRENCY_ENV    "BOOTFS_STORE_CONCURRENCY"
+#define STORE_CONCURRENCY        8
+
+/* Don't hash cached chunks of an image if all of them are marked verified. */
+#define TRUST_CACHE_ENV          "BOOTFS_TRUST_CACHE"
+
 #define access_file(path) access(path, F_OK)
 
+/* Chunk files handed to the chunk I/O engine at once */
+#define CHUNKIO_BATCH            4096
+#define CHUNKIO_PATH_LEN         256
+
+/* Mounts carried over into the new rootfs */
+struct submounts {
+  size_t n;
+  char **dirs;
+};
+void free_submounts(struct submounts *sm);
+
+/* Boot trace, printed if BOOTFS_TRACE is set in the environment. */
+#define TRACE_ENV                "BOOTFS_TRACE"
+
+/* Knobs of the lazy archive mount and the loop device on top (see tune.h) */
+#define FUSE_MAX_BACKGROUND_ENV       "BOOTFS_FUSE_MAX_BACKGROUND"
+#define FUSE_CONGESTION_THRESHOLD_ENV "BOOTFS_FUSE_CONGESTION_THRESHOLD"
+#define FUSE_READ_AHEAD_KB_ENV        "BOOTFS_FUSE_READ_AHEAD_KB"
+#define LOOP_READ_AHEAD_KB_ENV        "BOOTFS_LOOP_READ_AHEAD_KB"
+#define LOOP_DIRECT_IO_ENV            "BOOTFS_LOOP_DIRECT_IO"
+
+/* Threads running the boot stages, mostly blocked on I/O or child processes */
+#define BOOT_STAGE_WORKERS       4
+
+struct trace {
+  int enabled;
+  struct timespec start;
+};
+
+static void trace_begin(struct trace *t)
+{
+  t->enabled = getenv(TRACE_ENV) != NULL;
+  clock_gettime(CLOCK_MONOTONIC, &t->start);
+}
+
+static void trace_end(const struct trace *t, const char *stage)
+{
+  struct timespec end;
+
+  if (t->enabled) {
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fprintf(stderr, "Trace: %s took %.3f ms.\n", stage,
+            (end.tv_sec - t->start.tv_sec) * 1e3
+            + (end.tv_nsec - t->start.tv_nsec) / 1e6);
+  }
+}
+
+/* Boot manifest generated by the converter, and the paths it points to. */
+static struct bman manifest;
+static const char *caibx_file = CAIBX_FILE;   /* of layer 0 if layered */
+static const char *bidx_file = BIDX_FILE;
+static uint32_t nlayers;                        /* overlaid, or 0 */
+
 int access_dir(const char *path)
 {
   DIR* dir = opendir(path);
@@ -97,12 +173,148 @@ int wait_if_empty_dir(const char *trydir, int trynum)
   return 0;
 }
 
-int mount_archive_from_caibx_lazily()
+/*
+ * desync takes per-store options only from its config file. The concurrency
+ * is the number of sessions desync keeps open to the store, which for ssh://
+ * stores are channels multiplexed over one connection by dbclient_y.
+ */
+int store_concurrency()
 {
-  pid_t pid = fork();
-  
+  const char *concurrency = getenv(STORE_CONCURRENCY_ENV);
+  int n = concurrency ? atoi(concurrency) : STORE_CONCURRENCY;
+
+  return n > 0 ? n : STORE_CONCURRENCY;
+}
+
+/* Environment of desync processes, set in the forked child. */
+void set_desync_env()
+{
+  setenv("CASYNC_SSH_PATH", DBCLIENT_Y_BIN, 1);
+  /* desync finds its config via HOME; dbclient_y restores the original. */
+  setenv(SSH_HOME_ENV, getenv("HOME") ? getenv("HOME") : "", 1);
+  setenv("HOME", DESYNC_HOME_DIR, 1);
+}
+
+/*
+ * Whether every chunk of an index in the local cache carries a verify-once
+ * mark (see castr.h). desync's skip-verify covers all of the cache, so it's
+ * only set for images which have no unmarked chunk there. Missing chunks
+ * don't count, desync verifies them as they're fetched from the store.
+ */
+int is_cache_verified(const char *caibx)
+{
+  char path[PATH_MAX];
+  struct caibx idx;
+  struct zero_chunks zero;
+  struct stat st;
+  size_t marked = 0, unmarked = 0;
+
+  if (caibx_load(caibx, &idx)) {
+    return 0;
+  }
+  zero_chunks_init(&zero, caibx_sha512_256(&idx),
+                   idx.chunk_size_min, idx.chunk_size_max);
+  for (size_t i = 0; i < idx.n && unmarked == 0; i++) {
+    if (is_zero_chunk(&zero, &idx.chunks[i])
+        || chunk_path(CASTR_CACHE_DIR, idx.chunks[i].id, path, sizeof(path))) {
+      continue;
+    }
+    if (chunk_is_verified(path, &st)) {
+      marked++;
+    } else if (st.st_ino) {
+      unmarked++;
+    }
+  }
+  caibx_free(&idx);
+  if (unmarked == 0 && marked > 0) {
+    fprintf(stderr, "Trusting cached chunks of %s, all marked verified.\n",
+            caibx);
+    return 1;
+  }
+
+  return 0;
+}
+
+int write_desync_config(const char *store, int trust_cache)
+{
+  const char *dirs[] = { DESYNC_HOME_DIR,
+                         DESYNC_HOME_DIR "/.config",
+                         DESYNC_CONFIG_DIR,
+                         NULL };
+  JSON_Value *root_value = json_value_init_object();
+  JSON_Value *options_value = json_value_init_object();
+  JSON_Value *store_value = json_value_init_object();
+  JSON_Value *cache_value;
+  int ret = 0;
+
+  for (int i = 0; dirs[i] != NULL; i++) {
+    if (mkdir(dirs[i], 0755) && errno != EEXIST) {
+      fprintf(stderr, "Failed to create %s: %s\n", dirs[i], strerror(errno));
+      ret = -1;
+      goto out;
+    }
+  }
+  json_object_set_number(json_value_get_object(store_value),
+                         "n", store_concurrency());
+  json_object_set_value(json_value_get_object(options_value),
+                        store, store_value);
+  if (trust_cache) {
+    cache_value = json_value_init_object();
+    json_object_set_boolean(json_value_get_object(cache_value),
+                            "skip-verify", 1);
+    json_object_set_value(json_value_get_object(options_value),
+                          CASTR_CACHE_DIR, cache_value);
+  }
+  json_object_set_value(json_value_get_object(root_value),
+                        "store-options", options_value);
+  if (json_serialize_to_file(root_value, DESYNC_CONFIG_FILE) != JSONSuccess) {
+    fprintf(stderr, "Failed to write %s.\n", DESYNC_CONFIG_FILE);
+    ret = -1;
+  }
+
+  out:
+    json_value_free(root_value);
+
+    return ret;
+}
+
+/*
+ * Zero-filled regions of the archive are well-known all-zero chunks. Put
+ * them into the local cache synthetically so that desync never fetches them.
+ * Their IDs only depend on the index header, and each file is a few bytes,
+ * so seed them without scanning the chunk table.
+ */
+int seed_zero_chunks_from_caibx()
+{
+  struct caibx idx;
+  struct zero_chunks zero;
+
+  if (caibx_load_header(caibx_file, &idx)) {
+    return -1;
+  }
+  zero_chunks_init(&zero, caibx_sha512_256(&idx),
+                   idx.chunk_size_min, idx.chunk_size_max);
+
+  return seed_zero_chunks(CASTR_CACHE_DIR, &zero);
+}
+
+int mount_archive_from_caibx_lazily(const char *caibx, const char *dir)
+{
+  const char *store = getenv("BLOB_STORE");
+  pid_t pid;
+
+  if (store == NULL) {
+    fprintf(stderr, "BLOB_STORE isn't specified.\n");
+    return -1;
+  }
+  if (write_desync_config(store, getenv(TRUST_CACHE_ENV)
+                          && is_cache_verified(caibx))) {
+    fprintf(stderr, "Failed to configure desync.\n");
+    return -1;
+  }
+  pid = fork();
   if (pid == 0) {
-    setenv("CASYNC_SSH_PATH", DBCLIENT_Y_BIN, 1);
+    set_desync_env();
     int devnull;
     devnull = open("/dev/null",O_WRONLY | O_CREAT, 0666);
     dup2(devnull, 1);
@@ -113,9 +325,9 @@ int mount_archive_from_caibx_lazily()
           "-c",
           CASTR_CACHE_DIR,
           "--store",
-          getenv("BLOB_STORE"),
-          CAIBX_FILE,
-          ARCHIVE_MOUNT_DIR,
+          (char *)store,
+          (char *)caibx,
+          (char *)dir,
           NULL };
     execv(desync_mount_args[0], desync_mount_args);
     close(devnull);
@@ -123,14 +335,304 @@ int mount_archive_from_caibx_lazily()
     fprintf(stderr, "Failed to fork desync process.\n");
     return -1;
   }
-  if (wait_if_empty_dir(ARCHIVE_MOUNT_DIR,
-                        EXISTENCE_CHECK_LIMIT)) {
+  if (wait_if_empty_dir(dir, EXISTENCE_CHECK_LIMIT)) {
     fprintf(stderr, "Failed to mount archive with desync.\n");
     return -1;
   }
   return 0;
 }
 
+/*
+ * Prefetch-only mode. Fetch the chunks of the index (or only the ones which
+ * cover the offsets listed in a startup profile) into the local cache with
+ * desync's parallel workers, without mounting anything.
+ */
+int push_chunk(struct caibx *want, size_t *cap, const struct caibx_chunk *c)
+{
+  if (want->n == *cap) {
+    struct caibx_chunk *chunks;
+    *cap = *cap ? *cap * 2 : 1024;
+    if ((chunks = realloc(want->chunks,
+                          *cap * sizeof(struct caibx_chunk))) == NULL) {
+      fprintf(stderr, "Failed to allocate chunk list.\n");
+      return -1;
+    }
+    want->chunks = chunks;
+  }
+  want->chunks[want->n++] = *c;
+
+  return 0;
+}
+
+/* Use the sidecar index if the converter shipped one. */
+int lookup_chunk(const struct bidx *bx, const struct caibx *idx,
+                 uint64_t offset, struct caibx_chunk *c)
+{
+  const struct caibx_chunk *found;
+  size_t slot;
+
+  if (bx->n) {
+    if ((slot = bidx_lookup(bx, offset)) == 0) {
+      return -1;
+    }
+    c->offset = bx->keys[slot];
+    c->size = bx->records[slot].size;
+    memcpy(c->id, bx->records[slot].id, CHUNK_ID_LEN);
+    return 0;
+  }
+  if ((found = caibx_lookup(idx, offset)) == NULL) {
+    return -1;
+  }
+  *c = *found;
+
+  return 0;
+}
+
+/* Profile lines are "<offset> [<length>]" in the archive; # comments. */
+int collect_profile_chunks(const char *profile, const struct bidx *bx,
+                           const struct caibx *idx,
+                           struct caibx *want, size_t *cap)
+{
+  char line[256], *p;
+  uint64_t offset, end;
+  struct caibx_chunk c;
+  FILE *fp;
+  int ret = 0;
+
+  if ((fp = fopen(profile, "r")) == NULL) {
+    fprintf(stderr, "Failed to open %s: %s\n", profile, strerror(errno));
+    return -1;
+  }
+  while (ret == 0 && fgets(line, sizeof(line), fp)) {
+    if (line[0] == '#' || line[0] == '\n') {
+      continue;
+    }
+    offset = strtoull(line, &p, 0);
+    end = strtoull(p, NULL, 0);
+    end = offset + (end ? end : 1);
+    while (offset < end && lookup_chunk(bx, idx, offset, &c) == 0) {
+      ret = push_chunk(want, cap, &c);
+      offset = c.offset + c.size;
+    }
+  }
+  fclose(fp);
+
+  return ret;
+}
+
+int compare_chunk_id(const void *a, const void *b)
+{
+  return memcmp(((const struct caibx_chunk *)a)->id,
+                ((const struct caibx_chunk *)b)->id, CHUNK_ID_LEN);
+}
+
+int fetch_chunks(const char *store, const struct caibx *missing)
+{
+  char tmp[] = WARM_CAIBX_TEMPLATE, n[16];
+  int fd, status = -1;
+  pid_t pid;
+
+  if ((fd = mkstemp(tmp)) < 0) {
+    fprintf(stderr, "Failed to create %s: %s\n", tmp, strerror(errno));
+    return -1;
+  }
+  close(fd);
+  if (caibx_write(tmp, missing) || write_desync_config(store, 0)) {
+    goto out;
+  }
+  snprintf(n, sizeof(n), "%d", store_concurrency());
+  pid = fork();
+  if (pid == 0) {
+    set_desync_env();
+    char *const desync_cache_args[]
+      = { DESYNC_BIN,
+          "cache",
+          "-n",
+          n,
+          "--store",
+          (char *)store,
+          "--cache",
+          CASTR_CACHE_DIR,
+          tmp,
+          NULL };
+    execv(desync_cache_args[0], desync_cache_args);
+    _exit(127);
+  } else if (pid < 0) {
+    fprintf(stderr, "Failed to fork desync process.\n");
+    goto out;
+  }
+  if (waitpid(pid, &status, 0) < 0) {
+    fprintf(stderr, "Failed to wait desync: %s\n", strerror(errno));
+    status = -1;
+  }
+
+  out:
+    unlink(tmp);
+
+    return status == 0 ? 0 : -1;
+}
+
+/* Run op on the cache files of chunks in batches, results into res. */
+int cache_chunk_io(struct chunkio *io, int op,
+                   const struct caibx_chunk *chunks, size_t n, ssize_t *res)
+{
+  struct chunkio_req *reqs;
+  char *paths;
+  size_t m;
+
+  reqs = calloc(CHUNKIO_BATCH, sizeof(struct chunkio_req));
+  paths = malloc(CHUNKIO_BATCH * CHUNKIO_PATH_LEN);
+  if (reqs == NULL || paths == NULL) {
+    fprintf(stderr, "Failed to allocate chunk I/O requests.\n");
+    free(reqs);
+    free(paths);
+    return -1;
+  }
+  for (size_t i = 0; i < n; i += m) {
+    m = n - i > CHUNKIO_BATCH ? CHUNKIO_BATCH : n - i;
+    for (size_t j = 0; j < m; j++) {
+      reqs[j].op = op;
+      reqs[j].path = paths + j * CHUNKIO_PATH_LEN;
+      chunk_path(CASTR_CACHE_DIR, chunks[i + j].id,
+                 paths + j * CHUNKIO_PATH_LEN, CHUNKIO_PATH_LEN);
+    }
+    chunkio_run(io, reqs, m);
+    for (size_t j = 0; j < m; j++) {
+      res[i + j] = reqs[j].res;
+    }
+  }
+  free(reqs);
+  free(paths);
+
+  return 0;
+}
+
+int warm_cache(const char *caibx, const char *bidx, const char *profile)
+{
+  const char *store = getenv("BLOB_STORE");
+  struct caibx header, idx = { 0 }, want = { 0 };
+  struct bidx bx = { 0 };
+  struct caibx_chunk c, tmp;
+  struct zero_chunks zero;
+  struct timespec start, end;
+  struct chunkio io;
+  ssize_t *res = NULL;
+  size_t cap = 0, present = 0, zeros = 0, fetched = 0, missing, unique;
+  uint64_t fetched_bytes = 0;
+  int ret = -1;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (store == NULL) {
+    fprintf(stderr, "BLOB_STORE isn't specified.\n");
+    return -1;
+  }
+  if (caibx_load_header(caibx, &header)) {
+    return -1;
+  }
+  if ((bidx == NULL || access_file(bidx) || bidx_open(bidx, &bx))
+      && caibx_load(caibx, &idx)) {
+    return -1;
+  }
+  chunkio_init(&io, CHUNKIO_AUTO, 0);
+  if (profile) {
+    if (collect_profile_chunks(profile, &bx, &idx, &want, &cap)) {
+      goto out;
+    }
+  } else if (bx.n) {
+    for (size_t slot = bidx_next(&bx, 0); slot; slot = bidx_next(&bx, slot)) {
+      lookup_chunk(&bx, &idx, bx.keys[slot], &c);
+      if (push_chunk(&want, &cap, &c)) {
+        goto out;
+      }
+    }
+  } else {
+    for (size_t i = 0; i < idx.n; i++) {
+      if (push_chunk(&want, &cap, &idx.chunks[i])) {
+        goto out;
+      }
+    }
+  }
+
+  /* Fetch each chunk once; zero chunks are synthesized locally. */
+  zero_chunks_init(&zero, caibx_sha512_256(&header),
+                   header.chunk_size_min, header.chunk_size_max);
+  if (seed_zero_chunks(CASTR_CACHE_DIR, &zero)) {
+    fprintf(stderr, "Warning: Failed to prepare zero chunks.\n");
+  }
+  qsort(want.chunks, want.n, sizeof(struct caibx_chunk), compare_chunk_id);
+  unique = 0;
+  for (size_t i = 0; i < want.n; i++) {
+    if (i > 0 && compare_chunk_id(&want.chunks[i - 1], &want.chunks[i]) == 0) {
+      continue;
+    }
+    if (is_zero_chunk(&zero, &want.chunks[i])) {
+      zeros++;
+    } else {
+      want.chunks[unique++] = want.chunks[i];
+    }
+  }
+
+  /* Missing ones to the front, the ones in the cache behind them. */
+  if ((res = malloc((unique ? unique : 1) * sizeof(ssize_t))) == NULL
+      || cache_chunk_io(&io, CHUNKIO_STAT, want.chunks, unique, res)) {
+    goto out;
+  }
+  missing = 0;
+  for (size_t i = 0; i < unique; i++) {
+    if (res[i] >= 0) {
+      present++;
+      continue;
+    }
+    tmp = want.chunks[missing];
+    want.chunks[missing++] = want.chunks[i];
+    want.chunks[i] = tmp;
+  }
+  want.n = missing;
+  want.feature_flags = header.feature_flags;
+  want.chunk_size_min = header.chunk_size_min;
+  want.chunk_size_avg = header.chunk_size_avg;
+  want.chunk_size_max = header.chunk_size_max;
+  fprintf(stderr, "Fetching %zu chunks with %d workers...\n",
+          missing, store_concurrency());
+  ret = missing ? fetch_chunks(store, &want) : 0;
+
+  /* Count what actually landed, desync may have fetched only a part. */
+  if (cache_chunk_io(&io, CHUNKIO_STAT, want.chunks, missing, res)) {
+    ret = -1;
+    goto out;
+  }
+  for (size_t i = 0; i < missing; i++) {
+    if (res[i] >= 0) {
+      fetched++;
+      fetched_bytes += res[i];
+    }
+  }
+
+  /* The startup set is read first thing, so get it into the page cache. */
+  if (profile && cache_chunk_io(&io, CHUNKIO_READAHEAD,
+                                want.chunks, unique, res)) {
+    ret = -1;
+  }
+  if (fetched < missing) {
+    ret = -1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  fprintf(stderr, "Fetched %zu/%zu chunks (%llu bytes), "
+          "%zu already present, %zu zero, in %.3f seconds.\n",
+          fetched, missing, (unsigned long long)fetched_bytes,
+          present, zeros,
+          (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+
+  out:
+    chunkio_exit(&io);
+    free(res);
+    free(want.chunks);
+    caibx_free(&idx);
+    bidx_close(&bx);
+
+    return ret;
+}
+
 int get_loopdev_unused_minor_num()
 {
   int max = -1, this;
@@ -186,39 +688,65 @@ static void rmloopdev ()
   }
 }
 
-int mount_rootfs_from_iso9660(const char *archive, const char *target)
+static int loop_direct_io()
 {
-  int archive_fd = -1, loopdev_fd = -1, minor;
-  struct loop_info64 info;
+  const char *value = getenv(LOOP_DIRECT_IO_ENV);
+
+  return value != NULL && strcmp(value, "0");
+}
+
+/* Create a loop device node at path, which doesn't need the archive yet. */
+int make_loopdev(const char *path)
+{
+  int minor;
 
   /* Get unused loopback device minor num. */
   if ((minor = get_loopdev_unused_minor_num()) < 0) {
     fprintf(stderr, "Failed to find usable loopback device.\n");
-    goto error;
+    return -1;
   }
 
   /* Mknod loopback device node. */
-  if(mknod(DEV_LOOP_ISO,
+  if(mknod(path,
            S_IRUSR | S_IWUSR |
            S_IRGRP | S_IWGRP |
            S_IROTH | S_IWOTH |
            S_IFBLK,
            makedev(LOOP_DEV_MAJOR_NUM, minor))) {
     fprintf(stderr, "Failed to mknod device %s(minor: %d): %s\n",
-            DEV_LOOP_ISO, minor, strerror(errno));
-    goto error;
+            path, minor, strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Create DEV_LOOP_ISO, removed at exit. */
+int prepare_loopdev()
+{
+  if (make_loopdev(DEV_LOOP_ISO)) {
+    return -1;
   }
   atexit(rmloopdev);
 
+  return 0;
+}
+
+int mount_rootfs_from_iso9660(const char *archive, const char *loopdev,
+                              const char *target)
+{
+  int archive_fd = -1, loopdev_fd = -1;
+  struct loop_info64 info;
+
   /* Register the loopback device to kernel. */
   if((archive_fd = open(archive, O_RDONLY)) < 0) {
     fprintf(stderr, "Failed to open backing archive(%s): %s\n",
             archive, strerror(errno));
     goto error;
   }
-  if((loopdev_fd = open(DEV_LOOP_ISO, O_RDWR)) < 0) {
+  if((loopdev_fd = open(loopdev, O_RDWR)) < 0) {
     fprintf(stderr, "Failed to open device(%s): %s\n",
-            DEV_LOOP_ISO, strerror(errno));
+            loopdev, strerror(errno));
     goto error;
   }
   if(ioctl(loopdev_fd, LOOP_SET_FD, archive_fd) < 0) {
@@ -237,13 +765,26 @@ int mount_rootfs_from_iso9660(const char *archive, const char *target)
     fprintf(stderr, "Failed to set loop info: %s\n", strerror(errno));
     goto error;
   }
+
+  /*
+   * Optionally read the archive with direct I/O, so its pages are cached
+   * once on the loop device and not again on the FUSE file. It also skips
+   * the FUSE file's readahead (BOOTFS_FUSE_READ_AHEAD_KB), leaving only the
+   * loop device's, so it's off until rdbench shows it pays. The kernel keeps
+   * buffered I/O if the FUSE server doesn't allow it.
+   */
+  if (loop_direct_io()
+      && ioctl(loopdev_fd, LOOP_SET_DIRECT_IO, 1)) {
+    fprintf(stderr, "Loop device direct I/O unavailable: %s\n",
+            strerror(errno));
+  }
   close(loopdev_fd);
   close(archive_fd);
   loopdev_fd = -1;
   archive_fd = -1; 
 
   /* Mount iso image. */
-  if (mount(DEV_LOOP_ISO, target, ISO_FS_TYPE, MS_RDONLY, NULL)) {
+  if (mount(loopdev, target, ISO_FS_TYPE, MS_RDONLY, NULL)) {
     fprintf(stderr, "Failed to mount rootfs: %s\n", strerror(errno));
     goto error;
   }
@@ -262,6 +803,62 @@ int mount_rootfs_from_iso9660(const char *archive, const char *target)
     return -1;
 }
 
+/*
+ * Ask the node daemon for the rootfs. It keeps one lazy mount per image and
+ * hands us a detached clone of it, which we attach in our mount namespace.
+ */
+int mount_rootfs_from_daemon(const char *caibx, const char *target)
+{
+  struct sockaddr_un addr;
+  char msg[BOOTFSD_MSG_LEN];
+  const char *store = getenv("BLOB_STORE");
+  int sock = -1, caibx_fd = -1, tree_fd = -1, ret = -1;
+
+  if (store == NULL) {
+    fprintf(stderr, "BLOB_STORE isn't specified.\n");
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, BOOTFSD_SOCK, sizeof(addr.sun_path) - 1);
+  snprintf(msg, sizeof(msg), "%s %s\n", BOOTFSD_MOUNT, store);
+  if ((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0
+      || connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+    fprintf(stderr, "Failed to connect to %s: %s\n",
+            BOOTFSD_SOCK, strerror(errno));
+    goto out;
+  }
+  if ((caibx_fd = open(caibx, O_RDONLY | O_CLOEXEC)) < 0
+      || send_fd_msg(sock, msg, caibx_fd)
+      || recv_fd_msg(sock, msg, sizeof(msg), &tree_fd)) {
+    fprintf(stderr, "Failed to talk to bootfsd: %s\n", strerror(errno));
+    goto out;
+  }
+  if (strncmp(msg, BOOTFSD_OK, strlen(BOOTFSD_OK)) || tree_fd < 0) {
+    fprintf(stderr, "bootfsd refused: %s", msg);
+    goto out;
+  }
+  if (bootfs_move_mount(tree_fd, "", AT_FDCWD, target,
+                        MOVE_MOUNT_F_EMPTY_PATH)) {
+    fprintf(stderr, "Failed to attach shared rootfs: %s\n", strerror(errno));
+    goto out;
+  }
+  ret = 0;
+
+  out:
+    if (tree_fd >= 0) {
+      close(tree_fd);
+    }
+    if (caibx_fd >= 0) {
+      close(caibx_fd);
+    }
+    if (sock >= 0) {
+      close(sock);
+    }
+
+    return ret;
+}
+
 int mount_rootfs_from_catar(const char *archive, const char *target)
 {
   pid_t pid = fork();
@@ -286,48 +883,273 @@ int mount_rootfs_from_catar(const char *archive, const char *target)
   return 0;
 }
 
-int switch_root(const char *new_rootfs)
+static unsigned int env_uint(const char *name)
 {
-  struct mntent *ent;
-  FILE *proc_mounts;
-  char *target;
+  const char *value = getenv(name);
 
-  /* Each iteratoin has different role.
-   * 1st: Trying to mount all target mount points.
-   * 2nd: Finding all mount points which hasn't been moved to under new rootfs
-   *      during 1st iteration.
-   */
-  target = calloc(sizeof(char), MAX_FILENAME_PATH_LENGTH);
-  for (int i = 0; i < 2; i++) {
-    const char *proc_mounts_path = (i == 0) ? PROC_MOUNTS : MOVED_PROC_MOUNTS;
-    proc_mounts = setmntent(proc_mounts_path, "r");
-    if (proc_mounts == NULL) {
-      fprintf(stderr, "Failed to open %s\n", PROC_MOUNTS);
+  return value ? (unsigned int)strtoul(value, NULL, 0) : 0;
+}
+
+/*
+ * Layered images are an ISO 9660 archive per layer, whiteouts included as
+ * overlayfs ones, each mounted at LAYERS_MOUNT_DIR/N and overlaid read-only
+ * as the rootfs. Layers shared with other images share their chunks, and
+ * their lazy mounts too when bootfsd serves them.
+ */
+
+/* dir/i, made if it isn't there */
+static int layer_dir(char path[PATH_MAX], const char *dir, uint32_t i)
+{
+  snprintf(path, PATH_MAX, "%s/%u", dir, i);
+  if (mkdir(path, 0755) && errno != EEXIST) {
+    fprintf(stderr, "Failed to make %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+/* The archive of layer i desync serves, named after its index file. */
+static void layer_archive(char path[PATH_MAX], uint32_t i)
+{
+  const char *caibx = bman_vec_str(&manifest, BMAN_LAYERS, i);
+  const char *name = strrchr(caibx, '/'), *ext;
+
+  name = name ? name + 1 : caibx;
+  ext = strrchr(name, '.');
+  snprintf(path, PATH_MAX, "%s/%u/%.*s", LAYERS_ARCHIVE_DIR, i,
+           (int)(ext && ext != name ? (size_t)(ext - name) : strlen(name)),
+           name);
+}
+
+static void umount_layers(uint32_t n)
+{
+  char path[PATH_MAX];
+
+  for (uint32_t i = 0; i < n; i++) {
+    snprintf(path, sizeof(path), "%s/%u", LAYERS_MOUNT_DIR, i);
+    umount2(path, MNT_DETACH);
+  }
+}
+
+/* The mounted layers, topmost first, as one read-only tree at target */
+static int mount_rootfs_overlay(const char *target)
+{
+  char opts[PATH_MAX] = "lowerdir=";
+  size_t len = strlen(opts);
+  int n;
+
+  for (uint32_t i = nlayers; i-- > 0; len += n) {
+    n = snprintf(opts + len, sizeof(opts) - len, "%s%s/%u",
+                 i + 1 < nlayers ? ":" : "", LAYERS_MOUNT_DIR, i);
+    if (n < 0 || (size_t)n >= sizeof(opts) - len) {
+      fprintf(stderr, "Too many layers to overlay.\n");
+      return -1;
+    }
+  }
+  if (mount(OVERLAY_FS_TYPE, target, OVERLAY_FS_TYPE, MS_RDONLY, opts)) {
+    fprintf(stderr, "Failed to overlay layers: %s\n", strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Each layer shared by bootfsd, then overlaid; undone if any fails */
+int mount_layers_from_daemon(const char *target)
+{
+  char dir[PATH_MAX];
+
+  for (uint32_t i = 0; i < nlayers; i++) {
+    if (layer_dir(dir, LAYERS_MOUNT_DIR, i)
+        || mount_rootfs_from_daemon(bman_vec_str(&manifest, BMAN_LAYERS, i),
+                                    dir)) {
+      umount_layers(i);
       return -1;
     }
-    while ((ent = getmntent(proc_mounts))) {
-      
-      /* Directories which have prefix '/.bootfs/rootfs' won't be moved. */
-      if (strcmp(ent->mnt_dir, "/")
-          && strstr(ent->mnt_dir, ROOTFS_MOUNT_DIR) - ent->mnt_dir) {
-        snprintf(target, MAX_FILENAME_PATH_LENGTH,
-                 "%s/%s", new_rootfs, ent->mnt_dir);
-        if (mount(ent->mnt_dir, target, NULL, MS_MOVE, NULL)
-            && i) {
-          fprintf(stderr, "Warning: Failed to move mount %s: %s.\n",
-                  ent->mnt_dir, strerror(errno));
+  }
+  if (mount_rootfs_overlay(target)) {
+    umount_layers(nlayers);
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Each layer's archive served by desync on a loop device, then overlaid;
+ * undone if any fails
+ */
+int mount_layers_from_archives(const char *target)
+{
+  char archive[PATH_MAX], dev[PATH_MAX], dir[PATH_MAX];
+  struct stat st;
+  int ret;
+
+  for (uint32_t i = 0; i < nlayers; i++) {
+    layer_archive(archive, i);
+    snprintf(dev, sizeof(dev), DEV_LOOP_LAYER, i);
+    if (layer_dir(dir, LAYERS_MOUNT_DIR, i) || make_loopdev(dev)) {
+      umount_layers(i);
+      return -1;
+    }
+
+    /* The mount holds the device; the node isn't needed after it. */
+    ret = mount_rootfs_from_iso9660(archive, dev, dir);
+    if (ret == 0 && stat(dev, &st) == 0
+        && tune_read_ahead(st.st_rdev, env_uint(LOOP_READ_AHEAD_KB_ENV))) {
+      fprintf(stderr, "Warning: Failed to tune the loop device.\n");
+    }
+    unlink(dev);
+    if (ret) {
+      umount_layers(i);
+      return -1;
+    }
+  }
+  if (mount_rootfs_overlay(target)) {
+    umount_layers(nlayers);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Undo the octal escapes (\040 etc.) of paths in mountinfo, in place. */
+static void unescape_mountinfo(char *path)
+{
+  char *out = path;
+
+  for (char *in = path; *in; out++) {
+    if (in[0] == '\\' && in[1] >= '0' && in[1] <= '3'
+        && in[2] >= '0' && in[2] <= '7' && in[3] >= '0' && in[3] <= '7') {
+      *out = (in[1] - '0') << 6 | (in[2] - '0') << 3 | (in[3] - '0');
+      in += 4;
+    } else {
+      *out = *in++;
+    }
+  }
+  *out = '\0';
+}
+
+/*
+ * Mounts to carry over into the new rootfs, in one pass over mountinfo.
+ * Everything but "/" and our own mounts under ROOTFS_MOUNT_DIR is carried,
+ * and only the top-most ones are listed since moving a mount takes its
+ * submounts along. Parents precede children in mountinfo, so the list is
+ * already in a valid order.
+ */
+int list_submounts(struct submounts *sm)
+{
+  struct { int id, parent, moved; } *ents = NULL;
+  size_t n = 0, cap = 0, len = 0;
+  char *line = NULL, dir[PATH_MAX];
+  FILE *fp;
+  int id, parent;
+
+  memset(sm, 0, sizeof(struct submounts));
+  if ((fp = fopen(PROC_MOUNTINFO, "r")) == NULL) {
+    fprintf(stderr, "Failed to open %s: %s\n", PROC_MOUNTINFO, strerror(errno));
+    return -1;
+  }
+  while (getline(&line, &len, fp) > 0) {
+    if (sscanf(line, "%d %d %*s %*s %4095s", &id, &parent, dir) != 3) {
+      continue;
+    }
+    unescape_mountinfo(dir);
+    if (n == cap) {
+      void *p, *dirs;
+      cap = cap ? cap * 2 : 64;
+      if ((p = realloc(ents, cap * sizeof(*ents))) != NULL) {
+        ents = p;
+      }
+      if ((dirs = realloc(sm->dirs, cap * sizeof(char *))) != NULL) {
+        sm->dirs = dirs;
+      }
+      if (p == NULL || dirs == NULL) {
+        fprintf(stderr, "Failed to allocate mount list.\n");
+        goto error;
+      }
+    }
+    ents[n].id = id;
+    ents[n].parent = parent;
+    ents[n].moved = strcmp(dir, "/")
+      && strncmp(dir, ROOTFS_MOUNT_DIR, strlen(ROOTFS_MOUNT_DIR));
+    if (ents[n].moved) {
+      int carried = 0;
+      for (size_t i = 0; i < n; i++) {
+        if (ents[i].id == parent) {
+          carried = ents[i].moved;
+          break;
         }
       }
+      if (!carried && (sm->dirs[sm->n++] = strdup(dir)) == NULL) {
+        fprintf(stderr, "Failed to allocate mount list.\n");
+        goto error;
+      }
+    }
+    n++;
+  }
+  free(line);
+  free(ents);
+  fclose(fp);
+
+  return 0;
+
+  error:
+    free(line);
+    free(ents);
+    fclose(fp);
+    free_submounts(sm);
+
+    return -1;
+}
+
+void free_submounts(struct submounts *sm)
+{
+  for (size_t i = 0; i < sm->n; i++) {
+    free(sm->dirs[i]);
+  }
+  free(sm->dirs);
+  memset(sm, 0, sizeof(struct submounts));
+}
+
+static int move_one_mount(const char *from, const char *to)
+{
+  static int no_move_mount = 0;
+
+  if (!no_move_mount) {
+    if (bootfs_move_mount(AT_FDCWD, from, AT_FDCWD, to, 0) == 0) {
+      return 0;
+    } else if (errno != ENOSYS) {
+      return -1;
+    }
+    no_move_mount = 1;
+  }
+
+  return mount(from, to, NULL, MS_MOVE, NULL);
+}
+
+/*
+ * The new rootfs finally replaces "/" by MS_MOVE and chroot, not by
+ * pivot_root, which would also re-root desync serving the archive.
+ */
+int switch_root(const char *new_rootfs, const struct submounts *sm)
+{
+  char target[PATH_MAX];
+
+  for (size_t i = 0; i < sm->n; i++) {
+    snprintf(target, sizeof(target), "%s%s", new_rootfs, sm->dirs[i]);
+    if (move_one_mount(sm->dirs[i], target)) {
+      fprintf(stderr, "Warning: Failed to move mount %s: %s.\n",
+              sm->dirs[i], strerror(errno));
     }
-    endmntent(proc_mounts);
   }
-  free(target);
   if (chdir(new_rootfs)) {
     fprintf(stderr, "Failed to chdir to %s: %s.\n",
             new_rootfs, strerror(errno));
     return -1;
   };
-  if (mount(new_rootfs, "/", NULL, MS_MOVE, NULL)) {
+  if (move_one_mount(new_rootfs, "/")) {
     fprintf(stderr, "Failed to move mount %s -> %s: %s.\n",
             new_rootfs, "/", strerror(errno));
     return -1;
@@ -345,89 +1167,417 @@ int switch_root(const char *new_rootfs)
   return 0;
 }
 
-const char **restore_entrypoint_args(int argc, char *argv[])
+/*
+ * Exec arguments from the boot manifest, following docker: arguments given
+ * to the container replace Cmd, and are appended to Entrypoint. They point
+ * into the mapped manifest, which stays mapped across switch_root.
+ */
+const char **restore_exec_args(int argc, char *argv[])
 {
-  const char **args;
+  uint32_t entrypoint_num = bman_vec_len(&manifest, BMAN_ENTRYPOINT);
+  uint32_t cmd_num = argc > 1 ? 0 : bman_vec_len(&manifest, BMAN_CMD);
+  const char **args = calloc(sizeof(char *), entrypoint_num + cmd_num + argc);
   int argpos = 0;
-  JSON_Value *root_value;
-  JSON_Array *entrypoint_args;
-  
-  root_value = json_parse_file(ENTRYPOINT_MEMO);
-  if (json_value_get_type(root_value) != JSONArray) {
-    fprintf(stderr, "ENTRYPOINT is empty or not array.\n");
-    args = calloc(sizeof(char *), argc);
-  } else {
-    entrypoint_args = json_value_get_array(root_value);
-    int entrypoint_args_num = json_array_get_count(entrypoint_args);
-    args = calloc(sizeof(char *), entrypoint_args_num + argc);
-    for (int i = 0; i < entrypoint_args_num; i++) {
-      args[argpos++] = json_array_get_string(entrypoint_args, i);
-    }
+
+  if (args == NULL) {
+    return NULL;
+  }
+  for (uint32_t i = 0; i < entrypoint_num; i++) {
+    args[argpos++] = bman_vec_str(&manifest, BMAN_ENTRYPOINT, i);
+  }
+  for (uint32_t i = 0; i < cmd_num; i++) {
+    args[argpos++] = bman_vec_str(&manifest, BMAN_CMD, i);
   }
   for (int i = 1; i < argc; i++) {
     args[argpos++] = argv[i];
   }
   args[argpos] = NULL;
-  /* fprintf (stderr, "Exec arguments: [");
-   * for (int i = 0; i < argpos; i++) {
-   *   fprintf(stderr, " \"%s\" ,", args[i]);
-   * }
-   * fprintf (stderr, " NULL ]\n");
-   */
+  if (argpos == 0) {
+    fprintf(stderr, "Neither ENTRYPOINT nor CMD is specified.\n");
+    free(args);
+    return NULL;
+  }
 
   return args;
 }
 
-int main(int argc, char *argv[])
+/* Docker can't create mountpoints in the read-only rootfs; converter does. */
+void check_volumes(const char *new_rootfs)
+{
+  char path[PATH_MAX];
+
+  for (uint32_t i = 0; i < bman_vec_len(&manifest, BMAN_VOLUMES); i++) {
+    snprintf(path, sizeof(path), "%s/%s", new_rootfs,
+             bman_vec_str(&manifest, BMAN_VOLUMES, i));
+    if (access_dir(path)) {
+      fprintf(stderr, "Warning: Mountpoint %s doesn't exist in rootfs.\n",
+              bman_vec_str(&manifest, BMAN_VOLUMES, i));
+    }
+  }
+}
+
+/* Rest of the config, applied in the new rootfs right before exec. */
+int apply_exec_spec()
+{
+  const char *working_dir = bman_str(&manifest, BMAN_WORKING_DIR);
+  char name[256];
+
+  /* Variables given to the container take precedence. */
+  for (uint32_t i = 0; i < bman_vec_len(&manifest, BMAN_ENV); i++) {
+    const char *env = bman_vec_str(&manifest, BMAN_ENV, i);
+    const char *eq = strchr(env, '=');
+    if (eq == NULL || (size_t)(eq - env) >= sizeof(name)) {
+      continue;
+    }
+    memcpy(name, env, eq - env);
+    name[eq - env] = '\0';
+    setenv(name, eq + 1, 0);
+  }
+  if (working_dir && chdir(working_dir)) {
+    fprintf(stderr, "Failed to chdir to %s: %s\n",
+            working_dir, strerror(errno));
+    return -1;
+  }
+  if (manifest.header->flags & BMAN_USER) {
+    if (setgroups(0, NULL)
+        || setgid(manifest.header->gid)
+        || setuid(manifest.header->uid)) {
+      fprintf(stderr, "Failed to switch to user %u:%u: %s\n",
+              manifest.header->uid, manifest.header->gid, strerror(errno));
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Boot stages. Only the mount chain depends on each other; looking up the
+ * exec arguments, a loop device and the mounts to carry over overlap with
+ * the (slow) lazy mount.
+ */
+struct boot_ctx {
+  int argc;
+  char **argv;
+  int shared;                   /* rootfs came from bootfsd */
+  const char **args;
+  struct submounts sm;
+};
+
+static int stage_check(void *arg)
 {
-  /* Emulate original rootfs. */
-  fprintf(stderr, "Checking dependencies...\n");
   char const* reqired_files[]
+    = { PROC_MOUNTINFO,
+        ROOTFS_MOUNT_DIR,
+        caibx_file,
+        NULL };
+
+  (void)arg;
+  fprintf(stderr, "Checking dependencies...\n");
+  if (try_access_all(reqired_files)) {
+    fprintf(stderr, "Required file doesnt exist.\n");
+    return -1;
+  }
+  for (uint32_t i = 0; i < nlayers; i++) {
+    if (access_file(bman_vec_str(&manifest, BMAN_LAYERS, i))) {
+      fprintf(stderr, "Layer index %s doesnt exist.\n",
+              bman_vec_str(&manifest, BMAN_LAYERS, i));
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static int stage_daemon(void *arg)
+{
+  struct boot_ctx *ctx = arg;
+
+  if (access_file(BOOTFSD_SOCK) == 0) {
+    fprintf(stderr, "Mounting rootfs shared by bootfsd...\n");
+    if ((nlayers ? mount_layers_from_daemon(ROOTFS_MOUNT_DIR)
+         : mount_rootfs_from_daemon(caibx_file, ROOTFS_MOUNT_DIR)) == 0) {
+      ctx->shared = 1;
+      return 0;
+    }
+    fprintf(stderr, "Warning: Falling back to the in-container mount.\n");
+  }
+
+  return 0;
+}
+
+static int stage_lazy_check(void *arg)
+{
+  struct boot_ctx *ctx = arg;
+  char const* lazy_mount_files[]
     = { // CASYNC_BIN, // Uncomment if use casync as mount wrapper.
         DESYNC_BIN,
         DBCLIENT_BIN,
         DBCLIENT_Y_BIN,
         FUSERMOUNT_BIN,
-        PROC_MOUNTS,
         DEV_FUSE,
         ETC_PASSWD,
-        ROOTFS_MOUNT_DIR,
         CASTR_CACHE_DIR,
         ARCHIVE_MOUNT_DIR,
-        CAIBX_FILE,
-        ENTRYPOINT_MEMO,
         NULL };
-  if (try_access_all(reqired_files)) {
+
+  if (!ctx->shared && try_access_all(lazy_mount_files)) {
     fprintf(stderr, "Required file doesnt exist.\n");
     return -1;
   }
+
+  return 0;
+}
+
+static int stage_seed(void *arg)
+{
+  struct boot_ctx *ctx = arg;
+
+  if (!ctx->shared && seed_zero_chunks_from_caibx()) {
+    fprintf(stderr, "Warning: Failed to prepare zero chunks.\n");
+  }
+
+  return 0;
+}
+
+static int stage_archive(void *arg)
+{
+  struct boot_ctx *ctx = arg;
+  char dir[PATH_MAX];
+
+  if (ctx->shared) {
+    return 0;
+  }
   fprintf(stderr, "Mounting archive file lazily with desync...\n");
-  if (mount_archive_from_caibx_lazily()) {
+  for (uint32_t i = 0; i < nlayers; i++) {
+    if (layer_dir(dir, LAYERS_ARCHIVE_DIR, i)
+        || mount_archive_from_caibx_lazily(bman_vec_str(&manifest,
+                                                        BMAN_LAYERS, i),
+                                           dir)) {
+      fprintf(stderr, "Failed to prepare archive file of layer %u.\n", i);
+      return -1;
+    }
+  }
+  if (nlayers == 0
+      && mount_archive_from_caibx_lazily(caibx_file, ARCHIVE_MOUNT_DIR)) {
     fprintf(stderr, "Failed to prepare archive file.\n");
-    return 1;
+    return -1;
+  }
+
+  return 0;
+}
+
+static int stage_tune(void *arg)
+{
+  struct boot_ctx *ctx = arg;
+  struct fuse_tuning t = {
+    .max_background = env_uint(FUSE_MAX_BACKGROUND_ENV),
+    .congestion_threshold = env_uint(FUSE_CONGESTION_THRESHOLD_ENV),
+    .read_ahead_kb = env_uint(FUSE_READ_AHEAD_KB_ENV),
+  };
+
+  char archive[PATH_MAX];
+
+  /* Tuning is best effort; the mount works with the defaults. */
+  if (ctx->shared) {
+    return 0;
+  }
+  for (uint32_t i = 0; i < nlayers; i++) {
+    layer_archive(archive, i);
+    if (tune_fuse_mount(archive, &t)) {
+      fprintf(stderr, "Warning: Failed to tune the archive mount of layer "
+              "%u.\n", i);
+    }
+  }
+  if (nlayers == 0 && tune_fuse_mount(MOUNTED_ARCHIVE, &t)) {
+    fprintf(stderr, "Warning: Failed to tune the archive mount.\n");
+  }
+
+  return 0;
+}
+
+static int stage_loop(void *arg)
+{
+  (void)arg;
+
+  /* Layers get a loop device each once their archives are there. */
+  if (nlayers || manifest.header->archive_format == BMAN_ARCHIVE_CATAR
+      || access_file(BOOTFSD_SOCK) == 0) {
+    return 0;
+  }
+
+  return prepare_loopdev();
+}
+
+static int stage_rootfs(void *arg)
+{
+  struct boot_ctx *ctx = arg;
+  struct stat st;
+
+  if (ctx->shared) {
+    return 0;
+  }
+  if (nlayers) {
+    fprintf(stderr, "Mounting rootfs of %u layers...\n", nlayers);
+    if (mount_layers_from_archives(ROOTFS_MOUNT_DIR)) {
+      fprintf(stderr, "Failed to prepare rootfs.\n");
+      return -1;
+    }
+    return 0;
+  }
+  if (manifest.header->archive_format != BMAN_ARCHIVE_CATAR
+      && access_file(DEV_LOOP_ISO) && prepare_loopdev()) {
+    return -1;
   }
   fprintf(stderr, "Mounting rootfs...\n");
-  if (
-      // Uncomment and switch if use casync as mount wrapper.
-      // mount_rootfs_from_catar(MOUNTED_ARCHIVE, ROOTFS_MOUNT_DIR)
-      mount_rootfs_from_iso9660(MOUNTED_ARCHIVE, ROOTFS_MOUNT_DIR)
-      ) {
+  if (manifest.header->archive_format == BMAN_ARCHIVE_CATAR
+      ? mount_rootfs_from_catar(MOUNTED_ARCHIVE, ROOTFS_MOUNT_DIR)
+      : mount_rootfs_from_iso9660(MOUNTED_ARCHIVE, DEV_LOOP_ISO,
+                                  ROOTFS_MOUNT_DIR)) {
     fprintf(stderr, "Failed to prepare rootfs: %s\n", strerror(errno));
-    return 1;
+    return -1;
+  }
+  if (manifest.header->archive_format != BMAN_ARCHIVE_CATAR
+      && stat(DEV_LOOP_ISO, &st) == 0
+      && tune_read_ahead(st.st_rdev, env_uint(LOOP_READ_AHEAD_KB_ENV))) {
+    fprintf(stderr, "Warning: Failed to tune the loop device.\n");
   }
 
+  return 0;
+}
+
+static int stage_args(void *arg)
+{
+  struct boot_ctx *ctx = arg;
+
   /* Restore original entrypoint. */
   fprintf(stderr, "Restoring original ENTRYPOINT information...\n");
-  const char **args = restore_entrypoint_args(argc, argv);
+  ctx->args = restore_exec_args(ctx->argc, ctx->argv);
+
+  return ctx->args ? 0 : -1;
+}
+
+static int stage_submounts(void *arg)
+{
+  struct boot_ctx *ctx = arg;
+
+  return list_submounts(&ctx->sm);
+}
+
+static int stage_volumes(void *arg)
+{
+  (void)arg;
+  check_volumes(ROOTFS_MOUNT_DIR);
+
+  return 0;
+}
+
+enum {
+  BOOT_CHECK,
+  BOOT_DAEMON,
+  BOOT_LAZY_CHECK,
+  BOOT_SEED,
+  BOOT_ARCHIVE,
+  BOOT_TUNE,
+  BOOT_LOOP,
+  BOOT_ROOTFS,
+  BOOT_ARGS,
+  BOOT_SUBMOUNTS,
+  BOOT_VOLUMES,
+  BOOT_STAGE_NUM
+};
+
+static struct stage boot_stages[BOOT_STAGE_NUM] = {
+  [BOOT_CHECK]      = { "check", stage_check, 0 },
+  [BOOT_DAEMON]     = { "daemon", stage_daemon, STAGE_DEP(BOOT_CHECK) },
+  [BOOT_LAZY_CHECK] = { "lazy_check", stage_lazy_check,
+                        STAGE_DEP(BOOT_DAEMON) },
+  [BOOT_SEED]       = { "seed", stage_seed, STAGE_DEP(BOOT_LAZY_CHECK) },
+  [BOOT_ARCHIVE]    = { "archive", stage_archive, STAGE_DEP(BOOT_SEED) },
+  [BOOT_TUNE]       = { "tune", stage_tune, STAGE_DEP(BOOT_ARCHIVE) },
+  [BOOT_LOOP]       = { "loop", stage_loop, 0 },
+  [BOOT_ROOTFS]     = { "rootfs", stage_rootfs,
+                        STAGE_DEP(BOOT_TUNE) | STAGE_DEP(BOOT_LOOP) },
+  [BOOT_ARGS]       = { "args", stage_args, 0 },
+  [BOOT_SUBMOUNTS]  = { "submounts", stage_submounts, 0 },
+  [BOOT_VOLUMES]    = { "volumes", stage_volumes, STAGE_DEP(BOOT_ROOTFS) },
+};
+
+int main(int argc, char *argv[])
+{
+  struct trace trace;
+
+  if (access_file(BOOT_MANIFEST) || bman_open(BOOT_MANIFEST, &manifest)) {
+    fprintf(stderr, "Failed to load boot manifest.\n");
+    return 1;
+  }
+  if (bman_str(&manifest, BMAN_INDEX)) {
+    caibx_file = bman_str(&manifest, BMAN_INDEX);
+  }
+  if ((nlayers = bman_vec_len(&manifest, BMAN_LAYERS)) > 0) {
+    caibx_file = bman_vec_str(&manifest, BMAN_LAYERS, 0);
+  }
+  if (bman_str(&manifest, BMAN_SIDECAR)) {
+    bidx_file = bman_str(&manifest, BMAN_SIDECAR);
+  }
+
+  if (argc > 1 && strcmp(argv[1], WARM_OPTION) == 0) {
+    char const* warm_required_files[]
+      = { DESYNC_BIN,
+          DBCLIENT_BIN,
+          DBCLIENT_Y_BIN,
+          ETC_PASSWD,
+          caibx_file,
+          CASTR_CACHE_DIR,
+          NULL };
+    if (try_access_all(warm_required_files)) {
+      fprintf(stderr, "Required file doesnt exist.\n");
+      return 1;
+    }
+    fprintf(stderr, "Warming the local cache...\n");
+
+    /* Layers have no sidecar or profile, so each is warmed whole. */
+    int ret = 0;
+    for (uint32_t i = 0; i < nlayers; i++) {
+      if (warm_cache(bman_vec_str(&manifest, BMAN_LAYERS, i), NULL, NULL)) {
+        ret = 1;
+      }
+    }
+    if (nlayers) {
+      return ret;
+    }
+    return warm_cache(caibx_file, bidx_file,
+                      argc > 2 ? argv[2]
+                      : bman_str(&manifest, BMAN_PROFILE)) ? 1 : 0;
+  }
+
+  /* Emulate original rootfs. */
+  struct boot_ctx ctx = { .argc = argc, .argv = argv };
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (run_stages(boot_stages, BOOT_STAGE_NUM, BOOT_STAGE_WORKERS, &ctx)) {
+    return 1;
+  }
+  if (getenv(TRACE_ENV)) {
+    report_critical_path(boot_stages, BOOT_STAGE_NUM, &start);
+  }
+  const char **args = ctx.args;
+  struct submounts sm = ctx.sm;
 
   /* Switch rootfs. */
   fprintf(stderr, "Switching rootfs...\n");
-  if (switch_root(ROOTFS_MOUNT_DIR)) {
+  trace_begin(&trace);
+  if (switch_root(ROOTFS_MOUNT_DIR, &sm)) {
     fprintf(stderr, "Failed to switch rootfs.\n");
     return 1;
   }
+  trace_end(&trace, "switch_root");
+  free_submounts(&sm);
 
   /* Execute app. */
+  if (apply_exec_spec()) {
+    return 1;
+  }
   fprintf(stderr, "Now, diving into your app...\n");
   execvp(args[0], (char * const*)args);
 }
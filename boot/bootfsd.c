@@ -0,0 +1,447 @@
+/*******************************************************************************
+ *
+ * bootfsd.c
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/loop.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include "bootfsd.h"
+#include "caibx.h"
+#include "castr.h"
+#include "mntapi.h"
+#include "sha.h"
+
+/* Limit configuration */
+#define MOUNT_WAIT_MSEC    60000
+#define LOOP_SET_FD_RETRY  16
+
+#define ISO_FS_TYPE        "iso9660"
+#define ISO_SECTOR_SIZE    2048
+#define DEV_LOOP_CONTROL   "/dev/loop-control"
+
+/* As boot, reads archives with direct I/O if set (and not "0"). */
+#define LOOP_DIRECT_IO_ENV "BOOTFS_LOOP_DIRECT_IO"
+#define STORES_MAX         64
+
+static const char *state_dir = BOOTFSD_STATE_DIR;
+static const char *cache_dir = BOOTFSD_CACHE_DIR;
+static const char *desync_bin = "desync";
+
+/* The stores (-a) which clients may have the daemon fetch from */
+static const char *stores[STORES_MAX];
+static int nstores;
+
+static int mkdir_if_not_exist(const char *path)
+{
+  if (mkdir(path, 0755) && errno != EEXIST) {
+    fprintf(stderr, "Failed to create %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+static int is_mountpoint(const char *path)
+{
+  char parent[PATH_MAX];
+  struct stat st, pst;
+
+  snprintf(parent, sizeof(parent), "%s/..", path);
+  if (stat(path, &st) || stat(parent, &pst)) {
+    return 0;
+  }
+
+  return st.st_dev != pst.st_dev;
+}
+
+/* sha256 of the caibx which identifies the image, also copied to dst. */
+static int digest_and_copy(int fd, const char *dst, char hex[SHA256_LEN * 2 + 1])
+{
+  uint8_t buf[65536], digest[SHA256_LEN];
+  sha256_ctx ctx;
+  ssize_t n;
+  FILE *fp = dst ? fopen(dst, "w") : NULL;
+
+  if (dst && fp == NULL) {
+    fprintf(stderr, "Failed to create %s: %s\n", dst, strerror(errno));
+    return -1;
+  }
+  sha256_init(&ctx);
+  lseek(fd, 0, SEEK_SET);
+  while ((n = read(fd, buf, sizeof(buf))) > 0) {
+    sha256_update(&ctx, buf, n);
+    if (fp && fwrite(buf, n, 1, fp) != 1) {
+      n = -1;
+      break;
+    }
+  }
+  if (fp && fclose(fp)) {
+    n = -1;
+  }
+  if (n < 0) {
+    fprintf(stderr, "Failed to read index: %s\n", strerror(errno));
+    return -1;
+  }
+  sha256_final(&ctx, digest);
+  chunk_id_to_hex(digest, hex);
+
+  return 0;
+}
+
+/* sha256 of a string, to name a directory after it */
+static void digest_string(const char *s, char hex[SHA256_LEN * 2 + 1])
+{
+  uint8_t digest[SHA256_LEN];
+  sha256_ctx ctx;
+
+  sha256_init(&ctx);
+  sha256_update(&ctx, (const uint8_t *)s, strlen(s));
+  sha256_final(&ctx, digest);
+  chunk_id_to_hex(digest, hex);
+}
+
+static int is_allowed_store(const char *store)
+{
+  for (int i = 0; i < nstores; i++) {
+    if (strcmp(stores[i], store) == 0) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Whether desync still serves the archive. Its FUSE mount outlives it
+ * (e.g. killed by the OOM killer), failing every read with ENOTCONN.
+ */
+static int is_alive(const char *archive)
+{
+  char buf[ISO_SECTOR_SIZE];
+  int fd, ok;
+
+  if ((fd = open(archive, O_RDONLY | O_CLOEXEC)) < 0) {
+    return 0;
+  }
+  ok = pread(fd, buf, sizeof(buf), 0) == (ssize_t)sizeof(buf);
+  close(fd);
+
+  return ok;
+}
+
+static int wait_for_file(const char *path, int msec)
+{
+  struct timespec ts = { 0, 10 * 1000 * 1000 };
+
+  for (; msec > 0; msec -= 10) {
+    if (access(path, F_OK) == 0) {
+      return 0;
+    }
+    nanosleep(&ts, NULL);
+  }
+  fprintf(stderr, "%s didn't appear(timeout).\n", path);
+
+  return -1;
+}
+
+static int mount_archive_lazily(const char *store, const char *caibx,
+                                const char *archive_dir)
+{
+  char archive[PATH_MAX];
+  pid_t pid = fork();
+
+  if (pid == 0) {
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, 1);
+    dup2(devnull, 2);
+    setsid();
+    execlp(desync_bin, desync_bin, "mount-index", "-c", cache_dir,
+           "--store", store, caibx, archive_dir, (char *)NULL);
+    _exit(127);
+  } else if (pid < 0) {
+    fprintf(stderr, "Failed to fork desync process.\n");
+    return -1;
+  }
+  snprintf(archive, sizeof(archive), "%s/rootfs", archive_dir);
+
+  return wait_for_file(archive, MOUNT_WAIT_MSEC);
+}
+
+static int mount_iso9660(const char *archive, const char *target)
+{
+  char loopdev[PATH_MAX];
+  struct loop_info64 info;
+  int ctl = -1, archive_fd = -1, loop_fd = -1, minor, ret = -1;
+
+  if ((ctl = open(DEV_LOOP_CONTROL, O_RDWR | O_CLOEXEC)) < 0
+      || (archive_fd = open(archive, O_RDONLY | O_CLOEXEC)) < 0) {
+    fprintf(stderr, "Failed to open %s: %s\n",
+            ctl < 0 ? DEV_LOOP_CONTROL : archive, strerror(errno));
+    goto out;
+  }
+
+  /* Other handlers may race for the same free device. */
+  for (int i = 0; i < LOOP_SET_FD_RETRY; i++) {
+    if ((minor = ioctl(ctl, LOOP_CTL_GET_FREE)) < 0) {
+      fprintf(stderr, "Failed to get free loop device: %s\n", strerror(errno));
+      goto out;
+    }
+    snprintf(loopdev, sizeof(loopdev), "/dev/loop%d", minor);
+    if ((loop_fd = open(loopdev, O_RDWR | O_CLOEXEC)) < 0) {
+      continue;
+    }
+    if (ioctl(loop_fd, LOOP_SET_FD, archive_fd) == 0) {
+      break;
+    }
+    close(loop_fd);
+    loop_fd = -1;
+  }
+  if (loop_fd < 0) {
+    fprintf(stderr, "Failed to attach %s to a loop device.\n", archive);
+    goto out;
+  }
+  memset(&info, 0, sizeof(info));
+  info.lo_flags = LO_FLAGS_AUTOCLEAR | LO_FLAGS_READ_ONLY;
+  if (ioctl(loop_fd, LOOP_SET_STATUS64, &info)) {
+    fprintf(stderr, "Failed to set loop info: %s\n", strerror(errno));
+    ioctl(loop_fd, LOOP_CLR_FD, 0);
+    goto out;
+  }
+
+  /* Cache archive pages once, on the loop device (see boot.c). */
+  if (getenv(LOOP_DIRECT_IO_ENV) && strcmp(getenv(LOOP_DIRECT_IO_ENV), "0")
+      && ioctl(loop_fd, LOOP_SET_DIRECT_IO, 1)) {
+    fprintf(stderr, "Loop device direct I/O unavailable: %s\n",
+            strerror(errno));
+  }
+  if (mount(loopdev, target, ISO_FS_TYPE, MS_RDONLY, NULL)) {
+    fprintf(stderr, "Failed to mount %s: %s\n", loopdev, strerror(errno));
+    ioctl(loop_fd, LOOP_CLR_FD, 0);
+    goto out;
+  }
+  ret = 0;
+
+  out:
+    if (loop_fd >= 0) {
+      close(loop_fd);
+    }
+    if (archive_fd >= 0) {
+      close(archive_fd);
+    }
+    if (ctl >= 0) {
+      close(ctl);
+    }
+
+    return ret;
+}
+
+/*
+ * Make sure the image is mounted once on the node, for each store it's
+ * fetched from, and return its rootfs. A mount whose desync died is
+ * detached and made again.
+ */
+static int prepare_rootfs(const char *store, int caibx_fd,
+                          char *rootfs, size_t len)
+{
+  char hex[SHA256_LEN * 2 + 1], store_hex[SHA256_LEN * 2 + 1], dir[PATH_MAX],
+    path[PATH_MAX + 32], caibx[PATH_MAX + 32], archive[PATH_MAX + 32];
+  int lockfd, ret = -1;
+
+  if (digest_and_copy(caibx_fd, NULL, hex)) {
+    return -1;
+  }
+  digest_string(store, store_hex);
+  snprintf(dir, sizeof(dir), "%s/%s.%s", state_dir, hex, store_hex);
+  snprintf(rootfs, len, "%s/rootfs", dir);
+  snprintf(path, sizeof(path), "%s/lock", dir);
+  if (mkdir_if_not_exist(dir)
+      || (lockfd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0) {
+    return -1;
+  }
+  if (flock(lockfd, LOCK_EX)) {
+    close(lockfd);
+    return -1;
+  }
+  snprintf(path, sizeof(path), "%s/rootfs.ar", dir);
+  snprintf(archive, sizeof(archive), "%s/rootfs.ar/rootfs", dir);
+  if (is_mountpoint(rootfs)) {
+    if (is_alive(archive)) {
+      ret = 0;
+      goto out;
+    }
+    fprintf(stderr, "Image %s lost its desync; remounting...\n", hex);
+    umount2(rootfs, MNT_DETACH);
+  }
+  fprintf(stderr, "Mounting image %s lazily...\n", hex);
+  snprintf(caibx, sizeof(caibx), "%s/rootfs.caibx", dir);
+  if (mkdir_if_not_exist(rootfs) || mkdir_if_not_exist(path)
+      || digest_and_copy(caibx_fd, caibx, hex)) {
+    goto out;
+  }
+  if (!is_alive(archive)) {
+    umount2(path, MNT_DETACH);  /* a dead mount, if any */
+    if (mount_archive_lazily(store, caibx, path)) {
+      goto out;
+    }
+  }
+  ret = mount_iso9660(archive, rootfs);
+
+  out:
+    close(lockfd);
+
+    return ret;
+}
+
+static void handle(int sock)
+{
+  char msg[BOOTFSD_MSG_LEN], rootfs[PATH_MAX], *store, *eol;
+  int caibx_fd = -1, tree_fd = -1;
+
+  if (recv_fd_msg(sock, msg, sizeof(msg), &caibx_fd) || caibx_fd < 0
+      || strncmp(msg, BOOTFSD_MOUNT " ", strlen(BOOTFSD_MOUNT) + 1)) {
+    send_fd_msg(sock, BOOTFSD_ERR " bad request\n", -1);
+    return;
+  }
+  store = msg + strlen(BOOTFSD_MOUNT) + 1;
+  if ((eol = strchr(store, '\n'))) {
+    *eol = '\0';
+  }
+  if (!is_allowed_store(store)) {
+    fprintf(stderr, "Refused store %s.\n", store);
+    send_fd_msg(sock, BOOTFSD_ERR " store not allowed\n", -1);
+    return;
+  }
+  if (prepare_rootfs(store, caibx_fd, rootfs, sizeof(rootfs))) {
+    send_fd_msg(sock, BOOTFSD_ERR " failed to mount\n", -1);
+    return;
+  }
+
+  /* A detached clone of the shared mount, for the client to attach. */
+  if ((tree_fd = bootfs_open_tree(AT_FDCWD, rootfs,
+                                  OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC)) < 0) {
+    fprintf(stderr, "Failed to clone %s: %s\n", rootfs, strerror(errno));
+    send_fd_msg(sock, BOOTFSD_ERR " failed to clone\n", -1);
+    return;
+  }
+  send_fd_msg(sock, BOOTFSD_OK "\n", tree_fd);
+}
+
+/* Re-verify the cache now and then, in the background. */
+static void start_scrubber(unsigned int interval)
+{
+  struct scrub_stats stats;
+  pid_t pid;
+
+  if ((pid = fork()) < 0) {
+    fprintf(stderr, "Failed to fork scrubber.\n");
+    return;
+  } else if (pid > 0) {
+    return;
+  }
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+  if (nice(19) < 0) {
+    fprintf(stderr, "Warning: Failed to lower scrubber priority.\n");
+  }
+  while (1) {
+    sleep(interval);
+    if (scrub_store(cache_dir, &stats) == 0) {
+      fprintf(stderr, "Scrubbed %zu chunks: %zu removed as corrupt, "
+              "%zu newly marked, %zu skipped.\n", stats.chunks,
+              stats.corrupt, stats.marked, stats.skipped);
+    }
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  const char *sock_path = BOOTFSD_SOCK_PATH;
+  struct sockaddr_un addr;
+  unsigned int scrub_interval = 0;
+  int opt, sock, conn;
+  pid_t pid;
+
+  while ((opt = getopt(argc, argv, "s:a:d:c:D:S:")) != -1) {
+    switch (opt) {
+    case 's': sock_path = optarg; break;
+    case 'a':
+      if (nstores == STORES_MAX) {
+        fprintf(stderr, "Too many stores.\n");
+        return 1;
+      }
+      stores[nstores++] = optarg;
+      break;
+    case 'd': state_dir = optarg; break;
+    case 'c': cache_dir = optarg; break;
+    case 'D': desync_bin = optarg; break;
+    case 'S': scrub_interval = strtoul(optarg, NULL, 0); break;
+    default:
+      fprintf(stderr, "Usage: %s -a STORE [-a STORE]... [-s SOCKET] "
+              "[-d STATE_DIR] [-c CACHE_DIR] [-D DESYNC_BIN] "
+              "[-S SCRUB_INTERVAL_SEC]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (nstores == 0) {
+    fprintf(stderr, "No store is allowed; give them by -a.\n");
+    return 1;
+  }
+  if (mkdir_if_not_exist(state_dir) || mkdir_if_not_exist(cache_dir)) {
+    return 1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(sock_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", sock_path);
+    return 1;
+  }
+  strcpy(addr.sun_path, sock_path);
+  unlink(sock_path);
+  if ((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0
+      || bind(sock, (struct sockaddr *)&addr, sizeof(addr))
+      || listen(sock, SOMAXCONN)) {
+    fprintf(stderr, "Failed to listen on %s: %s\n", sock_path, strerror(errno));
+    return 1;
+  }
+  signal(SIGCHLD, SIG_IGN);
+  if (scrub_interval) {
+    start_scrubber(scrub_interval);
+  }
+  fprintf(stderr, "Listening on %s...\n", sock_path);
+
+  /* One process per request; mounts are serialized per image by a lock. */
+  while (1) {
+    if ((conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC)) < 0) {
+      if (errno != EINTR) {
+        fprintf(stderr, "Failed to accept: %s\n", strerror(errno));
+      }
+      continue;
+    }
+    if ((pid = fork()) == 0) {
+      close(sock);
+      handle(conn);
+      _exit(0);
+    } else if (pid < 0) {
+      fprintf(stderr, "Failed to fork handler.\n");
+    }
+    close(conn);
+  }
+}
@@ -0,0 +1,33 @@
+/*******************************************************************************
+ *
+ * bootfsd.h
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#ifndef BOOTFS_BOOTFSD_H
+#define BOOTFS_BOOTFSD_H
+
+/*
+ * Protocol between boot and the node daemon over a Unix socket.
+ *
+ *   boot -> bootfsd : "MOUNT <store>\n" + fd of rootfs.caibx
+ *   bootfsd -> boot : "OK\n" + fd of a detached clone of the rootfs mount
+ *                     "ERR <reason>\n"
+ *
+ * The daemon keys its lazy mounts by the digest of the caibx it reads from
+ * the passed fd and by the store, so one image is fetched and page-cached
+ * once per node. It only fetches from the stores it was started with.
+ */
+#define BOOTFSD_MOUNT      "MOUNT"
+#define BOOTFSD_OK         "OK"
+#define BOOTFSD_ERR        "ERR"
+#define BOOTFSD_MSG_LEN    4096
+
+/* Defaults on the node. */
+#define BOOTFSD_SOCK_PATH  "/run/bootfsd.sock"
+#define BOOTFSD_STATE_DIR  "/var/lib/bootfsd"
+#define BOOTFSD_CACHE_DIR  "/var/lib/bootfsd/castr"
+
+#endif
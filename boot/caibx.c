@@ -0,0 +1,209 @@
+/*******************************************************************************
+ *
+ * caibx.c
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "caibx.h"
+
+#define INDEX_HEADER_SIZE 48
+#define TABLE_HEADER_SIZE 16
+#define TABLE_ITEM_SIZE   (8 + CHUNK_ID_LEN)
+
+static uint64_t load_le64(const uint8_t *p)
+{
+  uint64_t v = 0;
+
+  for (int i = 7; i >= 0; i--) {
+    v = (v << 8) | p[i];
+  }
+
+  return v;
+}
+
+static void store_le64(uint8_t *p, uint64_t v)
+{
+  for (int i = 0; i < 8; i++) {
+    p[i] = v >> (i * 8);
+  }
+}
+
+static int read_header(FILE *fp, const char *path, struct caibx *idx)
+{
+  uint8_t header[INDEX_HEADER_SIZE];
+
+  if (fread(header, INDEX_HEADER_SIZE, 1, fp) != 1
+      || load_le64(header) != INDEX_HEADER_SIZE
+      || load_le64(header + 8) != CA_FORMAT_INDEX) {
+    fprintf(stderr, "%s isn't a caibx file.\n", path);
+    return -1;
+  }
+  idx->feature_flags  = load_le64(header + 16);
+  idx->chunk_size_min = load_le64(header + 24);
+  idx->chunk_size_avg = load_le64(header + 32);
+  idx->chunk_size_max = load_le64(header + 40);
+
+  return 0;
+}
+
+int caibx_load_header(const char *path, struct caibx *idx)
+{
+  FILE *fp;
+  int ret;
+
+  memset(idx, 0, sizeof(struct caibx));
+  if ((fp = fopen(path, "r")) == NULL) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  ret = read_header(fp, path, idx);
+  fclose(fp);
+
+  return ret;
+}
+
+int caibx_load(const char *path, struct caibx *idx)
+{
+  uint8_t header[TABLE_HEADER_SIZE], item[TABLE_ITEM_SIZE];
+  uint64_t end, prev = 0;
+  size_t cap = 0;
+  FILE *fp;
+
+  memset(idx, 0, sizeof(struct caibx));
+  if ((fp = fopen(path, "r")) == NULL) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  if (read_header(fp, path, idx)) {
+    goto error;
+  }
+  if (fread(header, TABLE_HEADER_SIZE, 1, fp) != 1
+      || load_le64(header + 8) != CA_FORMAT_TABLE) {
+    fprintf(stderr, "Broken chunk table in %s.\n", path);
+    goto error;
+  }
+
+  /* Items hold the end offset of each chunk; the tail starts with zero. */
+  while (fread(item, TABLE_ITEM_SIZE, 1, fp) == 1
+         && (end = load_le64(item)) != 0) {
+    if (end <= prev) {
+      fprintf(stderr, "Unordered chunk table in %s.\n", path);
+      goto error;
+    }
+    if (idx->n == cap) {
+      struct caibx_chunk *chunks;
+      cap = cap ? cap * 2 : 1024;
+      if ((chunks = realloc(idx->chunks,
+                            cap * sizeof(struct caibx_chunk))) == NULL) {
+        fprintf(stderr, "Failed to allocate chunk table.\n");
+        goto error;
+      }
+      idx->chunks = chunks;
+    }
+    idx->chunks[idx->n].offset = prev;
+    idx->chunks[idx->n].size = end - prev;
+    memcpy(idx->chunks[idx->n].id, item + 8, CHUNK_ID_LEN);
+    idx->n++;
+    prev = end;
+  }
+  if (load_le64(item + 32) != CA_FORMAT_TABLE_TAIL_MARKER) {
+    fprintf(stderr, "Truncated chunk table in %s.\n", path);
+    goto error;
+  }
+  fclose(fp);
+
+  return 0;
+
+  error:
+    fclose(fp);
+    caibx_free(idx);
+
+    return -1;
+}
+
+int caibx_write(const char *path, const struct caibx *idx)
+{
+  uint8_t header[INDEX_HEADER_SIZE], item[TABLE_ITEM_SIZE];
+  uint64_t end = 0;
+  FILE *fp;
+
+  if ((fp = fopen(path, "w")) == NULL) {
+    fprintf(stderr, "Failed to create %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  store_le64(header, INDEX_HEADER_SIZE);
+  store_le64(header + 8, CA_FORMAT_INDEX);
+  store_le64(header + 16, idx->feature_flags);
+  store_le64(header + 24, idx->chunk_size_min);
+  store_le64(header + 32, idx->chunk_size_avg);
+  store_le64(header + 40, idx->chunk_size_max);
+  fwrite(header, INDEX_HEADER_SIZE, 1, fp);
+  store_le64(header, UINT64_MAX);
+  store_le64(header + 8, CA_FORMAT_TABLE);
+  fwrite(header, TABLE_HEADER_SIZE, 1, fp);
+
+  /* End offsets are recomputed, so any subset of chunks makes an index. */
+  for (size_t i = 0; i < idx->n; i++) {
+    end += idx->chunks[i].size;
+    store_le64(item, end);
+    memcpy(item + 8, idx->chunks[i].id, CHUNK_ID_LEN);
+    fwrite(item, TABLE_ITEM_SIZE, 1, fp);
+  }
+  store_le64(item, 0);
+  store_le64(item + 8, 0);
+  store_le64(item + 16, INDEX_HEADER_SIZE);
+  store_le64(item + 24, TABLE_HEADER_SIZE + (idx->n + 1) * TABLE_ITEM_SIZE);
+  store_le64(item + 32, CA_FORMAT_TABLE_TAIL_MARKER);
+  fwrite(item, TABLE_ITEM_SIZE, 1, fp);
+  if (ferror(fp) | fclose(fp)) {
+    fprintf(stderr, "Failed to write %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+const struct caibx_chunk *caibx_lookup(const struct caibx *idx,
+                                       uint64_t offset)
+{
+  size_t lo = 0, hi = idx->n;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (idx->chunks[mid].offset + idx->chunks[mid].size <= offset) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == idx->n || offset < idx->chunks[lo].offset) {
+    return NULL;
+  }
+
+  return &idx->chunks[lo];
+}
+
+void caibx_free(struct caibx *idx)
+{
+  free(idx->chunks);
+  idx->chunks = NULL;
+  idx->n = 0;
+}
+
+void chunk_id_to_hex(const uint8_t id[CHUNK_ID_LEN],
+                     char hex[CHUNK_ID_HEX_LEN + 1])
+{
+  static const char digits[] = "0123456789abcdef";
+
+  for (int i = 0; i < CHUNK_ID_LEN; i++) {
+    hex[i * 2]     = digits[id[i] >> 4];
+    hex[i * 2 + 1] = digits[id[i] & 0xf];
+  }
+  hex[CHUNK_ID_HEX_LEN] = '\0';
+}
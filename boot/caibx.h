@@ -0,0 +1,59 @@
+/*******************************************************************************
+ *
+ * caibx.h
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#ifndef BOOTFS_CAIBX_H
+#define BOOTFS_CAIBX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* casync index format (https://github.com/systemd/casync, caformat.h) */
+#define CA_FORMAT_INDEX             0x96824d9c7b129ff9ULL
+#define CA_FORMAT_TABLE             0xe75b9e112f17417dULL
+#define CA_FORMAT_TABLE_TAIL_MARKER 0x4b4f050e5549ecd1ULL
+#define CA_FORMAT_SHA512_256        0x2000000000000000ULL
+#define CHUNK_ID_LEN                32
+#define CHUNK_ID_HEX_LEN            (CHUNK_ID_LEN * 2)
+
+struct caibx_chunk {
+  uint64_t offset;              /* start offset in the archive */
+  uint64_t size;
+  uint8_t id[CHUNK_ID_LEN];
+};
+
+struct caibx {
+  uint64_t feature_flags;
+  uint64_t chunk_size_min;
+  uint64_t chunk_size_avg;
+  uint64_t chunk_size_max;
+  size_t n;
+  struct caibx_chunk *chunks;
+};
+
+#define caibx_sha512_256(idx) (((idx)->feature_flags & CA_FORMAT_SHA512_256) != 0)
+#define caibx_archive_size(idx)                                         \
+  ((idx)->n ? (idx)->chunks[(idx)->n - 1].offset                        \
+              + (idx)->chunks[(idx)->n - 1].size : 0)
+
+int caibx_load(const char *path, struct caibx *idx);
+
+/* Read only the fixed-size header; the chunk table is left empty. */
+int caibx_load_header(const char *path, struct caibx *idx);
+void caibx_free(struct caibx *idx);
+
+/* Write chunks in order as a caibx; offsets of idx->chunks are ignored. */
+int caibx_write(const char *path, const struct caibx *idx);
+
+/* Chunk which contains offset, or NULL if out of the archive. */
+const struct caibx_chunk *caibx_lookup(const struct caibx *idx,
+                                       uint64_t offset);
+
+void chunk_id_to_hex(const uint8_t id[CHUNK_ID_LEN],
+                     char hex[CHUNK_ID_HEX_LEN + 1]);
+
+#endif
@@ -0,0 +1,342 @@
+/*******************************************************************************
+ *
+ * caibx_util.c
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "bidx.h"
+#include "caibx.h"
+#include "castr.h"
+#include "chunkcache.h"
+#include "chunker.h"
+
+#define CAT_BLOCK_SIZE (1024 * 1024)
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "Usage:\n");
+  fprintf(stderr, "  %s zero INDEX              "
+          "Report all-zero chunks served locally\n", name);
+  fprintf(stderr, "  %s sidecar INDEX SIDECAR   "
+          "Generate mmap-able sidecar index\n", name);
+  fprintf(stderr, "  %s lookup SIDECAR OFFSET.. "
+          "Print chunks which contain offsets\n", name);
+  fprintf(stderr, "  %s cat INDEX STORE [OFFSET [LENGTH]]\n"
+          "                              "
+          "Write the archive from a local store to stdout\n", name);
+  fprintf(stderr, "  %s replay INDEX STORE PROFILE\n"
+          "                              "
+          "Read profile ranges through the chunk cache\n", name);
+  fprintf(stderr, "  %s dedup INDEX...           "
+          "Report how a store of the indexes' chunks dedups them\n", name);
+  fprintf(stderr, "  %s scrub STORE              "
+          "Verify chunks of a local store, removing bad ones\n", name);
+  fprintf(stderr, "  %s make [-j THREADS] [-k scalar|avx2|avx512] [-s] "
+          "[[-b BASE_ARCHIVE] -i BASE_INDEX] ARCHIVE INDEX STORE\n"
+          "                              "
+          "Chunk an archive into a store, as casync make\n", name);
+}
+
+static int zero_report(const char *path)
+{
+  struct caibx idx;
+  struct zero_chunks zero;
+  uint64_t bytes, total;
+  size_t n;
+
+  if (caibx_load(path, &idx)) {
+    return 1;
+  }
+  zero_chunks_init(&zero, caibx_sha512_256(&idx),
+                   idx.chunk_size_min, idx.chunk_size_max);
+  n = count_zero_chunks(&zero, &idx, &bytes);
+  total = caibx_archive_size(&idx);
+  printf("Zero chunks: %zu of %zu chunks, %llu of %llu bytes (%.1f%%) "
+         "served without fetching.\n",
+         n, idx.n, (unsigned long long)bytes, (unsigned long long)total,
+         total ? 100.0 * bytes / total : 0.0);
+  caibx_free(&idx);
+
+  return 0;
+}
+
+static int compare_chunk_id(const void *a, const void *b)
+{
+  return memcmp(((const struct caibx_chunk *)a)->id,
+                ((const struct caibx_chunk *)b)->id, CHUNK_ID_LEN);
+}
+
+/*
+ * Bytes of the archives of some indexes (a catalogue of images) against
+ * the bytes of their distinct chunks, which is what a store holds of them.
+ */
+static int dedup_report(int n, char *paths[])
+{
+  struct caibx_chunk *all = NULL, *p;
+  struct caibx idx;
+  size_t total = 0, cap = 0, unique = 0;
+  uint64_t bytes = 0, unique_bytes = 0;
+  int ret = 1;
+
+  for (int i = 0; i < n; i++) {
+    if (caibx_load(paths[i], &idx)) {
+      goto out;
+    }
+    if (total + idx.n > cap) {
+      cap = (total + idx.n) * 2;
+      if ((p = realloc(all, cap * sizeof(*all))) == NULL) {
+        fprintf(stderr, "Failed to allocate chunk list.\n");
+        caibx_free(&idx);
+        goto out;
+      }
+      all = p;
+    }
+    memcpy(all + total, idx.chunks, idx.n * sizeof(*all));
+    total += idx.n;
+    bytes += caibx_archive_size(&idx);
+    caibx_free(&idx);
+  }
+  qsort(all, total, sizeof(*all), compare_chunk_id);
+  for (size_t i = 0; i < total; i++) {
+    if (i == 0 || compare_chunk_id(&all[i - 1], &all[i])) {
+      unique++;
+      unique_bytes += all[i].size;
+    }
+  }
+  printf("Dedup: %d indexes, %zu chunks (%llu bytes), %zu distinct "
+         "(%llu bytes), ratio %.3f.\n", n, total, (unsigned long long)bytes,
+         unique, (unsigned long long)unique_bytes,
+         unique_bytes ? (double)bytes / unique_bytes : 0.0);
+  ret = 0;
+
+  out:
+    free(all);
+
+    return ret;
+}
+
+static int sidecar(const char *path, const char *out)
+{
+  struct caibx idx;
+  int ret;
+
+  if (caibx_load(path, &idx)) {
+    return 1;
+  }
+  ret = bidx_write(out, &idx) ? 1 : 0;
+  caibx_free(&idx);
+
+  return ret;
+}
+
+static int lookup(const char *path, int n, char *offsets[])
+{
+  struct bidx bx;
+  char hex[CHUNK_ID_HEX_LEN + 1];
+  size_t slot;
+
+  if (bidx_open(path, &bx)) {
+    return 1;
+  }
+  for (int i = 0; i < n; i++) {
+    unsigned long long offset = strtoull(offsets[i], NULL, 0);
+    if ((slot = bidx_lookup(&bx, offset)) == 0) {
+      printf("%llu -\n", offset);
+      continue;
+    }
+    chunk_id_to_hex(bx.records[slot].id, hex);
+    printf("%llu %s %llu+%u\n", offset, hex,
+           (unsigned long long)bx.keys[slot], bx.records[slot].size);
+  }
+  bidx_close(&bx);
+
+  return 0;
+}
+
+static int cat(const char *path, const char *store, int argc, char *argv[])
+{
+  struct caibx idx;
+  struct chunk_cache c;
+  uint64_t offset = argc > 0 ? strtoull(argv[0], NULL, 0) : 0;
+  uint64_t len = argc > 1 ? strtoull(argv[1], NULL, 0) : UINT64_MAX;
+  ssize_t n = 0;
+  char *buf;
+  int ret = 1;
+
+  if (caibx_load(path, &idx)) {
+    return 1;
+  }
+  if ((buf = malloc(CAT_BLOCK_SIZE)) == NULL
+      || chunk_cache_init(&c, store, &idx, 0)) {
+    free(buf);
+    caibx_free(&idx);
+    return 1;
+  }
+  while (len > 0) {
+    n = chunk_cache_read(&c, &idx, offset,
+                         buf, len < CAT_BLOCK_SIZE ? len : CAT_BLOCK_SIZE);
+    if (n <= 0) {
+      break;
+    }
+    if (fwrite(buf, 1, n, stdout) != (size_t)n) {
+      n = -1;
+      break;
+    }
+    offset += n;
+    len -= n;
+  }
+  if (n == 0 || len == 0) {
+    ret = 0;
+  } else {
+    fprintf(stderr, "Failed to read the archive at %llu.\n",
+            (unsigned long long)offset);
+  }
+  chunk_cache_free(&c);
+  free(buf);
+  caibx_free(&idx);
+
+  return ret;
+}
+
+/* Profile lines are "<offset> [<length>]" in the archive, as boot --warm. */
+static int replay(const char *path, const char *store, const char *profile)
+{
+  struct caibx idx;
+  struct chunk_cache c;
+  struct timespec start, end;
+  char line[256], *p, *buf = NULL;
+  uint64_t offset, len;
+  size_t reads = 0;
+  FILE *fp;
+  int ret = 0;
+
+  if (caibx_load(path, &idx)) {
+    return 1;
+  }
+  if ((fp = fopen(profile, "r")) == NULL) {
+    fprintf(stderr, "Failed to open %s\n", profile);
+    caibx_free(&idx);
+    return 1;
+  }
+  if (chunk_cache_init(&c, store, &idx, 0)) {
+    fclose(fp);
+    caibx_free(&idx);
+    return 1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (ret == 0 && fgets(line, sizeof(line), fp)) {
+    if (line[0] == '#' || line[0] == '\n') {
+      continue;
+    }
+    offset = strtoull(line, &p, 0);
+    len = strtoull(p, NULL, 0);
+    len = len ? len : 1;
+    free(buf);
+    if ((buf = malloc(len)) == NULL
+        || chunk_cache_read(&c, &idx, offset, buf, len) < 0) {
+      fprintf(stderr, "Failed to read %llu+%llu.\n",
+              (unsigned long long)offset, (unsigned long long)len);
+      ret = 1;
+    }
+    reads++;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("reads=%zu seconds=%.6f\n", reads,
+         (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+  chunk_cache_report(&c, stdout);
+  chunk_cache_free(&c);
+  free(buf);
+  fclose(fp);
+  caibx_free(&idx);
+
+  return ret;
+}
+
+static int scrub(const char *store)
+{
+  struct scrub_stats stats;
+  int ret = scrub_store(store, &stats) ? 1 : 0;
+
+  printf("chunks=%zu bytes=%llu verified=%zu marked=%zu corrupt=%zu "
+         "skipped=%zu\n", stats.chunks, (unsigned long long)stats.bytes,
+         stats.verified, stats.marked, stats.corrupt, stats.skipped);
+
+  return ret;
+}
+
+static int make(int argc, char *argv[])
+{
+  struct chunker_opts opts = { 0, -1, 0, NULL, NULL };
+  struct chunker_stats stats;
+  double seconds;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "j:k:sb:i:")) != -1) {
+    switch (opt) {
+    case 'j': opts.threads = atoi(optarg); break;
+    case 'k':
+      for (opts.kernel = CHUNKER_KERNELS - 1; opts.kernel > 0
+             && strcmp(optarg, chunker_kernel_name(opts.kernel));
+           opts.kernel--) {
+      }
+      if (strcmp(optarg, chunker_kernel_name(opts.kernel))) {
+        return -1;
+      }
+      break;
+    case 's': opts.skip = 1; break;
+    case 'b': opts.base_archive = optarg; break;
+    case 'i': opts.base_index = optarg; break;
+    default: return -1;
+    }
+  }
+  if (optind != argc - 3 || (opts.base_archive && !opts.base_index)) {
+    return -1;
+  }
+  if (chunker_make(argv[optind], argv[optind + 1], argv[optind + 2], &opts,
+                   &stats)) {
+    return 1;
+  }
+  seconds = stats.match_s + stats.cut_s + stats.store_s;
+  printf("chunks=%zu bytes=%llu stored=%zu stored_bytes=%llu reused=%zu "
+         "reused_bytes=%llu match_s=%.3f cut_s=%.3f store_s=%.3f mbps=%.1f\n",
+         stats.chunks, (unsigned long long)stats.bytes, stats.stored,
+         (unsigned long long)stats.stored_bytes, stats.reused,
+         (unsigned long long)stats.reused_bytes, stats.match_s, stats.cut_s,
+         stats.store_s, seconds > 0 ? stats.bytes / seconds / 1e6 : 0.0);
+
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  int ret;
+
+  if (argc == 3 && strcmp(argv[1], "zero") == 0) {
+    return zero_report(argv[2]);
+  } else if (argc == 4 && strcmp(argv[1], "sidecar") == 0) {
+    return sidecar(argv[2], argv[3]);
+  } else if (argc >= 4 && strcmp(argv[1], "lookup") == 0) {
+    return lookup(argv[2], argc - 3, argv + 3);
+  } else if (argc >= 4 && argc <= 6 && strcmp(argv[1], "cat") == 0) {
+    return cat(argv[2], argv[3], argc - 4, argv + 4);
+  } else if (argc == 5 && strcmp(argv[1], "replay") == 0) {
+    return replay(argv[2], argv[3], argv[4]);
+  } else if (argc >= 3 && strcmp(argv[1], "dedup") == 0) {
+    return dedup_report(argc - 2, argv + 2);
+  } else if (argc == 3 && strcmp(argv[1], "scrub") == 0) {
+    return scrub(argv[2]);
+  } else if (argc >= 5 && strcmp(argv[1], "make") == 0
+             && (ret = make(argc - 1, argv + 1)) >= 0) {
+    return ret;
+  }
+  usage(argv[0]);
+
+  return 1;
+}
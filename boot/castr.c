@@ -0,0 +1,521 @@
+/*******************************************************************************
+ *
+ * castr.c
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+#include "castr.h"
+#include "sha.h"
+
+/* zstd frame format (RFC 8878) */
+#define ZSTD_MAGIC          0xFD2FB528U
+#define ZSTD_FHD_SINGLE_SEG 0x20
+#define ZSTD_FHD_FCS_8      0xC0
+#define ZSTD_FHD_CHECKSUM   0x04
+#define ZSTD_BLOCK_RAW      0
+#define ZSTD_BLOCK_RLE      1
+#define ZSTD_BLOCK_COMP     2
+#define ZSTD_BLOCK_MAX      (128 * 1024)
+#define ZSTD_FRAME_HEADER   (4 + 1 + 8)
+
+/* Verify-once mark: ino, size, mtime (sec, nsec), each LE64 */
+#define CHUNK_MARK_LEN      32
+
+/* Largest decoded chunk scrub_store() takes, way above casync's defaults */
+#define SCRUB_CHUNK_MAX     (16 * 1024 * 1024)
+
+int chunk_path(const char *store, const uint8_t id[CHUNK_ID_LEN],
+               char *path, size_t len)
+{
+  char hex[CHUNK_ID_HEX_LEN + 1];
+  int n;
+
+  chunk_id_to_hex(id, hex);
+  n = snprintf(path, len, "%s/%.4s/%s%s", store, hex, hex, CHUNK_FILE_SUFFIX);
+
+  return (n < 0 || (size_t)n >= len) ? -1 : 0;
+}
+
+int chunk_store(const char *store, const uint8_t id[CHUNK_ID_LEN],
+                const void *data, size_t len)
+{
+  char path[PATH_MAX];
+
+  if (chunk_path(store, id, path, sizeof(path))) {
+    return -1;
+  }
+
+  return chunk_publish(path, data, len);
+}
+
+int chunk_publish(const char *path, const void *data, size_t len)
+{
+  char tmp[PATH_MAX + 32];
+  const uint8_t *p = data;
+  ssize_t n;
+  int fd, ret = -1;
+
+  /* <store>/<prefix> */
+  snprintf(tmp, sizeof(tmp), "%.*s",
+           (int)(strrchr(path, '/') - path), path);
+  if (mkdir(tmp, 0755) && errno != EEXIST) {
+    fprintf(stderr, "Failed to create %s: %s\n", tmp, strerror(errno));
+    return -1;
+  }
+
+  /*
+   * The cache is shared among containers, where we are all PID 1, so the
+   * temporary file needs a unique name rather than one based on the PID.
+   */
+  snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+  if ((fd = mkstemp(tmp)) < 0) {
+    fprintf(stderr, "Failed to create %s: %s\n", tmp, strerror(errno));
+    return -1;
+  }
+  fchmod(fd, 0644);
+  while (len > 0) {
+    if ((n = write(fd, p, len)) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "Failed to write %s: %s\n", tmp, strerror(errno));
+      goto out;
+    }
+    p += n;
+    len -= n;
+  }
+
+  /* Someone else publishing the same chunk first is just as good. */
+  if (link(tmp, path) && errno != EEXIST) {
+    fprintf(stderr, "Failed to publish %s: %s\n", path, strerror(errno));
+    goto out;
+  }
+  ret = 0;
+
+  out:
+    close(fd);
+    unlink(tmp);
+
+    return ret;
+}
+
+size_t zstd_stored_bound(size_t len)
+{
+  size_t blocks = len ? (len + ZSTD_BLOCK_MAX - 1) / ZSTD_BLOCK_MAX : 1;
+
+  return ZSTD_FRAME_HEADER + blocks * 3 + len;
+}
+
+static void put_le(uint8_t *p, uint64_t v, int bytes)
+{
+  for (int i = 0; i < bytes; i++, v >>= 8) {
+    p[i] = (uint8_t)v;
+  }
+}
+
+static int is_run(const uint8_t *p, size_t len)
+{
+  return len > 0 && p[0] == p[len - 1] && memcmp(p, p + 1, len - 1) == 0;
+}
+
+size_t zstd_encode_stored(const void *data, size_t len, uint8_t *out)
+{
+  const uint8_t *p = data;
+  size_t pos = 0;
+
+  put_le(out, ZSTD_MAGIC, 4);
+  out[4] = ZSTD_FHD_SINGLE_SEG | ZSTD_FHD_FCS_8;
+  put_le(out + 5, len, 8);
+  pos = ZSTD_FRAME_HEADER;
+  do {
+    size_t n = len > ZSTD_BLOCK_MAX ? ZSTD_BLOCK_MAX : len;
+    int last = (n == len), rle = is_run(p, n);
+
+    put_le(out + pos,
+           last | ((rle ? ZSTD_BLOCK_RLE : ZSTD_BLOCK_RAW) << 1) | (n << 3), 3);
+    pos += 3;
+    if (rle) {
+      out[pos++] = p[0];
+    } else {
+      memcpy(out + pos, p, n);
+      pos += n;
+    }
+    p += n;
+    len -= n;
+  } while (len > 0);
+
+  return pos;
+}
+
+size_t zstd_bound(size_t len)
+{
+#ifdef WITH_ZSTD
+  return ZSTD_compressBound(len);
+#else
+  return zstd_stored_bound(len);
+#endif
+}
+
+size_t zstd_encode(const void *data, size_t len, void *out)
+{
+#ifdef WITH_ZSTD
+  size_t n = ZSTD_compress(out, ZSTD_compressBound(len), data, len,
+                           ZSTD_LEVEL);
+
+  return ZSTD_isError(n) ? 0 : n;
+#else
+  return zstd_encode_stored(data, len, out);
+#endif
+}
+
+#ifndef WITH_ZSTD
+static uint64_t get_le(const uint8_t *p, int bytes)
+{
+  uint64_t v = 0;
+
+  for (int i = bytes - 1; i >= 0; i--) {
+    v = (v << 8) | p[i];
+  }
+
+  return v;
+}
+#endif
+
+ssize_t zstd_decode(const void *frame, size_t len, void *out, size_t cap)
+{
+#ifdef WITH_ZSTD
+  size_t n = ZSTD_decompress(out, cap, frame, len);
+
+  return ZSTD_isError(n) ? -1 : (ssize_t)n;
+#else
+  static const int dict_id_size[] = { 0, 1, 2, 4 };
+  const uint8_t *p = frame, *end = p + len;
+  uint8_t *q = out;
+  uint32_t header;
+  size_t n, pos = 0;
+  int fhd, fcs_size;
+
+  if (len < 5 || get_le(p, 4) != ZSTD_MAGIC) {
+    return -1;
+  }
+  fhd = p[4];
+  fcs_size = (fhd >> 6) ? 1 << (fhd >> 6) : (fhd & ZSTD_FHD_SINGLE_SEG) != 0;
+  p += 5 + !(fhd & ZSTD_FHD_SINGLE_SEG) + dict_id_size[fhd & 3] + fcs_size;
+  do {
+    if (end - p < 3) {
+      return -1;
+    }
+    header = get_le(p, 3);
+    n = header >> 3;
+    p += 3;
+    if (pos + n > cap) {
+      return -1;
+    }
+    switch ((header >> 1) & 3) {
+    case ZSTD_BLOCK_RAW:
+      if ((size_t)(end - p) < n) {
+        return -1;
+      }
+      memcpy(q + pos, p, n);
+      p += n;
+      break;
+    case ZSTD_BLOCK_RLE:
+      if (end - p < 1) {
+        return -1;
+      }
+      memset(q + pos, *p++, n);
+      break;
+    case ZSTD_BLOCK_COMP:
+      return ZSTD_UNSUPPORTED;
+    default:
+      return -1;
+    }
+    pos += n;
+  } while (!(header & 1));
+  if ((fhd & ZSTD_FHD_CHECKSUM) && end - p < 4) {
+    return -1;
+  }
+
+  return pos;
+#endif
+}
+
+static void chunk_mark(const struct stat *st, uint8_t mark[CHUNK_MARK_LEN])
+{
+  put_le(mark, st->st_ino, 8);
+  put_le(mark + 8, st->st_size, 8);
+  put_le(mark + 16, st->st_mtim.tv_sec, 8);
+  put_le(mark + 24, st->st_mtim.tv_nsec, 8);
+}
+
+int chunk_is_verified(const char *path, struct stat *st)
+{
+  uint8_t mark[CHUNK_MARK_LEN], want[CHUNK_MARK_LEN];
+
+  if (stat(path, st)) {
+    memset(st, 0, sizeof(*st));
+    return 0;
+  }
+  if (getxattr(path, CHUNK_VERIFIED_XATTR, mark, sizeof(mark))
+      != CHUNK_MARK_LEN) {
+    return 0;
+  }
+  chunk_mark(st, want);
+
+  return memcmp(mark, want, CHUNK_MARK_LEN) == 0;
+}
+
+int chunk_mark_verified(const char *path, const struct stat *st)
+{
+  uint8_t mark[CHUNK_MARK_LEN], now[CHUNK_MARK_LEN];
+  struct stat cur;
+
+  if (stat(path, &cur)) {
+    return -1;
+  }
+  chunk_mark(st, mark);
+  chunk_mark(&cur, now);
+  if (memcmp(mark, now, CHUNK_MARK_LEN)) {
+    return -1;                  /* replaced since it was read */
+  }
+
+  return setxattr(path, CHUNK_VERIFIED_XATTR, mark, sizeof(mark), 0);
+}
+
+static int chunk_id_from_hex(const char *hex, uint8_t id[CHUNK_ID_LEN])
+{
+  unsigned int byte;
+
+  for (int i = 0; i < CHUNK_ID_LEN; i++) {
+    if (sscanf(hex + i * 2, "%2x", &byte) != 1) {
+      return -1;
+    }
+    id[i] = byte;
+  }
+
+  return 0;
+}
+
+static int read_file(const char *path, struct stat *st, uint8_t **data)
+{
+  ssize_t n;
+  size_t len = 0;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, st)) {
+    goto error;
+  }
+  if ((*data = malloc(st->st_size ? st->st_size : 1)) == NULL) {
+    goto error;
+  }
+  while (len < (size_t)st->st_size
+         && (n = read(fd, *data + len, st->st_size - len)) > 0) {
+    len += n;
+  }
+  close(fd);
+  fd = -1;
+  if (len == (size_t)st->st_size) {
+    return 0;
+  }
+  free(*data);
+
+  error:
+    if (fd >= 0) {
+      close(fd);
+    }
+
+    return -1;
+}
+
+/* Check a chunk against its name, by either digest as the index isn't known. */
+static int scrub_chunk(const char *path, const uint8_t id[CHUNK_ID_LEN],
+                       uint8_t *buf, struct scrub_stats *stats)
+{
+  uint8_t *frame, digest[CHUNK_ID_LEN];
+  struct stat st, now;
+  ssize_t n;
+  int ok;
+
+  if (read_file(path, &st, &frame)) {
+    return 0;                   /* gone meanwhile */
+  }
+  n = zstd_decode(frame, st.st_size, buf, SCRUB_CHUNK_MAX);
+  free(frame);
+  stats->chunks++;
+  stats->bytes += st.st_size;
+  if (n == ZSTD_UNSUPPORTED) {
+    stats->skipped++;
+    return 0;
+  }
+  ok = 0;
+  for (int sha512_256 = 1; n >= 0 && sha512_256 >= 0 && !ok; sha512_256--) {
+    chunk_digest(sha512_256, buf, n, digest);
+    ok = memcmp(digest, id, CHUNK_ID_LEN) == 0;
+  }
+  if (ok) {
+    stats->verified++;
+    if (!chunk_is_verified(path, &now) && chunk_mark_verified(path, &st) == 0) {
+      stats->marked++;
+    }
+    return 0;
+  }
+
+  /* Unless it's been replaced since, readers fetch it again. */
+  if (stat(path, &now) == 0 && now.st_ino == st.st_ino) {
+    if (unlink(path)) {
+      fprintf(stderr, "Failed to remove %s: %s\n", path, strerror(errno));
+      return -1;
+    }
+    fprintf(stderr, "Removed corrupt chunk %s.\n", path);
+    stats->corrupt++;
+  }
+
+  return 0;
+}
+
+int scrub_store(const char *store, struct scrub_stats *stats)
+{
+  char dir[PATH_MAX], path[PATH_MAX * 2];
+  size_t suffix_len = strlen(CHUNK_FILE_SUFFIX);
+  uint8_t id[CHUNK_ID_LEN], *buf;
+  struct dirent *p, *c;
+  DIR *sd, *cd;
+  int ret = 0;
+
+  memset(stats, 0, sizeof(*stats));
+  if ((sd = opendir(store)) == NULL) {
+    fprintf(stderr, "Failed to open %s: %s\n", store, strerror(errno));
+    return -1;
+  }
+  if ((buf = malloc(SCRUB_CHUNK_MAX)) == NULL) {
+    closedir(sd);
+    return -1;
+  }
+  while ((p = readdir(sd)) != NULL) {
+    if (p->d_name[0] == '.') {
+      continue;
+    }
+    snprintf(dir, sizeof(dir), "%s/%s", store, p->d_name);
+    if ((cd = opendir(dir)) == NULL) {
+      continue;
+    }
+
+    /* <id>.cacnk only, not temporary files being published */
+    while ((c = readdir(cd)) != NULL) {
+      if (strlen(c->d_name) != CHUNK_ID_HEX_LEN + suffix_len
+          || strcmp(c->d_name + CHUNK_ID_HEX_LEN, CHUNK_FILE_SUFFIX)
+          || chunk_id_from_hex(c->d_name, id)) {
+        continue;
+      }
+      snprintf(path, sizeof(path), "%s/%s", dir, c->d_name);
+      if (scrub_chunk(path, id, buf, stats)) {
+        ret = -1;
+      }
+    }
+    closedir(cd);
+  }
+  closedir(sd);
+  free(buf);
+
+  return ret;
+}
+
+void zero_chunks_init(struct zero_chunks *zero, int sha512_256,
+                      uint64_t size_min, uint64_t size_max)
+{
+  uint64_t sizes[ZERO_CHUNK_KINDS] = { size_max, size_min };
+  uint8_t *zeros = calloc(1, size_max);
+
+  zero->n = 0;
+  if (zeros == NULL) {
+    return;
+  }
+  for (int i = 0; i < ZERO_CHUNK_KINDS; i++) {
+    if (sizes[i] == 0 || (i > 0 && sizes[i] == sizes[0])) {
+      continue;
+    }
+    zero->size[zero->n] = sizes[i];
+    chunk_digest(sha512_256, zeros, sizes[i], zero->id[zero->n]);
+    zero->n++;
+  }
+  free(zeros);
+}
+
+int zero_chunk_kind(const struct zero_chunks *zero,
+                    const struct caibx_chunk *chunk)
+{
+  for (int i = 0; i < zero->n; i++) {
+    if (chunk->size == zero->size[i]
+        && memcmp(chunk->id, zero->id[i], CHUNK_ID_LEN) == 0) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+size_t count_zero_chunks(const struct zero_chunks *zero,
+                         const struct caibx *idx, uint64_t *bytes)
+{
+  size_t n = 0;
+
+  *bytes = 0;
+  for (size_t i = 0; i < idx->n; i++) {
+    if (is_zero_chunk(zero, &idx->chunks[i])) {
+      *bytes += idx->chunks[i].size;
+      n++;
+    }
+  }
+
+  return n;
+}
+
+int seed_zero_chunks(const char *store, const struct zero_chunks *zero)
+{
+  char path[PATH_MAX];
+  uint8_t *zeros, *frame;
+  uint64_t size_max = 0;
+  size_t len;
+  int ret = 0;
+
+  for (int i = 0; i < zero->n; i++) {
+    size_max = zero->size[i] > size_max ? zero->size[i] : size_max;
+  }
+  zeros = calloc(1, size_max);
+  frame = malloc(zstd_stored_bound(size_max));
+  if (zeros == NULL || frame == NULL) {
+    ret = -1;
+    goto out;
+  }
+  for (int i = 0; i < zero->n; i++) {
+    if (chunk_path(store, zero->id[i], path, sizeof(path))
+        || access(path, F_OK) == 0) {
+      continue;
+    }
+    len = zstd_encode_stored(zeros, zero->size[i], frame);
+    if (chunk_store(store, zero->id[i], frame, len)) {
+      ret = -1;
+    }
+  }
+
+  out:
+    free(zeros);
+    free(frame);
+
+    return ret;
+}
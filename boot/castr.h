@@ -0,0 +1,108 @@
+/*******************************************************************************
+ *
+ * castr.h
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#ifndef BOOTFS_CASTR_H
+#define BOOTFS_CASTR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "caibx.h"
+
+/* Chunk store layout shared by casync and desync. */
+#define CHUNK_FILE_SUFFIX ".cacnk"
+
+/* Path of a chunk in a local store: <store>/<id[0:4]>/<id>.cacnk */
+int chunk_path(const char *store, const uint8_t id[CHUNK_ID_LEN],
+               char *path, size_t len);
+
+/* Publish a chunk file atomically (temporary file + link). */
+int chunk_store(const char *store, const uint8_t id[CHUNK_ID_LEN],
+                const void *data, size_t len);
+int chunk_publish(const char *path, const void *data, size_t len);
+
+/*
+ * Encode data as a zstd frame which only uses raw and RLE blocks. Any zstd
+ * decoder (including desync's) accepts it, and runs of a single byte shrink
+ * to a few bytes per block without linking a compressor.
+ */
+size_t zstd_stored_bound(size_t len);
+size_t zstd_encode_stored(const void *data, size_t len, uint8_t *out);
+
+/*
+ * Encode a chunk for a store, into zstd_bound(len) bytes at out: compressed
+ * with libzstd in WITH_ZSTD builds, else stored as above. Returns the size
+ * of the frame, or 0.
+ */
+#define ZSTD_LEVEL 3            /* zstd's default, as casync uses */
+size_t zstd_bound(size_t len);
+size_t zstd_encode(const void *data, size_t len, void *out);
+
+/*
+ * Decode a zstd frame into out. Returns the decoded size, or -1. Frames of
+ * raw and RLE blocks (as above) always decode; compressed blocks, which is
+ * what desync writes, need libzstd (make WITH_ZSTD=1).
+ */
+ssize_t zstd_decode(const void *frame, size_t len, void *out, size_t cap);
+#define ZSTD_UNSUPPORTED -2     /* compressed, and built without libzstd */
+
+/*
+ * Verify-once marks. A chunk file which passed verification carries an
+ * xattr with its inode, size and mtime, so that later readers can skip
+ * hashing while the file stays the same. A file written anew (another
+ * inode or mtime) loses its mark, and scrub_store() re-verifies them.
+ */
+#define CHUNK_VERIFIED_XATTR "user.bootfs.verified"
+
+/* 1 if path is marked and still the file it was marked on. Fills st. */
+int chunk_is_verified(const char *path, struct stat *st);
+
+/* Mark path, if it's still the file st was taken from. */
+int chunk_mark_verified(const char *path, const struct stat *st);
+
+struct scrub_stats {
+  size_t chunks;
+  size_t verified;              /* of which newly marked */
+  size_t marked;
+  size_t corrupt;               /* removed, to be fetched again */
+  size_t skipped;               /* not decodable in this build */
+  uint64_t bytes;
+};
+
+/* Verify every chunk of a local store, marking good ones. */
+int scrub_store(const char *store, struct scrub_stats *stats);
+
+/*
+ * All-zero chunks. A run of zeros never matches the chunker's boundary
+ * condition except at fixed distances, so zero regions always turn into
+ * chunks of the maximum (or minimum) size whose IDs are known in advance.
+ */
+#define ZERO_CHUNK_KINDS 2
+
+struct zero_chunks {
+  int n;
+  uint64_t size[ZERO_CHUNK_KINDS];
+  uint8_t id[ZERO_CHUNK_KINDS][CHUNK_ID_LEN];
+};
+
+void zero_chunks_init(struct zero_chunks *zero, int sha512_256,
+                      uint64_t size_min, uint64_t size_max);
+/* Index into zero->id of an all-zero chunk, or -1. */
+int zero_chunk_kind(const struct zero_chunks *zero,
+                    const struct caibx_chunk *chunk);
+#define is_zero_chunk(zero, chunk) (zero_chunk_kind(zero, chunk) >= 0)
+
+/* Count the zero chunks of an index. Returns the number of chunks. */
+size_t count_zero_chunks(const struct zero_chunks *zero,
+                         const struct caibx *idx, uint64_t *bytes);
+
+/* Synthesize the zero chunks into a local store (a few bytes each). */
+int seed_zero_chunks(const char *store, const struct zero_chunks *zero);
+
+#endif
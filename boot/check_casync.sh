@@ -0,0 +1,63 @@
+#!/bin/bash
+############################################################
+#
+# check_casync.sh
+#
+# Copyright 2019, Kohei Tokunaga
+# Licensed under Apache License, Version 2.0
+#
+############################################################
+
+# Checks the native chunker against casync. An archive is chunked by
+# "casync make", then chunker_bench checks the skipping chunker and every
+# kernel against its boundaries and chunk IDs, and "caibx_util make" with
+# each kernel, and with -s, must write the same chunk table.
+
+function check {
+    if [ $? -ne 0 ] ; then
+        (>&2 echo "Failed: ${1}")
+        exit 1
+    else
+        echo "Succeeded: ${1}"
+    fi
+}
+
+BIN_DIR=$(cd "$(dirname "${0}")" && pwd)
+CASYNC_BIN="${CASYNC_BIN:-casync}"
+ARCHIVE_SIZE=$((48 * 1024 * 1024))
+WORK_DIR=$(mktemp -d)
+trap 'rm -rf "${WORK_DIR}"' EXIT
+
+# Binaries and libraries of the system (text, code and repeats), then
+# zeros and random data.
+( find /usr/bin /usr/lib -maxdepth 1 -type f -print0 2>/dev/null \
+      | LC_ALL=C sort -z | xargs -0 cat 2>/dev/null \
+      | head -c $((ARCHIVE_SIZE / 2)) ; \
+  head -c $((ARCHIVE_SIZE / 8)) /dev/zero ; \
+  head -c $((ARCHIVE_SIZE * 3 / 8)) /dev/urandom ) > "${WORK_DIR}"/archive
+check "Generating an archive."
+
+"${CASYNC_BIN}" make --store="${WORK_DIR}"/casync.castr \
+                "${WORK_DIR}"/casync.caibx "${WORK_DIR}"/archive > /dev/null
+check "Chunking the archive with casync."
+
+KERNELS=$("${BIN_DIR}"/chunker_bench -p 1 \
+                     "${WORK_DIR}"/archive "${WORK_DIR}"/casync.caibx \
+              | sed -n 's/^kernel=\([a-z0-9]*\) .*/\1/p' | grep -v '^skip$' ; \
+          exit ${PIPESTATUS[0]})
+check "Matching boundaries and chunk IDs of casync with each kernel."
+
+# The chunk tables follow the 48-byte headers, which have casync's own
+# feature flags.
+for OPTION in ${KERNELS} -s ; do
+    if [ "${OPTION}" == "-s" ] ; then
+        MAKE_OPTION=( -s )
+    else
+        MAKE_OPTION=( -k "${OPTION}" )
+    fi
+    "${BIN_DIR}"/caibx_util make "${MAKE_OPTION[@]}" "${WORK_DIR}"/archive \
+                            "${WORK_DIR}"/native.caibx \
+                            "${WORK_DIR}"/native.castr > /dev/null \
+        && cmp -i 48 "${WORK_DIR}"/casync.caibx "${WORK_DIR}"/native.caibx
+    check "caibx_util make ${MAKE_OPTION[*]} writing casync's chunks."
+done
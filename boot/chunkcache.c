@@ -0,0 +1,359 @@
+/*******************************************************************************
+ *
+ * chunkcache.c
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "castr.h"
+#include "chunkcache.h"
+#include "sha.h"
+
+#define MAX_ENTRIES (1 << 22)
+
+/* Chunk IDs are digests, so their first bytes are as good as any hash. */
+static size_t id_hash(const uint8_t id[CHUNK_ID_LEN])
+{
+  uint64_t h;
+
+  memcpy(&h, id, sizeof(h));
+
+  return h;
+}
+
+/* Called locked, as are the others below. */
+static struct chunk_cache_entry *lookup(struct chunk_cache *c,
+                                        const uint8_t id[CHUNK_ID_LEN])
+{
+  struct chunk_cache_entry *e;
+
+  for (size_t s = id_hash(id) & c->mask; c->slots[s]; s = (s + 1) & c->mask) {
+    e = &c->entries[c->slots[s] - 1];
+    if (memcmp(e->id, id, CHUNK_ID_LEN) == 0) {
+      return e;
+    }
+  }
+
+  return NULL;
+}
+
+static void evict_one(struct chunk_cache *c)
+{
+  struct chunk_cache_entry *e;
+  size_t i, s, j, home;
+
+  /* CLOCK: give referenced entries a second chance. */
+  for (;;) {
+    i = c->hand;
+    c->hand = (c->hand + 1) % c->max;
+    e = &c->entries[i];
+    if (e->data == NULL) {
+      continue;
+    } else if (e->referenced) {
+      e->referenced = 0;
+      continue;
+    }
+    break;
+  }
+
+  /* Delete from the table by shifting the rest of the cluster back. */
+  for (s = id_hash(e->id) & c->mask; c->slots[s] != i + 1;
+       s = (s + 1) & c->mask) {
+  }
+  for (j = s; ; ) {
+    j = (j + 1) & c->mask;
+    if (c->slots[j] == 0) {
+      break;
+    }
+    home = id_hash(c->entries[c->slots[j] - 1].id) & c->mask;
+    if ((s <= j) ? (home <= s || home > j) : (home <= s && home > j)) {
+      c->slots[s] = c->slots[j];
+      s = j;
+    }
+  }
+  c->slots[s] = 0;
+
+  c->bytes -= e->size;
+  free(e->data);
+  e->data = NULL;
+  c->free_list[c->nfree++] = i;
+  c->stats.evictions++;
+}
+
+static void insert(struct chunk_cache *c, const struct caibx_chunk *chunk,
+                   const void *data)
+{
+  struct chunk_cache_entry *e;
+  uint8_t *copy;
+  size_t i, s;
+
+  /* Someone else may have loaded it meanwhile. */
+  if (chunk->size > c->capacity || lookup(c, chunk->id)) {
+    return;
+  }
+  while (c->bytes + chunk->size > c->capacity || c->nfree == 0) {
+    evict_one(c);
+  }
+  if ((copy = malloc(chunk->size ? chunk->size : 1)) == NULL) {
+    return;
+  }
+  memcpy(copy, data, chunk->size);
+  i = c->free_list[--c->nfree];
+  e = &c->entries[i];
+  memcpy(e->id, chunk->id, CHUNK_ID_LEN);
+  e->size = chunk->size;
+  e->referenced = 0;
+  e->data = copy;
+  for (s = id_hash(e->id) & c->mask; c->slots[s]; s = (s + 1) & c->mask) {
+  }
+  c->slots[s] = i + 1;
+  c->bytes += chunk->size;
+}
+
+int chunk_cache_init(struct chunk_cache *c, const char *store,
+                     const struct caibx *header, size_t capacity)
+{
+  const char *env = getenv(CHUNK_CACHE_SIZE_ENV);
+  size_t nslots = 1;
+
+  memset(c, 0, sizeof(*c));
+  if (capacity == 0) {
+    capacity = env ? strtoull(env, NULL, 0) * 1024 * 1024 : CHUNK_CACHE_SIZE;
+  }
+  c->store = store;
+  c->sha512_256 = caibx_sha512_256(header);
+  c->capacity = capacity;
+
+  /* As many entries as the smallest chunks fill the budget with */
+  c->max = capacity / (header->chunk_size_min ? header->chunk_size_min : 1);
+  if (c->max == 0) {
+    c->max = 1;
+  } else if (c->max > MAX_ENTRIES) {
+    c->max = MAX_ENTRIES;
+  }
+  while (nslots < c->max * 2) {
+    nslots <<= 1;
+  }
+  c->mask = nslots - 1;
+  c->entries = calloc(c->max, sizeof(struct chunk_cache_entry));
+  c->free_list = malloc(c->max * sizeof(size_t));
+  c->slots = calloc(nslots, sizeof(uint32_t));
+  if (c->entries == NULL || c->free_list == NULL || c->slots == NULL) {
+    fprintf(stderr, "Failed to allocate chunk cache.\n");
+    free(c->entries);
+    free(c->free_list);
+    free(c->slots);
+    return -1;
+  }
+  for (size_t i = 0; i < c->max; i++) {
+    c->free_list[c->nfree++] = c->max - 1 - i;
+  }
+  pthread_mutex_init(&c->lock, NULL);
+  pthread_mutex_init(&c->io_lock, NULL);
+  chunkio_init(&c->io, CHUNKIO_AUTO, 0);
+
+  return 0;
+}
+
+void chunk_cache_free(struct chunk_cache *c)
+{
+  chunkio_exit(&c->io);
+  for (size_t i = 0; i < c->max; i++) {
+    free(c->entries[i].data);
+  }
+  free(c->entries);
+  free(c->free_list);
+  free(c->slots);
+  pthread_mutex_destroy(&c->io_lock);
+  pthread_mutex_destroy(&c->lock);
+}
+
+int chunk_cache_get(struct chunk_cache *c, const struct caibx_chunk *chunks,
+                    size_t n, void **bufs)
+{
+  struct chunk_cache_entry *e;
+  struct chunkio_req *reqs = NULL;
+  struct stat *st = NULL;
+  uint8_t (*digests)[CHUNK_ID_LEN] = NULL, *marked = NULL, *ok = NULL;
+  char hex[CHUNK_ID_HEX_LEN + 1], *paths = NULL;
+  const void **data = NULL;
+  size_t *miss, nmiss = 0, plen = strlen(c->store) + CHUNK_ID_HEX_LEN + 16;
+  size_t *hash = NULL, *lens = NULL, nhash = 0;
+  int ret = -1;
+
+  if ((miss = malloc((n ? n : 1) * sizeof(size_t))) == NULL) {
+    return -1;
+  }
+  pthread_mutex_lock(&c->lock);
+  for (size_t i = 0; i < n; i++) {
+    if ((e = lookup(c, chunks[i].id)) && e->size == chunks[i].size) {
+      memcpy(bufs[i], e->data, e->size);
+      e->referenced = 1;
+      c->stats.mem_hits++;
+    } else {
+      miss[nmiss++] = i;
+      c->stats.mem_misses++;
+    }
+  }
+  pthread_mutex_unlock(&c->lock);
+  if (nmiss == 0) {
+    ret = 0;
+    goto out;
+  }
+
+  /* Load the rest from the store in one batch. */
+  reqs = calloc(nmiss, sizeof(struct chunkio_req));
+  paths = malloc(nmiss * plen);
+  st = malloc(nmiss * sizeof(struct stat));
+  marked = malloc(nmiss);
+  ok = calloc(nmiss, 1);
+  hash = malloc(nmiss * sizeof(size_t));
+  lens = malloc(nmiss * sizeof(size_t));
+  data = malloc(nmiss * sizeof(void *));
+  digests = malloc(nmiss * CHUNK_ID_LEN);
+  if (reqs == NULL || paths == NULL || st == NULL || marked == NULL
+      || ok == NULL || hash == NULL || lens == NULL || data == NULL
+      || digests == NULL) {
+    fprintf(stderr, "Failed to allocate chunk I/O requests.\n");
+    goto out;
+  }
+  for (size_t k = 0; k < nmiss; k++) {
+    reqs[k].op = CHUNKIO_READ;
+    reqs[k].path = paths + k * plen;
+    chunk_path(c->store, chunks[miss[k]].id, paths + k * plen, plen);
+    marked[k] = chunk_is_verified(reqs[k].path, &st[k]);
+  }
+  pthread_mutex_lock(&c->io_lock);
+  chunkio_run(&c->io, reqs, nmiss);
+  pthread_mutex_unlock(&c->io_lock);
+
+  /* Decode all, then hash those not verified before in one go. */
+  for (size_t k = 0; k < nmiss; k++) {
+    const struct caibx_chunk *chunk = &chunks[miss[k]];
+    if (reqs[k].res < 0) {
+      /* Not cached yet, for the caller to fetch */
+    } else if (zstd_decode(reqs[k].buf, reqs[k].res, bufs[miss[k]],
+                           chunk->size) != (ssize_t)chunk->size) {
+      chunk_id_to_hex(chunk->id, hex);
+      fprintf(stderr, "Failed to decode chunk %s in %s.\n", hex, c->store);
+    } else if (marked[k]) {
+      ok[k] = 1;                /* verified when it was first read */
+    } else {
+      hash[nhash] = k;
+      data[nhash] = bufs[miss[k]];
+      lens[nhash++] = chunk->size;
+    }
+  }
+  chunk_digest_many(c->sha512_256, data, lens, nhash, digests);
+  for (size_t j = 0; j < nhash; j++) {
+    size_t k = hash[j];
+    if (memcmp(digests[j], chunks[miss[k]].id, CHUNK_ID_LEN) == 0) {
+      ok[k] = 1;
+      if (st[k].st_ino) {
+        chunk_mark_verified(reqs[k].path, &st[k]);
+      }
+    } else {
+      chunk_id_to_hex(chunks[miss[k]].id, hex);
+      fprintf(stderr, "Chunk %s in %s is corrupt.\n", hex, c->store);
+    }
+  }
+
+  ret = 0;
+  for (size_t k = 0; k < nmiss; k++) {
+    const struct caibx_chunk *chunk = &chunks[miss[k]];
+    pthread_mutex_lock(&c->lock);
+    if (ok[k]) {
+      c->stats.disk_hits++;
+      c->stats.trusted += marked[k];
+      insert(c, chunk, bufs[miss[k]]);
+    } else if (reqs[k].res >= 0) {
+      c->stats.corrupt++;
+    } else {
+      c->stats.disk_misses++;
+    }
+    pthread_mutex_unlock(&c->lock);
+    if (!ok[k]) {
+      ret = -1;
+    }
+    free(reqs[k].buf);
+  }
+
+  out:
+    free(digests);
+    free(data);
+    free(lens);
+    free(hash);
+    free(ok);
+    free(marked);
+    free(st);
+    free(paths);
+    free(reqs);
+    free(miss);
+
+    return ret;
+}
+
+ssize_t chunk_cache_read(struct chunk_cache *c, const struct caibx *idx,
+                         uint64_t offset, void *buf, size_t len)
+{
+  const struct caibx_chunk *first = caibx_lookup(idx, offset), *last;
+  uint64_t end = offset + len, size = caibx_archive_size(idx), from, to;
+  void **bufs;
+  size_t n = 0;
+  ssize_t ret = -1;
+
+  if (first == NULL || len == 0) {
+    return 0;
+  }
+  if (end > size) {
+    end = size;
+  }
+  for (last = first; last < idx->chunks + idx->n && last->offset < end;
+       last++) {
+    n++;
+  }
+  if ((bufs = calloc(n, sizeof(void *))) == NULL) {
+    return -1;
+  }
+  for (size_t i = 0; i < n; i++) {
+    if ((bufs[i] = malloc(first[i].size ? first[i].size : 1)) == NULL) {
+      goto out;
+    }
+  }
+  if (chunk_cache_get(c, first, n, bufs)) {
+    goto out;
+  }
+  for (size_t i = 0; i < n; i++) {
+    from = first[i].offset < offset ? offset - first[i].offset : 0;
+    to = first[i].offset + first[i].size > end
+      ? end - first[i].offset : first[i].size;
+    memcpy((uint8_t *)buf + (first[i].offset + from - offset),
+           (uint8_t *)bufs[i] + from, to - from);
+  }
+  ret = end - offset;
+
+  out:
+    for (size_t i = 0; i < n; i++) {
+      free(bufs[i]);
+    }
+    free(bufs);
+
+    return ret;
+}
+
+void chunk_cache_report(struct chunk_cache *c, FILE *fp)
+{
+  pthread_mutex_lock(&c->lock);
+  fprintf(fp, "tier=memory hits=%llu misses=%llu entries=%zu bytes=%zu "
+          "evictions=%llu\n",
+          c->stats.mem_hits, c->stats.mem_misses, c->max - c->nfree,
+          c->bytes, c->stats.evictions);
+  fprintf(fp, "tier=disk hits=%llu misses=%llu corrupt=%llu trusted=%llu\n",
+          c->stats.disk_hits, c->stats.disk_misses, c->stats.corrupt,
+          c->stats.trusted);
+  pthread_mutex_unlock(&c->lock);
+}
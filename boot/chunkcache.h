@@ -0,0 +1,82 @@
+/*******************************************************************************
+ *
+ * chunkcache.h
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#ifndef BOOTFS_CHUNKCACHE_H
+#define BOOTFS_CHUNKCACHE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include "caibx.h"
+#include "chunkio.h"
+
+/*
+ * Chunks decompressed and verified, kept in memory in front of a local
+ * store (e.g. CASTR_CACHE_DIR), so that chunks read over and over (ISO
+ * directory extents, hot libraries) don't pay an open, a read, decoding
+ * and hashing each time. Entries are found by an open addressing table
+ * keyed by chunk ID and evicted by CLOCK within a byte budget. Chunks
+ * loaded from the store are hashed only once there (see castr.h).
+ *
+ * Only caibx_util (cat and replay) reads through it for now: containers
+ * read the archive from desync, which has no hook to plug it in.
+ */
+#define CHUNK_CACHE_SIZE_ENV "BOOTFS_CHUNK_CACHE_MB"
+#define CHUNK_CACHE_SIZE     (64 * 1024 * 1024)
+
+struct chunk_cache_entry {
+  uint8_t id[CHUNK_ID_LEN];
+  uint32_t size;
+  int referenced;
+  uint8_t *data;                /* NULL if unused */
+};
+
+struct chunk_cache_stats {
+  unsigned long long mem_hits, mem_misses, evictions;
+  unsigned long long disk_hits, disk_misses, corrupt;
+  unsigned long long trusted;   /* disk hits which skipped hashing */
+};
+
+struct chunk_cache {
+  const char *store;
+  int sha512_256;
+  size_t capacity, bytes;
+  struct chunk_cache_entry *entries;
+  size_t max, *free_list, nfree;
+  uint32_t *slots;              /* entry index + 1, 0 if empty */
+  size_t mask;
+  size_t hand;
+  struct chunk_cache_stats stats;
+  pthread_mutex_t lock;
+  struct chunkio io;
+  pthread_mutex_t io_lock;
+};
+
+/* capacity in bytes of decompressed chunks, 0 for default. */
+int chunk_cache_init(struct chunk_cache *c, const char *store,
+                     const struct caibx *header, size_t capacity);
+void chunk_cache_free(struct chunk_cache *c);
+
+/*
+ * Copy chunks into bufs (chunks[i].size bytes each), from memory or else
+ * from the store. Returns -1 if any of them isn't in the store or fails
+ * verification.
+ */
+int chunk_cache_get(struct chunk_cache *c, const struct caibx_chunk *chunks,
+                    size_t n, void **bufs);
+
+/* Read len bytes of the archive of idx at offset. Returns bytes read. */
+ssize_t chunk_cache_read(struct chunk_cache *c, const struct caibx *idx,
+                         uint64_t offset, void *buf, size_t len);
+
+/* Counters of each tier, as lines of key=value. */
+void chunk_cache_report(struct chunk_cache *c, FILE *fp);
+
+#endif
@@ -0,0 +1,1312 @@
+/*******************************************************************************
+ *
+ * chunker.c
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+#include "caibx.h"
+#include "castr.h"
+#include "chunker.h"
+#include "sha.h"
+
+#define SEGMENT_SIZE (16 * 1024 * 1024)
+#define STORE_BATCH  64         /* chunks a worker hashes at once */
+#define LANES_MAX    16
+#define LANE_PIECE   (256 * 1024 * 1024)      /* lane offsets are 32 bits */
+#define ROL32(x, n)  (((x) << (n)) | ((x) >> (32 - (n))))
+
+/*
+ * Byte values to random words: casync's table (which desync uses too), so
+ * that boundaries and chunk IDs are those of casync and desync, and chunks
+ * deduplicate against stores they made. Each bit is set in half the words.
+ */
+static const uint32_t buzhash_table[256] = {
+  0x458be752, 0xc10748cc, 0xfbbcdbb8, 0x6ded5b68, 0xb10a82b5, 0x20d75648,
+  0xdfc5665f, 0xa8428801, 0x7ebf5191, 0x841135c7, 0x65cc53b3, 0x280a597c,
+  0x16f60255, 0xc78cbc3e, 0x294415f5, 0xb938d494, 0xec85c4e6, 0xb7d33edc,
+  0xe549b544, 0xfdeda5aa, 0x882bf287, 0x3116737c, 0x05569956, 0xe8cc1f68,
+  0x0806ac5e, 0x22a14443, 0x15297e10, 0x50d090e7, 0x4ba60f6f, 0xefd9f1a7,
+  0x5c5c885c, 0x82482f93, 0x9bfd7c64, 0x0b3e7276, 0xf2688e77, 0x8fad8abc,
+  0xb0509568, 0xf1ada29f, 0xa53efdfe, 0xcb2b1d00, 0xf2a9e986, 0x6463432b,
+  0x95094051, 0x5a223ad2, 0x9be8401b, 0x61e579cb, 0x1a556a14, 0x5840fdc2,
+  0x9261ddf6, 0xcde002bb, 0x52432bb0, 0xbf17373e, 0x7b7c222f, 0x2955ed16,
+  0x9f10ca59, 0xe840c4c9, 0xccabd806, 0x14543f34, 0x1462417a, 0x0d4a1f9c,
+  0x087ed925, 0xd7f8f24c, 0x7338c425, 0xcf86c8f5, 0xb19165cd, 0x9891c393,
+  0x325384ac, 0x0308459d, 0x86141d7e, 0xc922116a, 0xe2ffa6b6, 0x53f52aed,
+  0x2cd86197, 0xf5b9f498, 0xbf319c8f, 0xe0411fae, 0x977eb18c, 0xd8770976,
+  0x9833466a, 0xc674df7f, 0x8c297d45, 0x8ca48d26, 0xc49ed8e2, 0x7344f874,
+  0x556f79c7, 0x6b25eaed, 0xa03e2b42, 0xf68f66a4, 0x8e8b09a2, 0xf2e0e62a,
+  0x0d3a9806, 0x9729e493, 0x8c72b0fc, 0x160b94f6, 0x450e4d3d, 0x7a320e85,
+  0xbef8f0e1, 0x21d73653, 0x4e3d977a, 0x1e7b3929, 0x1cc6c719, 0xbe478d53,
+  0x8d752809, 0xe6d8c2c6, 0x275f0892, 0xc8acc273, 0x4cc21580, 0xecc4a617,
+  0xf5f7be70, 0xe795248a, 0x375a2fe9, 0x425570b6, 0x8898dcf8, 0xdc2d97c4,
+  0x0106114b, 0x364dc22f, 0x1e0cad1f, 0xbe63803c, 0x5f69fac2, 0x4d5afa6f,
+  0x1bc0dfb5, 0xfb273589, 0x0ea47f7b, 0x3c1c2b50, 0x21b2a932, 0x6b1223fd,
+  0x2fe706a8, 0xf9bd6ce2, 0xa268e64e, 0xe987f486, 0x3eacf563, 0x1ca2018c,
+  0x65e18228, 0x2207360a, 0x57cf1715, 0x34c37d2b, 0x1f8f3cde, 0x93b657cf,
+  0x31a019fd, 0xe69eb729, 0x8bca7b9b, 0x4c9d5bed, 0x277ebeaf, 0xe0d8f8ae,
+  0xd150821c, 0x31381871, 0xafc3f1b0, 0x927db328, 0xe95effac, 0x305a47bd,
+  0x426ba35b, 0x1233af3f, 0x686a5b83, 0x50e072e5, 0xd9d3bb2a, 0x8befc475,
+  0x487f0de6, 0xc88dff89, 0xbd664d5e, 0x971b5d18, 0x63b14847, 0xd7d3c1ce,
+  0x7f583cf3, 0x72cbcb09, 0xc0d0a81c, 0x7fa3429b, 0xe9158a1b, 0x225ea19a,
+  0xd8ca9ea3, 0xc763b282, 0xbb0c6341, 0x020b8293, 0xd4cd299d, 0x58cfa7f8,
+  0x91b4ee53, 0x37e4d140, 0x95ec764c, 0x30f76b06, 0x5ee68d24, 0x679c8661,
+  0xa41979c2, 0xf2b61284, 0x4fac1475, 0x0adb49f9, 0x19727a23, 0x15a7e374,
+  0xc43a18d5, 0x3fb1aa73, 0x342fc615, 0x924c0793, 0xbee2d7f0, 0x8a279de9,
+  0x4aa2d70c, 0xe24dd37f, 0xbe862c0b, 0x177c22c2, 0x5388e5ee, 0xcd8a7510,
+  0xf901b4fd, 0xdbc13dbc, 0x6c0bae5b, 0x64efe8c7, 0x48b02079, 0x80331a49,
+  0xca3d8ae6, 0xf3546190, 0xfed7108b, 0xc49b941b, 0x32baf4a9, 0xeb833a4a,
+  0x88a3f1a5, 0x3a91ce0a, 0x3cc27da1, 0x7112e684, 0x4a3096b1, 0x3794574c,
+  0xa3c8b6f3, 0x1d213941, 0x6e0a2e00, 0x233479f1, 0x0f4cd82f, 0x6093edd2,
+  0x5d7d209e, 0x464fe319, 0xd4dcac9e, 0x0db845cb, 0xfb5e4bc3, 0xe0256ce1,
+  0x09fb4ed1, 0x0914be1e, 0xa5bdb2c3, 0xc6eb57bb, 0x30320350, 0x3f397e91,
+  0xa67791bc, 0x86bc0e2c, 0xefa0a7e2, 0xe9ff7543, 0xe733612c, 0xd185897b,
+  0x329e5388, 0x91dd236b, 0x2ecb0d93, 0xf4d82a3d, 0x35b5c03f, 0xe4e606f0,
+  0x05b21843, 0x37b45964, 0x5eff22f4, 0x6027f4cc, 0x77178b3c, 0xae507131,
+  0x7bf7cabc, 0xf9c18d66, 0x593ade65, 0xd95ddf11
+};
+
+/*
+ * Previous version of the archive, with its index. A chunk with the bytes
+ * of one of its chunks has that chunk's ID, found by a table keyed by the
+ * size and ends of chunks and confirmed by comparing the bytes. Without the
+ * archive (data NULL), the table is keyed by IDs, and chunks are looked up
+ * once hashed.
+ */
+struct chunker_base {
+  const uint8_t *data;
+  uint64_t size;
+  struct caibx idx;
+  size_t *slots;                /* chunk index + 1, or 0 */
+  size_t mask;
+};
+
+struct job {
+  const struct chunker *c;
+  const struct chunker_base *base;
+  const uint8_t *data;
+  uint64_t size;
+  const char *store;
+  struct chunker_matches *segs;
+  size_t nsegs;
+  struct caibx_chunk *chunks;
+  size_t n;
+  pthread_mutex_t lock;
+  size_t next;
+  int failed;
+  struct chunker_stats *stats;
+};
+
+static double now_s()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int chunker_init(struct chunker *c, uint64_t min, uint64_t avg, uint64_t max)
+{
+  if (min < CHUNKER_WINDOW_SIZE || min > avg || avg > max) {
+    fprintf(stderr, "Invalid chunk sizes %llu/%llu/%llu.\n",
+            (unsigned long long)min, (unsigned long long)avg,
+            (unsigned long long)max);
+    return -1;
+  }
+  c->min = min;
+  c->avg = avg;
+  c->max = max;
+
+  /* casync's CA_CHUNKER_DISCRIMINATOR_FROM_AVG() */
+  c->discriminator = (uint32_t)(avg / (-1.42888852e-7 * avg + 1.33237515));
+
+  /*
+   * h % d == d - 1 is d dividing h + 1, which is multiplying by the inverse
+   * of the odd part of d and comparing (Granlund-Montgomery), for lanes of
+   * vectors which have no division. h + 1 wraps for h = 2^32 - 1, so hits
+   * are confirmed with a division.
+   */
+  uint32_t odd = c->discriminator;
+  for (c->shift = 0; (odd & 1) == 0; c->shift++) {
+    odd >>= 1;
+  }
+  c->inv = odd;
+  for (int i = 0; i < 5; i++) {
+    c->inv *= 2 - odd * c->inv;
+  }
+  c->lim = UINT32_MAX / c->discriminator;
+
+  c->kernel = CHUNKER_SCALAR;
+  for (int k = CHUNKER_KERNELS - 1; k > CHUNKER_SCALAR; k--) {
+    if (chunker_use(c, k) == 0) {
+      break;
+    }
+  }
+
+  return 0;
+}
+
+int chunker_use(struct chunker *c, int kernel)
+{
+  int ok = kernel == CHUNKER_SCALAR;
+
+#ifdef __x86_64__
+  __builtin_cpu_init();
+  if (kernel == CHUNKER_AVX2) {
+    ok = __builtin_cpu_supports("avx2");
+  } else if (kernel == CHUNKER_AVX512) {
+    ok = __builtin_cpu_supports("avx512f");
+  }
+#endif
+  if (!ok) {
+    return -1;
+  }
+  c->kernel = kernel;
+
+  return 0;
+}
+
+const char *chunker_kernel_name(int kernel)
+{
+  static const char *names[CHUNKER_KERNELS] = { "scalar", "avx2", "avx512" };
+
+  return kernel >= 0 && kernel < CHUNKER_KERNELS ? names[kernel] : "unknown";
+}
+
+/* h % d == d - 1, mostly without dividing (see chunker_init()) */
+static inline int is_match(const struct chunker *c, uint32_t h)
+{
+  uint32_t x = (h + 1) * c->inv;
+
+  x = c->shift ? (x >> c->shift) | (x << (32 - c->shift)) : x;
+
+  return x <= c->lim && h % c->discriminator == c->discriminator - 1;
+}
+
+static int add_match(struct chunker_matches *m, uint64_t end)
+{
+  uint64_t *ends;
+
+  if (m->n == m->cap) {
+    m->cap = m->cap ? m->cap * 2 : 1024;
+    if ((ends = realloc(m->ends, m->cap * sizeof(uint64_t))) == NULL) {
+      return -1;
+    }
+    m->ends = ends;
+  }
+  m->ends[m->n++] = end;
+
+  return 0;
+}
+
+static int match_scalar(const struct chunker *c, const uint8_t *data,
+                        uint64_t from, uint64_t to, struct chunker_matches *m)
+{
+  uint64_t e = from + 1 > CHUNKER_WINDOW_SIZE ? from + 1 : CHUNKER_WINDOW_SIZE;
+  uint32_t h = 0;
+
+  if (e > to) {
+    return 0;
+  }
+  for (uint64_t i = e - CHUNKER_WINDOW_SIZE; i < e; i++) {
+    h = ROL32(h, 1) ^ buzhash_table[data[i]];
+  }
+  for (;;) {
+    if (is_match(c, h) && add_match(m, e)) {
+      fprintf(stderr, "Failed to allocate chunk boundaries.\n");
+      return -1;
+    }
+    if (++e > to) {
+      break;
+    }
+    h = ROL32(h, 1)
+      ^ ROL32(buzhash_table[data[e - 1 - CHUNKER_WINDOW_SIZE]],
+              CHUNKER_WINDOW_SIZE % 32)
+      ^ buzhash_table[data[e - 1]];
+  }
+
+  return 0;
+}
+
+static uint32_t window_hash(const uint8_t *p)
+{
+  uint32_t h = 0;
+
+  for (int i = 0; i < CHUNKER_WINDOW_SIZE; i++) {
+    h = ROL32(h, 1) ^ buzhash_table[p[i]];
+  }
+
+  return h;
+}
+
+/*
+ * Lane l rolls over the ends e0 + l * per + [0, per) of data. Offsets of
+ * its bytes are taken from base = data + e0 - CHUNKER_WINDOW_SIZE, and the
+ * gathers read 3 bytes past the last one.
+ */
+typedef void (*match_kernel)(const struct chunker *c, const uint8_t *data,
+                             uint64_t e0, uint64_t per,
+                             struct chunker_matches *lanes, int *failed);
+
+static void lane_hit(const struct chunker *c, struct chunker_matches *lane,
+                     uint32_t h, uint64_t end, int *failed)
+{
+  if (is_match(c, h) && add_match(lane, end)) {
+    *failed = 1;
+  }
+}
+
+#ifdef __x86_64__
+/*
+ * The byte leaving the window entered it 48 steps before, so the vectors
+ * of its rotated table words are kept in a ring rather than looked up
+ * again, and bytes come in 4 at a time: one table lookup per step.
+ */
+__attribute__((target("avx2")))
+static void match_avx2(const struct chunker *c, const uint8_t *data,
+                       uint64_t e0, uint64_t per,
+                       struct chunker_matches *lanes, int *failed)
+{
+  const uint8_t *base = data + e0 - CHUNKER_WINDOW_SIZE;
+  const __m256i one = _mm256_set1_epi32(1), bytes = _mm256_set1_epi32(0xff);
+  const __m256i inv = _mm256_set1_epi32(c->inv), lim = _mm256_set1_epi32(c->lim);
+  const __m128i shift = _mm_cvtsi32_si128(c->shift);
+  const __m128i rshift = _mm_cvtsi32_si128((32 - c->shift) & 31);
+  __m256i ring[CHUNKER_WINDOW_SIZE], h, pin, w = _mm256_setzero_si256(), x, t_in;
+  uint32_t hs[8], in[8], v;
+  unsigned int hits;
+  int r = 0;
+
+  for (int l = 0; l < 8; l++) {
+    hs[l] = window_hash(base + l * per);
+    in[l] = l * per + CHUNKER_WINDOW_SIZE;
+  }
+  for (int i = 0; i < CHUNKER_WINDOW_SIZE; i++) {
+    for (int l = 0; l < 8; l++) {
+      v = buzhash_table[base[l * per + i]];
+      ((uint32_t *)&ring[i])[l] = ROL32(v, CHUNKER_WINDOW_SIZE % 32);
+    }
+  }
+  h = _mm256_loadu_si256((const __m256i *)hs);
+  pin = _mm256_loadu_si256((const __m256i *)in);
+  for (uint64_t t = 0; ; t++) {
+    x = _mm256_mullo_epi32(_mm256_add_epi32(h, one), inv);
+    if (c->shift) {
+      x = _mm256_or_si256(_mm256_srl_epi32(x, shift), _mm256_sll_epi32(x, rshift));
+    }
+    hits = _mm256_movemask_ps(_mm256_castsi256_ps(
+      _mm256_cmpeq_epi32(_mm256_min_epu32(x, lim), x)));
+    if (hits) {
+      _mm256_storeu_si256((__m256i *)hs, h);
+      for (int l = 0; l < 8; l++) {
+        if (hits & (1 << l)) {
+          lane_hit(c, &lanes[l], hs[l], e0 + l * per + t, failed);
+        }
+      }
+    }
+    if (t + 1 == per) {
+      break;
+    }
+    if ((t & 3) == 0) {
+      w = _mm256_i32gather_epi32((const int *)base, pin, 1);
+      pin = _mm256_add_epi32(pin, _mm256_set1_epi32(4));
+    } else {
+      w = _mm256_srli_epi32(w, 8);
+    }
+    t_in = _mm256_i32gather_epi32((const int *)buzhash_table,
+                                  _mm256_and_si256(w, bytes), 4);
+    h = _mm256_xor_si256(
+      _mm256_or_si256(_mm256_slli_epi32(h, 1), _mm256_srli_epi32(h, 31)),
+      _mm256_xor_si256(ring[r], t_in));
+    ring[r] = _mm256_or_si256(_mm256_slli_epi32(t_in, 16),
+                              _mm256_srli_epi32(t_in, 16));
+    r = r + 1 == CHUNKER_WINDOW_SIZE ? 0 : r + 1;
+  }
+}
+
+__attribute__((target("avx512f")))
+static void match_avx512(const struct chunker *c, const uint8_t *data,
+                         uint64_t e0, uint64_t per,
+                         struct chunker_matches *lanes, int *failed)
+{
+  const uint8_t *base = data + e0 - CHUNKER_WINDOW_SIZE;
+  const __m512i one = _mm512_set1_epi32(1), bytes = _mm512_set1_epi32(0xff);
+  const __m512i inv = _mm512_set1_epi32(c->inv), lim = _mm512_set1_epi32(c->lim);
+  const __m512i shift = _mm512_set1_epi32(c->shift);
+  __m512i ring[CHUNKER_WINDOW_SIZE], h, pin, w = _mm512_setzero_si512(), t_in;
+  uint32_t hs[16], in[16], v;
+  __mmask16 hits;
+  int r = 0;
+
+  for (int l = 0; l < 16; l++) {
+    hs[l] = window_hash(base + l * per);
+    in[l] = l * per + CHUNKER_WINDOW_SIZE;
+  }
+  for (int i = 0; i < CHUNKER_WINDOW_SIZE; i++) {
+    for (int l = 0; l < 16; l++) {
+      v = buzhash_table[base[l * per + i]];
+      ((uint32_t *)&ring[i])[l] = ROL32(v, CHUNKER_WINDOW_SIZE % 32);
+    }
+  }
+  h = _mm512_loadu_si512(hs);
+  pin = _mm512_loadu_si512(in);
+  for (uint64_t t = 0; ; t++) {
+    hits = _mm512_cmple_epu32_mask(
+      _mm512_rorv_epi32(_mm512_mullo_epi32(_mm512_add_epi32(h, one), inv),
+                        shift), lim);
+    if (hits) {
+      _mm512_storeu_si512(hs, h);
+      for (int l = 0; l < 16; l++) {
+        if (hits & (1 << l)) {
+          lane_hit(c, &lanes[l], hs[l], e0 + l * per + t, failed);
+        }
+      }
+    }
+    if (t + 1 == per) {
+      break;
+    }
+    if ((t & 3) == 0) {
+      w = _mm512_i32gather_epi32(pin, base, 1);
+      pin = _mm512_add_epi32(pin, _mm512_set1_epi32(4));
+    } else {
+      w = _mm512_srli_epi32(w, 8);
+    }
+    t_in = _mm512_i32gather_epi32(_mm512_and_si512(w, bytes),
+                                  buzhash_table, 4);
+    h = _mm512_ternarylogic_epi32(_mm512_rol_epi32(h, 1), ring[r], t_in, 0x96);
+    ring[r] = _mm512_rol_epi32(t_in, 16);
+    r = r + 1 == CHUNKER_WINDOW_SIZE ? 0 : r + 1;
+  }
+}
+#endif
+
+static int match_lanes(const struct chunker *c, const uint8_t *data,
+                       uint64_t from, uint64_t to, struct chunker_matches *m,
+                       match_kernel kernel, int n)
+{
+  struct chunker_matches lanes[LANES_MAX];
+  uint64_t e0 = from + 1 > CHUNKER_WINDOW_SIZE ? from + 1 : CHUNKER_WINDOW_SIZE;
+  uint64_t per;
+  int failed = 0;
+
+  /* Whole lanes here, the rest (and the bytes the gathers overread) after */
+  if (to < e0 + 4 || (per = (to - e0 - 4) / n) < CHUNKER_WINDOW_SIZE) {
+    return match_scalar(c, data, from, to, m);
+  }
+  memset(lanes, 0, sizeof(lanes));
+  kernel(c, data, e0, per, lanes, &failed);
+  for (int l = 0; l < n; l++) {
+    for (size_t i = 0; i < lanes[l].n && !failed; i++) {
+      failed = add_match(m, lanes[l].ends[i]);
+    }
+    free(lanes[l].ends);
+  }
+  if (failed) {
+    fprintf(stderr, "Failed to allocate chunk boundaries.\n");
+    return -1;
+  }
+
+  return match_scalar(c, data, e0 + n * per - 1, to, m);
+}
+
+int chunker_match(const struct chunker *c, const uint8_t *data,
+                  uint64_t from, uint64_t to, struct chunker_matches *m)
+{
+  uint64_t piece;
+
+  for (; from < to; from += piece) {
+    piece = to - from < LANE_PIECE ? to - from : LANE_PIECE;
+#ifdef __x86_64__
+    if (c->kernel == CHUNKER_AVX512) {
+      if (match_lanes(c, data, from, from + piece, m, match_avx512, 16)) {
+        return -1;
+      }
+      continue;
+    } else if (c->kernel == CHUNKER_AVX2) {
+      if (match_lanes(c, data, from, from + piece, m, match_avx2, 8)) {
+        return -1;
+      }
+      continue;
+    }
+#endif
+    if (match_scalar(c, data, from, from + piece, m)) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+uint64_t chunker_next(const struct chunker *c, const uint8_t *data,
+                      uint64_t b, uint64_t size)
+{
+  uint64_t limit = b + c->max < size ? b + c->max : size, e = b + c->min;
+  uint32_t h;
+
+  if (e >= limit) {
+    return limit;
+  }
+  h = window_hash(data + e - CHUNKER_WINDOW_SIZE);
+  while (!is_match(c, h) && e < limit) {
+    h = ROL32(h, 1)
+      ^ ROL32(buzhash_table[data[e - CHUNKER_WINDOW_SIZE]],
+              CHUNKER_WINDOW_SIZE % 32)
+      ^ buzhash_table[data[e]];
+    e++;
+  }
+
+  return e;
+}
+
+/* Next unit of work, or units if there's none left. */
+static size_t take(struct job *j, size_t units)
+{
+  size_t i;
+
+  pthread_mutex_lock(&j->lock);
+  i = j->failed ? units : j->next;
+  if (i < units) {
+    j->next++;
+  }
+  pthread_mutex_unlock(&j->lock);
+
+  return i;
+}
+
+static void fail(struct job *j)
+{
+  pthread_mutex_lock(&j->lock);
+  j->failed = 1;
+  pthread_mutex_unlock(&j->lock);
+}
+
+static void *match_worker(void *arg)
+{
+  struct job *j = arg;
+  uint64_t from, to;
+  size_t s;
+
+  while ((s = take(j, j->nsegs)) < j->nsegs) {
+    from = (uint64_t)s * SEGMENT_SIZE;
+    to = from + SEGMENT_SIZE < j->size ? from + SEGMENT_SIZE : j->size;
+    if (chunker_match(j->c, j->data, from, to, &j->segs[s])) {
+      fail(j);
+    }
+  }
+
+  return NULL;
+}
+
+static uint64_t chunk_key(const uint8_t *data, uint64_t len)
+{
+  uint64_t head = 0, tail = 0, k;
+  size_t n = len < sizeof(head) ? len : sizeof(head);
+
+  memcpy(&head, data, n);
+  memcpy(&tail, data + len - n, n);
+  k = (len ^ head) * 0x9e3779b97f4a7c15ULL;
+  k = (k ^ tail) * 0xff51afd7ed558ccdULL;
+
+  return k ^ (k >> 32);
+}
+
+static uint64_t id_key(const uint8_t id[CHUNK_ID_LEN])
+{
+  uint64_t k;
+
+  memcpy(&k, id, sizeof(k));    /* a digest, so already spread */
+
+  return k;
+}
+
+/* Map the base archive, which must be the one the index is of. */
+static int base_map(struct chunker_base *b, const char *archive,
+                    const char *index)
+{
+  struct stat st;
+  void *map = MAP_FAILED;
+  int fd;
+
+  if ((fd = open(archive, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &st)) {
+    fprintf(stderr, "Failed to open %s: %s\n", archive, strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  if ((uint64_t)st.st_size != caibx_archive_size(&b->idx)) {
+    fprintf(stderr, "%s isn't the archive of %s.\n", archive, index);
+    close(fd);
+    return -1;
+  }
+  if (st.st_size > 0 && (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+                                    fd, 0)) == MAP_FAILED) {
+    fprintf(stderr, "Failed to map %s: %s\n", archive, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  close(fd);
+  b->data = map == MAP_FAILED ? NULL : map;
+  b->size = st.st_size;
+
+  return 0;
+}
+
+static int base_open(struct chunker_base *b, const struct chunker *c,
+                     const char *archive, const char *index)
+{
+  const struct caibx_chunk *chunk;
+  size_t slot;
+
+  memset(b, 0, sizeof(*b));
+  if (caibx_load(index, &b->idx)) {
+    return -1;
+  }
+  if (!caibx_sha512_256(&b->idx) || b->idx.chunk_size_min != c->min
+      || b->idx.chunk_size_avg != c->avg || b->idx.chunk_size_max != c->max) {
+    fprintf(stderr, "%s isn't chunked as this archive is.\n", index);
+    goto error;
+  }
+  if (archive && base_map(b, archive, index)) {
+    goto error;
+  }
+
+  for (b->mask = 1; b->mask < b->idx.n * 2; b->mask <<= 1) {
+  }
+  if ((b->slots = calloc(b->mask, sizeof(size_t))) == NULL) {
+    fprintf(stderr, "Failed to allocate base chunk table.\n");
+    goto error;
+  }
+  b->mask--;
+  for (size_t i = 0; i < b->idx.n; i++) {
+    chunk = &b->idx.chunks[i];
+    slot = (archive ? chunk_key(b->data + chunk->offset, chunk->size)
+            : id_key(chunk->id)) & b->mask;
+    while (b->slots[slot]) {
+      slot = (slot + 1) & b->mask;
+    }
+    b->slots[slot] = i + 1;
+  }
+
+  return 0;
+
+  error:
+    if (b->data) {
+      munmap((void *)b->data, b->size);
+    }
+    caibx_free(&b->idx);
+    return -1;
+}
+
+static void base_close(struct chunker_base *b)
+{
+  free(b->slots);
+  if (b->data) {
+    munmap((void *)b->data, b->size);
+  }
+  caibx_free(&b->idx);
+}
+
+/* ID of a chunk of the base with these bytes, or NULL */
+static const uint8_t *base_find(const struct chunker_base *b,
+                                const uint8_t *data, uint64_t len)
+{
+  const struct caibx_chunk *chunk;
+  size_t slot = chunk_key(data, len) & b->mask;
+
+  for (; b->slots[slot]; slot = (slot + 1) & b->mask) {
+    chunk = &b->idx.chunks[b->slots[slot] - 1];
+    if (chunk->size == len && memcmp(b->data + chunk->offset, data, len) == 0) {
+      return chunk->id;
+    }
+  }
+
+  return NULL;
+}
+
+/* Whether the base has a chunk with this ID */
+static int base_has(const struct chunker_base *b, const uint8_t *id)
+{
+  size_t slot = id_key(id) & b->mask;
+
+  for (; b->slots[slot]; slot = (slot + 1) & b->mask) {
+    if (memcmp(b->idx.chunks[b->slots[slot] - 1].id, id, CHUNK_ID_LEN) == 0) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Hash n chunks, whose bytes are at data (from being the archive offset of
+ * data[0]), and write those new to store. frame holds zstd_bound(max).
+ * Counts are added to stats.
+ */
+static int store_chunks(const char *store, const struct chunker_base *base,
+                        const uint8_t *data, uint64_t from,
+                        struct caibx_chunk *chunks, size_t n, uint8_t *frame,
+                        struct chunker_stats *stats)
+{
+  const void *ptr[STORE_BATCH];
+  const uint8_t *id;
+  size_t len[STORE_BATCH], pick[STORE_BATCH], m = 0, frame_len;
+  uint8_t ids[STORE_BATCH][CHUNK_ID_LEN];
+  char path[PATH_MAX];
+
+  for (size_t i = 0; i < n; i++) {
+    /* Chunks of the base are in the store of the version it came from. */
+    if (base && base->data && (id = base_find(base, data + chunks[i].offset
+                                              - from, chunks[i].size))) {
+      memcpy(chunks[i].id, id, CHUNK_ID_LEN);
+      stats->reused++;
+      stats->reused_bytes += chunks[i].size;
+      continue;
+    }
+    pick[m] = i;
+    ptr[m] = data + chunks[i].offset - from;
+    len[m++] = chunks[i].size;
+  }
+  if (m == 0) {
+    return 0;
+  }
+  chunk_digest_many(1, ptr, len, m, ids);
+  for (size_t k = 0; k < m; k++) {
+    memcpy(chunks[pick[k]].id, ids[k], CHUNK_ID_LEN);
+    if (base && base->data == NULL && base_has(base, ids[k])) {
+      stats->reused++;
+      stats->reused_bytes += len[k];
+      continue;
+    }
+    if (chunk_path(store, ids[k], path, sizeof(path))) {
+      return -1;
+    }
+    /* Chunks already there are the same, by their name. */
+    if (access(path, F_OK) == 0) {
+      continue;
+    }
+    if ((frame_len = zstd_encode(ptr[k], len[k], frame)) == 0) {
+      fprintf(stderr, "Failed to compress chunk at %llu.\n",
+              (unsigned long long)chunks[pick[k]].offset);
+      return -1;
+    }
+    if (chunk_publish(path, frame, frame_len)) {
+      return -1;
+    }
+    stats->stored++;
+    stats->stored_bytes += frame_len;
+  }
+
+  return 0;
+}
+
+static void add_stats(struct chunker_stats *to, const struct chunker_stats *s)
+{
+  to->stored += s->stored;
+  to->stored_bytes += s->stored_bytes;
+  to->reused += s->reused;
+  to->reused_bytes += s->reused_bytes;
+}
+
+static void *store_worker(void *arg)
+{
+  struct job *j = arg;
+  struct chunker_stats stats;
+  size_t batches = (j->n + STORE_BATCH - 1) / STORE_BATCH, b, n;
+  uint8_t *frame;
+
+  if ((frame = malloc(zstd_bound(j->c->max))) == NULL) {
+    fprintf(stderr, "Failed to allocate chunk buffer.\n");
+    fail(j);
+    return NULL;
+  }
+  while ((b = take(j, batches)) < batches) {
+    n = j->n - b * STORE_BATCH < STORE_BATCH ? j->n - b * STORE_BATCH
+      : STORE_BATCH;
+    memset(&stats, 0, sizeof(stats));
+    if (store_chunks(j->store, j->base, j->data, 0,
+                     j->chunks + b * STORE_BATCH, n, frame, &stats)) {
+      fail(j);
+    }
+    pthread_mutex_lock(&j->lock);
+    add_stats(j->stats, &stats);
+    pthread_mutex_unlock(&j->lock);
+  }
+  free(frame);
+
+  return NULL;
+}
+
+static int run_workers(struct job *j, int threads, void *(*fn)(void *),
+                       size_t units)
+{
+  pthread_t *tids;
+  int n = (size_t)threads < units ? threads : (int)units, started = 0;
+
+  j->next = 0;
+  if (n <= 1) {
+    fn(j);
+    return j->failed ? -1 : 0;
+  }
+  if ((tids = calloc(n, sizeof(pthread_t))) == NULL) {
+    fprintf(stderr, "Failed to allocate workers.\n");
+    return -1;
+  }
+  for (; started < n; started++) {
+    if (pthread_create(&tids[started], NULL, fn, j)) {
+      break;
+    }
+  }
+  if (started == 0) {
+    fn(j);                      /* on our own then */
+  }
+  for (int i = 0; i < started; i++) {
+    pthread_join(tids[i], NULL);
+  }
+  free(tids);
+
+  return j->failed ? -1 : 0;
+}
+
+size_t chunker_cut(const struct chunker *c, const struct chunker_matches *segs,
+                   size_t nsegs, uint64_t size, struct caibx_chunk *chunks)
+{
+  uint64_t b = 0, limit, end;
+  size_t s = 0, k = 0, n = 0;
+
+  while (b < size) {
+    limit = b + c->max < size ? b + c->max : size;
+    while (s < nsegs && (k >= segs[s].n || segs[s].ends[k] < b + c->min)) {
+      if (k >= segs[s].n) {
+        s++;
+        k = 0;
+      } else {
+        k++;
+      }
+    }
+    end = s < nsegs && segs[s].ends[k] <= limit ? segs[s].ends[k] : limit;
+    chunks[n].offset = b;
+    chunks[n].size = end - b;
+    n++;
+    b = end;
+  }
+
+  return n;
+}
+
+/* Segment chunked from its start, up to the first chunk past its end */
+static void *skip_worker(void *arg)
+{
+  struct job *j = arg;
+  uint64_t b, to;
+  size_t s;
+
+  while ((s = take(j, j->nsegs)) < j->nsegs) {
+    b = (uint64_t)s * SEGMENT_SIZE;
+    to = b + SEGMENT_SIZE < j->size ? b + SEGMENT_SIZE : j->size;
+    while (b < to) {
+      b = chunker_next(j->c, j->data, b, j->size);
+      if (add_match(&j->segs[s], b)) {
+        fprintf(stderr, "Failed to allocate chunk boundaries.\n");
+        fail(j);
+        break;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+static void add_chunk(struct job *j, uint64_t b, uint64_t end)
+{
+  j->chunks[j->n].offset = b;
+  j->chunks[j->n].size = end - b;
+  j->n++;
+}
+
+/*
+ * The true boundaries, chunking on from where the last segment left off
+ * until they meet those of the segment, which then are the same.
+ */
+static void cut_skip(struct job *j)
+{
+  struct chunker_matches *seg;
+  uint64_t b = 0, from, to, end;
+  size_t k;
+
+  for (size_t s = 0; s < j->nsegs; s++) {
+    seg = &j->segs[s];
+    from = (uint64_t)s * SEGMENT_SIZE;
+    to = from + SEGMENT_SIZE < j->size ? from + SEGMENT_SIZE : j->size;
+    k = 0;
+    while (b < to) {
+      while (k < seg->n && seg->ends[k] < b) {
+        k++;
+      }
+      if (b == from || (k < seg->n && seg->ends[k] == b)) {
+        for (k += (b != from); k < seg->n; k++) {
+          add_chunk(j, b, seg->ends[k]);
+          b = seg->ends[k];
+        }
+        break;
+      }
+      end = chunker_next(j->c, j->data, b, j->size);
+      add_chunk(j, b, end);
+      b = end;
+    }
+  }
+}
+
+int chunker_make(const char *archive, const char *index, const char *store,
+                 const struct chunker_opts *opts, struct chunker_stats *stats)
+{
+  struct chunker c;
+  struct job j;
+  struct chunker_base base;
+  struct caibx idx;
+  struct stat st;
+  void *map = MAP_FAILED;
+  double t;
+  int fd, ret = -1, threads = opts->threads;
+
+  memset(stats, 0, sizeof(*stats));
+  memset(&j, 0, sizeof(j));
+  chunker_init(&c, CHUNKER_SIZE_MIN, CHUNKER_SIZE_AVG, CHUNKER_SIZE_MAX);
+  if (opts->kernel >= 0 && chunker_use(&c, opts->kernel)) {
+    fprintf(stderr, "No %s on this CPU.\n", chunker_kernel_name(opts->kernel));
+    return -1;
+  }
+  if (threads <= 0) {
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (opts->base_index) {
+    if (base_open(&base, &c, opts->base_archive, opts->base_index)) {
+      return -1;
+    }
+    j.base = &base;
+  }
+  if ((fd = open(archive, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &st)) {
+    fprintf(stderr, "Failed to open %s: %s\n", archive, strerror(errno));
+    goto out;
+  }
+  if (st.st_size > 0 && (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+                                    fd, 0)) == MAP_FAILED) {
+    fprintf(stderr, "Failed to map %s: %s\n", archive, strerror(errno));
+    goto out;
+  }
+  j.c = &c;
+  j.data = map;
+  j.size = st.st_size;
+  j.store = store;
+  j.stats = stats;
+  j.nsegs = (j.size + SEGMENT_SIZE - 1) / SEGMENT_SIZE;
+  j.segs = calloc(j.nsegs ? j.nsegs : 1, sizeof(struct chunker_matches));
+  j.chunks = malloc((j.size / c.min + 1) * sizeof(struct caibx_chunk));
+  if (j.segs == NULL || j.chunks == NULL) {
+    fprintf(stderr, "Failed to allocate chunk table.\n");
+    goto out;
+  }
+  pthread_mutex_init(&j.lock, NULL);
+  if (mkdir(store, 0755) && errno != EEXIST) {
+    fprintf(stderr, "Failed to create %s: %s\n", store, strerror(errno));
+    goto destroy;
+  }
+
+  t = now_s();
+  if (run_workers(&j, threads, opts->skip ? skip_worker : match_worker,
+                  j.nsegs)) {
+    goto destroy;
+  }
+  stats->match_s = now_s() - t;
+  t = now_s();
+  if (opts->skip) {
+    cut_skip(&j);
+  } else {
+    j.n = chunker_cut(&c, j.segs, j.nsegs, j.size, j.chunks);
+  }
+  stats->cut_s = now_s() - t;
+  t = now_s();
+  if (run_workers(&j, threads, store_worker,
+                  (j.n + STORE_BATCH - 1) / STORE_BATCH)) {
+    goto destroy;
+  }
+  stats->store_s = now_s() - t;
+  stats->chunks = j.n;
+  stats->bytes = j.size;
+
+  idx.feature_flags = CA_FORMAT_SHA512_256;
+  idx.chunk_size_min = c.min;
+  idx.chunk_size_avg = c.avg;
+  idx.chunk_size_max = c.max;
+  idx.n = j.n;
+  idx.chunks = j.chunks;
+  ret = caibx_write(index, &idx);
+
+  destroy:
+    pthread_mutex_destroy(&j.lock);
+  out:
+    for (size_t s = 0; j.segs && s < j.nsegs; s++) {
+      free(j.segs[s].ends);
+    }
+    free(j.segs);
+    free(j.chunks);
+    if (map != MAP_FAILED) {
+      munmap(map, st.st_size);
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+    if (j.base) {
+      base_close(&base);
+    }
+
+    return ret;
+}
+
+/* Chunks of a stream being stored, with a copy of their bytes */
+struct chunk_batch {
+  struct chunk_batch *next;
+  size_t first, n;              /* of the stream's chunks */
+  uint64_t offset;              /* of data in the archive */
+  uint8_t *data;
+  size_t len, cap;
+  struct caibx_chunk chunks[STORE_BATCH];
+};
+
+static void free_batch(struct chunk_batch *b)
+{
+  if (b) {
+    free(b->data);
+    free(b);
+  }
+}
+
+/* Store a batch, and set the IDs of its chunks in the stream's table. */
+static int store_batch(struct chunk_stream *s, struct chunk_batch *b,
+                       uint8_t *frame)
+{
+  struct chunker_stats stats;
+  int ret;
+
+  memset(&stats, 0, sizeof(stats));
+  ret = store_chunks(s->store, s->base, b->data, b->offset, b->chunks, b->n,
+                     frame, &stats);
+  pthread_mutex_lock(&s->lock);
+  for (size_t i = 0; i < b->n; i++) {
+    memcpy(s->chunks[b->first + i].id, b->chunks[i].id, CHUNK_ID_LEN);
+  }
+  add_stats(&s->stats, &stats);
+  if (ret) {
+    s->failed = 1;
+  }
+  s->inflight--;
+  pthread_cond_broadcast(&s->cond);
+  pthread_mutex_unlock(&s->lock);
+
+  return ret;
+}
+
+static void *stream_worker(void *arg)
+{
+  struct chunk_stream *s = arg;
+  struct chunk_batch *b;
+  uint8_t *frame;
+
+  if ((frame = malloc(zstd_bound(s->c.max))) == NULL) {
+    fprintf(stderr, "Failed to allocate chunk buffer.\n");
+  }
+  for (;;) {
+    pthread_mutex_lock(&s->lock);
+    if (frame == NULL) {
+      s->failed = 1;
+    }
+    while (s->head == NULL && !s->closing) {
+      pthread_cond_wait(&s->cond, &s->lock);
+    }
+    if ((b = s->head) == NULL) {
+      pthread_mutex_unlock(&s->lock);
+      break;
+    }
+    if ((s->head = b->next) == NULL) {
+      s->tail = NULL;
+    }
+    if (s->failed) {
+      s->inflight--;
+      pthread_cond_broadcast(&s->cond);
+      pthread_mutex_unlock(&s->lock);
+      free_batch(b);
+      continue;
+    }
+    pthread_mutex_unlock(&s->lock);
+    store_batch(s, b, frame);
+    free_batch(b);
+  }
+  free(frame);
+
+  return NULL;
+}
+
+/* Hand the batch being filled to the workers, once there's room for it. */
+static int queue_batch(struct chunk_stream *s)
+{
+  struct chunk_batch *b = s->batch;
+  uint8_t *frame;
+  int ret;
+
+  s->batch = NULL;
+  if (s->threads == 0) {
+    if ((frame = malloc(zstd_bound(s->c.max))) == NULL) {
+      fprintf(stderr, "Failed to allocate chunk buffer.\n");
+      free_batch(b);
+      return -1;
+    }
+    s->inflight++;
+    ret = store_batch(s, b, frame);
+    free(frame);
+    free_batch(b);
+    return ret;
+  }
+  pthread_mutex_lock(&s->lock);
+  while (s->inflight >= s->inflight_max && !s->failed) {
+    pthread_cond_wait(&s->cond, &s->lock);
+  }
+  if (s->failed) {
+    pthread_mutex_unlock(&s->lock);
+    free_batch(b);
+    return -1;
+  }
+  b->next = NULL;
+  if (s->tail) {
+    s->tail->next = b;
+  } else {
+    s->head = b;
+  }
+  s->tail = b;
+  s->inflight++;
+  pthread_cond_broadcast(&s->cond);
+  pthread_mutex_unlock(&s->lock);
+
+  return 0;
+}
+
+static int add_stream_chunk(struct chunk_stream *s, const uint8_t *data,
+                            uint64_t offset, size_t len)
+{
+  struct caibx_chunk *chunks;
+  struct chunk_batch *b;
+  uint8_t *buf;
+  size_t cap;
+
+  if (s->n == s->chunks_cap) {
+    cap = s->chunks_cap ? s->chunks_cap * 2 : 1024;
+    pthread_mutex_lock(&s->lock);   /* workers set IDs in the table */
+    chunks = realloc(s->chunks, cap * sizeof(*chunks));
+    if (chunks) {
+      s->chunks = chunks;
+      s->chunks_cap = cap;
+    }
+    pthread_mutex_unlock(&s->lock);
+    if (chunks == NULL) {
+      fprintf(stderr, "Failed to allocate chunk table.\n");
+      return -1;
+    }
+  }
+  if (s->batch == NULL) {
+    if ((s->batch = calloc(1, sizeof(*s->batch))) == NULL) {
+      fprintf(stderr, "Failed to allocate a chunk batch.\n");
+      return -1;
+    }
+    s->batch->first = s->n;
+    s->batch->offset = offset;
+  }
+  b = s->batch;
+  if (b->len + len > b->cap) {
+    for (cap = b->cap ? b->cap : s->c.max; cap < b->len + len; cap *= 2) {
+    }
+    if ((buf = realloc(b->data, cap)) == NULL) {
+      fprintf(stderr, "Failed to allocate a chunk batch.\n");
+      return -1;
+    }
+    b->data = buf;
+    b->cap = cap;
+  }
+  memcpy(b->data + b->len, data, len);
+  b->len += len;
+  b->chunks[b->n].offset = s->chunks[s->n].offset = offset;
+  b->chunks[b->n].size = s->chunks[s->n].size = len;
+  b->n++;
+  s->n++;
+
+  return b->n == STORE_BATCH ? queue_batch(s) : 0;
+}
+
+/*
+ * Cut what's buffered while a whole chunk's worth is, as the end of a chunk
+ * is only known max bytes on, or all of it at the end of the stream.
+ */
+static int cut_stream(struct chunk_stream *s, int last)
+{
+  uint64_t b = 0, end;
+  double t = now_s();
+
+  while (b < s->len && (last || s->len - b >= s->c.max)) {
+    end = chunker_next(&s->c, s->buf, b, s->len);
+    if (add_stream_chunk(s, s->buf + b, s->offset + b, end - b)) {
+      return -1;
+    }
+    b = end;
+  }
+  memmove(s->buf, s->buf + b, s->len - b);
+  s->len -= b;
+  s->offset += b;
+  s->stats.cut_s += now_s() - t;
+
+  return 0;
+}
+
+int chunk_stream_init(struct chunk_stream *s, const char *store,
+                      const struct chunker_opts *opts)
+{
+  int threads = opts->threads;
+
+  memset(s, 0, sizeof(*s));
+  s->start = now_s();
+  chunker_init(&s->c, CHUNKER_SIZE_MIN, CHUNKER_SIZE_AVG, CHUNKER_SIZE_MAX);
+  if (opts->kernel >= 0 && chunker_use(&s->c, opts->kernel)) {
+    fprintf(stderr, "No %s on this CPU.\n", chunker_kernel_name(opts->kernel));
+    return -1;
+  }
+  if (mkdir(store, 0755) && errno != EEXIST) {
+    fprintf(stderr, "Failed to create %s: %s\n", store, strerror(errno));
+    return -1;
+  }
+  s->store = store;
+  s->cap = s->c.max * 4;
+  if ((s->buf = malloc(s->cap)) == NULL) {
+    fprintf(stderr, "Failed to allocate chunk buffer.\n");
+    return -1;
+  }
+  if (opts->base_index) {
+    if ((s->base = malloc(sizeof(*s->base))) == NULL
+        || base_open(s->base, &s->c, NULL, opts->base_index)) {
+      free(s->base);
+      free(s->buf);
+      return -1;
+    }
+  }
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_cond_init(&s->cond, NULL);
+
+  if (threads <= 0) {
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  s->inflight_max = threads * 2;
+  if ((s->tids = calloc(threads, sizeof(pthread_t))) == NULL) {
+    threads = 0;                /* on our own then */
+  }
+  for (; s->threads < threads; s->threads++) {
+    if (pthread_create(&s->tids[s->threads], NULL, stream_worker, s)) {
+      break;
+    }
+  }
+
+  return 0;
+}
+
+int chunk_stream_write(struct chunk_stream *s, const void *data, size_t len)
+{
+  const uint8_t *p = data;
+  size_t n;
+
+  while (len > 0) {
+    n = s->cap - s->len < len ? s->cap - s->len : len;
+    memcpy(s->buf + s->len, p, n);
+    s->len += n;
+    p += n;
+    len -= n;
+    if (s->len == s->cap && cut_stream(s, 0)) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+int chunk_stream_cut(struct chunk_stream *s)
+{
+  return cut_stream(s, 1);
+}
+
+int chunk_stream_finish(struct chunk_stream *s, const char *index,
+                        struct chunker_stats *stats)
+{
+  struct chunk_batch *b;
+  struct caibx idx;
+  int ret = -1;
+
+  if (index && cut_stream(s, 1) == 0 && (s->batch == NULL
+                                         || queue_batch(s) == 0)) {
+    ret = 0;
+  }
+  pthread_mutex_lock(&s->lock);
+  if (ret) {
+    s->failed = 1;
+  }
+  s->closing = 1;
+  pthread_cond_broadcast(&s->cond);
+  pthread_mutex_unlock(&s->lock);
+  for (int i = 0; i < s->threads; i++) {
+    pthread_join(s->tids[i], NULL);
+  }
+  if (ret == 0 && !s->failed) {
+    s->stats.chunks = s->n;
+    s->stats.bytes = s->offset;
+    s->stats.store_s = now_s() - s->start;
+    idx.feature_flags = CA_FORMAT_SHA512_256;
+    idx.chunk_size_min = s->c.min;
+    idx.chunk_size_avg = s->c.avg;
+    idx.chunk_size_max = s->c.max;
+    idx.n = s->n;
+    idx.chunks = s->chunks;
+    ret = caibx_write(index, &idx);
+  } else {
+    ret = -1;
+  }
+  if (stats) {
+    *stats = s->stats;
+  }
+
+  while ((b = s->head)) {
+    s->head = b->next;
+    free_batch(b);
+  }
+  free_batch(s->batch);
+  pthread_cond_destroy(&s->cond);
+  pthread_mutex_destroy(&s->lock);
+  if (s->base) {
+    base_close(s->base);
+    free(s->base);
+  }
+  free(s->tids);
+  free(s->chunks);
+  free(s->buf);
+
+  return ret;
+}
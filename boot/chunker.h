@@ -0,0 +1,167 @@
+/*******************************************************************************
+ *
+ * chunker.h
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#ifndef BOOTFS_CHUNKER_H
+#define BOOTFS_CHUNKER_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "caibx.h"
+
+/*
+ * Content-defined chunking as casync does it: a buzhash of the last 48
+ * bytes, and a cut after a byte where the hash modulo a discriminator
+ * derived from the average size hits discriminator - 1, once the chunk is
+ * at least the minimum size, or where it reaches the maximum size.
+ *
+ * As the window only ever covers the chunk being cut, whether a position
+ * matches doesn't depend on where the chunk started. So positions are
+ * matched in parallel on segments of the archive, and the boundaries are
+ * then picked from them in one cheap sequential pass, the very ones a
+ * sequential chunker would make.
+ */
+#define CHUNKER_WINDOW_SIZE 48
+#define CHUNKER_SIZE_AVG    (64 * 1024)         /* casync's defaults */
+#define CHUNKER_SIZE_MIN    (CHUNKER_SIZE_AVG / 4)
+#define CHUNKER_SIZE_MAX    (CHUNKER_SIZE_AVG * 4)
+
+/*
+ * Kernels matching positions: one rolling hash, or one per lane of a vector
+ * (each rolling over its own part of the range). chunker_init() picks the
+ * fastest the CPU has.
+ */
+#define CHUNKER_SCALAR 0
+#define CHUNKER_AVX2   1
+#define CHUNKER_AVX512 2
+#define CHUNKER_KERNELS 3
+
+struct chunker {
+  uint64_t min, avg, max;
+  uint32_t discriminator;
+  uint32_t inv, lim;            /* divisibility test by discriminator */
+  int shift;
+  int kernel;
+};
+
+int chunker_init(struct chunker *c, uint64_t min, uint64_t avg, uint64_t max);
+
+/* Use a kernel, if the CPU has it. */
+int chunker_use(struct chunker *c, int kernel);
+const char *chunker_kernel_name(int kernel);
+
+/* Matching positions, as offsets of the end of their window */
+struct chunker_matches {
+  uint64_t *ends;
+  size_t n, cap;
+};
+
+/* Append positions in (from, to] of data, which must hold to bytes. */
+int chunker_match(const struct chunker *c, const uint8_t *data,
+                  uint64_t from, uint64_t to, struct chunker_matches *m);
+
+/*
+ * Boundaries of an archive of size bytes out of the matches of consecutive
+ * segments (in order). chunks holds size / c->min + 1. Returns the number
+ * of chunks.
+ */
+size_t chunker_cut(const struct chunker *c, const struct chunker_matches *segs,
+                   size_t nsegs, uint64_t size, struct caibx_chunk *chunks);
+
+/*
+ * End of the chunk starting at b, as casync's chunker finds it: hashing
+ * starts min bytes in, since nothing before can be a boundary.
+ */
+uint64_t chunker_next(const struct chunker *c, const uint8_t *data,
+                      uint64_t b, uint64_t size);
+
+struct chunker_stats {
+  size_t chunks, stored;        /* stored: new in the store */
+  uint64_t bytes, stored_bytes; /* stored_bytes: encoded */
+  size_t reused;                /* found in the base archive */
+  uint64_t reused_bytes;
+  double match_s, cut_s, store_s;
+};
+
+/*
+ * Chunk archive into store (<store>/<id[0:4]>/<id>.cacnk) and write its
+ * index, as "casync make --store=STORE INDEX ARCHIVE" with the default
+ * chunk sizes and SHA-512/256 IDs. threads 0 is one per CPU. kernel -1 is
+ * the default one.
+ *
+ * With skip, each segment is instead chunked from its start with
+ * chunker_next(), skipping the first min bytes of every chunk, and the
+ * chunks of a segment are taken from where its true boundaries meet them,
+ * which they do within a chunk or two. The index is the same either way.
+ *
+ * With base_archive and base_index (a previous version of the archive),
+ * chunks with the bytes of a chunk of the base take its ID without being
+ * hashed or written, as the store of that version has them already. Only
+ * new chunks go to store. With base_index alone, chunks are hashed and
+ * those the base index has aren't written.
+ */
+struct chunker_opts {
+  int threads;
+  int kernel;
+  int skip;
+  const char *base_archive, *base_index;
+};
+
+int chunker_make(const char *archive, const char *index, const char *store,
+                 const struct chunker_opts *opts, struct chunker_stats *stats);
+
+/*
+ * Chunking of an archive written as a stream, which is never whole in
+ * memory or on disk: bytes are cut as they come with chunker_next(), and
+ * batches of chunks go through a bounded queue to threads hashing,
+ * compressing and storing them, so that writing waits for them rather than
+ * buffering. Options are those of chunker_make() but skip and
+ * base_archive, which don't apply.
+ */
+struct chunk_batch;
+struct chunker_base;
+
+struct chunk_stream {
+  struct chunker c;
+  const char *store;
+  struct chunker_base *base;
+  uint8_t *buf;                 /* bytes not cut yet */
+  size_t len, cap;
+  uint64_t offset;              /* of buf in the archive */
+  struct chunk_batch *batch;    /* being filled */
+  struct caibx_chunk *chunks;   /* IDs set as batches are stored */
+  size_t n, chunks_cap;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct chunk_batch *head, *tail;      /* queued */
+  size_t inflight, inflight_max;
+  int closing, failed;
+  pthread_t *tids;
+  int threads;
+  struct chunker_stats stats;
+  double start;
+};
+
+int chunk_stream_init(struct chunk_stream *s, const char *store,
+                      const struct chunker_opts *opts);
+int chunk_stream_write(struct chunk_stream *s, const void *data, size_t len);
+
+/*
+ * Force a boundary where the stream is, as at its end, so that the chunks
+ * of what follows depend on its bytes only, not on what came before.
+ */
+int chunk_stream_cut(struct chunk_stream *s);
+
+/*
+ * Cut the rest, wait for the batches and write the index, then free the
+ * stream. index NULL only frees it (after a failure).
+ */
+int chunk_stream_finish(struct chunk_stream *s, const char *index,
+                        struct chunker_stats *stats);
+
+#endif
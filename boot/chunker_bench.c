@@ -0,0 +1,181 @@
+/*******************************************************************************
+ *
+ * chunker_bench.c
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "caibx.h"
+#include "chunker.h"
+#include "sha.h"
+
+/*
+ * Boundary detection benchmark, on one thread. Matches positions of random
+ * data (or of ARCHIVE) with each kernel the CPU has, and chunks it the
+ * sequential way, skipping the first min bytes of each chunk, which is the
+ * reference all kernels must agree with. With INDEX (made by casync or
+ * desync from ARCHIVE), its boundaries and chunk IDs are checked as well.
+ * Prints one line of key=value per kernel.
+ */
+#define DEFAULT_SIZE_MB 256
+#define DEFAULT_PASSES  3
+
+static double now_s()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int same_chunks(const struct caibx_chunk *a, size_t na,
+                       const struct caibx_chunk *b, size_t nb)
+{
+  if (na != nb) {
+    return 0;
+  }
+  for (size_t i = 0; i < na; i++) {
+    if (a[i].offset != b[i].offset || a[i].size != b[i].size) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/* IDs of the chunks of data, as an index records them */
+static int same_ids(const struct caibx *idx, const uint8_t *data)
+{
+  uint8_t id[CHUNK_ID_LEN];
+
+  for (size_t i = 0; i < idx->n; i++) {
+    chunk_digest(caibx_sha512_256(idx), data + idx->chunks[i].offset,
+                 idx->chunks[i].size, id);
+    if (memcmp(id, idx->chunks[i].id, CHUNK_ID_LEN)) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "Usage: %s [-s SIZE_MB] [-p PASSES] [ARCHIVE [INDEX]]\n",
+          name);
+}
+
+int main(int argc, char *argv[])
+{
+  struct chunker c;
+  struct chunker_matches m;
+  struct caibx_chunk *ref, *got;
+  struct caibx idx = { 0 };
+  uint64_t size = (uint64_t)DEFAULT_SIZE_MB * 1024 * 1024, b;
+  size_t nref = 0, ngot = 0;
+  uint8_t *data;
+  struct stat st;
+  double t;
+  int opt, passes = DEFAULT_PASSES, fd, failed = 0;
+
+  while ((opt = getopt(argc, argv, "s:p:")) != -1) {
+    switch (opt) {
+    case 's': size = strtoull(optarg, NULL, 0) * 1024 * 1024; break;
+    case 'p': passes = atoi(optarg); break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (argc - optind > 2 || size == 0 || passes <= 0) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (optind < argc) {
+    if ((fd = open(argv[optind], O_RDONLY)) < 0 || fstat(fd, &st)
+        || st.st_size == 0
+        || (data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+           == MAP_FAILED) {
+      fprintf(stderr, "Failed to map %s: %s\n", argv[optind], strerror(errno));
+      return 1;
+    }
+    size = st.st_size;
+    if (optind + 1 < argc && caibx_load(argv[optind + 1], &idx)) {
+      return 1;
+    }
+  } else {
+    if ((data = malloc(size)) == NULL) {
+      fprintf(stderr, "Failed to allocate data.\n");
+      return 1;
+    }
+    srand(1);
+    for (uint64_t i = 0; i < size; i++) {
+      data[i] = (uint8_t)rand();
+    }
+  }
+  chunker_init(&c, CHUNKER_SIZE_MIN, CHUNKER_SIZE_AVG, CHUNKER_SIZE_MAX);
+  ref = malloc((size / c.min + 1) * sizeof(struct caibx_chunk));
+  got = malloc((size / c.min + 1) * sizeof(struct caibx_chunk));
+  if (ref == NULL || got == NULL) {
+    fprintf(stderr, "Failed to allocate chunks.\n");
+    return 1;
+  }
+
+  t = now_s();
+  for (int p = 0; p < passes; p++) {
+    for (b = 0, nref = 0; b < size; b += ref[nref++].size) {
+      ref[nref].offset = b;
+      ref[nref].size = chunker_next(&c, data, b, size) - b;
+    }
+  }
+  t = now_s() - t;
+  printf("kernel=skip bytes=%llu chunks=%zu gbps=%.3f\n",
+         (unsigned long long)size, nref, size * passes / t / 1e9);
+  if (idx.n && !same_chunks(ref, nref, idx.chunks, idx.n)) {
+    fprintf(stderr, "Boundaries differ from %s.\n", argv[optind + 1]);
+    failed = 1;
+  } else if (idx.n && !same_ids(&idx, data)) {
+    fprintf(stderr, "Chunk IDs differ from %s.\n", argv[optind + 1]);
+    failed = 1;
+  }
+
+  for (int k = 0; k < CHUNKER_KERNELS; k++) {
+    if (chunker_use(&c, k)) {
+      continue;
+    }
+    t = now_s();
+    for (int p = 0; p < passes; p++) {
+      memset(&m, 0, sizeof(m));
+      if (chunker_match(&c, data, 0, size, &m)) {
+        return 1;
+      }
+      if (p < passes - 1) {
+        free(m.ends);
+      }
+    }
+    t = now_s() - t;
+    ngot = chunker_cut(&c, &m, 1, size, got);
+    free(m.ends);
+    printf("kernel=%s bytes=%llu chunks=%zu gbps=%.3f\n",
+           chunker_kernel_name(k), (unsigned long long)size, ngot,
+           size * passes / t / 1e9);
+    if (!same_chunks(ref, nref, got, ngot)) {
+      fprintf(stderr, "Boundaries of %s differ.\n", chunker_kernel_name(k));
+      failed = 1;
+    }
+  }
+  caibx_free(&idx);
+
+  return failed;
+}
@@ -0,0 +1,578 @@
+/*******************************************************************************
+ *
+ * chunkio.c
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "castr.h"
+#include "chunkio.h"
+
+/* Steps of a request on io_uring, each one SQE. */
+#define STEP_STATX   0
+#define STEP_OPEN    1
+#define STEP_READ    2
+#define STEP_CLOSE   3
+#define STEP_MKDIR   4
+#define STEP_CREATE  5
+#define STEP_WRITE   6
+#define STEP_LINK    7
+#define STEP_UNLINK  8
+#define STEP_FADVISE 9
+#define STEP_DONE    10
+
+static const int steps[][8] = {
+  [CHUNKIO_STAT] = { STEP_STATX, STEP_DONE },
+  [CHUNKIO_READ] = { STEP_STATX, STEP_OPEN, STEP_READ, STEP_CLOSE, STEP_DONE },
+  [CHUNKIO_PUBLISH] = { STEP_MKDIR, STEP_CREATE, STEP_WRITE, STEP_CLOSE,
+                        STEP_LINK, STEP_UNLINK, STEP_DONE },
+  [CHUNKIO_READAHEAD] = { STEP_OPEN, STEP_FADVISE, STEP_CLOSE, STEP_DONE },
+};
+
+/* Opcodes we need from the kernel, mkdirat and linkat being the latest. */
+static const int required_ops[] = {
+  IORING_OP_NOP, IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ,
+  IORING_OP_CLOSE, IORING_OP_MKDIRAT, IORING_OP_WRITE, IORING_OP_LINKAT,
+  IORING_OP_UNLINKAT, IORING_OP_FADVISE,
+};
+
+#define load_acquire(p)     __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+static int ring_probe(int fd)
+{
+  struct io_uring_probe *probe;
+  size_t len = sizeof(*probe) + IORING_OP_LAST * sizeof(probe->ops[0]);
+  int ret = -1;
+
+  if ((probe = calloc(1, len)) == NULL) {
+    return -1;
+  }
+  if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+              probe, IORING_OP_LAST) < 0) {
+    goto out;
+  }
+  for (size_t i = 0; i < sizeof(required_ops) / sizeof(int); i++) {
+    if (required_ops[i] > probe->last_op
+        || !(probe->ops[required_ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+      goto out;
+    }
+  }
+  ret = 0;
+
+  out:
+    free(probe);
+
+    return ret;
+}
+
+static void ring_exit(struct chunkio_ring *r)
+{
+  if (r->sqes && r->sqes != MAP_FAILED) {
+    munmap(r->sqes, r->entries * sizeof(struct io_uring_sqe));
+  }
+  if (r->cq_map && r->cq_map != MAP_FAILED && r->cq_map != r->sq_map) {
+    munmap(r->cq_map, r->cq_map_len);
+  }
+  if (r->sq_map && r->sq_map != MAP_FAILED) {
+    munmap(r->sq_map, r->sq_map_len);
+  }
+  if (r->fd >= 0) {
+    close(r->fd);
+  }
+  memset(r, 0, sizeof(*r));
+  r->fd = -1;
+}
+
+static int ring_setup(struct chunkio_ring *r, unsigned int depth)
+{
+  struct io_uring_params p;
+
+  memset(r, 0, sizeof(*r));
+  memset(&p, 0, sizeof(p));
+  if ((r->fd = syscall(__NR_io_uring_setup, depth, &p)) < 0) {
+    return -1;
+  }
+  if (ring_probe(r->fd)) {
+    goto error;
+  }
+  r->entries = p.sq_entries;
+  r->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  r->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (r->cq_map_len > r->sq_map_len) {
+      r->sq_map_len = r->cq_map_len;
+    }
+    r->cq_map_len = r->sq_map_len;
+  }
+  r->sq_map = mmap(NULL, r->sq_map_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_map == MAP_FAILED) {
+    goto error;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    r->cq_map = r->sq_map;
+  } else {
+    r->cq_map = mmap(NULL, r->cq_map_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (r->cq_map == MAP_FAILED) {
+      goto error;
+    }
+  }
+  r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                 r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED) {
+    goto error;
+  }
+  r->sq_head = (unsigned int *)((char *)r->sq_map + p.sq_off.head);
+  r->sq_tail = (unsigned int *)((char *)r->sq_map + p.sq_off.tail);
+  r->sq_mask = (unsigned int *)((char *)r->sq_map + p.sq_off.ring_mask);
+  r->sq_array = (unsigned int *)((char *)r->sq_map + p.sq_off.array);
+  r->cq_head = (unsigned int *)((char *)r->cq_map + p.cq_off.head);
+  r->cq_tail = (unsigned int *)((char *)r->cq_map + p.cq_off.tail);
+  r->cq_mask = (unsigned int *)((char *)r->cq_map + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)((char *)r->cq_map + p.cq_off.cqes);
+
+  return 0;
+
+  error:
+    ring_exit(r);
+
+    return -1;
+}
+
+static int publish_tmp_name(struct chunkio_req *req)
+{
+  unsigned long long suffix;
+
+  if (getrandom(&suffix, sizeof(suffix), 0) != sizeof(suffix)) {
+    return -1;
+  }
+  sprintf(req->tmp, "%s.%016llx", req->path, suffix);
+
+  return 0;
+}
+
+static void prep(struct chunkio_req *req, struct io_uring_sqe *sqe,
+                 struct statx *stx)
+{
+  memset(sqe, 0, sizeof(*sqe));
+  switch (steps[req->op][req->step]) {
+  case STEP_STATX:
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long)req->path;
+    sqe->addr2 = (unsigned long)stx;
+    sqe->len = STATX_SIZE;
+    break;
+  case STEP_OPEN:
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long)req->path;
+    sqe->open_flags = O_RDONLY | O_CLOEXEC;
+    break;
+  case STEP_READ:
+  case STEP_WRITE:
+    sqe->opcode = steps[req->op][req->step] == STEP_READ
+      ? IORING_OP_READ : IORING_OP_WRITE;
+    sqe->fd = req->fd;
+    sqe->addr = (unsigned long)((char *)req->buf + req->off);
+    sqe->len = req->len - req->off;
+    sqe->off = req->off;
+    break;
+  case STEP_CLOSE:
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = req->fd;
+    break;
+  case STEP_MKDIR:
+    /* <store>/<prefix>, in the buffer for the temporary name for now */
+    if ((req->tmp = malloc(strlen(req->path) + 18)) == NULL) {
+      req->res = -ENOMEM;
+      sqe->opcode = IORING_OP_NOP;
+      break;
+    }
+    sprintf(req->tmp, "%.*s",
+            (int)(strrchr(req->path, '/') - req->path), req->path);
+    sqe->opcode = IORING_OP_MKDIRAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long)req->tmp;
+    sqe->len = 0755;
+    break;
+  case STEP_CREATE:
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long)req->tmp;
+    sqe->open_flags = O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC;
+    sqe->len = 0644;
+    break;
+  case STEP_LINK:
+    sqe->opcode = IORING_OP_LINKAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long)req->tmp;
+    sqe->len = AT_FDCWD;
+    sqe->addr2 = (unsigned long)req->path;
+    break;
+  case STEP_UNLINK:
+    sqe->opcode = IORING_OP_UNLINKAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long)req->tmp;
+    break;
+  case STEP_FADVISE:
+    sqe->opcode = IORING_OP_FADVISE;
+    sqe->fd = req->fd;
+    sqe->fadvise_advice = POSIX_FADV_WILLNEED;
+    break;
+  }
+}
+
+/* Only cleanup is left to do after a failure. */
+static int needed(const struct chunkio_req *req, int step)
+{
+  return req->res >= 0
+    || (step == STEP_CLOSE && req->fd >= 0)
+    || (step == STEP_UNLINK && req->created)
+    || step == STEP_DONE;
+}
+
+/* Takes the result of the current step. Returns 1 if there's more to do. */
+static int advance(struct chunkio_req *req, int res, const struct statx *stx)
+{
+  int step = steps[req->op][req->step];
+
+  switch (step) {
+  case STEP_STATX:
+    if (res < 0) {
+      break;
+    }
+    if (req->op == CHUNKIO_STAT) {
+      req->res = stx->stx_size;
+    } else if ((req->buf = malloc(stx->stx_size ? stx->stx_size : 1))) {
+      req->len = stx->stx_size;
+    } else {
+      res = -ENOMEM;
+    }
+    break;
+  case STEP_OPEN:
+    req->fd = res;
+    break;
+  case STEP_READ:
+  case STEP_WRITE:
+    if (res < 0) {
+      break;
+    }
+    req->off += res;
+    if (res > 0 && req->off < req->len) {
+      return 1;                 /* short, again from where it stopped */
+    }
+    if (step == STEP_WRITE && req->off < req->len) {
+      res = -EIO;
+    } else if (step == STEP_READ) {
+      req->res = req->off;
+    }
+    break;
+  case STEP_CLOSE:
+    req->fd = -1;
+    res = 0;
+    break;
+  case STEP_MKDIR:
+    if ((res == 0 || res == -EEXIST) && req->res >= 0) {
+      res = publish_tmp_name(req) ? -EIO : 0;
+    }
+    break;
+  case STEP_CREATE:
+    req->fd = res;
+    req->created = res >= 0;
+    break;
+  case STEP_LINK:
+    /* Someone else publishing the same chunk first is just as good. */
+    if (res == -EEXIST) {
+      res = 0;
+    }
+    break;
+  case STEP_UNLINK:
+    req->created = 0;
+    res = 0;
+    break;
+  }
+  if (res < 0 && req->res >= 0) {
+    req->res = res;
+    if (req->op == CHUNKIO_PUBLISH) {
+      fprintf(stderr, "Failed to publish %s: %s\n", req->path, strerror(-res));
+    }
+  }
+  do {
+    req->step++;
+  } while (!needed(req, steps[req->op][req->step]));
+
+  return steps[req->op][req->step] != STEP_DONE;
+}
+
+static void finish(struct chunkio_req *req)
+{
+  free(req->tmp);
+  req->tmp = NULL;
+  clock_gettime(CLOCK_MONOTONIC, &req->done);
+}
+
+static void ring_run(struct chunkio_ring *r, struct chunkio_req *reqs,
+                     size_t n)
+{
+  struct statx *stx;
+  size_t *ready, nready = 0, next = 0, finished = 0;
+  unsigned int inflight = 0, pending = 0, tail, head, mask = *r->sq_mask;
+  int ret;
+
+  stx = malloc(n * sizeof(struct statx));
+  ready = malloc(r->entries * sizeof(size_t));
+  if (stx == NULL || ready == NULL) {
+    for (size_t i = 0; i < n; i++) {
+      reqs[i].res = -ENOMEM;
+    }
+    goto out;
+  }
+  while (finished < n) {
+    /* Queue the next step of requests, the ones already going first. */
+    tail = *r->sq_tail;
+    while (inflight + pending < r->entries && (nready || next < n)) {
+      size_t i = nready ? ready[--nready] : next++;
+      prep(&reqs[i], &r->sqes[tail & mask], &stx[i]);
+      r->sqes[tail & mask].user_data = i;
+      r->sq_array[tail & mask] = tail & mask;
+      tail++;
+      pending++;
+    }
+    store_release(r->sq_tail, tail);
+
+    ret = syscall(__NR_io_uring_enter, r->fd, pending, 1,
+                  IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      ret = -errno;
+      fprintf(stderr, "Failed to enter io_uring: %s\n", strerror(-ret));
+      for (size_t i = 0; i < n; i++) {
+        if (reqs[i].done.tv_sec == 0 && reqs[i].res >= 0) {
+          reqs[i].res = ret;
+        }
+      }
+      goto out;
+    }
+    if (ret > 0) {
+      inflight += ret;
+      pending -= ret;
+    }
+
+    for (head = *r->cq_head; head != load_acquire(r->cq_tail); head++) {
+      struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+      size_t i = cqe->user_data;
+      inflight--;
+      if (advance(&reqs[i], cqe->res, &stx[i])) {
+        ready[nready++] = i;
+      } else {
+        finish(&reqs[i]);
+        finished++;
+      }
+    }
+    store_release(r->cq_head, head);
+  }
+
+  out:
+    free(ready);
+    free(stx);
+}
+
+/* The same requests with blocking syscalls, for the thread pool */
+static void run_sync(struct chunkio_req *req)
+{
+  struct stat st;
+  ssize_t n;
+  int fd;
+
+  switch (req->op) {
+  case CHUNKIO_STAT:
+    req->res = stat(req->path, &st) ? -errno : st.st_size;
+    break;
+  case CHUNKIO_READ:
+    if ((fd = open(req->path, O_RDONLY | O_CLOEXEC)) < 0) {
+      req->res = -errno;
+      break;
+    }
+    if (req->buf == NULL) {
+      if (fstat(fd, &st)) {
+        req->res = -errno;
+      } else if ((req->buf = malloc(st.st_size ? st.st_size : 1)) == NULL) {
+        req->res = -ENOMEM;
+      }
+      req->len = st.st_size;
+    }
+    while (req->res >= 0 && req->off < req->len) {
+      if ((n = pread(fd, (char *)req->buf + req->off,
+                     req->len - req->off, req->off)) < 0) {
+        req->res = errno == EINTR ? 0 : -errno;
+        continue;
+      } else if (n == 0) {
+        break;
+      }
+      req->off += n;
+    }
+    if (req->res >= 0) {
+      req->res = req->off;
+    }
+    close(fd);
+    break;
+  case CHUNKIO_PUBLISH:
+    req->res = chunk_publish(req->path, req->buf, req->len) ? -EIO : 0;
+    break;
+  case CHUNKIO_READAHEAD:
+    if ((fd = open(req->path, O_RDONLY | O_CLOEXEC)) < 0) {
+      req->res = -errno;
+      break;
+    }
+    req->res = -posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+    break;
+  }
+  finish(req);
+}
+
+/* Take requests until the batch runs out. Called locked. */
+static void pool_drain(struct chunkio_pool *p)
+{
+  while (p->next < p->nreqs) {
+    struct chunkio_req *req = &p->reqs[p->next++];
+    pthread_mutex_unlock(&p->lock);
+    run_sync(req);
+    pthread_mutex_lock(&p->lock);
+    if (++p->done == p->nreqs) {
+      pthread_cond_broadcast(&p->idle);
+    }
+  }
+}
+
+static void *pool_worker(void *arg)
+{
+  struct chunkio_pool *p = arg;
+
+  pthread_mutex_lock(&p->lock);
+  while (!p->stop) {
+    if (p->next < p->nreqs) {
+      pool_drain(p);
+    } else {
+      pthread_cond_wait(&p->cond, &p->lock);
+    }
+  }
+  pthread_mutex_unlock(&p->lock);
+
+  return NULL;
+}
+
+static void pool_run(struct chunkio_pool *p, struct chunkio_req *reqs,
+                     size_t n)
+{
+  pthread_mutex_lock(&p->lock);
+  p->reqs = reqs;
+  p->nreqs = n;
+  p->next = p->done = 0;
+  pthread_cond_broadcast(&p->cond);
+
+  /* The calling thread works too, so this completes even without threads. */
+  pool_drain(p);
+  while (p->done < p->nreqs) {
+    pthread_cond_wait(&p->idle, &p->lock);
+  }
+  p->nreqs = p->next = 0;
+  pthread_mutex_unlock(&p->lock);
+}
+
+int chunkio_init(struct chunkio *io, int engine, unsigned int depth)
+{
+  const char *env = getenv(CHUNKIO_ENGINE_ENV);
+  struct chunkio_pool *p = &io->pool;
+
+  memset(io, 0, sizeof(*io));
+  io->ring.fd = -1;
+  if (engine == CHUNKIO_AUTO && env) {
+    engine = strcmp(env, "threads") == 0 ? CHUNKIO_THREADS : CHUNKIO_URING;
+  }
+  if (engine != CHUNKIO_THREADS) {
+    if (ring_setup(&io->ring, depth ? depth : CHUNKIO_DEPTH) == 0) {
+      io->engine = CHUNKIO_URING;
+      return 0;
+    }
+    if (engine == CHUNKIO_URING) {
+      fprintf(stderr, "Warning: io_uring isn't available, using threads.\n");
+    }
+  }
+  io->engine = CHUNKIO_THREADS;
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->cond, NULL);
+  pthread_cond_init(&p->idle, NULL);
+  for (int i = 0; i < CHUNKIO_THREADS_N; i++) {
+    if (pthread_create(&p->threads[p->n], NULL, pool_worker, p) == 0) {
+      p->n++;
+    }
+  }
+
+  return 0;
+}
+
+void chunkio_exit(struct chunkio *io)
+{
+  struct chunkio_pool *p = &io->pool;
+
+  if (io->engine == CHUNKIO_URING) {
+    ring_exit(&io->ring);
+    return;
+  }
+  pthread_mutex_lock(&p->lock);
+  p->stop = 1;
+  pthread_cond_broadcast(&p->cond);
+  pthread_mutex_unlock(&p->lock);
+  for (int i = 0; i < p->n; i++) {
+    pthread_join(p->threads[i], NULL);
+  }
+  pthread_cond_destroy(&p->idle);
+  pthread_cond_destroy(&p->cond);
+  pthread_mutex_destroy(&p->lock);
+}
+
+size_t chunkio_run(struct chunkio *io, struct chunkio_req *reqs, size_t n)
+{
+  size_t failed = 0;
+
+  for (size_t i = 0; i < n; i++) {
+    struct chunkio_req *req = &reqs[i];
+    req->res = 0;
+    req->fd = -1;
+    req->created = 0;
+    req->off = 0;
+    req->tmp = NULL;
+    memset(&req->done, 0, sizeof(req->done));
+    /* Read into the caller's buffer without asking the size first. */
+    req->step = (req->op == CHUNKIO_READ && req->buf) ? 1 : 0;
+  }
+  if (io->engine == CHUNKIO_URING) {
+    ring_run(&io->ring, reqs, n);
+  } else {
+    pool_run(&io->pool, reqs, n);
+  }
+  for (size_t i = 0; i < n; i++) {
+    if (reqs[i].res < 0) {
+      failed++;
+    }
+  }
+
+  return failed;
+}
@@ -0,0 +1,95 @@
+/*******************************************************************************
+ *
+ * chunkio.h
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#ifndef BOOTFS_CHUNKIO_H
+#define BOOTFS_CHUNKIO_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+/*
+ * Batched I/O on chunk files of a local store. A batch is pushed through
+ * io_uring in a few rounds of submissions (open, then read, then close,
+ * ...), or spread over a pool of threads doing blocking syscalls where
+ * io_uring isn't available.
+ */
+#define CHUNKIO_STAT      0     /* res = size of the file */
+#define CHUNKIO_READ      1     /* the file into buf, res = bytes read; buf is
+                                   allocated (and owned by the caller) if NULL */
+#define CHUNKIO_PUBLISH   2     /* buf as the file, atomically and fsync-less */
+#define CHUNKIO_READAHEAD 3     /* ask the kernel to read the file in */
+
+/* Engines */
+#define CHUNKIO_AUTO      0
+#define CHUNKIO_URING     1
+#define CHUNKIO_THREADS   2
+
+#define CHUNKIO_ENGINE_ENV "BOOTFS_CHUNKIO"   /* "uring" or "threads" */
+#define CHUNKIO_DEPTH      64
+#define CHUNKIO_THREADS_N  8
+
+struct chunkio_req {
+  int op;
+  const char *path;
+  void *buf;
+  size_t len;
+
+  /* Results: res is -errno on failure; done is when it completed. */
+  ssize_t res;
+  struct timespec done;
+
+  /* Internal */
+  int step;
+  int fd;
+  int created;
+  size_t off;
+  char *tmp;
+};
+
+struct chunkio_ring {
+  int fd;
+  unsigned int entries;
+  void *sq_map, *cq_map;
+  size_t sq_map_len, cq_map_len;
+  struct io_uring_sqe *sqes;
+  unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned int *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+};
+
+struct chunkio_pool {
+  pthread_t threads[CHUNKIO_THREADS_N];
+  int n;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_cond_t idle;
+  struct chunkio_req *reqs;
+  size_t nreqs, next, done;
+  int stop;
+};
+
+struct chunkio {
+  int engine;
+  struct chunkio_ring ring;
+  struct chunkio_pool pool;
+};
+
+/* depth is the number of requests in flight on io_uring, 0 for default. */
+int chunkio_init(struct chunkio *io, int engine, unsigned int depth);
+void chunkio_exit(struct chunkio *io);
+
+/* Run a batch to completion. Returns the number of failed requests. */
+size_t chunkio_run(struct chunkio *io, struct chunkio_req *reqs, size_t n);
+
+#define chunkio_engine_name(io)                                         \
+  ((io)->engine == CHUNKIO_URING ? "io_uring" : "threads")
+
+#endif
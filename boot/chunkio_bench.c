@@ -0,0 +1,322 @@
+/*******************************************************************************
+ *
+ * chunkio_bench.c
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "castr.h"
+#include "chunkio.h"
+
+/*
+ * Cache-hit read benchmark of a chunk store. Reads every chunk file once
+ * per pass with concurrent readers, after a pass to get them into the page
+ * cache, and prints one line of key=value like rdbench. Latency is from
+ * asking for a batch until each chunk of it is in, for either engine.
+ */
+#define ENGINE_SYNC    -1       /* one blocking read after another */
+#define DEFAULT_READERS 4
+#define DEFAULT_BATCH   32
+#define DEFAULT_PASSES  3
+
+struct files {
+  size_t n, cap;
+  char **paths;
+  size_t max_size;
+  unsigned long long bytes;
+};
+
+struct reader {
+  pthread_t thread;
+  int index;
+  double *lat;
+  size_t nlat;
+  unsigned long long bytes;
+  int failed;
+};
+
+static struct files files;
+static int engine = CHUNKIO_AUTO, readers = DEFAULT_READERS;
+static int batch = DEFAULT_BATCH, passes = DEFAULT_PASSES;
+static unsigned int depth;
+
+static double now_us()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static double cpu_us()
+{
+  struct rusage ru;
+
+  getrusage(RUSAGE_SELF, &ru);
+
+  return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e6
+    + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+static double percentile(double *lat, size_t n, double p)
+{
+  return n ? lat[(size_t)((n - 1) * p)] : 0.0;
+}
+
+static int add_file(const char *path, size_t size)
+{
+  char **paths;
+
+  if (files.n == files.cap) {
+    files.cap = files.cap ? files.cap * 2 : 1024;
+    if ((paths = realloc(files.paths, files.cap * sizeof(char *))) == NULL) {
+      return -1;
+    }
+    files.paths = paths;
+  }
+  if ((files.paths[files.n] = strdup(path)) == NULL) {
+    return -1;
+  }
+  files.n++;
+  files.bytes += size;
+  if (size > files.max_size) {
+    files.max_size = size;
+  }
+
+  return 0;
+}
+
+/* <store>/<prefix>/<id>.cacnk */
+static int scan_store(const char *store)
+{
+  char dir[PATH_MAX], path[PATH_MAX * 2];
+  size_t suffix_len = strlen(CHUNK_FILE_SUFFIX), len;
+  struct dirent *p, *c;
+  struct stat st;
+  DIR *sd, *cd;
+
+  if ((sd = opendir(store)) == NULL) {
+    fprintf(stderr, "Failed to open %s: %s\n", store, strerror(errno));
+    return -1;
+  }
+  while ((p = readdir(sd)) != NULL) {
+    if (p->d_name[0] == '.') {
+      continue;
+    }
+    snprintf(dir, sizeof(dir), "%s/%s", store, p->d_name);
+    if ((cd = opendir(dir)) == NULL) {
+      continue;
+    }
+    while ((c = readdir(cd)) != NULL) {
+      len = strlen(c->d_name);
+      if (len <= suffix_len
+          || strcmp(c->d_name + len - suffix_len, CHUNK_FILE_SUFFIX)) {
+        continue;
+      }
+      snprintf(path, sizeof(path), "%s/%s", dir, c->d_name);
+      if (stat(path, &st) == 0 && add_file(path, st.st_size)) {
+        fprintf(stderr, "Failed to allocate file list.\n");
+        closedir(cd);
+        closedir(sd);
+        return -1;
+      }
+    }
+    closedir(cd);
+  }
+  closedir(sd);
+
+  return 0;
+}
+
+static int read_sync(const char *path, void *buf, size_t len)
+{
+  ssize_t n;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+    return -1;
+  }
+  n = read(fd, buf, len);
+  close(fd);
+
+  return n < 0 ? -1 : n;
+}
+
+static void *run_reader(void *arg)
+{
+  struct reader *r = arg;
+  struct chunkio io;
+  struct chunkio_req *reqs;
+  char *bufs;
+  double begin;
+  int n;
+
+  reqs = calloc(batch, sizeof(struct chunkio_req));
+  bufs = malloc((size_t)batch * files.max_size);
+  if (reqs == NULL || bufs == NULL) {
+    r->failed = 1;
+    goto out;
+  }
+  if (engine != ENGINE_SYNC) {
+    chunkio_init(&io, engine, depth);
+  }
+  for (int pass = 0; pass < passes; pass++) {
+    /* Reader k takes files k, k + readers, ... */
+    for (size_t i = r->index; i < files.n; ) {
+      for (n = 0; n < batch && i < files.n; n++, i += readers) {
+        reqs[n].op = CHUNKIO_READ;
+        reqs[n].path = files.paths[i];
+        reqs[n].buf = bufs + (size_t)n * files.max_size;
+        reqs[n].len = files.max_size;
+      }
+      begin = now_us();
+      if (engine == ENGINE_SYNC) {
+        for (int j = 0; j < n; j++) {
+          reqs[j].res = read_sync(reqs[j].path, reqs[j].buf, reqs[j].len);
+          r->lat[r->nlat++] = now_us() - begin;
+        }
+      } else {
+        chunkio_run(&io, reqs, n);
+        for (int j = 0; j < n; j++) {
+          r->lat[r->nlat++] = reqs[j].done.tv_sec * 1e6
+            + reqs[j].done.tv_nsec / 1e3 - begin;
+        }
+      }
+      for (int j = 0; j < n; j++) {
+        if (reqs[j].res < 0) {
+          r->failed = 1;
+        } else {
+          r->bytes += reqs[j].res;
+        }
+      }
+    }
+  }
+  if (engine != ENGINE_SYNC) {
+    chunkio_exit(&io);
+  }
+
+  out:
+    free(bufs);
+    free(reqs);
+
+    return NULL;
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "Usage: %s [-e sync|uring|threads] [-r READERS] [-b BATCH] "
+          "[-d DEPTH] [-p PASSES] STORE\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+  struct reader *rs;
+  struct chunkio probe;
+  double *lat, elapsed, cpu;
+  unsigned long long bytes = 0;
+  size_t nlat = 0;
+  char *buf;
+  int opt, failed = 0;
+
+  while ((opt = getopt(argc, argv, "e:r:b:d:p:")) != -1) {
+    switch (opt) {
+    case 'e':
+      engine = strcmp(optarg, "sync") == 0 ? ENGINE_SYNC
+        : strcmp(optarg, "threads") == 0 ? CHUNKIO_THREADS : CHUNKIO_URING;
+      break;
+    case 'r': readers = atoi(optarg); break;
+    case 'b': batch = atoi(optarg); break;
+    case 'd': depth = strtoul(optarg, NULL, 0); break;
+    case 'p': passes = atoi(optarg); break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind != argc - 1 || readers <= 0 || batch <= 0 || passes <= 0) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (scan_store(argv[optind])) {
+    return 1;
+  }
+  if (files.n == 0) {
+    fprintf(stderr, "No chunks in %s.\n", argv[optind]);
+    return 1;
+  }
+  rs = calloc(readers, sizeof(struct reader));
+  lat = malloc(files.n * passes * sizeof(double));
+  buf = malloc(files.max_size);
+  if (rs == NULL || lat == NULL || buf == NULL) {
+    fprintf(stderr, "Failed to allocate buffers.\n");
+    return 1;
+  }
+
+  /* Cache hits only: get everything into the page cache first. */
+  for (size_t i = 0; i < files.n; i++) {
+    read_sync(files.paths[i], buf, files.max_size);
+  }
+  if (engine != ENGINE_SYNC) {
+    chunkio_init(&probe, engine, depth);
+    printf("engine=%s ", chunkio_engine_name(&probe));
+    chunkio_exit(&probe);
+  } else {
+    printf("engine=sync ");
+  }
+
+  cpu = cpu_us();
+  elapsed = now_us();
+  for (int i = 0; i < readers; i++) {
+    rs[i].index = i;
+    rs[i].lat = lat + nlat;
+    if ((size_t)i < files.n) {
+      nlat += ((files.n - i + readers - 1) / readers) * passes;
+    }
+    pthread_create(&rs[i].thread, NULL, run_reader, &rs[i]);
+  }
+  nlat = 0;
+  for (int i = 0; i < readers; i++) {
+    pthread_join(rs[i].thread, NULL);
+    memmove(lat + nlat, rs[i].lat, rs[i].nlat * sizeof(double));
+    nlat += rs[i].nlat;
+    bytes += rs[i].bytes;
+    failed |= rs[i].failed;
+  }
+  elapsed = now_us() - elapsed;
+  cpu = cpu_us() - cpu;
+  qsort(lat, nlat, sizeof(double), compare_double);
+  printf("readers=%d batch=%d files=%zu bytes=%llu mbps=%.1f "
+         "mb_per_cpu_s=%.1f p50_us=%.0f p99_us=%.0f\n",
+         readers, batch, files.n, bytes, bytes / elapsed,
+         cpu > 0 ? bytes / cpu : 0.0,
+         percentile(lat, nlat, 0.5), percentile(lat, nlat, 0.99));
+  if (failed) {
+    fprintf(stderr, "Failed to read some chunks.\n");
+  }
+  free(buf);
+  free(lat);
+  free(rs);
+
+  return failed;
+}
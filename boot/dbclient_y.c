@@ -6,28 +6,286 @@
  * Licensed under Apache License, Version 2.0
  *
  ******************************************************************************/
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include "path.h"
 
-int main(int argc, char *argv[])
+/* Transport configuration */
+#define SSH_CLIENT_ENV     "BOOTFS_SSH_CLIENT"  /* "openssh" or "dropbear" */
+#define SSH_CIPHER_ENV     "BOOTFS_SSH_CIPHER"
+#define SSH_MAC_ENV        "BOOTFS_SSH_MAC"
+#define SSH_ASKPASS_ENV    "BOOTFS_SSH_ASKPASS"
+#define SSH_PASSWORD_ENV   "DROPBEAR_PASSWORD"
+#define SSH_DEFAULT_CIPHER "aes128-gcm@openssh.com,chacha20-poly1305@openssh.com"
+#define DROPBEAR_DEFAULT_CIPHER "chacha20-poly1305@openssh.com"
+#define SSH_KEEPALIVE_SEC  "30"
+
+/* Fixed arguments we add in front of the ones desync gives us. */
+#define MAX_SSH_ARGS       32
+
+struct ssh_args {
+  const char **args;
+  int argpos;
+  int argmax;
+};
+
+static int args_init(struct ssh_args *a, int argc)
+{
+  a->argmax = MAX_SSH_ARGS + argc;
+  a->argpos = 0;
+  a->args = calloc(sizeof(char *), a->argmax + 1);
+
+  return a->args ? 0 : -1;
+}
+
+static void args_push(struct ssh_args *a, const char *arg)
+{
+  if (a->argpos >= a->argmax) {
+    fprintf(stderr, "Too many SSH arguments.\n");
+    exit(1);
+  }
+  a->args[a->argpos++] = arg;
+  a->args[a->argpos] = NULL;
+}
+
+static const char *getenv_or(const char *name, const char *defval)
+{
+  const char *val = getenv(name);
+
+  return (val && *val) ? val : defval;
+}
+
+/*
+ * boot points HOME at desync's config for desync itself. Give the SSH
+ * clients back the original one, where ~/.ssh lives.
+ */
+static void restore_home()
+{
+  const char *home = getenv(SSH_HOME_ENV);
+
+  if (home == NULL) {
+    return;
+  }
+  if (*home) {
+    setenv("HOME", home, 1);
+  } else {
+    unsetenv("HOME");
+  }
+  unsetenv(SSH_HOME_ENV);
+}
+
+/*
+ * OpenSSH calls us back as SSH_ASKPASS. Hand it the password which the user
+ * gave us in the same way as dropbear takes it.
+ */
+static int askpass()
+{
+  const char *password = getenv(SSH_PASSWORD_ENV);
+
+  if (password == NULL) {
+    return 1;
+  }
+  printf("%s\n", password);
+
+  return 0;
+}
+
+/* Options of ssh(1) which take an argument. */
+static int takes_value(const char *opt)
+{
+  return opt[0] == '-' && opt[1] != '\0' && opt[2] == '\0'
+    && strchr("BbcDEeFIiJLlmOoPpQRSWw", opt[1]) != NULL;
+}
+
+/* Return position of the destination argument, or -1. */
+static int find_destination(int argc, char *argv[])
+{
+  for (int i = 1; i < argc; i++) {
+    if (argv[i][0] != '-') {
+      return i;
+    }
+    if (takes_value(argv[i])) {
+      i++;
+    }
+  }
+
+  return -1;
+}
+
+static void push_common_openssh_args(struct ssh_args *a)
 {
-  const char **args = calloc(sizeof(char *), argc + 1);
-  int argpos = 0;
-  
-  args[argpos++] = DBCLIENT_BIN;
-  args[argpos++] = "-y";
+  args_push(a, SSH_BIN);
+  args_push(a, "-c");
+  args_push(a, getenv_or(SSH_CIPHER_ENV, SSH_DEFAULT_CIPHER));
+  if (getenv(SSH_MAC_ENV)) {
+    args_push(a, "-m");
+    args_push(a, getenv(SSH_MAC_ENV));
+  }
+  args_push(a, "-o");
+  args_push(a, "Compression=no");
+  args_push(a, "-o");
+  args_push(a, "StrictHostKeyChecking=no");
+  args_push(a, "-o");
+  args_push(a, "UserKnownHostsFile=/dev/null");
+  args_push(a, "-o");
+  args_push(a, "LogLevel=ERROR");
+  args_push(a, "-o");
+  args_push(a, "ServerAliveInterval=" SSH_KEEPALIVE_SEC);
+  args_push(a, "-o");
+  args_push(a, "ControlPath=" SSH_CONTROL_DIR "/%C");
+}
+
+/*
+ * Make sure exactly one authenticated master connection is up for the
+ * destination. desync opens a pool of sessions at once, so serialize on a
+ * lock file to avoid each of them racing to become the master.
+ */
+static int ensure_master(int argc, char *argv[], int dest)
+{
+  struct ssh_args a;
+  int lockfd, status;
+  pid_t pid;
+
+  if (mkdir(SSH_CONTROL_DIR, 0700) && access(SSH_CONTROL_DIR, F_OK)) {
+    fprintf(stderr, "Failed to create %s.\n", SSH_CONTROL_DIR);
+    return -1;
+  }
+  if ((lockfd = open(SSH_CONTROL_LOCK, O_RDWR | O_CREAT, 0600)) < 0) {
+    fprintf(stderr, "Failed to open %s.\n", SSH_CONTROL_LOCK);
+    return -1;
+  }
+  if (flock(lockfd, LOCK_EX)) {
+    fprintf(stderr, "Failed to lock %s.\n", SSH_CONTROL_LOCK);
+    close(lockfd);
+    return -1;
+  }
+  for (int check = 1; check >= 0; check--) {
+
+    /* 1st: "-O check" the master. 2nd: start it in background. */
+    if (args_init(&a, argc)) {
+      break;
+    }
+    push_common_openssh_args(&a);
+    if (check) {
+      args_push(&a, "-O");
+      args_push(&a, "check");
+    } else {
+      args_push(&a, "-o");
+      args_push(&a, "ControlMaster=yes");
+      args_push(&a, "-o");
+      args_push(&a, "ControlPersist=yes");
+      args_push(&a, "-f");
+      args_push(&a, "-N");
+    }
+    for (int i = 1; i <= dest; i++) {
+      args_push(&a, argv[i]);
+    }
+    if ((pid = fork()) == 0) {
+      if (check) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, 2);
+      }
+      execv(a.args[0], (char * const*)a.args);
+      _exit(127);
+    }
+    free(a.args);
+    if (pid < 0 || waitpid(pid, &status, 0) < 0) {
+      break;
+    }
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+      close(lockfd);
+      return 0;
+    }
+  }
+  close(lockfd);
+  fprintf(stderr, "Failed to start SSH master connection.\n");
+
+  return -1;
+}
+
+static int exec_openssh(int argc, char *argv[])
+{
+  struct ssh_args a;
+  int dest;
+
+  setenv("SSH_ASKPASS", DBCLIENT_Y_BIN, 1);
+  setenv("SSH_ASKPASS_REQUIRE", "force", 1);
+  setenv(SSH_ASKPASS_ENV, "1", 1);
+
+  /* Fall back to a dedicated connection if the master isn't available. */
+  dest = find_destination(argc, argv);
+  if (args_init(&a, argc)) {
+    return -1;
+  }
+  push_common_openssh_args(&a);
+  args_push(&a, "-o");
+  args_push(&a, (dest > 0 && ensure_master(argc, argv, dest) == 0) ?
+            "ControlMaster=no" : "ControlMaster=auto");
   for (int i = 1; i < argc; i++) {
-    args[argpos++] = argv[i];
+    args_push(&a, argv[i]);
   }
-  args[argpos] = NULL;
-  
+
+  return execv(a.args[0], (char * const*)a.args);
+}
+
+static int exec_dropbear(int argc, char *argv[])
+{
+  struct ssh_args a;
+
+  if (args_init(&a, argc)) {
+    return -1;
+  }
+
+  /* Dropbear is built without GCM by default, so it has its own list. */
+  args_push(&a, DBCLIENT_BIN);
+  args_push(&a, "-y");
+  args_push(&a, "-K");
+  args_push(&a, SSH_KEEPALIVE_SEC);
+  args_push(&a, "-c");
+  args_push(&a, getenv_or(SSH_CIPHER_ENV, DROPBEAR_DEFAULT_CIPHER));
+  if (getenv(SSH_MAC_ENV)) {
+    args_push(&a, "-m");
+    args_push(&a, getenv(SSH_MAC_ENV));
+  }
+  for (int i = 1; i < argc; i++) {
+    args_push(&a, argv[i]);
+  }
+
   /* fprintf (stderr, "Exec arguments: ["); */
-  /* for (int i = 0; i < argpos; i++) { */
-  /*   fprintf(stderr, " \"%s\" ,", args[i]); */
+  /* for (int i = 0; i < a.argpos; i++) { */
+  /*   fprintf(stderr, " \"%s\" ,", a.args[i]); */
   /* } */
   /* fprintf (stderr, " NULL ]\n"); */
 
-  execv(args[0], (char * const*)args);
+  return execv(a.args[0], (char * const*)a.args);
+}
+
+int main(int argc, char *argv[])
+{
+  const char *client = getenv(SSH_CLIENT_ENV);
+
+  if (getenv(SSH_ASKPASS_ENV)) {
+    return askpass();
+  }
+  restore_home();
+
+  /*
+   * Prefer OpenSSH when it is shipped, because only it can multiplex all
+   * sessions of a store over one connection (ControlMaster).
+   */
+  if ((client == NULL && access(SSH_BIN, X_OK) == 0)
+      || (client && strcmp(client, "openssh") == 0)) {
+    exec_openssh(argc, argv);
+  } else {
+    exec_dropbear(argc, argv);
+  }
+  fprintf(stderr, "Failed to exec SSH client.\n");
+
+  return 1;
 }
@@ -0,0 +1,725 @@
+/*******************************************************************************
+ *
+ * elf.c
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <limits.h>
+#include <link.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "elf.h"
+
+#define ELF_CLASS_NATIVE (sizeof(void *) == 8 ? ELFCLASS64 : ELFCLASS32)
+#define LD_SO_CONF "/etc/ld.so.conf"
+#define LD_SO_CONF_DEPTH 8
+#define COPY_BUF_SIZE (256 * 1024)
+
+/* Searched after ld.so.conf's, as ld.so does */
+static const char *default_dirs[] = {
+  "/lib64", "/usr/lib64", "/lib", "/usr/lib",
+};
+
+struct elf_map {
+  const uint8_t *p;
+  size_t size;
+  const ElfW(Ehdr) *eh;
+  const ElfW(Phdr) *ph;
+};
+
+/* Maps an ELF object of our class. Quiet ones are candidates to skip. */
+static int map_elf(const char *path, struct elf_map *m, int quiet)
+{
+  struct stat st;
+  int fd;
+
+  memset(m, 0, sizeof(*m));
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+    if (!quiet) {
+      fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    }
+    return -1;
+  }
+  if (fstat(fd, &st) || !S_ISREG(st.st_mode)
+      || (size_t)st.st_size < sizeof(ElfW(Ehdr))) {
+    close(fd);
+    goto bad;
+  }
+  m->size = st.st_size;
+  m->p = mmap(NULL, m->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (m->p == MAP_FAILED) {
+    m->p = NULL;
+    if (!quiet) {
+      fprintf(stderr, "Failed to map %s: %s\n", path, strerror(errno));
+    }
+    return -1;
+  }
+  m->eh = (const ElfW(Ehdr) *)m->p;
+  if (memcmp(m->eh->e_ident, ELFMAG, SELFMAG)
+      || m->eh->e_ident[EI_CLASS] != ELF_CLASS_NATIVE
+      || m->eh->e_phentsize != sizeof(ElfW(Phdr))
+      || m->eh->e_phoff > m->size
+      || m->eh->e_phnum > (m->size - m->eh->e_phoff) / sizeof(ElfW(Phdr))) {
+    munmap((void *)m->p, m->size);
+    m->p = NULL;
+    goto bad;
+  }
+  m->ph = (const ElfW(Phdr) *)(m->p + m->eh->e_phoff);
+
+  return 0;
+
+  bad:
+    if (!quiet) {
+      fprintf(stderr, "%s isn't a %zu-bit ELF object.\n", path,
+              8 * sizeof(void *));
+    }
+    return -1;
+}
+
+static void unmap_elf(struct elf_map *m)
+{
+  if (m->p) {
+    munmap((void *)m->p, m->size);
+  }
+}
+
+/* File offset of an address, through the loaded segments */
+static int file_offset(const struct elf_map *m, uint64_t addr, uint64_t *off)
+{
+  const ElfW(Phdr) *ph;
+
+  for (int i = 0; i < m->eh->e_phnum; i++) {
+    ph = &m->ph[i];
+    if (ph->p_type == PT_LOAD && addr >= ph->p_vaddr
+        && addr - ph->p_vaddr < ph->p_filesz) {
+      *off = ph->p_offset + (addr - ph->p_vaddr);
+      return *off < m->size ? 0 : -1;
+    }
+  }
+
+  return -1;
+}
+
+/* A NUL-terminated string within the map, copied */
+static char *map_string(const struct elf_map *m, uint64_t off)
+{
+  if (off >= m->size || memchr(m->p + off, '\0', m->size - off) == NULL) {
+    return NULL;
+  }
+
+  return strdup((const char *)m->p + off);
+}
+
+int elf_read_deps(const char *path, struct elf_deps *d)
+{
+  const ElfW(Phdr) *ph, *dyn = NULL;
+  const ElfW(Dyn) *e;
+  struct elf_map m;
+  uint64_t strtab = 0, off, strs;
+  size_t n = 0;
+  char **needed;
+  int has_strs;
+
+  memset(d, 0, sizeof(*d));
+  if (map_elf(path, &m, 0)) {
+    return -1;
+  }
+  d->machine = m.eh->e_machine;
+  for (int i = 0; i < m.eh->e_phnum; i++) {
+    ph = &m.ph[i];
+    if (ph->p_type == PT_INTERP) {
+      if ((d->interp = map_string(&m, ph->p_offset)) == NULL) {
+        goto bad;
+      }
+    } else if (ph->p_type == PT_DYNAMIC) {
+      dyn = ph;
+    }
+  }
+  if (dyn == NULL) {
+    unmap_elf(&m);
+    return 0;                   /* static */
+  }
+  if (dyn->p_offset > m.size
+      || dyn->p_filesz > m.size - dyn->p_offset) {
+    goto bad;
+  }
+
+  /* The string table first, then what's in it. */
+  e = (const ElfW(Dyn) *)(m.p + dyn->p_offset);
+  for (size_t i = 0; i < dyn->p_filesz / sizeof(*e); i++) {
+    if (e[i].d_tag == DT_STRTAB) {
+      strtab = e[i].d_un.d_ptr;
+    }
+    n += e[i].d_tag == DT_NEEDED;
+  }
+  if ((d->needed = calloc(n + 1, sizeof(*d->needed))) == NULL) {
+    goto bad;
+  }
+  needed = d->needed;
+  has_strs = file_offset(&m, strtab, &strs) == 0;
+  for (size_t i = 0; i < dyn->p_filesz / sizeof(*e); i++) {
+    if (e[i].d_tag == DT_NULL) {
+      break;
+    }
+    if (e[i].d_tag != DT_NEEDED && e[i].d_tag != DT_RPATH
+        && e[i].d_tag != DT_RUNPATH) {
+      continue;
+    }
+    if (!has_strs || e[i].d_un.d_val >= m.size) {
+      goto bad;
+    }
+    off = strs + e[i].d_un.d_val;
+    if (e[i].d_tag == DT_NEEDED) {
+      if ((needed[d->nneeded] = map_string(&m, off)) == NULL) {
+        goto bad;
+      }
+      d->nneeded++;
+    } else if (e[i].d_tag == DT_RPATH && d->rpath == NULL) {
+      if ((d->rpath = map_string(&m, off)) == NULL) {
+        goto bad;
+      }
+    } else if (e[i].d_tag == DT_RUNPATH && d->runpath == NULL) {
+      if ((d->runpath = map_string(&m, off)) == NULL) {
+        goto bad;
+      }
+    }
+  }
+  unmap_elf(&m);
+
+  return 0;
+
+  bad:
+    fprintf(stderr, "Failed to read the dynamic section of %s.\n", path);
+    unmap_elf(&m);
+    elf_free_deps(d);
+    return -1;
+}
+
+void elf_free_deps(struct elf_deps *d)
+{
+  for (size_t i = 0; i < d->nneeded; i++) {
+    free(d->needed[i]);
+  }
+  free(d->needed);
+  free(d->interp);
+  free(d->rpath);
+  free(d->runpath);
+  memset(d, 0, sizeof(*d));
+}
+
+static int add_dir(struct elf_closure *c, const char *dir)
+{
+  char **dirs;
+
+  for (size_t i = 0; i < c->ndirs; i++) {
+    if (strcmp(c->dirs[i], dir) == 0) {
+      return 0;
+    }
+  }
+  if (c->ndirs == c->dirs_cap) {
+    c->dirs_cap = c->dirs_cap ? 2 * c->dirs_cap : 16;
+    if ((dirs = realloc(c->dirs, c->dirs_cap * sizeof(*dirs))) == NULL) {
+      goto fail;
+    }
+    c->dirs = dirs;
+  }
+  if ((c->dirs[c->ndirs] = strdup(dir)) == NULL) {
+    goto fail;
+  }
+  c->ndirs++;
+
+  return 0;
+
+  fail:
+    fprintf(stderr, "Failed to allocate library directories.\n");
+    return -1;
+}
+
+/* Directories of an ld.so.conf and the ones it includes, in order */
+static int read_conf(struct elf_closure *c, const char *path, int depth)
+{
+  char *line = NULL, *p, *tok, *save, pattern[PATH_MAX];
+  size_t cap = 0, len;
+  glob_t g;
+  FILE *fp;
+  int ret = 0;
+
+  if (depth > LD_SO_CONF_DEPTH || (fp = fopen(path, "r")) == NULL) {
+    return 0;                   /* as ld.so, without a cache */
+  }
+  while (ret == 0 && getline(&line, &cap, fp) != -1) {
+    if ((p = strchr(line, '#')) != NULL) {
+      *p = '\0';
+    }
+    p = line + strspn(line, " \t");
+    if (strncmp(p, "include", 7) == 0 && (p[7] == ' ' || p[7] == '\t')) {
+      for (tok = strtok_r(p + 8, " \t\n", &save); tok && ret == 0;
+           tok = strtok_r(NULL, " \t\n", &save)) {
+        /* Relative to the directory of the file including them */
+        len = strrchr(path, '/') ? strrchr(path, '/') - path + 1 : 0;
+        if (snprintf(pattern, sizeof(pattern), "%.*s%s",
+                     tok[0] == '/' ? 0 : (int)len, path, tok)
+            >= (int)sizeof(pattern)) {
+          continue;
+        }
+        if (glob(pattern, 0, NULL, &g) == 0) {
+          for (size_t i = 0; i < g.gl_pathc && ret == 0; i++) {
+            ret = read_conf(c, g.gl_pathv[i], depth + 1);
+          }
+        }
+        globfree(&g);
+      }
+      continue;
+    }
+    if (strncmp(p, "hwcap", 5) == 0 && (p[5] == ' ' || p[5] == '\t')) {
+      continue;
+    }
+    for (tok = strtok_r(p, " \t\n:,", &save); tok && ret == 0;
+         tok = strtok_r(NULL, " \t\n:,", &save)) {
+      if (tok[0] == '/') {
+        ret = add_dir(c, tok);
+      }
+    }
+  }
+  free(line);
+  fclose(fp);
+
+  return ret;
+}
+
+int elf_closure_init(struct elf_closure *c)
+{
+  memset(c, 0, sizeof(*c));
+  c->machine = -1;
+  if (read_conf(c, LD_SO_CONF, 0)) {
+    elf_closure_free(c);
+    return -1;
+  }
+  for (size_t i = 0; i < sizeof(default_dirs) / sizeof(*default_dirs); i++) {
+    if (add_dir(c, default_dirs[i])) {
+      elf_closure_free(c);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+void elf_closure_free(struct elf_closure *c)
+{
+  for (size_t i = 0; i < c->n; i++) {
+    free(c->libs[i].path);
+  }
+  free(c->libs);
+  for (size_t i = 0; i < c->ndirs; i++) {
+    free(c->dirs[i]);
+  }
+  free(c->dirs);
+  memset(c, 0, sizeof(*c));
+}
+
+/* A loadable object of our machine at path, 1 if so */
+static int candidate(const struct elf_closure *c, const char *path)
+{
+  struct elf_map m;
+  int ok;
+
+  if (map_elf(path, &m, 1)) {
+    return 0;
+  }
+  ok = m.eh->e_type == ET_DYN
+    && (c->machine < 0 || m.eh->e_machine == c->machine);
+  unmap_elf(&m);
+
+  return ok;
+}
+
+/* Tries the directories of a search path ($ORIGIN expanded) for name. */
+static int search(const struct elf_closure *c, const char *list,
+                  const char *origin, const char *name, char out[PATH_MAX])
+{
+  char dir[PATH_MAX];
+  const char *p, *end;
+  size_t len;
+
+  for (p = list; p && *p; p = *end ? end + 1 : end) {
+    end = p + strcspn(p, ":");
+    len = end - p;
+    if (len >= 7 && strncmp(p, "$ORIGIN", 7) == 0) {
+      snprintf(dir, sizeof(dir), "%s%.*s", origin, (int)len - 7, p + 7);
+    } else if (len >= 9 && strncmp(p, "${ORIGIN}", 9) == 0) {
+      snprintf(dir, sizeof(dir), "%s%.*s", origin, (int)len - 9, p + 9);
+    } else if (len > 0 && memchr(p, '$', len) == NULL) {
+      snprintf(dir, sizeof(dir), "%.*s", (int)len, p);
+    } else {
+      continue;                 /* $LIB, $PLATFORM or the working dir */
+    }
+    if ((size_t)snprintf(out, PATH_MAX, "%s/%s", dir, name) < PATH_MAX
+        && candidate(c, out)) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Finds a library needed by an object (of the given deps and directory)
+ * or by the executable of exe_rpath, as ld.so does but LD_LIBRARY_PATH.
+ */
+static int resolve(const struct elf_closure *c, const char *name,
+                   const struct elf_deps *d, const char *origin,
+                   const char *exe_rpath, char out[PATH_MAX])
+{
+  if (strchr(name, '/')) {
+    return (size_t)snprintf(out, PATH_MAX, "%s", name) < PATH_MAX
+      && candidate(c, out);
+  }
+  if (d && d->runpath == NULL && search(c, d->rpath, origin, name, out)) {
+    return 1;
+  }
+  if ((d == NULL || d->runpath == NULL)
+      && search(c, exe_rpath, origin, name, out)) {
+    return 1;
+  }
+  if (d && search(c, d->runpath, origin, name, out)) {
+    return 1;
+  }
+  for (size_t i = 0; i < c->ndirs; i++) {
+    if (search(c, c->dirs[i], origin, name, out)) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* Adds a library unless it's in already (by any name). 0 or -1 */
+static int add_lib(struct elf_closure *c, const char *path)
+{
+  struct elf_lib *libs;
+  struct stat st;
+
+  if (stat(path, &st)) {
+    fprintf(stderr, "Failed to stat %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  for (size_t i = 0; i < c->n; i++) {
+    if (c->libs[i].dev == st.st_dev && c->libs[i].ino == st.st_ino) {
+      return 0;
+    }
+  }
+  if (c->n == c->cap) {
+    c->cap = c->cap ? 2 * c->cap : 32;
+    if ((libs = realloc(c->libs, c->cap * sizeof(*libs))) == NULL) {
+      goto fail;
+    }
+    c->libs = libs;
+  }
+  if ((c->libs[c->n].path = strdup(path)) == NULL) {
+    goto fail;
+  }
+  c->libs[c->n].dev = st.st_dev;
+  c->libs[c->n].ino = st.st_ino;
+  c->libs[c->n].size = st.st_size;
+  c->n++;
+
+  return 0;
+
+  fail:
+    fprintf(stderr, "Failed to allocate libraries.\n");
+    return -1;
+}
+
+static void dir_of(const char *path, char dir[PATH_MAX])
+{
+  const char *slash = strrchr(path, '/');
+
+  if (slash == NULL) {
+    snprintf(dir, PATH_MAX, ".");
+  } else {
+    snprintf(dir, PATH_MAX, "%.*s", (int)(slash == path ? 1 : slash - path),
+             path);
+  }
+}
+
+/* The needed libraries of the ones from the first-th on, breadth first */
+static int add_needed(struct elf_closure *c, size_t first,
+                      const char *exe_rpath)
+{
+  char origin[PATH_MAX], found[PATH_MAX];
+  struct elf_deps d;
+
+  for (size_t i = first; i < c->n; i++) {
+    if (elf_read_deps(c->libs[i].path, &d)) {
+      return -1;
+    }
+    dir_of(c->libs[i].path, origin);
+    for (size_t k = 0; k < d.nneeded; k++) {
+      if (!resolve(c, d.needed[k], &d, origin, exe_rpath, found)) {
+        fprintf(stderr, "Failed to find %s needed by %s.\n", d.needed[k],
+                c->libs[i].path);
+        elf_free_deps(&d);
+        return -1;
+      }
+      if (add_lib(c, found)) {
+        elf_free_deps(&d);
+        return -1;
+      }
+    }
+    elf_free_deps(&d);
+  }
+
+  return 0;
+}
+
+/* 1 if a file starts as ELF objects do, 0 if not, or -1 */
+static int is_elf(const char *path)
+{
+  char magic[SELFMAG];
+  ssize_t n;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  n = read(fd, magic, sizeof(magic));
+  close(fd);
+
+  return n == SELFMAG && memcmp(magic, ELFMAG, SELFMAG) == 0;
+}
+
+int elf_closure_add(struct elf_closure *c, const char *bin)
+{
+  char origin[PATH_MAX], found[PATH_MAX];
+  struct elf_deps d;
+  size_t first = c->n;
+  int ret = -1;
+
+  if ((ret = is_elf(bin)) <= 0) {
+    if (ret == 0) {
+      fprintf(stderr, "%s isn't an ELF binary: no libraries.\n", bin);
+    }
+    return ret;
+  }
+  ret = -1;
+  if (elf_read_deps(bin, &d)) {
+    return -1;
+  }
+  if (c->machine < 0) {
+    c->machine = d.machine;
+  }
+  if (d.interp && add_lib(c, d.interp)) {
+    goto out;
+  }
+  dir_of(bin, origin);
+  for (size_t k = 0; k < d.nneeded; k++) {
+    if (!resolve(c, d.needed[k], &d, origin, NULL, found)) {
+      fprintf(stderr, "Failed to find %s needed by %s.\n", d.needed[k], bin);
+      goto out;
+    }
+    if (add_lib(c, found)) {
+      goto out;
+    }
+  }
+  ret = add_needed(c, first, d.runpath ? NULL : d.rpath);
+
+  out:
+    elf_free_deps(&d);
+    return ret;
+}
+
+int elf_closure_add_lib(struct elf_closure *c, const char *name)
+{
+  char found[PATH_MAX];
+  size_t first = c->n;
+
+  if (!resolve(c, name, NULL, ".", NULL, found)) {
+    return 1;
+  }
+  if (add_lib(c, found)) {
+    return -1;
+  }
+
+  return add_needed(c, first, NULL);
+}
+
+/* Installing libraries, a worker each */
+struct install {
+  const struct elf_closure *c;
+  const char *root;
+  size_t next;
+  int failed;
+  pthread_mutex_t lock;
+};
+
+static int make_parents(char *path)
+{
+  for (char *p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/')) {
+    *p = '\0';
+    if (mkdir(path, 0755) && errno != EEXIST) {
+      fprintf(stderr, "Failed to create %s: %s\n", path, strerror(errno));
+      *p = '/';
+      return -1;
+    }
+    *p = '/';
+  }
+
+  return 0;
+}
+
+static int copy_file(const char *src, const char *dst, mode_t mode,
+                     uint8_t *buf)
+{
+  ssize_t n, w;
+  int in, out, ret = -1;
+
+  if ((in = open(src, O_RDONLY | O_CLOEXEC)) < 0) {
+    fprintf(stderr, "Failed to open %s: %s\n", src, strerror(errno));
+    return -1;
+  }
+  if ((out = open(dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode)) < 0) {
+    fprintf(stderr, "Failed to create %s: %s\n", dst, strerror(errno));
+    close(in);
+    return -1;
+  }
+  while ((n = read(in, buf, COPY_BUF_SIZE)) != 0) {
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "Failed to read %s: %s\n", src, strerror(errno));
+      goto out;
+    }
+    for (uint8_t *p = buf; n > 0; p += w, n -= w) {
+      if ((w = write(out, p, n)) < 0) {
+        if (errno == EINTR) {
+          w = 0;
+          continue;
+        }
+        fprintf(stderr, "Failed to write %s: %s\n", dst, strerror(errno));
+        goto out;
+      }
+    }
+  }
+  ret = fchmod(out, mode);
+
+  out:
+    close(in);
+    if (close(out)) {
+      ret = -1;
+    }
+    return ret;
+}
+
+static int install_lib(const struct elf_lib *lib, const char *root,
+                       uint8_t *buf)
+{
+  char dst[PATH_MAX], *real;
+  struct stat st;
+  int ret;
+
+  if ((size_t)snprintf(dst, sizeof(dst), "%s%s%s", root,
+                       lib->path[0] == '/' ? "" : "/", lib->path)
+      >= sizeof(dst)) {
+    fprintf(stderr, "Too long path %s%s.\n", root, lib->path);
+    return -1;
+  }
+  if (make_parents(dst) || (unlink(dst) && errno != ENOENT)) {
+    return -1;
+  }
+  /* The file itself, even if the loader finds it by a symlink */
+  if ((real = realpath(lib->path, NULL)) == NULL) {
+    fprintf(stderr, "Failed to resolve %s: %s\n", lib->path, strerror(errno));
+    return -1;
+  }
+  if (link(real, dst) == 0) {
+    free(real);
+    return 0;
+  }
+  if (stat(real, &st)) {
+    fprintf(stderr, "Failed to stat %s: %s\n", real, strerror(errno));
+    free(real);
+    return -1;
+  }
+  ret = copy_file(real, dst, st.st_mode & 07777, buf);
+  free(real);
+
+  return ret;
+}
+
+static void *install_libs(void *arg)
+{
+  struct install *in = arg;
+  uint8_t *buf;
+  size_t i;
+
+  if ((buf = malloc(COPY_BUF_SIZE)) == NULL) {
+    fprintf(stderr, "Failed to allocate a buffer.\n");
+    pthread_mutex_lock(&in->lock);
+    in->failed = 1;
+    pthread_mutex_unlock(&in->lock);
+    return NULL;
+  }
+  for (;;) {
+    pthread_mutex_lock(&in->lock);
+    i = in->failed ? in->c->n : in->next++;
+    pthread_mutex_unlock(&in->lock);
+    if (i >= in->c->n) {
+      break;
+    }
+    if (install_lib(&in->c->libs[i], in->root, buf)) {
+      pthread_mutex_lock(&in->lock);
+      in->failed = 1;
+      pthread_mutex_unlock(&in->lock);
+    }
+  }
+  free(buf);
+
+  return NULL;
+}
+
+int elf_install(const struct elf_closure *c, const char *root, int threads)
+{
+  struct install in = { .c = c, .root = root };
+  pthread_t *tids;
+  int started = 0;
+
+  if (threads <= 0) {
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if ((size_t)threads > c->n) {
+    threads = c->n;
+  }
+  pthread_mutex_init(&in.lock, NULL);
+  if (threads > 1 && (tids = calloc(threads, sizeof(*tids))) != NULL) {
+    for (; started < threads; started++) {
+      if (pthread_create(&tids[started], NULL, install_libs, &in)) {
+        break;
+      }
+    }
+    for (int i = 0; i < started; i++) {
+      pthread_join(tids[i], NULL);
+    }
+    free(tids);
+  }
+  if (started == 0) {
+    install_libs(&in);          /* on our own then */
+  }
+  pthread_mutex_destroy(&in.lock);
+
+  return in.failed ? -1 : 0;
+}
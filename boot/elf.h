@@ -0,0 +1,63 @@
+/*******************************************************************************
+ *
+ * elf.h
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#ifndef BOOTFS_ELF_H
+#define BOOTFS_ELF_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* What the dynamic loader reads of an ELF object to load it */
+struct elf_deps {
+  int machine;
+  char *interp;                 /* PT_INTERP, or NULL */
+  char **needed;                /* DT_NEEDED */
+  size_t nneeded;
+  char *rpath, *runpath;        /* or NULL */
+};
+
+int elf_read_deps(const char *path, struct elf_deps *d);
+void elf_free_deps(struct elf_deps *d);
+
+struct elf_lib {
+  char *path;                   /* as the loader finds it */
+  dev_t dev;
+  ino_t ino;
+  uint64_t size;
+};
+
+/*
+ * The shared libraries some binaries load, found as ld.so finds them
+ * (RPATH, RUNPATH, the directories of /etc/ld.so.conf, then the default
+ * ones), each once however many names it's found by.
+ */
+struct elf_closure {
+  struct elf_lib *libs;
+  size_t n, cap;
+  char **dirs;
+  size_t ndirs, dirs_cap;
+  int machine;                  /* of the first binary */
+};
+
+int elf_closure_init(struct elf_closure *c);
+void elf_closure_free(struct elf_closure *c);
+
+/* Adds the interpreter and the libraries a binary (scripts have none) loads */
+int elf_closure_add(struct elf_closure *c, const char *bin);
+
+/* Adds a library as dlopen() loads it by name. 0, 1 if not found, or -1 */
+int elf_closure_add_lib(struct elf_closure *c, const char *name);
+
+/*
+ * Hard links (or copies, across file systems) the libraries to the same
+ * paths under root, by threads (one per CPU if 0). Returns 0 or -1.
+ */
+int elf_install(const struct elf_closure *c, const char *root, int threads);
+
+#endif
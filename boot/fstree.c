@@ -0,0 +1,813 @@
+/*******************************************************************************
+ *
+ * fstree.c
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fstree.h"
+#include "layer.h"
+
+#define SYMLINKS_MAX 40         /* as the kernel's */
+
+static struct fs_inode *new_inode(struct fstree *t, char type, mode_t mode)
+{
+  struct fs_inode *ino;
+
+  if ((ino = calloc(1, sizeof(*ino))) == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  ino->type = type;
+  ino->mode = mode;
+  if (type == TAR_DIR) {
+    t->dirs++;
+  } else if (type == TAR_REG) {
+    t->files++;
+  }
+
+  return ino;
+}
+
+static void put_inode(struct fstree *t, struct fs_inode *ino)
+{
+  if (--ino->nlink > 0) {
+    return;
+  }
+  if (ino->type == TAR_DIR) {
+    t->dirs--;
+  } else if (ino->type == TAR_REG) {
+    t->files--;
+  }
+  free(ino->link);
+  free(ino);
+}
+
+static struct fs_node *new_node(const char *name, struct fs_inode *ino)
+{
+  struct fs_node *n;
+
+  if ((n = calloc(1, sizeof(*n))) == NULL
+      || (n->name = strdup(name)) == NULL) {
+    free(n);
+    errno = ENOMEM;
+    return NULL;
+  }
+  n->inode = ino;
+  ino->nlink++;
+
+  return n;
+}
+
+static void free_node(struct fstree *t, struct fs_node *n)
+{
+  for (size_t i = 0; i < n->nchildren; i++) {
+    free_node(t, n->children[i]);
+  }
+  free(n->children);
+  put_inode(t, n->inode);
+  free(n->name);
+  free(n);
+}
+
+/* Where name is, or would be, among the children of dir */
+static size_t find_slot(const struct fs_node *dir, const char *name,
+                        int *found)
+{
+  size_t lo = 0, hi = dir->nchildren, mid;
+  int cmp;
+
+  /* Entries mostly come in order, so try the end first. */
+  if (hi > 0 && strcmp(dir->children[hi - 1]->name, name) < 0) {
+    *found = 0;
+    return hi;
+  }
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if ((cmp = strcmp(dir->children[mid]->name, name)) == 0) {
+      *found = 1;
+      return mid;
+    }
+    if (cmp < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  *found = 0;
+
+  return lo;
+}
+
+static struct fs_node *find_child(const struct fs_node *dir, const char *name)
+{
+  int found;
+  size_t i = find_slot(dir, name, &found);
+
+  return found ? dir->children[i] : NULL;
+}
+
+/* Remove name (a whole tree for a directory) if it's there. */
+static void remove_child(struct fstree *t, struct fs_node *dir,
+                         const char *name)
+{
+  int found;
+  size_t i = find_slot(dir, name, &found);
+
+  if (found) {
+    free_node(t, dir->children[i]);
+    memmove(&dir->children[i], &dir->children[i + 1],
+            (dir->nchildren - i - 1) * sizeof(struct fs_node *));
+    dir->nchildren--;
+  }
+}
+
+/* Add n to dir, replacing what's there under its name. */
+static int add_child(struct fstree *t, struct fs_node *dir, struct fs_node *n)
+{
+  struct fs_node **children;
+  int found;
+  size_t i = find_slot(dir, n->name, &found);
+
+  if (found) {
+    free_node(t, dir->children[i]);
+    dir->children[i] = n;
+    n->parent = dir;
+    return 0;
+  }
+  if (dir->nchildren == dir->cap) {
+    dir->cap = dir->cap ? dir->cap * 2 : 8;
+    if ((children = realloc(dir->children,
+                            dir->cap * sizeof(*children))) == NULL) {
+      errno = ENOMEM;
+      return -1;
+    }
+    dir->children = children;
+  }
+  memmove(&dir->children[i + 1], &dir->children[i],
+          (dir->nchildren - i) * sizeof(struct fs_node *));
+  dir->children[i] = n;
+  dir->nchildren++;
+  n->parent = dir;
+
+  return 0;
+}
+
+static struct fs_node *add_dir(struct fstree *t, struct fs_node *dir,
+                               const char *name)
+{
+  struct fs_inode *ino;
+  struct fs_node *n;
+
+  if ((ino = new_inode(t, TAR_DIR, 0755)) == NULL) {
+    return NULL;
+  }
+  if ((n = new_node(name, ino)) == NULL) {
+    ino->nlink = 1;
+    put_inode(t, ino);
+    return NULL;
+  }
+  if (add_child(t, dir, n)) {
+    free_node(t, n);
+    return NULL;
+  }
+
+  return n;
+}
+
+/* The node and the directories it's in were written by the layer. */
+static void mark_written(struct fs_node *n, size_t mark)
+{
+  for (; n && n->layer != mark; n = n->parent) {
+    n->layer = mark;
+  }
+}
+
+static int is_whiteout(const struct fs_node *n)
+{
+  return n->inode->type == TAR_CHR && n->inode->devmajor == 0
+    && n->inode->devminor == 0;
+}
+
+/* Path of a node from the root, which is "" */
+static int node_path(const struct fs_node *n, char path[PATH_MAX])
+{
+  const struct fs_node *p;
+  size_t pos = 0, len;
+
+  for (p = n; p->parent; p = p->parent) {
+    pos += strlen(p->name) + (pos > 0);
+  }
+  if (pos >= PATH_MAX) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  path[pos] = '\0';
+  for (p = n; p->parent; p = p->parent) {
+    len = strlen(p->name);
+    pos -= len;
+    memcpy(path + pos, p->name, len);
+    if (pos > 0) {
+      path[--pos] = '/';
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Node at path in a tree of a layer, symlinks not followed, as overlayfs
+ * looks it up there. hidden is set if a whiteout or a non-directory on the
+ * way hides the path in the layers below.
+ */
+static struct fs_node *walk(const struct fstree *t, const char *path,
+                            int *hidden)
+{
+  char work[PATH_MAX], *comp, *save;
+  struct fs_node *cur = t->root;
+
+  *hidden = 0;
+  snprintf(work, sizeof(work), "%s", path);
+  for (comp = strtok_r(work, "/", &save); comp;
+       comp = strtok_r(NULL, "/", &save)) {
+    if (cur->inode->type != TAR_DIR) {
+      *hidden = 1;
+      return NULL;
+    }
+    if ((cur = find_child(cur, comp)) == NULL) {
+      return NULL;
+    }
+    if (is_whiteout(cur)) {
+      *hidden = 1;
+      return NULL;
+    }
+  }
+
+  return cur;
+}
+
+/* The topmost node at path in the layers below, or NULL */
+static struct fs_node *lookup_below(const struct fstree *t, const char *path)
+{
+  struct fs_node *n;
+  int hidden;
+
+  for (const struct fstree *l = t->below; l; l = l->below) {
+    if ((n = walk(l, path, &hidden)) != NULL) {
+      return n;
+    }
+    if (hidden) {
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+/* The topmost node at name in dir in the layers below, or NULL */
+static struct fs_node *lookup_child_below(const struct fstree *t,
+                                          const struct fs_node *dir,
+                                          const char *name)
+{
+  char path[PATH_MAX];
+  size_t len;
+
+  if (node_path(dir, path)) {
+    return NULL;
+  }
+  len = strlen(path);
+  if (snprintf(path + len, sizeof(path) - len, "%s%s", len ? "/" : "", name)
+      >= (int)(sizeof(path) - len)) {
+    return NULL;
+  }
+
+  return lookup_below(t, path);
+}
+
+/* A directory of a layer made for its entries is the one below, if any. */
+static int inherit_dir(const struct fstree *t, struct fs_node *n)
+{
+  char path[PATH_MAX];
+  struct fs_node *b;
+
+  if (node_path(n, path)) {
+    return -1;
+  }
+  if ((b = lookup_below(t, path)) != NULL && b->inode->type == TAR_DIR) {
+    n->inode->mode = b->inode->mode;
+    n->inode->uid = b->inode->uid;
+    n->inode->gid = b->inode->gid;
+    n->inode->mtime = b->inode->mtime;
+  }
+
+  return 0;
+}
+
+/*
+ * Directory at path, made (as layer_apply() makes them) if create is set.
+ * Symlinks on the way are followed as if the tree's root were the root,
+ * in a layer's tree those of the layers below too, as a directory made
+ * there would hide them in the overlay.
+ */
+static struct fs_node *resolve_dir(struct fstree *t, const char *path,
+                                   int create)
+{
+  char work[PATH_MAX], next[PATH_MAX];
+  char *p = work, *comp, *end;
+  struct fs_node *cur = t->root, *n;
+  int links = 0;
+
+  if (snprintf(work, sizeof(work), "%s", path) >= (int)sizeof(work)) {
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+  while (*p) {
+    comp = p;
+    if ((end = strchr(p, '/'))) {
+      *end = '\0';
+      p = end + 1;
+    } else {
+      p += strlen(p);
+    }
+    if (comp[0] == '\0' || strcmp(comp, ".") == 0) {
+      continue;
+    }
+    if (strcmp(comp, "..") == 0) {
+      cur = cur->parent ? cur->parent : cur;
+      continue;
+    }
+    if ((n = find_child(cur, comp)) == NULL) {
+      if (!create) {
+        errno = ENOENT;
+        return NULL;
+      }
+      if (t->layered && (n = lookup_child_below(t, cur, comp)) != NULL
+          && n->inode->type != TAR_DIR) {
+        /* followed (or refused) below, never made current */
+      } else if ((n = add_dir(t, cur, comp)) == NULL
+                 || (t->layered && inherit_dir(t, n))) {
+        return NULL;
+      }
+    }
+    if (n->inode->type == TAR_SYMLINK) {
+      if (++links > SYMLINKS_MAX) {
+        errno = ELOOP;
+        return NULL;
+      }
+      if (snprintf(next, sizeof(next), "%s/%s", n->inode->link, p)
+          >= (int)sizeof(next)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+      }
+      strcpy(work, next);
+      p = work;
+      if (work[0] == '/') {
+        cur = t->root;
+      }
+      continue;
+    }
+    if (n->inode->type != TAR_DIR) {
+      errno = ENOTDIR;
+      return NULL;
+    }
+    cur = n;
+  }
+
+  return cur;
+}
+
+static void split(char *path, const char **dir, const char **name)
+{
+  char *slash = strrchr(path, '/');
+
+  if (slash) {
+    *slash = '\0';
+    *dir = path;
+    *name = slash + 1;
+  } else {
+    *dir = "";
+    *name = path;
+  }
+}
+
+static void set_attrs(struct fs_inode *ino, const struct tar_entry *e)
+{
+  ino->mode = e->mode;
+  ino->uid = e->uid;
+  ino->gid = e->gid;
+  ino->mtime = e->mtime;
+}
+
+/* Everything in dir which this layer didn't write */
+static void remove_lower(struct fstree *t, struct fs_node *dir, size_t mark)
+{
+  size_t k = 0;
+
+  for (size_t i = 0; i < dir->nchildren; i++) {
+    if (dir->children[i]->layer == mark) {
+      dir->children[k++] = dir->children[i];
+    } else {
+      free_node(t, dir->children[i]);
+    }
+  }
+  dir->nchildren = k;
+}
+
+static int add_whiteout(struct fstree *t, struct fs_node *dir,
+                        const char *name, size_t mark)
+{
+  struct fs_inode *ino;
+  struct fs_node *n;
+
+  if ((ino = new_inode(t, TAR_CHR, 0)) == NULL) {
+    return -1;
+  }
+  if ((n = new_node(name, ino)) == NULL) {
+    ino->nlink = 1;
+    put_inode(t, ino);
+    return -1;
+  }
+  n->layer = mark;
+  if (add_child(t, dir, n)) {
+    free_node(t, n);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* A hard link of a layer to a file of one below, which it gets a copy of */
+static int copy_below(struct fstree *t, struct fs_node *dir, const char *name,
+                      const char *target, size_t mark)
+{
+  struct fs_inode *ino, *b;
+  struct fs_node *n;
+
+  if ((n = lookup_below(t, target)) == NULL) {
+    errno = ENOENT;
+    return -1;
+  }
+  b = n->inode;
+  if (b->type == TAR_DIR) {
+    errno = EPERM;
+    return -1;
+  }
+  if ((ino = new_inode(t, b->type, b->mode)) == NULL) {
+    return -1;
+  }
+  *ino = *b;
+  ino->nlink = 0;
+  ino->link = NULL;
+  if ((b->link && (ino->link = strdup(b->link)) == NULL)
+      || (n = new_node(name, ino)) == NULL) {
+    ino->nlink = 1;
+    put_inode(t, ino);
+    errno = ENOMEM;
+    return -1;
+  }
+  n->layer = mark;
+  if (add_child(t, dir, n)) {
+    free_node(t, n);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int add_link(struct fstree *t, struct fs_node *dir, const char *name,
+                    const char *full, const char *link, size_t mark)
+{
+  char target[PATH_MAX], whole[PATH_MAX];
+  const char *tdir, *tname;
+  struct fs_node *d, *n;
+
+  if (layer_normalize(link, target, sizeof(target))) {
+    fprintf(stderr, "Bad link target in the layer: %s\n", link);
+    errno = EINVAL;
+    return -1;
+  }
+  if (strcmp(target, full) == 0) {
+    return 0;
+  }
+  strcpy(whole, target);
+  split(target, &tdir, &tname);
+  d = resolve_dir(t, tdir, 0);
+  n = d ? find_child(d, tname) : NULL;
+  if (n == NULL && t->layered && (d || errno == ENOENT)) {
+    return copy_below(t, dir, name, whole, mark);
+  }
+  if (d == NULL) {
+    return -1;
+  }
+  if (n == NULL) {
+    errno = ENOENT;
+    return -1;
+  }
+  if (n->inode->type == TAR_DIR) {
+    errno = EPERM;
+    return -1;
+  }
+  if (n->parent == dir && strcmp(n->name, name) == 0) {
+    return 0;
+  }
+  if ((n = new_node(name, n->inode)) == NULL) {
+    return -1;
+  }
+  n->layer = mark;
+  if (add_child(t, dir, n)) {
+    free_node(t, n);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int add_entry(struct fstree *t, size_t mark, const struct tar_entry *e)
+{
+  char path[PATH_MAX], full[PATH_MAX];
+  const char *dir, *name;
+  struct fs_inode *ino;
+  struct fs_node *d, *n;
+
+  if (layer_normalize(e->path, path, sizeof(path))) {
+    fprintf(stderr, "Bad path in the layer: %s\n", e->path);
+    errno = EINVAL;
+    return -1;
+  }
+  if (path[0] == '\0') {
+    return 0;                   /* the root itself */
+  }
+  strcpy(full, path);
+  split(path, &dir, &name);
+
+  if (strncmp(name, WHITEOUT_PREFIX, strlen(WHITEOUT_PREFIX)) == 0
+      && t->layered) {
+    if ((d = resolve_dir(t, dir, 1)) == NULL) {
+      return -1;
+    }
+    mark_written(d, mark);
+    if (strcmp(name, WHITEOUT_OPAQUE) == 0) {
+      d->opaque = 1;
+      return 0;
+    }
+    return add_whiteout(t, d, name + strlen(WHITEOUT_PREFIX), mark);
+  }
+  if (strncmp(name, WHITEOUT_PREFIX, strlen(WHITEOUT_PREFIX)) == 0) {
+    if ((d = resolve_dir(t, dir, 0)) == NULL) {
+      return errno == ENOENT ? 0 : -1;
+    }
+    if (strcmp(name, WHITEOUT_OPAQUE) == 0) {
+      remove_lower(t, d, mark);
+    } else {
+      remove_child(t, d, name + strlen(WHITEOUT_PREFIX));
+    }
+    return 0;
+  }
+
+  if ((d = resolve_dir(t, dir, 1)) == NULL) {
+    return -1;
+  }
+  mark_written(d, mark);
+  switch (e->type) {
+  case TAR_DIR:
+    if ((n = find_child(d, name)) == NULL || n->inode->type != TAR_DIR) {
+      if ((n = add_dir(t, d, name)) == NULL) {
+        return -1;
+      }
+    }
+    set_attrs(n->inode, e);
+    n->layer = mark;
+    return 0;
+  case TAR_LINK:
+    return add_link(t, d, name, full, e->link, mark);
+  case TAR_REG:
+  case TAR_SYMLINK:
+  case TAR_CHR:
+  case TAR_BLK:
+  case TAR_FIFO:
+    break;
+  default:
+    return 0;
+  }
+
+  if ((ino = new_inode(t, e->type, e->mode)) == NULL) {
+    return -1;
+  }
+  set_attrs(ino, e);
+  if (e->type == TAR_REG) {
+    ino->layer = mark - 1;
+    ino->offset = e->offset;
+    ino->size = e->size;
+  } else if (e->type == TAR_SYMLINK) {
+    if ((ino->link = strdup(e->link)) == NULL) {
+      errno = ENOMEM;
+    }
+  } else {
+    ino->devmajor = e->devmajor;
+    ino->devminor = e->devminor;
+  }
+  if ((e->type == TAR_SYMLINK && ino->link == NULL)
+      || (n = new_node(name, ino)) == NULL) {
+    ino->nlink = 1;
+    put_inode(t, ino);
+    return -1;
+  }
+  n->layer = mark;
+  if (add_child(t, d, n)) {
+    free_node(t, n);
+    return -1;
+  }
+
+  return 0;
+}
+
+int fstree_init(struct fstree *t)
+{
+  struct fs_inode *ino;
+
+  memset(t, 0, sizeof(*t));
+  if ((ino = new_inode(t, TAR_DIR, 0755)) == NULL
+      || (t->root = new_node("", ino)) == NULL) {
+    free(ino);
+    fprintf(stderr, "Failed to allocate the rootfs tree.\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+void fstree_free(struct fstree *t)
+{
+  if (t->root) {
+    free_node(t, t->root);
+    t->root = NULL;
+  }
+}
+
+int fstree_add(struct fstree *t, size_t layer, const struct tar_entry *e)
+{
+  /* Marks are layer + 1, as nodes not written by any layer have 0. */
+  if (add_entry(t, layer + 1, e)) {
+    fprintf(stderr, "Failed to apply %s: %s\n", e->path, strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+int fstree_mkdir(struct fstree *t, const char *path)
+{
+  char norm[PATH_MAX];
+
+  if (layer_normalize(path, norm, sizeof(norm))) {
+    fprintf(stderr, "Bad directory path: %s\n", path);
+    errno = EINVAL;
+    return -1;
+  }
+  if (resolve_dir(t, norm, 1) == NULL) {
+    fprintf(stderr, "Failed to make %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+int fstree_init_layer(struct fstree *t, struct fstree *below)
+{
+  if (fstree_init(t)) {
+    return -1;
+  }
+  t->layered = 1;
+  t->below = below;
+
+  return 0;
+}
+
+/* A name in a directory of a layer below, and its topmost node */
+struct below_entry {
+  const char *name;
+  struct fs_node *node;
+  size_t depth;
+};
+
+static int compare_below(const void *a, const void *b)
+{
+  const struct below_entry *x = a, *y = b;
+  int cmp = strcmp(x->name, y->name);
+
+  return cmp ? cmp : x->depth < y->depth ? -1 : x->depth > y->depth;
+}
+
+/* What the directory at path has, as overlayfs shows it of the layers below */
+static struct below_entry *list_below(const struct fstree *t,
+                                      const char *path, size_t *n)
+{
+  struct below_entry *e = NULL, *p;
+  struct fs_node *d;
+  size_t cap = 0, depth = 0, k = 0;
+  int hidden;
+
+  *n = 0;
+  for (const struct fstree *l = t->below; l; l = l->below, depth++) {
+    if ((d = walk(l, path, &hidden)) == NULL) {
+      if (hidden) {
+        break;
+      }
+      continue;
+    }
+    if (d->inode->type != TAR_DIR) {
+      break;
+    }
+    for (size_t i = 0; i < d->nchildren; i++) {
+      if (*n == cap) {
+        cap = cap ? 2 * cap : 64;
+        if ((p = realloc(e, cap * sizeof(*e))) == NULL) {
+          free(e);
+          errno = ENOMEM;
+          return NULL;
+        }
+        e = p;
+      }
+      e[*n].name = d->children[i]->name;
+      e[*n].node = d->children[i];
+      e[*n].depth = depth;
+      (*n)++;
+    }
+  }
+  if (e == NULL && (e = malloc(sizeof(*e))) == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  qsort(e, *n, sizeof(*e), compare_below);
+  for (size_t i = 0; i < *n; i++) {
+    if ((i == 0 || strcmp(e[i - 1].name, e[i].name))
+        && !is_whiteout(e[i].node)) {
+      e[k++] = e[i];
+    }
+  }
+  *n = k;
+
+  return e;
+}
+
+/*
+ * Whiteouts for what's below in an opaque directory, and in the ones in it
+ * which would merge with directories below.
+ */
+static int expand_opaque(struct fstree *t, struct fs_node *dir)
+{
+  char path[PATH_MAX];
+  struct below_entry *e;
+  struct fs_node *c;
+  size_t n;
+  int ret = 0;
+
+  dir->opaque = 0;
+  if (node_path(dir, path) || (e = list_below(t, path, &n)) == NULL) {
+    return -1;
+  }
+  for (size_t i = 0; ret == 0 && i < n; i++) {
+    if ((c = find_child(dir, e[i].name)) == NULL) {
+      ret = add_whiteout(t, dir, e[i].name, dir->layer);
+    } else if (c->inode->type == TAR_DIR
+               && e[i].node->inode->type == TAR_DIR) {
+      ret = expand_opaque(t, c);
+    }
+  }
+  free(e);
+
+  return ret;
+}
+
+static int end_dir(struct fstree *t, struct fs_node *dir)
+{
+  if (dir->opaque && expand_opaque(t, dir)) {
+    return -1;
+  }
+  for (size_t i = 0; i < dir->nchildren; i++) {
+    if (dir->children[i]->inode->type == TAR_DIR
+        && end_dir(t, dir->children[i])) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+int fstree_end_layer(struct fstree *t)
+{
+  if (end_dir(t, t->root)) {
+    fprintf(stderr, "Failed to white out opaque directories: %s\n",
+            strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
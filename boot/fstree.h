@@ -0,0 +1,77 @@
+/*******************************************************************************
+ *
+ * fstree.h
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#ifndef BOOTFS_FSTREE_H
+#define BOOTFS_FSTREE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+#include "tar.h"
+
+/*
+ * The rootfs the layers of an image make, as layer_apply() would write it,
+ * but only its metadata: the data of a regular file stays where it is in
+ * its layer, to be read again when the rootfs is written out.
+ */
+struct fs_inode {
+  char type;                    /* TAR_*, but TAR_LINK */
+  mode_t mode;
+  uid_t uid;
+  gid_t gid;
+  struct timespec mtime;
+  uint64_t size;
+  char *link;                   /* symlink target */
+  unsigned int devmajor, devminor;
+  size_t layer;                 /* data of a regular file, */
+  uint64_t offset;              /* in the layer's tar stream */
+  uint32_t nlink;               /* entries linking it */
+  uint32_t extent;              /* set by the writer */
+};
+
+struct fs_node {
+  char *name;
+  struct fs_node *parent;
+  struct fs_inode *inode;
+  struct fs_node **children;    /* of a directory, sorted by name */
+  size_t nchildren, cap;
+  size_t layer;                 /* last one to write it (or in it), + 1 */
+  uint32_t extent, size;        /* of a directory, set by the writer */
+  uint32_t number;              /* of a directory in the path table */
+  int opaque;                   /* of a layer's tree, till its end */
+};
+
+struct fstree {
+  struct fs_node *root;
+  size_t dirs, files;           /* files: regular ones, each inode once */
+  int layered;
+  struct fstree *below;         /* the tree of the layer under, if layered */
+};
+
+int fstree_init(struct fstree *t);
+void fstree_free(struct fstree *t);
+
+/*
+ * A tree of one layer only, as overlayfs takes it as a lower directory on
+ * top of the trees below: ".wh.<name>" is a whiteout (a 0/0 character
+ * device) and, as a read-only file system can't keep the xattr marking an
+ * opaque directory, fstree_end_layer() whites out everything below in it
+ * instead. Directories made for entries, and hard links to files of lower
+ * layers, are copied from below.
+ */
+int fstree_init_layer(struct fstree *t, struct fstree *below);
+int fstree_end_layer(struct fstree *t);
+
+/* Apply an entry of layer (0 being the lowest), its data left in place. */
+int fstree_add(struct fstree *t, size_t layer, const struct tar_entry *e);
+
+/* Make a directory and those it's in, as mkdir -p, if it isn't there. */
+int fstree_mkdir(struct fstree *t, const char *path);
+
+#endif
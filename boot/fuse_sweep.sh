@@ -0,0 +1,49 @@
+#!/bin/bash
+############################################################
+#
+# fuse_sweep.sh
+#
+# Copyright 2019, Kohei Tokunaga
+# Licensed under Apache License, Version 2.0
+#
+############################################################
+
+# Sweep the knobs of the lazy archive mount and measure reads with rdbench.
+# Run it as root where the archive is mounted (e.g. in a booted container),
+# after warming the cache so that it measures FUSE and not the store.
+
+if [ $# -lt 1 ] ; then
+    echo "Specify args."
+    echo "${0} FILE [RDBENCH_ARGS...]"
+    echo "  FILE is the archive on the FUSE mount (e.g. /.bootfs/rootfs.ar/rootfs)."
+    exit 1
+fi
+TARGET_FILE="${1}"
+shift
+RDBENCH_BIN="${RDBENCH_BIN:-$(dirname "${0}")/rdbench}"
+MAX_BACKGROUND_LIST="${MAX_BACKGROUND_LIST:-12 32 64 128}"
+READ_AHEAD_KB_LIST="${READ_AHEAD_KB_LIST:-128 512 1024 4096}"
+FUSECTL_DIR=$(mktemp -d)
+
+DEV_MAJOR=$(stat -c '%Hd' "${TARGET_FILE}")
+DEV_MINOR=$(stat -c '%Ld' "${TARGET_FILE}")
+CONN_DIR="${FUSECTL_DIR}/$(( (DEV_MAJOR << 20) | DEV_MINOR ))"
+BDI_DIR="/sys/class/bdi/${DEV_MAJOR}:${DEV_MINOR}"
+
+mount -t fusectl fusectl "${FUSECTL_DIR}" || exit 1
+trap 'umount "${FUSECTL_DIR}"; rmdir "${FUSECTL_DIR}"' EXIT
+if [ ! -d "${CONN_DIR}" ] ; then
+    (>&2 echo "Fatal: ${TARGET_FILE} isn't on a FUSE mount.")
+    exit 1
+fi
+
+for MAX_BACKGROUND in ${MAX_BACKGROUND_LIST} ; do
+    for READ_AHEAD_KB in ${READ_AHEAD_KB_LIST} ; do
+        echo "${MAX_BACKGROUND}" > "${CONN_DIR}/max_background"
+        echo $(( MAX_BACKGROUND * 3 / 4 )) > "${CONN_DIR}/congestion_threshold"
+        echo "${READ_AHEAD_KB}" > "${BDI_DIR}/read_ahead_kb"
+        sync && echo 3 > /proc/sys/vm/drop_caches
+        echo "max_background=${MAX_BACKGROUND} read_ahead_kb=${READ_AHEAD_KB}" \
+             $("${RDBENCH_BIN}" "$@" "${TARGET_FILE}")
+    done
+done
@@ -0,0 +1,533 @@
+/*******************************************************************************
+ *
+ * image.c
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "image.h"
+#include "parson/parson.h"
+#include "tar.h"
+#include "zindex.h"
+
+#define SKIP_BUF_SIZE (64 * 1024)
+#define ARCH "amd64"            /* of the boot program */
+
+struct image_member {
+  char *name;
+  uint64_t offset, size;
+};
+
+int blob_reader_open(struct blob_reader *r, const struct blob *b)
+{
+  memset(r, 0, sizeof(*r));
+  r->b = b;
+  if ((r->format = b->index ? b->index->format : zindex_format(b)) < 0) {
+    return -1;
+  }
+  if (b->index) {
+    if ((r->zr = malloc(sizeof(*r->zr))) == NULL
+        || zreader_open(r->zr, b->index)) {
+      free(r->zr);
+      r->zr = NULL;
+      return -1;
+    }
+  } else if (r->format != ZINDEX_NONE) {
+    if ((r->d = malloc(sizeof(*r->d))) == NULL
+        || zdec_open(r->d, b, r->format, NULL)) {
+      free(r->d);
+      r->d = NULL;
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+void blob_reader_close(struct blob_reader *r)
+{
+  if (r->zr) {
+    zreader_close(r->zr);
+    free(r->zr);
+  }
+  if (r->d) {
+    zdec_close(r->d);
+    free(r->d);
+  }
+}
+
+ssize_t blob_read(struct blob_reader *r, void *buf, size_t len)
+{
+  ssize_t n;
+
+  if (r->format == ZINDEX_NONE) {
+    if (r->pos + len > r->b->size) {
+      len = r->b->size - r->pos;
+    }
+    if (len == 0) {
+      r->end = 1;
+      return 0;
+    }
+    do {
+      n = pread(r->b->fd, buf, len, r->b->offset + r->pos);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+      fprintf(stderr, "Failed to read a blob: %s\n",
+              n < 0 ? strerror(errno) : "truncated");
+      return -1;
+    }
+    r->pos += n;
+    r->out += n;
+    return n;
+  }
+
+  if (r->end || len == 0) {
+    return 0;
+  }
+  if (r->zr) {
+    n = zreader_read(r->zr, buf, len);
+    r->end = r->zr->end;
+  } else {
+    n = zdec_read(r->d, buf, len);
+    r->end = r->d->end;
+  }
+  if (n > 0) {
+    r->out += n;
+  }
+
+  return n;
+}
+
+int blob_read_full(struct blob_reader *r, void *buf, uint64_t len)
+{
+  uint8_t skip[SKIP_BUF_SIZE];
+  size_t chunk;
+  ssize_t n;
+
+  if (buf == NULL && r->zr) {
+    if (zreader_skip(r->zr, len)) {
+      r->end = r->zr->end;
+      return -1;
+    }
+    r->out += len;
+    return 0;
+  }
+  if (buf == NULL && r->format == ZINDEX_NONE) {
+    if (r->pos + len > r->b->size) {
+      r->pos = r->b->size;
+      r->end = 1;
+      return -1;
+    }
+    r->pos += len;
+    r->out += len;
+    return 0;
+  }
+  while (len > 0) {
+    chunk = buf || len < sizeof(skip) ? len : sizeof(skip);
+    if ((n = blob_read(r, buf ? buf : skip, chunk)) <= 0) {
+      return -1;
+    }
+    len -= n;
+    if (buf) {
+      buf = (uint8_t *)buf + n;
+    }
+  }
+
+  return 0;
+}
+
+/* Members of a tarball, where they are in it */
+static int index_members(struct image *img)
+{
+  struct blob whole = { img->fd, 0, 0, NULL };
+  struct blob_reader r;
+  struct tar t;
+  struct tar_entry *e;
+  struct image_member *m;
+  struct stat st;
+  size_t cap = 0;
+  int ret;
+
+  if (fstat(img->fd, &st)) {
+    fprintf(stderr, "Failed to stat the image: %s\n", strerror(errno));
+    return -1;
+  }
+  whole.size = st.st_size;
+  if (blob_reader_open(&r, &whole)) {
+    return -1;
+  }
+  if (r.format != ZINDEX_NONE) {
+    fprintf(stderr, "Compressed image tarballs aren't supported.\n");
+    blob_reader_close(&r);
+    return -1;
+  }
+  tar_init(&t, &r);
+  while ((ret = tar_next(&t, &e)) > 0) {
+    if (e->type != TAR_REG) {
+      continue;
+    }
+    if (img->nmembers == cap) {
+      cap = cap ? cap * 2 : 64;
+      if ((m = realloc(img->members, cap * sizeof(*m))) == NULL) {
+        fprintf(stderr, "Failed to allocate image members.\n");
+        ret = -1;
+        break;
+      }
+      img->members = m;
+    }
+    m = &img->members[img->nmembers];
+    m->name = strdup(strncmp(e->path, "./", 2) ? e->path : e->path + 2);
+    m->offset = e->offset;
+    m->size = e->size;
+    if (m->name == NULL) {
+      ret = -1;
+      break;
+    }
+    img->nmembers++;
+  }
+  tar_free(&t);
+  blob_reader_close(&r);
+  if (ret < 0) {
+    fprintf(stderr, "Failed to read the image tarball.\n");
+  }
+
+  return ret;
+}
+
+/* Names come from the image: nothing outside it. */
+static int safe_name(const char *name)
+{
+  const char *p = name;
+
+  if (name[0] == '/') {
+    return 0;
+  }
+  for (; p; p = strchr(p, '/') ? strchr(p, '/') + 1 : NULL) {
+    if (strncmp(p, "..", 2) == 0 && (p[2] == '/' || p[2] == '\0')) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+static int find_member(struct image *img, const char *name, struct blob *b)
+{
+  struct stat st;
+
+  if (!safe_name(name)) {
+    fprintf(stderr, "Bad name in the image: %s\n", name);
+    return -1;
+  }
+  if (img->dirfd >= 0) {
+    if ((b->fd = openat(img->dirfd, name, O_RDONLY | O_CLOEXEC)) < 0
+        || fstat(b->fd, &st)) {
+      if (b->fd >= 0) {
+        close(b->fd);
+      }
+      return -1;
+    }
+    b->offset = 0;
+    b->size = st.st_size;
+    b->index = NULL;
+    return 0;
+  }
+  for (size_t i = 0; i < img->nmembers; i++) {
+    if (strcmp(img->members[i].name, name) == 0) {
+      b->fd = img->fd;
+      b->offset = img->members[i].offset;
+      b->size = img->members[i].size;
+      b->index = NULL;
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+static void release_blob(struct image *img, struct blob *b)
+{
+  if (img->dirfd >= 0 && b->fd >= 0) {
+    close(b->fd);
+  }
+  b->fd = -1;
+}
+
+/* A JSON (or any text) member, NUL-terminated */
+static char *read_member(struct image *img, const char *name, size_t *len)
+{
+  struct blob b;
+  struct blob_reader r;
+  char *buf = NULL;
+
+  if (find_member(img, name, &b)) {
+    fprintf(stderr, "No %s in the image.\n", name);
+    return NULL;
+  }
+  if ((buf = malloc(b.size + 1)) == NULL) {
+    fprintf(stderr, "Failed to allocate %s.\n", name);
+  } else if (blob_reader_open(&r, &b) == 0) {
+    if (blob_read_full(&r, buf, b.size) == 0) {
+      buf[b.size] = '\0';
+      if (len) {
+        *len = b.size;
+      }
+    } else {
+      fprintf(stderr, "Failed to read %s.\n", name);
+      free(buf);
+      buf = NULL;
+    }
+    blob_reader_close(&r);
+  } else {
+    free(buf);
+    buf = NULL;
+  }
+  release_blob(img, &b);
+
+  return buf;
+}
+
+/* "sha256:<hex>" to "blobs/sha256/<hex>" */
+static int blob_path(const char *digest, char *path, size_t len)
+{
+  const char *colon = digest ? strchr(digest, ':') : NULL;
+
+  if (colon == NULL || (size_t)snprintf(path, len, "blobs/%.*s/%s",
+                                        (int)(colon - digest), digest,
+                                        colon + 1) >= len) {
+    fprintf(stderr, "Bad digest in the image: %s\n", digest ? digest : "");
+    return -1;
+  }
+
+  return 0;
+}
+
+static JSON_Value *read_json(struct image *img, const char *name)
+{
+  char *text = read_member(img, name, NULL);
+  JSON_Value *v = text ? json_parse_string(text) : NULL;
+
+  if (text && v == NULL) {
+    fprintf(stderr, "Failed to parse %s.\n", name);
+  }
+  free(text);
+
+  return v;
+}
+
+static int add_layer(struct image *img, const char *name)
+{
+  struct blob *layers;
+
+  if ((layers = realloc(img->layers,
+                        (img->nlayers + 1) * sizeof(struct blob))) == NULL) {
+    fprintf(stderr, "Failed to allocate layers.\n");
+    return -1;
+  }
+  img->layers = layers;
+  if (find_member(img, name, &img->layers[img->nlayers])) {
+    fprintf(stderr, "No layer %s in the image.\n", name);
+    return -1;
+  }
+  img->nlayers++;
+
+  return 0;
+}
+
+/* Manifest of an index for this platform (or without one) */
+static const char *pick_manifest(JSON_Object *index)
+{
+  JSON_Array *manifests = json_object_get_array(index, "manifests");
+  JSON_Object *m;
+  const char *os, *arch;
+
+  for (size_t i = 0; i < json_array_get_count(manifests); i++) {
+    m = json_array_get_object(manifests, i);
+    os = json_object_dotget_string(m, "platform.os");
+    arch = json_object_dotget_string(m, "platform.architecture");
+    if ((os == NULL || strcmp(os, "linux") == 0)
+        && (arch == NULL || strcmp(arch, ARCH) == 0)) {
+      return json_object_get_string(m, "digest");
+    }
+  }
+
+  return NULL;
+}
+
+static int open_oci(struct image *img)
+{
+  JSON_Value *v = read_json(img, "index.json"), *mv;
+  JSON_Object *o;
+  JSON_Array *layers;
+  char path[PATH_MAX];
+  const char *digest;
+  int ret = -1;
+
+  /* Down nested indexes to the image manifest */
+  for (int depth = 0; v && depth < 4; depth++) {
+    o = json_value_get_object(v);
+    if (json_object_get_array(o, "manifests") == NULL) {
+      break;
+    }
+    if ((digest = pick_manifest(o)) == NULL) {
+      fprintf(stderr, "No image for linux/" ARCH " in the image index.\n");
+      goto out;
+    }
+    if (blob_path(digest, path, sizeof(path))) {
+      goto out;
+    }
+    mv = read_json(img, path);
+    json_value_free(v);
+    v = mv;
+  }
+  if (v == NULL) {
+    goto out;
+  }
+  o = json_value_get_object(v);
+  if (blob_path(json_object_dotget_string(o, "config.digest"), path,
+                sizeof(path))
+      || (img->config = read_member(img, path, &img->config_len)) == NULL) {
+    goto out;
+  }
+  layers = json_object_get_array(o, "layers");
+  for (size_t i = 0; i < json_array_get_count(layers); i++) {
+    digest = json_object_get_string(json_array_get_object(layers, i),
+                                    "digest");
+    if (blob_path(digest, path, sizeof(path)) || add_layer(img, path)) {
+      goto out;
+    }
+  }
+  ret = 0;
+
+  out:
+    json_value_free(v);
+    return ret;
+}
+
+static int open_docker(struct image *img)
+{
+  JSON_Value *v = read_json(img, "manifest.json");
+  JSON_Object *o = json_array_get_object(json_value_get_array(v), 0);
+  JSON_Array *layers = json_object_get_array(o, "Layers");
+  const char *config = json_object_get_string(o, "Config");
+  int ret = -1;
+
+  if (config == NULL) {
+    fprintf(stderr, "No image in manifest.json.\n");
+    goto out;
+  }
+  if ((img->config = read_member(img, config, &img->config_len)) == NULL) {
+    goto out;
+  }
+  for (size_t i = 0; i < json_array_get_count(layers); i++) {
+    if (add_layer(img, json_array_get_string(layers, i))) {
+      goto out;
+    }
+  }
+  ret = 0;
+
+  out:
+    json_value_free(v);
+    return ret;
+}
+
+int image_open(const char *path, struct image *img)
+{
+  struct blob b;
+  struct stat st;
+  int oci, docker;
+
+  memset(img, 0, sizeof(*img));
+  img->fd = img->dirfd = -1;
+  if (stat(path, &st)) {
+    fprintf(stderr, "Failed to stat %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  if (S_ISDIR(st.st_mode)) {
+    img->dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  } else {
+    img->fd = open(path, O_RDONLY | O_CLOEXEC);
+  }
+  if (img->dirfd < 0 && img->fd < 0) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  if (img->fd >= 0 && index_members(img)) {
+    image_close(img);
+    return -1;
+  }
+  if ((oci = find_member(img, "index.json", &b) == 0)) {
+    release_blob(img, &b);
+  }
+  if ((docker = find_member(img, "manifest.json", &b) == 0)) {
+    release_blob(img, &b);
+  }
+  if (!oci && !docker) {
+    fprintf(stderr, "%s is neither an OCI image layout nor a docker-archive.\n",
+            path);
+    image_close(img);
+    return -1;
+  }
+  /* docker save of recent versions writes both; they agree. */
+  img->oci = oci && !docker;
+  if (img->oci ? open_oci(img) : open_docker(img)) {
+    image_close(img);
+    return -1;
+  }
+
+  return 0;
+}
+
+int image_index(struct image *img, int threads)
+{
+  if (threads <= 0) {
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (threads <= 1 || img->nlayers == 0) {
+    return 0;
+  }
+  if ((img->indexer = zindexer_start(img->layers, img->nlayers,
+                                     threads)) == NULL) {
+    return -1;
+  }
+  for (size_t i = 0; i < img->nlayers; i++) {
+    if (img->indexer->ix[i].format != ZINDEX_NONE) {
+      img->layers[i].index = &img->indexer->ix[i];
+    }
+  }
+
+  return 0;
+}
+
+void image_close(struct image *img)
+{
+  if (img->indexer) {
+    zindexer_free(img->indexer);
+  }
+  for (size_t i = 0; i < img->nlayers; i++) {
+    release_blob(img, &img->layers[i]);
+  }
+  free(img->layers);
+  free(img->config);
+  for (size_t i = 0; i < img->nmembers; i++) {
+    free(img->members[i].name);
+  }
+  free(img->members);
+  if (img->fd >= 0) {
+    close(img->fd);
+  }
+  if (img->dirfd >= 0) {
+    close(img->dirfd);
+  }
+  memset(img, 0, sizeof(*img));
+  img->fd = img->dirfd = -1;
+}
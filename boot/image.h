@@ -0,0 +1,83 @@
+/*******************************************************************************
+ *
+ * image.h
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#ifndef BOOTFS_IMAGE_H
+#define BOOTFS_IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct zindex;
+struct zindexer;
+struct zdec;
+struct zreader;
+
+/* A blob of an image: a file of a layout, or a member of a tarball. */
+struct blob {
+  int fd;
+  uint64_t offset, size;
+  struct zindex *index;         /* of a compressed layer, or NULL */
+};
+
+/*
+ * Reads a blob, decompressing it if it's gzip'ed (of one or more members,
+ * as pigz writes them) or zstd'ed (WITH_ZSTD). Layers are read from start
+ * to end, once indexed by spans which threads decompress ahead.
+ */
+#define BLOB_READ_SIZE (256 * 1024)
+
+struct blob_reader {
+  const struct blob *b;
+  uint64_t pos;                 /* in the blob, if it isn't compressed */
+  uint64_t out;                 /* bytes read out of it */
+  int format, end;
+  struct zdec *d;               /* decompressed in order, */
+  struct zreader *zr;           /* or in spans */
+};
+
+int blob_reader_open(struct blob_reader *r, const struct blob *b);
+void blob_reader_close(struct blob_reader *r);
+
+/* Returns bytes read, 0 at the end, or -1. */
+ssize_t blob_read(struct blob_reader *r, void *buf, size_t len);
+
+/* Read exactly len bytes, or skip them (buf NULL). */
+int blob_read_full(struct blob_reader *r, void *buf, uint64_t len);
+
+/*
+ * An image as docker save writes it (a docker-archive: manifest.json and
+ * the blobs it names) or an OCI image layout (oci-layout, index.json and
+ * blobs/<alg>/<hex>), either as a directory or as a tarball which is read
+ * in place.
+ */
+struct image_member;
+
+struct image {
+  int fd;                       /* tarball, or -1 */
+  int dirfd;                    /* directory, or -1 */
+  struct image_member *members; /* of the tarball */
+  size_t nmembers;
+  int oci;
+  char *config;                 /* image config JSON */
+  size_t config_len;
+  struct blob *layers;          /* lowest first */
+  size_t nlayers;
+  struct zindexer *indexer;
+};
+
+int image_open(const char *path, struct image *img);
+
+/*
+ * Index the compressed layers on threads (one per CPU if 0), a layer each,
+ * so that they're read decompressed by as many threads. Nothing with one.
+ */
+int image_index(struct image *img, int threads);
+void image_close(struct image *img);
+
+#endif
@@ -0,0 +1,986 @@
+/*******************************************************************************
+ *
+ * image_util.c
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "chunker.h"
+#include "elf.h"
+#include "fstree.h"
+#include "image.h"
+#include "iso.h"
+#include "layer.h"
+#include "parson/parson.h"
+#include "sha.h"
+#include "tar.h"
+
+#define MOUNTPOINTS_MAX 64
+#define HASH_BUF_SIZE (256 * 1024)
+#define DIGEST_HEX_LEN (SHA256_LEN * 2)
+#define LAYER_NAME "layer.tar"
+#define LAYER_MTIME (-446774400)        /* 1955-11-05, of every layer file */
+#define OCI_MANIFEST_TYPE "application/vnd.oci.image.manifest.v1+json"
+#define OCI_CONFIG_TYPE "application/vnd.oci.image.config.v1+json"
+#define OCI_LAYER_TYPE "application/vnd.oci.image.layer.v1.tar"
+#define OCI_REF_NAME "org.opencontainers.image.ref.name"
+#define OCI_LAYOUT "{\"imageLayoutVersion\":\"1.0.0\"}"
+#define NSS_DATABASES "passwd", "group"  /* getpwuid() of the SSH client */
+#define NSS_DEFAULT "files"               /* without nsswitch.conf */
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "Usage:\n");
+  fprintf(stderr, "  %s flatten [-j THREADS] IMAGE ROOTFS CONFIG\n", name);
+  fprintf(stderr, "      Apply the layers of an image (OCI layout or "
+          "docker-archive, as a\n"
+          "      directory or a tarball) to ROOTFS, and write its config "
+          "json to CONFIG.\n"
+          "      Compressed layers are decompressed by THREADS (one per "
+          "CPU by default)\n");
+  fprintf(stderr, "  %s config IMAGE CONFIG\n", name);
+  fprintf(stderr, "      Write the config json of an image to CONFIG\n");
+  fprintf(stderr, "  %s convert [-j THREADS] [-i BASE_INDEX] [-a ARCHIVE] "
+          "[-e ROOTFS] [-m DIR]... [-L] [-f]\n"
+          "          IMAGE INDEX STORE\n"
+          "      Write the rootfs of an image as an ISO 9660 archive (as "
+          "genisoimage -R)\n"
+          "      straight into chunks of STORE and their INDEX, without "
+          "extracting it.\n"
+          "      -a also writes the archive, -e the rootfs's /etc under "
+          "ROOTFS, and -m\n"
+          "      makes a directory (a mountpoint) in the archive. Layers "
+          "are decompressed\n"
+          "      and chunks made by THREADS (one per CPU by default). -L "
+          "keeps the layers:\n"
+          "      INDEX is a directory getting N.caibx of an archive per "
+          "layer, lowest first,\n"
+          "      with whiteouts as overlayfs ones, and one more of the "
+          "mountpoints on top.\n"
+          "      -f chunks each file of 16 KiB or more apart from what's "
+          "around it, so\n"
+          "      that it makes the same chunks in any image\n", name);
+  fprintf(stderr, "  %s write [-t TAG] [-o LAYOUT] CONFIG ENTRYPOINT DIR "
+          "LAYER...\n", name);
+  fprintf(stderr, "      Write a docker-archive to DIR of layer tarballs "
+          "(moved into it) and\n"
+          "      of CONFIG running ENTRYPOINT, with its command, user, "
+          "working directory\n"
+          "      and history cleared. A LAYER directory is written as a "
+          "tarball that\n"
+          "      depends only on its contents. -o also writes it as an "
+          "OCI image layout\n");
+  fprintf(stderr, "  %s libs [-j THREADS] [-n NSSWITCH] ROOTFS BIN...\n",
+          name);
+  fprintf(stderr, "      Link (or copy) the shared libraries BINs load to "
+          "the same paths under\n"
+          "      ROOTFS, with the NSS modules NSSWITCH names for users and "
+          "groups, and\n"
+          "      report their size and ROOTFS's. THREADS (one per CPU by "
+          "default) install\n"
+          "      them\n");
+}
+
+static int write_file(const char *path, const void *data, size_t len)
+{
+  FILE *fp;
+
+  if ((fp = fopen(path, "w")) == NULL) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  if (fwrite(data, 1, len, fp) != len) {
+    fprintf(stderr, "Failed to write %s.\n", path);
+    fclose(fp);
+    return -1;
+  }
+
+  return fclose(fp) ? -1 : 0;
+}
+
+static int write_config(const struct image *img, const char *path)
+{
+  return write_file(path, img->config, img->config_len);
+}
+
+static int dump_config(const char *path, const char *config)
+{
+  struct image img;
+  int ret;
+
+  if (image_open(path, &img)) {
+    return 1;
+  }
+  ret = write_config(&img, config) ? 1 : 0;
+  image_close(&img);
+
+  return ret;
+}
+
+static int flatten(int argc, char *argv[])
+{
+  const char *path, *rootfs, *config;
+  struct image img;
+  int opt, threads = 0, ret = 1;
+
+  while ((opt = getopt(argc, argv, "j:")) != -1) {
+    switch (opt) {
+    case 'j': threads = atoi(optarg); break;
+    default: return -1;
+    }
+  }
+  if (optind != argc - 3) {
+    return -1;
+  }
+  path = argv[optind];
+  rootfs = argv[optind + 1];
+  config = argv[optind + 2];
+  if (image_open(path, &img)) {
+    return 1;
+  }
+  if (image_index(&img, threads)) {
+    goto out;
+  }
+  if (mkdir(rootfs, 0755) && errno != EEXIST) {
+    fprintf(stderr, "Failed to create %s: %s\n", rootfs, strerror(errno));
+    goto out;
+  }
+  for (size_t i = 0; i < img.nlayers; i++) {
+    if (layer_apply(rootfs, &img.layers[i])) {
+      fprintf(stderr, "Failed to apply layer %zu.\n", i);
+      goto out;
+    }
+  }
+  if (write_config(&img, config)) {
+    goto out;
+  }
+  printf("layout=%s layers=%zu\n", img.oci ? "oci" : "docker-archive",
+         img.nlayers);
+  ret = 0;
+
+  out:
+    image_close(&img);
+    return ret;
+}
+
+struct sink {
+  struct chunk_stream *s;
+  int fd;
+};
+
+static int sink_write(void *arg, const void *data, size_t len)
+{
+  struct sink *k = arg;
+  const char *p = data;
+  ssize_t n;
+
+  for (size_t off = 0; k->fd >= 0 && off < len; off += n) {
+    if ((n = write(k->fd, p + off, len - off)) < 0) {
+      fprintf(stderr, "Failed to write the archive: %s\n", strerror(errno));
+      return -1;
+    }
+  }
+
+  return chunk_stream_write(k->s, data, len);
+}
+
+/*
+ * Files of at least a chunk's minimum size get boundaries of their own at
+ * both ends, so the same file makes the same chunks in any archive.
+ */
+static int sink_cut(void *arg, uint64_t size)
+{
+  struct sink *k = arg;
+
+  return size >= CHUNKER_SIZE_MIN ? chunk_stream_cut(k->s) : 0;
+}
+
+/* Entries of /etc, and not hardlinks to files out of it */
+static int in_etc(const struct tar_entry *e)
+{
+  char path[PATH_MAX];
+
+  if (layer_normalize(e->path, path, sizeof(path))
+      || (strcmp(path, "etc") && strncmp(path, "etc/", 4))) {
+    return 0;
+  }
+  if (e->type == TAR_LINK && (layer_normalize(e->link, path, sizeof(path))
+                              || strncmp(path, "etc/", 4))) {
+    return 0;
+  }
+
+  return 1;
+}
+
+/*
+ * The metadata of the rootfs, or of each layer to trees[layer] if layered,
+ * and its /etc to etc if given
+ */
+static int read_tree(const struct image *img, struct fstree *trees,
+                     int layered, const char *etc)
+{
+  struct fstree *t = trees;
+  struct layer_applier *a = NULL;
+  struct blob_reader r;
+  struct tar tar;
+  struct tar_entry *e;
+  int ret = 0;
+
+  if (etc && (mkdir(etc, 0755) && errno != EEXIST)) {
+    fprintf(stderr, "Failed to create %s: %s\n", etc, strerror(errno));
+    return -1;
+  }
+  if (etc && (a = layer_applier_new(etc)) == NULL) {
+    return -1;
+  }
+  for (size_t i = 0; ret == 0 && i < img->nlayers; i++) {
+    if (blob_reader_open(&r, &img->layers[i])) {
+      ret = -1;
+      break;
+    }
+    tar_init(&tar, &r);
+    t = layered ? &trees[i] : trees;
+    while ((ret = tar_next(&tar, &e)) > 0) {
+      if (fstree_add(t, i, e) || (a && in_etc(e)
+                                  && layer_applier_entry(a, &tar, e))) {
+        ret = -1;
+        break;
+      }
+    }
+    if (ret == 0 && a) {
+      layer_applier_end(a);
+    }
+    if (ret == 0 && layered && fstree_end_layer(t)) {
+      ret = -1;
+    }
+    if (ret) {
+      fprintf(stderr, "Failed to read layer %zu.\n", i);
+    }
+    tar_free(&tar);
+    blob_reader_close(&r);
+  }
+  if (a) {
+    layer_applier_free(a);
+  }
+
+  return ret;
+}
+
+static int format_path(char path[PATH_MAX], const char *fmt, ...)
+{
+  va_list ap;
+  int n;
+
+  va_start(ap, fmt);
+  n = vsnprintf(path, PATH_MAX, fmt, ap);
+  va_end(ap);
+  if (n < 0 || n >= PATH_MAX) {
+    fprintf(stderr, "Too long path.\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+/* A tree as an ISO 9660 archive, written straight into chunks of store */
+static int write_archive(struct fstree *t, const struct image *img,
+                         const char *archive, const char *index,
+                         const char *store, const struct chunker_opts *opts,
+                         int by_file, struct chunker_stats *stats,
+                         size_t *dirs, size_t *files)
+{
+  struct chunk_stream s;
+  struct iso iso;
+  struct sink k = { &s, -1 };
+  int ret = -1;
+
+  if (iso_layout(&iso, t)) {
+    return -1;
+  }
+  if (archive && (k.fd = open(archive, O_WRONLY | O_CREAT | O_TRUNC
+                              | O_CLOEXEC, 0644)) < 0) {
+    fprintf(stderr, "Failed to open %s: %s\n", archive, strerror(errno));
+    goto free_iso;
+  }
+  if (chunk_stream_init(&s, store, opts)) {
+    goto close;
+  }
+  if (iso_write(&iso, img->layers, sink_write, by_file ? sink_cut : NULL,
+                &k)) {
+    chunk_stream_finish(&s, NULL, NULL);
+    goto close;
+  }
+  if (chunk_stream_finish(&s, index, stats)) {
+    goto close;
+  }
+  if (k.fd >= 0 && fsync(k.fd)) {
+    fprintf(stderr, "Failed to write %s: %s\n", archive, strerror(errno));
+    goto close;
+  }
+  *dirs = iso.ndirs;
+  *files = iso.nfiles;
+  ret = 0;
+
+  close:
+    if (k.fd >= 0) {
+      close(k.fd);
+    }
+  free_iso:
+    iso_free(&iso);
+    return ret;
+}
+
+static void add_stats(struct chunker_stats *total,
+                      const struct chunker_stats *s)
+{
+  total->chunks += s->chunks;
+  total->bytes += s->bytes;
+  total->stored += s->stored;
+  total->stored_bytes += s->stored_bytes;
+  total->reused += s->reused;
+  total->reused_bytes += s->reused_bytes;
+  total->store_s += s->store_s;
+}
+
+static int convert(int argc, char *argv[])
+{
+  struct chunker_opts opts = { 0, -1, 0, NULL, NULL };
+  const char *mountpoints[MOUNTPOINTS_MAX], *archive = NULL, *etc = NULL;
+  struct chunker_stats stats, total;
+  struct fstree *trees = NULL;
+  struct image img;
+  char index[PATH_MAX];
+  size_t nmountpoints = 0, ntrees = 1, dirs, files, ndirs = 0, nfiles = 0;
+  int opt, layered = 0, by_file = 0, ret = 1;
+
+  while ((opt = getopt(argc, argv, "j:i:a:e:m:Lf")) != -1) {
+    switch (opt) {
+    case 'j': opts.threads = atoi(optarg); break;
+    case 'i': opts.base_index = optarg; break;
+    case 'a': archive = optarg; break;
+    case 'e': etc = optarg; break;
+    case 'm':
+      if (nmountpoints == MOUNTPOINTS_MAX) {
+        return -1;
+      }
+      mountpoints[nmountpoints++] = optarg;
+      break;
+    case 'L': layered = 1; break;
+    case 'f': by_file = 1; break;
+    default: return -1;
+    }
+  }
+  if (optind != argc - 3) {
+    return -1;
+  }
+  if (layered && (archive || opts.base_index)) {
+    fprintf(stderr, "-a and -i are for a single archive, not with -L.\n");
+    return 1;
+  }
+  if (image_open(argv[optind], &img)) {
+    return 1;
+  }
+  /* Layered, mountpoints go in a tree of their own on top. */
+  ntrees = layered ? img.nlayers + 1 : 1;
+  if (image_index(&img, opts.threads)) {
+    goto out;
+  }
+  if ((trees = calloc(ntrees, sizeof(*trees))) == NULL) {
+    fprintf(stderr, "Failed to allocate trees.\n");
+    goto out;
+  }
+  for (size_t i = 0; i < ntrees; i++) {
+    if (layered ? fstree_init_layer(&trees[i], i ? &trees[i - 1] : NULL)
+        : fstree_init(&trees[i])) {
+      goto out;
+    }
+  }
+  if (read_tree(&img, trees, layered, etc)) {
+    goto out;
+  }
+  for (size_t i = 0; i < nmountpoints; i++) {
+    if (fstree_mkdir(&trees[ntrees - 1], mountpoints[i])) {
+      goto out;
+    }
+  }
+  memset(&total, 0, sizeof(total));
+  for (size_t i = 0; i < ntrees; i++) {
+    if ((layered ? format_path(index, "%s/%zu.caibx", argv[optind + 1], i)
+         : format_path(index, "%s", argv[optind + 1]))
+        || write_archive(&trees[i], &img, archive, index, argv[optind + 2],
+                         &opts, by_file, &stats, &dirs, &files)) {
+      goto out;
+    }
+    if (layered) {
+      printf("archive=%zu dirs=%zu files=%zu chunks=%zu bytes=%llu "
+             "stored=%zu\n", i, dirs, files, stats.chunks,
+             (unsigned long long)stats.bytes, stats.stored);
+    }
+    add_stats(&total, &stats);
+    ndirs += dirs;
+    nfiles += files;
+  }
+  printf("layout=%s layers=%zu dirs=%zu files=%zu chunks=%zu bytes=%llu "
+         "stored=%zu stored_bytes=%llu reused=%zu reused_bytes=%llu "
+         "seconds=%.3f mbps=%.1f\n", img.oci ? "oci" : "docker-archive",
+         img.nlayers, ndirs, nfiles, total.chunks,
+         (unsigned long long)total.bytes, total.stored,
+         (unsigned long long)total.stored_bytes, total.reused,
+         (unsigned long long)total.reused_bytes, total.store_s,
+         total.store_s > 0 ? total.bytes / total.store_s / 1e6 : 0.0);
+  ret = 0;
+
+  out:
+    for (size_t i = 0; trees && i < ntrees; i++) {
+      fstree_free(&trees[i]);
+    }
+    free(trees);
+    image_close(&img);
+    return ret;
+}
+
+static void digest_hex(const uint8_t digest[SHA256_LEN],
+                       char hex[DIGEST_HEX_LEN + 1])
+{
+  for (int i = 0; i < SHA256_LEN; i++) {
+    sprintf(hex + i * 2, "%02x", digest[i]);
+  }
+}
+
+static int hash_file(const char *path, char hex[DIGEST_HEX_LEN + 1],
+                     uint64_t *size)
+{
+  uint8_t digest[SHA256_LEN], *buf;
+  sha256_ctx ctx;
+  ssize_t n;
+  int fd, ret = -1;
+
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  if ((buf = malloc(HASH_BUF_SIZE)) == NULL) {
+    fprintf(stderr, "Failed to allocate a buffer.\n");
+    close(fd);
+    return -1;
+  }
+  sha256_init(&ctx);
+  for (*size = 0; (n = read(fd, buf, HASH_BUF_SIZE)) != 0; *size += n) {
+    if (n < 0) {
+      if (errno == EINTR) {
+        n = 0;
+        continue;
+      }
+      fprintf(stderr, "Failed to read %s: %s\n", path, strerror(errno));
+      goto out;
+    }
+    sha256_update(&ctx, buf, n);
+  }
+  sha256_final(&ctx, digest);
+  digest_hex(digest, hex);
+  ret = 0;
+
+  out:
+    free(buf);
+    close(fd);
+    return ret;
+}
+
+/* Write a JSON document as dir/<its digest><suffix> */
+static int write_json_blob(const JSON_Value *v, const char *dir,
+                           const char *suffix, char hex[DIGEST_HEX_LEN + 1],
+                           uint64_t *size)
+{
+  uint8_t digest[SHA256_LEN];
+  char path[PATH_MAX], *text;
+  sha256_ctx ctx;
+  int ret;
+
+  if ((text = json_serialize_to_string(v)) == NULL) {
+    fprintf(stderr, "Failed to serialize JSON.\n");
+    return -1;
+  }
+  *size = strlen(text);
+  sha256_init(&ctx);
+  sha256_update(&ctx, text, *size);
+  sha256_final(&ctx, digest);
+  digest_hex(digest, hex);
+  ret = format_path(path, "%s/%s%s", dir, hex, suffix)
+    || write_file(path, text, *size) ? -1 : 0;
+  json_free_serialized_string(text);
+
+  return ret;
+}
+
+static int make_dir(const char *path)
+{
+  if (mkdir(path, 0755) && errno != EEXIST) {
+    fprintf(stderr, "Failed to create %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Link a file as a blob, replacing one of the same digest, as ln -f */
+static int link_blob(const char *path, const char *blobs, const char *hex)
+{
+  char blob[PATH_MAX];
+
+  if (format_path(blob, "%s/%s", blobs, hex)) {
+    return -1;
+  }
+  if ((unlink(blob) && errno != ENOENT) || link(path, blob)) {
+    fprintf(stderr, "Failed to link %s: %s\n", blob, strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+static JSON_Value *descriptor(const char *type, const char *hex,
+                              uint64_t size)
+{
+  JSON_Value *v = json_value_init_object();
+  JSON_Object *o = json_value_get_object(v);
+  char digest[sizeof("sha256:") + DIGEST_HEX_LEN];
+
+  snprintf(digest, sizeof(digest), "sha256:%s", hex);
+  if (v && (json_object_set_string(o, "mediaType", type)
+            || json_object_set_string(o, "digest", digest)
+            || json_object_set_number(o, "size", size))) {
+    json_value_free(v);
+    return NULL;
+  }
+
+  return v;
+}
+
+/*
+ * The image written by write_image() as an OCI image layout, its blobs
+ * linked rather than copied
+ */
+static int write_layout(const char *layout, const char *dir,
+                        const char *config_hex, uint64_t config_size,
+                        char (*hexes)[DIGEST_HEX_LEN + 1],
+                        const uint64_t *sizes, size_t n, const char *tag)
+{
+  JSON_Value *manifest = json_value_init_object();
+  JSON_Value *index = json_value_init_object(), *array, *d, *a;
+  JSON_Object *o;
+  char blobs[PATH_MAX], path[PATH_MAX], hex[DIGEST_HEX_LEN + 1];
+  uint64_t size;
+  int ret = -1;
+
+  if (format_path(blobs, "%s/blobs", layout) || make_dir(layout)
+      || make_dir(blobs) || format_path(blobs, "%s/blobs/sha256", layout)
+      || make_dir(blobs)) {
+    goto out;
+  }
+  if (format_path(path, "%s/%s.json", dir, config_hex)
+      || link_blob(path, blobs, config_hex)) {
+    goto out;
+  }
+  for (size_t i = 0; i < n; i++) {
+    if (format_path(path, "%s/%s/" LAYER_NAME, dir, hexes[i])
+        || link_blob(path, blobs, hexes[i])) {
+      goto out;
+    }
+  }
+  if (manifest == NULL || index == NULL
+      || (array = json_value_init_array()) == NULL) {
+    goto bad;
+  }
+  o = json_value_get_object(manifest);
+  if (json_object_set_number(o, "schemaVersion", 2)
+      || json_object_set_string(o, "mediaType", OCI_MANIFEST_TYPE)
+      || (d = descriptor(OCI_CONFIG_TYPE, config_hex, config_size)) == NULL
+      || json_object_set_value(o, "config", d)
+      || json_object_set_value(o, "layers", array)) {
+    goto bad;
+  }
+  for (size_t i = 0; i < n; i++) {
+    if ((d = descriptor(OCI_LAYER_TYPE, hexes[i], sizes[i])) == NULL
+        || json_array_append_value(json_array(array), d)) {
+      goto bad;
+    }
+  }
+  if (write_json_blob(manifest, blobs, "", hex, &size)) {
+    goto out;
+  }
+  o = json_value_get_object(index);
+  if (json_object_set_number(o, "schemaVersion", 2)
+      || (array = json_value_init_array()) == NULL
+      || json_object_set_value(o, "manifests", array)
+      || (d = descriptor(OCI_MANIFEST_TYPE, hex, size)) == NULL
+      || json_array_append_value(json_array(array), d)) {
+    goto bad;
+  }
+  if (tag && ((a = json_value_init_object()) == NULL
+              || json_object_set_value(json_value_get_object(d),
+                                       "annotations", a)
+              || json_object_set_string(json_value_get_object(a),
+                                        OCI_REF_NAME, tag))) {
+    goto bad;
+  }
+  ret = format_path(path, "%s/index.json", layout)
+    || json_serialize_to_file(index, path)
+    || format_path(path, "%s/oci-layout", layout)
+    || write_file(path, OCI_LAYOUT, strlen(OCI_LAYOUT)) ? -1 : 0;
+  goto out;
+
+  bad:
+    fprintf(stderr, "Failed to make the image manifest.\n");
+  out:
+    json_value_free(manifest);
+    json_value_free(index);
+    return ret;
+}
+
+/* A layer tarball being written, hashed as it goes */
+struct layer_out {
+  int fd;
+  const char *path;
+  sha256_ctx ctx;
+  uint64_t size;
+};
+
+static int layer_write(void *arg, const void *data, size_t len)
+{
+  struct layer_out *lo = arg;
+  const uint8_t *p = data;
+  ssize_t n;
+
+  sha256_update(&lo->ctx, data, len);
+  lo->size += len;
+  for (; len > 0; p += n, len -= n) {
+    if ((n = write(lo->fd, p, len)) < 0) {
+      if (errno == EINTR) {
+        n = 0;
+        continue;
+      }
+      fprintf(stderr, "Failed to write %s: %s\n", lo->path, strerror(errno));
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Moves a layer tarball to DIR/<digest>/layer.tar, as docker save writes
+ * them, or writes a directory's tarball there in the same pass as hashing.
+ */
+static int add_layer(const char *dir, const char *src,
+                     char hex[DIGEST_HEX_LEN + 1], uint64_t *size,
+                     char name[PATH_MAX])
+{
+  char path[PATH_MAX], tmp[PATH_MAX] = "";
+  uint8_t digest[SHA256_LEN];
+  struct layer_out lo;
+  struct stat st;
+  int ret = -1;
+
+  if (stat(src, &st)) {
+    fprintf(stderr, "Failed to stat %s: %s\n", src, strerror(errno));
+    return -1;
+  }
+  if (S_ISDIR(st.st_mode)) {
+    if (format_path(tmp, "%s/." LAYER_NAME ".XXXXXX", dir)) {
+      return -1;
+    }
+    if ((lo.fd = mkstemp(tmp)) < 0) {
+      fprintf(stderr, "Failed to create %s: %s\n", tmp, strerror(errno));
+      return -1;
+    }
+    lo.path = tmp;
+    lo.size = 0;
+    sha256_init(&lo.ctx);
+    if (fchmod(lo.fd, 0644)
+        || tar_write_dir(src, LAYER_MTIME, layer_write, &lo)) {
+      close(lo.fd);
+      goto out;
+    }
+    if (close(lo.fd)) {
+      fprintf(stderr, "Failed to write %s: %s\n", tmp, strerror(errno));
+      goto out;
+    }
+    sha256_final(&lo.ctx, digest);
+    digest_hex(digest, hex);
+    *size = lo.size;
+    src = tmp;
+  } else if (hash_file(src, hex, size)) {
+    return -1;
+  }
+  if (format_path(path, "%s/%s", dir, hex) || make_dir(path)
+      || format_path(name, "%s/%s/" LAYER_NAME, dir, hex)) {
+    goto out;
+  }
+  if (rename(src, name)) {
+    fprintf(stderr, "Failed to move %s: %s\n", src, strerror(errno));
+    goto out;
+  }
+  tmp[0] = '\0';
+  ret = 0;
+
+  out:
+    if (tmp[0]) {
+      unlink(tmp);
+    }
+    return ret;
+}
+
+static int write_image(int argc, char *argv[])
+{
+  const char *tag = NULL, *layout = NULL, *dir;
+  JSON_Value *config = NULL, *manifest = NULL, *v;
+  JSON_Object *o, *m;
+  JSON_Array *diff_ids, *layers;
+  char (*hexes)[DIGEST_HEX_LEN + 1] = NULL, hex[DIGEST_HEX_LEN + 1];
+  char path[PATH_MAX], name[PATH_MAX];
+  uint64_t *sizes = NULL, size;
+  size_t n;
+  int opt, ret = 1;
+
+  while ((opt = getopt(argc, argv, "t:o:")) != -1) {
+    switch (opt) {
+    case 't': tag = optarg; break;
+    case 'o': layout = optarg; break;
+    default: return -1;
+    }
+  }
+  if (optind > argc - 4) {
+    return -1;
+  }
+  dir = argv[optind + 2];
+  n = argc - optind - 3;
+  json_set_escape_slashes(0);
+  if ((config = json_parse_file(argv[optind])) == NULL) {
+    fprintf(stderr, "Failed to parse %s.\n", argv[optind]);
+    return 1;
+  }
+  if ((hexes = calloc(n, sizeof(*hexes))) == NULL
+      || (sizes = calloc(n, sizeof(*sizes))) == NULL) {
+    fprintf(stderr, "Failed to allocate layers.\n");
+    goto out;
+  }
+
+  /* The boot program runs the app, as the boot manifest tells it. */
+  o = json_value_get_object(config);
+  if (o == NULL || (v = json_value_init_array()) == NULL
+      || json_array_append_string(json_array(v), argv[optind + 1])
+      || json_object_dotset_value(o, "config.Entrypoint", v)
+      || json_object_dotset_null(o, "config.Cmd")
+      || json_object_dotset_string(o, "config.User", "")
+      || json_object_dotset_string(o, "config.WorkingDir", "")
+      || json_object_set_value(o, "history", json_value_init_array())
+      || json_object_dotset_value(o, "rootfs.diff_ids",
+                                  json_value_init_array())
+      || (diff_ids = json_object_dotget_array(o, "rootfs.diff_ids")) == NULL) {
+    fprintf(stderr, "Failed to edit the image config.\n");
+    goto out;
+  }
+  if ((manifest = json_value_init_array()) == NULL
+      || json_array_append_value(json_array(manifest),
+                                 v = json_value_init_object())
+      || (m = json_value_get_object(v)) == NULL
+      || json_object_set_string(m, "Config", "")
+      || json_object_set_value(m, "RepoTags", json_value_init_array())
+      || (tag && json_array_append_string(json_object_get_array(m, "RepoTags"),
+                                          tag))
+      || json_object_set_value(m, "Layers", json_value_init_array())
+      || (layers = json_object_get_array(m, "Layers")) == NULL) {
+    fprintf(stderr, "Failed to make the image manifest.\n");
+    goto out;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    if (add_layer(dir, argv[optind + 3 + i], hexes[i], &sizes[i], name)) {
+      goto out;
+    }
+    snprintf(path, sizeof(path), "sha256:%s", hexes[i]);
+    if (json_array_append_string(diff_ids, path)
+        || json_array_append_string(layers, name + strlen(dir) + 1)) {
+      fprintf(stderr, "Failed to add a layer.\n");
+      goto out;
+    }
+  }
+  if (write_json_blob(config, dir, ".json", hex, &size)) {
+    goto out;
+  }
+  snprintf(name, sizeof(name), "%s.json", hex);
+  if (json_object_set_string(m, "Config", name)
+      || format_path(path, "%s/manifest.json", dir)
+      || json_serialize_to_file(manifest, path)) {
+    fprintf(stderr, "Failed to write the image manifest.\n");
+    goto out;
+  }
+  if (layout && write_layout(layout, dir, hex, size, hexes, sizes, n, tag)) {
+    goto out;
+  }
+  printf("config=sha256:%s layers=%zu\n", hex, n);
+  ret = 0;
+
+  out:
+    json_value_free(config);
+    json_value_free(manifest);
+    free(hexes);
+    free(sizes);
+    return ret;
+}
+
+/* The NSS modules an nsswitch.conf has the databases looked up in */
+static int add_nss_modules(struct elf_closure *c, const char *path)
+{
+  static const char *databases[] = { NSS_DATABASES };
+  char *line = NULL, *p, *tok, *save, lib[NAME_MAX + 1];
+  size_t cap = 0, len, found = 0;
+  FILE *fp;
+  int ret = 0;
+
+  if ((fp = fopen(path, "r")) == NULL && errno != ENOENT) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  while (fp && ret == 0 && getline(&line, &cap, fp) != -1) {
+    if ((p = strchr(line, '#')) != NULL) {
+      *p = '\0';
+    }
+    p = line + strspn(line, " \t");
+    for (size_t i = 0; i < sizeof(databases) / sizeof(*databases); i++) {
+      len = strlen(databases[i]);
+      if (strncmp(p, databases[i], len) || p[len] != ':') {
+        continue;
+      }
+      found++;
+      for (tok = strtok_r(p + len + 1, " \t\n", &save); tok && ret == 0;
+           tok = strtok_r(NULL, " \t\n", &save)) {
+        if (tok[0] == '[' || tok[strlen(tok) - 1] == ']') {
+          continue;             /* [NOTFOUND=return] */
+        }
+        snprintf(lib, sizeof(lib), "libnss_%s.so.2", tok);
+        /* Not found is built into libc, or not there at all. */
+        ret = elf_closure_add_lib(c, lib) < 0 ? -1 : 0;
+      }
+    }
+  }
+  free(line);
+  if (fp) {
+    fclose(fp);
+  }
+  if (ret == 0 && found == 0) {
+    snprintf(lib, sizeof(lib), "libnss_%s.so.2", NSS_DEFAULT);
+    ret = elf_closure_add_lib(c, lib) < 0 ? -1 : 0;
+  }
+
+  return ret;
+}
+
+/* Bytes of the files and symlinks under a directory */
+static int tree_size(const char *path, uint64_t *size)
+{
+  char sub[PATH_MAX];
+  struct dirent *de;
+  struct stat st;
+  DIR *d;
+  int ret = 0;
+
+  if ((d = opendir(path)) == NULL) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  while (ret == 0 && (de = readdir(d)) != NULL) {
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+      continue;
+    }
+    if (format_path(sub, "%s/%s", path, de->d_name) || lstat(sub, &st)) {
+      ret = -1;
+    } else if (S_ISDIR(st.st_mode)) {
+      ret = tree_size(sub, size);
+    } else if (S_ISREG(st.st_mode) || S_ISLNK(st.st_mode)) {
+      *size += st.st_size;
+    }
+  }
+  closedir(d);
+
+  return ret;
+}
+
+static int import_libs(int argc, char *argv[])
+{
+  const char *nsswitch = NULL, *rootfs;
+  struct elf_closure c;
+  uint64_t size = 0, total = 0;
+  int opt, threads = 0, ret = 1;
+
+  while ((opt = getopt(argc, argv, "j:n:")) != -1) {
+    switch (opt) {
+    case 'j': threads = atoi(optarg); break;
+    case 'n': nsswitch = optarg; break;
+    default: return -1;
+    }
+  }
+  if (optind > argc - 2) {
+    return -1;
+  }
+  rootfs = argv[optind];
+  if (elf_closure_init(&c)) {
+    return 1;
+  }
+  for (int i = optind + 1; i < argc; i++) {
+    if (elf_closure_add(&c, argv[i])) {
+      goto out;
+    }
+  }
+  if (nsswitch && add_nss_modules(&c, nsswitch)) {
+    goto out;
+  }
+  if (elf_install(&c, rootfs, threads) || tree_size(rootfs, &total)) {
+    goto out;
+  }
+  for (size_t i = 0; i < c.n; i++) {
+    size += c.libs[i].size;
+  }
+  printf("libs=%zu size=%llu rootfs=%llu\n", c.n, (unsigned long long)size,
+         (unsigned long long)total);
+  ret = 0;
+
+  out:
+    elf_closure_free(&c);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+  int ret;
+
+  if (argc >= 5 && strcmp(argv[1], "flatten") == 0
+      && (ret = flatten(argc - 1, argv + 1)) >= 0) {
+    return ret;
+  } else if (argc == 4 && strcmp(argv[1], "config") == 0) {
+    return dump_config(argv[2], argv[3]);
+  } else if (argc >= 5 && strcmp(argv[1], "convert") == 0
+             && (ret = convert(argc - 1, argv + 1)) >= 0) {
+    return ret;
+  } else if (argc >= 6 && strcmp(argv[1], "write") == 0
+             && (ret = write_image(argc - 1, argv + 1)) >= 0) {
+    return ret;
+  } else if (argc >= 4 && strcmp(argv[1], "libs") == 0
+             && (ret = import_libs(argc - 1, argv + 1)) >= 0) {
+    return ret;
+  }
+  usage(argv[0]);
+
+  return 1;
+}
@@ -0,0 +1,827 @@
+/*******************************************************************************
+ *
+ * iso.c
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "iso.h"
+
+/* ECMA-119 */
+#define SYSTEM_SECTORS  16
+#define RECORD_LEN      33      /* of a directory record, without its name */
+#define RECORD_MAX      255
+#define DIR_FLAG        0x02
+#define PATH_TABLE_SECTOR (SYSTEM_SECTORS + 2)
+#define DIRS_MAX        65535   /* numbered in 16 bits by path tables */
+
+/* SUSP and RRIP 1.09 */
+#define SU_MAX          (8 * 1024)      /* of a record, continued or not */
+#define SU_ENTRIES_MAX  64
+#define CE_LEN          28
+#define PX_LEN          36
+#define TF_LEN          26      /* modify, access and attributes times */
+#define PN_LEN          20
+#define NM_PIECE        250
+#define SL_LEN_MAX      255
+#define SL_PIECE        248
+#define RR_PX 0x01
+#define RR_PN 0x02
+#define RR_SL 0x04
+#define RR_NM 0x08
+#define RR_TF 0x80
+#define TF_MODIFY       0x02
+#define TF_ACCESS       0x04
+#define TF_ATTRIBUTES   0x08
+#define SL_CONTINUE     0x01
+#define SL_CURRENT      0x02
+#define SL_PARENT       0x04
+#define SL_ROOT         0x08
+
+#define ER_ID  "RRIP_1991A"
+#define ER_DES "THE ROCK RIDGE INTERCHANGE PROTOCOL PROVIDES SUPPORT FOR " \
+  "POSIX FILE SYSTEM SEMANTICS"
+#define ER_SRC "PLEASE CONTACT DISC PUBLISHER FOR SPECIFICATION SOURCE.  " \
+  "SEE PUBLISHER IDENTIFIER IN PRIMARY VOLUME DESCRIPTOR FOR CONTACT "  \
+  "INFORMATION."
+
+#define COPY_BUF_SIZE (256 * 1024)
+
+struct buf {
+  uint8_t *p;
+  size_t len, cap;
+};
+
+/* System use entries of a record, before they're placed */
+struct su {
+  uint8_t data[SU_MAX];
+  size_t len;
+  size_t ends[SU_ENTRIES_MAX];
+  size_t n;
+};
+
+/* Writing directories and continuation areas, at their sectors or not */
+struct emit {
+  struct buf dirs, pool;
+  uint32_t pool_sector;
+};
+
+static int grow(struct buf *b, size_t len)
+{
+  uint8_t *p;
+  size_t cap;
+
+  if (b->len + len <= b->cap) {
+    return 0;
+  }
+  for (cap = b->cap ? b->cap : 64 * 1024; cap < b->len + len; cap *= 2) {
+  }
+  if ((p = realloc(b->p, cap)) == NULL) {
+    fprintf(stderr, "Failed to allocate image metadata.\n");
+    return -1;
+  }
+  memset(p + b->cap, 0, cap - b->cap);
+  b->p = p;
+  b->cap = cap;
+
+  return 0;
+}
+
+/* Room for len bytes not crossing a sector, from where it's returned */
+static int reserve(struct buf *b, size_t len, size_t *at)
+{
+  size_t used = b->len % ISO_SECTOR_SIZE;
+
+  if (used && used + len > ISO_SECTOR_SIZE) {
+    b->len += ISO_SECTOR_SIZE - used;
+  }
+  if (grow(b, len)) {
+    return -1;
+  }
+  *at = b->len;
+  b->len += len;
+
+  return 0;
+}
+
+static void pad_sector(struct buf *b)
+{
+  size_t used = b->len % ISO_SECTOR_SIZE;
+
+  if (used) {
+    b->len += ISO_SECTOR_SIZE - used;
+  }
+}
+
+/* Numbers in both byte orders (7.2.3, 7.3.3), and in one */
+static void put_both16(uint8_t *p, uint16_t v)
+{
+  p[0] = p[3] = v & 0xff;
+  p[1] = p[2] = v >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+  for (int i = 0; i < 4; i++) {
+    p[i] = v >> (8 * i);
+  }
+}
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+  for (int i = 0; i < 4; i++) {
+    p[3 - i] = v >> (8 * i);
+  }
+}
+
+static void put_both32(uint8_t *p, uint32_t v)
+{
+  put_le32(p, v);
+  put_be32(p + 4, v);
+}
+
+/* Seven-byte date (9.1.5), clamped to the years it holds */
+static void put_date(uint8_t *p, const struct timespec *ts)
+{
+  struct tm tm;
+  time_t t = ts->tv_sec;
+
+  if (gmtime_r(&t, &tm) == NULL || tm.tm_year < 0) {
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_mday = 1;
+  } else if (tm.tm_year > 255) {
+    tm.tm_year = 255;
+    tm.tm_mon = 11;
+    tm.tm_mday = 31;
+    tm.tm_hour = 23;
+    tm.tm_min = tm.tm_sec = 59;
+  }
+  p[0] = tm.tm_year;
+  p[1] = tm.tm_mon + 1;
+  p[2] = tm.tm_mday;
+  p[3] = tm.tm_hour;
+  p[4] = tm.tm_min;
+  p[5] = tm.tm_sec > 59 ? 59 : tm.tm_sec;
+  p[6] = 0;                     /* GMT */
+}
+
+static uint8_t *su_add(struct su *su, const char sig[2], size_t len)
+{
+  uint8_t *p;
+
+  if (su->len + len > SU_MAX || su->n == SU_ENTRIES_MAX) {
+    return NULL;
+  }
+  p = su->data + su->len;
+  p[0] = sig[0];
+  p[1] = sig[1];
+  p[2] = len;
+  p[3] = 1;                     /* version */
+  su->len += len;
+  su->ends[su->n++] = su->len;
+
+  return p;
+}
+
+static mode_t file_type(const struct fs_inode *ino)
+{
+  switch (ino->type) {
+  case TAR_DIR:     return S_IFDIR;
+  case TAR_SYMLINK: return S_IFLNK;
+  case TAR_CHR:     return S_IFCHR;
+  case TAR_BLK:     return S_IFBLK;
+  case TAR_FIFO:    return S_IFIFO;
+  default:          return S_IFREG;
+  }
+}
+
+static uint32_t subdirs(const struct fs_node *dir)
+{
+  uint32_t n = 0;
+
+  for (size_t i = 0; i < dir->nchildren; i++) {
+    n += dir->children[i]->inode->type == TAR_DIR;
+  }
+
+  return n;
+}
+
+/* Name, split as NM entries hold it */
+static int su_name(struct su *su, const char *name)
+{
+  size_t len = strlen(name), n;
+  uint8_t *p;
+
+  do {
+    n = len < NM_PIECE ? len : NM_PIECE;
+    if ((p = su_add(su, "NM", 5 + n)) == NULL) {
+      return -1;
+    }
+    p[4] = len > n;             /* continued */
+    memcpy(p + 5, name, n);
+    name += n;
+    len -= n;
+  } while (len > 0);
+
+  return 0;
+}
+
+/* Component of a symlink target, in pieces if it's long */
+static int sl_component(struct su *su, uint8_t **sl, uint8_t flags,
+                        const char *p, size_t len)
+{
+  size_t n;
+
+  do {
+    n = len < SL_PIECE ? len : SL_PIECE;
+    if (*sl == NULL || (*sl)[2] + 2 + n > SL_LEN_MAX) {
+      if (*sl) {
+        (*sl)[4] |= SL_CONTINUE;
+      }
+      if ((*sl = su_add(su, "SL", 5)) == NULL) {
+        return -1;
+      }
+      (*sl)[4] = 0;
+    }
+    if (su->len + 2 + n > SU_MAX) {
+      return -1;
+    }
+    (*sl)[(*sl)[2]] = flags | (len > n ? SL_CONTINUE : 0);
+    (*sl)[(*sl)[2] + 1] = n;
+    memcpy(*sl + (*sl)[2] + 2, p, n);
+    (*sl)[2] += 2 + n;
+    su->len += 2 + n;
+    su->ends[su->n - 1] = su->len;
+    p += n;
+    len -= n;
+  } while (len > 0);
+
+  return 0;
+}
+
+/* Symlink target as components of SL entries, continued as they fill */
+static int su_symlink(struct su *su, const char *target)
+{
+  const char *p = target;
+  uint8_t *sl = NULL, flags;
+  size_t len;
+
+  if (*p == '/' && sl_component(su, &sl, SL_ROOT, p, 0)) {
+    return -1;
+  }
+  for (;; p += len) {
+    for (; *p == '/'; p++) {
+    }
+    if (*p == '\0') {
+      break;
+    }
+    len = strcspn(p, "/");
+    flags = 0;
+    if (len == 1 && p[0] == '.') {
+      flags = SL_CURRENT;
+    } else if (len == 2 && p[0] == '.' && p[1] == '.') {
+      flags = SL_PARENT;
+    }
+    if (sl_component(su, &sl, flags, p, flags ? 0 : len)) {
+      return -1;
+    }
+  }
+  if (sl == NULL && su_add(su, "SL", 5) == NULL) {
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Rock Ridge entries of a node, named unless it's "." or ".." */
+static int su_entries(struct su *su, const struct fs_node *n,
+                      const char *name)
+{
+  const struct fs_inode *ino = n->inode;
+  uint8_t *rr, *p;
+
+  if ((rr = su_add(su, "RR", 5)) == NULL
+      || (p = su_add(su, "PX", PX_LEN)) == NULL) {
+    return -1;
+  }
+  rr[4] = RR_PX | RR_TF;
+  put_both32(p + 4, file_type(ino) | (ino->mode & 07777));
+  put_both32(p + 12, ino->type == TAR_DIR ? 2 + subdirs(n) : ino->nlink);
+  put_both32(p + 20, ino->uid);
+  put_both32(p + 28, ino->gid);
+  if ((p = su_add(su, "TF", TF_LEN)) == NULL) {
+    return -1;
+  }
+  p[4] = TF_MODIFY | TF_ACCESS | TF_ATTRIBUTES;
+  for (int i = 0; i < 3; i++) {
+    put_date(p + 5 + i * 7, &ino->mtime);
+  }
+  if (ino->type == TAR_CHR || ino->type == TAR_BLK) {
+    if ((p = su_add(su, "PN", PN_LEN)) == NULL) {
+      return -1;
+    }
+    rr[4] |= RR_PN;
+    put_both32(p + 4, ino->devmajor);
+    put_both32(p + 12, ino->devminor);
+  }
+  if (name) {
+    rr[4] |= RR_NM;
+    if (su_name(su, name)) {
+      return -1;
+    }
+  }
+  if (ino->type == TAR_SYMLINK) {
+    rr[4] |= RR_SL;
+    if (su_symlink(su, ino->link)) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static void put_ce(uint8_t *p, uint32_t sector, uint32_t offset, uint32_t len)
+{
+  p[0] = 'C';
+  p[1] = 'E';
+  p[2] = CE_LEN;
+  p[3] = 1;
+  put_both32(p + 4, sector);
+  put_both32(p + 12, offset);
+  put_both32(p + 20, len);
+}
+
+/* Entries from first on which fit in cap bytes, leaving room for a CE */
+static size_t fit(const struct su *su, size_t first, size_t cap, int *more)
+{
+  size_t start = first ? su->ends[first - 1] : 0, k = first;
+
+  *more = 0;
+  if (su->len - start <= cap) {
+    return su->n;
+  }
+  while (k < su->n && su->ends[k] - start + CE_LEN <= cap) {
+    k++;
+  }
+  *more = 1;
+
+  return k;
+}
+
+/*
+ * Place entries in the system use area of a record (at, of cap bytes), and
+ * those which don't fit in continuation areas, each within a sector.
+ */
+static int place(struct emit *em, const struct su *su, uint8_t *at,
+                 size_t cap, size_t *used)
+{
+  size_t first, k, start, len, off, ce_off = 0;
+  uint8_t *ce;
+  int more, pooled = 0;
+
+  k = fit(su, 0, cap, &more);
+  len = k ? su->ends[k - 1] : 0;
+  memcpy(at, su->data, len);
+  *used = len + (more ? CE_LEN : 0);
+  ce = at + len;
+  while (more) {
+    first = k;
+    start = first ? su->ends[first - 1] : 0;
+    k = fit(su, first, ISO_SECTOR_SIZE, &more);
+    len = su->ends[k - 1] - start;
+    if (reserve(&em->pool, len + (more ? CE_LEN : 0), &off)) {
+      return -1;
+    }
+    if (pooled) {
+      ce = em->pool.p + ce_off; /* the pool may have moved */
+    }
+    put_ce(ce, em->pool_sector + off / ISO_SECTOR_SIZE,
+           off % ISO_SECTOR_SIZE, len + (more ? CE_LEN : 0));
+    memcpy(em->pool.p + off, su->data + start, len);
+    ce_off = off + len;
+    pooled = 1;
+  }
+
+  return 0;
+}
+
+/* Record header (9.1) with its identifier; len includes system use. */
+static void put_header(uint8_t *rec, size_t len, const struct fs_node *n,
+                       const char *id, size_t idlen)
+{
+  const struct fs_inode *ino = n->inode;
+
+  memset(rec, 0, RECORD_LEN);
+  rec[0] = len;
+  if (ino->type == TAR_DIR) {
+    put_both32(rec + 2, n->extent);
+    put_both32(rec + 10, n->size);
+    rec[25] = DIR_FLAG;
+  } else if (ino->type == TAR_REG) {
+    put_both32(rec + 2, ino->size ? ino->extent : 0);
+    put_both32(rec + 10, ino->size);
+  }
+  put_date(rec + 18, &ino->mtime);
+  put_both16(rec + 28, 1);      /* volume sequence number */
+  rec[32] = idlen;
+  memcpy(rec + RECORD_LEN, id, idlen);
+  if ((idlen & 1) == 0) {
+    rec[RECORD_LEN + idlen] = 0;
+  }
+}
+
+/* Append the record of n, named id, with its system use entries. */
+static int put_record(struct emit *em, const struct fs_node *n,
+                      const char *id, size_t idlen, const struct su *su)
+{
+  uint8_t rec[RECORD_MAX];
+  size_t base = RECORD_LEN + idlen + !(idlen & 1), used, len, off;
+
+  /* Records are of an even length, up to 254 bytes then. */
+  if (place(em, su, rec + base, (RECORD_MAX & ~1) - base, &used)) {
+    return -1;
+  }
+  len = base + used;
+  len += len & 1;
+  put_header(rec, len, n, id, idlen);
+  if (len > base + used) {
+    rec[len - 1] = 0;
+  }
+  if (reserve(&em->dirs, len, &off)) {
+    return -1;
+  }
+  memcpy(em->dirs.p + off, rec, len);
+
+  return 0;
+}
+
+/* ISO 9660 name of the i-th entry of a directory, a counter */
+static size_t iso_name(const struct fs_node *n, size_t i, char *id)
+{
+  return sprintf(id, n->inode->type == TAR_DIR ? "%08zX" : "%08zX.;1",
+                 i + 1);
+}
+
+static int root_entries(struct su *su, const struct fs_node *root)
+{
+  uint8_t *p;
+  size_t id = strlen(ER_ID), des = strlen(ER_DES), src = strlen(ER_SRC);
+
+  /* SP first of all, telling SUSP is used */
+  if ((p = su_add(su, "SP", 7)) == NULL) {
+    return -1;
+  }
+  p[4] = 0xbe;
+  p[5] = 0xef;
+  p[6] = 0;
+  if (su_entries(su, root, NULL)
+      || (p = su_add(su, "ER", 8 + id + des + src)) == NULL) {
+    return -1;
+  }
+  p[4] = id;
+  p[5] = des;
+  p[6] = src;
+  p[7] = 1;
+  memcpy(p + 8, ER_ID, id);
+  memcpy(p + 8 + id, ER_DES, des);
+  memcpy(p + 8 + id + des, ER_SRC, src);
+
+  return 0;
+}
+
+/* The records of a directory, which start on a sector and fill the last */
+static int emit_dir(struct emit *em, struct fs_node *dir, struct su *su)
+{
+  const struct fs_node *parent = dir->parent ? dir->parent : dir, *n;
+  size_t start, idlen;
+  char id[32];
+  int ret;
+
+  pad_sector(&em->dirs);
+  start = em->dirs.len;
+  su->len = su->n = 0;
+  ret = dir->parent ? su_entries(su, dir, NULL) : root_entries(su, dir);
+  if (ret || put_record(em, dir, "\0", 1, su)) {
+    return -1;
+  }
+  su->len = su->n = 0;
+  if (su_entries(su, parent, NULL) || put_record(em, parent, "\1", 1, su)) {
+    return -1;
+  }
+  for (size_t i = 0; i < dir->nchildren; i++) {
+    n = dir->children[i];
+    idlen = iso_name(n, i, id);
+    su->len = su->n = 0;
+    if (su_entries(su, n, n->name)) {
+      fprintf(stderr, "Too long a name or symlink target: %s\n", n->name);
+      return -1;
+    }
+    if (put_record(em, n, id, idlen, su)) {
+      return -1;
+    }
+  }
+  pad_sector(&em->dirs);
+  if (grow(&em->dirs, 0)) {
+    return -1;
+  }
+  dir->size = em->dirs.len - start;
+
+  return 0;
+}
+
+static int emit_dirs(struct emit *em, const struct iso *iso)
+{
+  struct su *su;
+  int ret = 0;
+
+  if ((su = malloc(sizeof(*su))) == NULL) {
+    fprintf(stderr, "Failed to allocate image metadata.\n");
+    return -1;
+  }
+  for (size_t i = 0; ret == 0 && i < iso->ndirs; i++) {
+    ret = emit_dir(em, iso->dirs[i], su);
+  }
+  free(su);
+
+  return ret;
+}
+
+static void put_path_entry(uint8_t *l, uint8_t *m, const char *id,
+                           size_t idlen, uint32_t extent, uint32_t parent)
+{
+  if (parent > DIRS_MAX) {
+    parent = DIRS_MAX;          /* which the kernel doesn't read anyway */
+  }
+  l[0] = m[0] = idlen;
+  put_le32(l + 2, extent);
+  put_be32(m + 2, extent);
+  l[6] = m[7] = parent & 0xff;
+  l[7] = m[6] = parent >> 8;
+  memcpy(l + 8, id, idlen);
+  memcpy(m + 8, id, idlen);
+}
+
+/* Path tables (9.4), of directories in the order they're numbered */
+static size_t put_path_tables(const struct iso *iso, uint8_t *l, uint8_t *m)
+{
+  const struct fs_node *dir, *n;
+  size_t len = 0, idlen;
+  char id[32];
+
+  if (l) {
+    put_path_entry(l, m, "\0", 1, iso->dirs[0]->extent, 1);
+  }
+  len = 10;
+  for (size_t k = 0; k < iso->ndirs; k++) {
+    dir = iso->dirs[k];
+    for (size_t i = 0; i < dir->nchildren; i++) {
+      n = dir->children[i];
+      if (n->inode->type != TAR_DIR) {
+        continue;
+      }
+      idlen = iso_name(n, i, id);
+      if (l) {
+        put_path_entry(l + len, m + len, id, idlen, n->extent, dir->number);
+      }
+      len += 8 + idlen + (idlen & 1);
+    }
+  }
+
+  return len;
+}
+
+static void put_pvd(const struct iso *iso, uint8_t *p, size_t pt_len,
+                    uint32_t pt_sectors)
+{
+  memset(p, ' ', ISO_SECTOR_SIZE);
+  memset(p, 0, 8);
+  p[0] = 1;
+  memcpy(p + 1, "CD001", 5);
+  p[6] = 1;
+  memcpy(p + 8, "LINUX", 5);
+  memcpy(p + 40, "ROOTFS", 6);
+  memset(p + 72, 0, 8);
+  put_both32(p + 80, iso->size / ISO_SECTOR_SIZE);
+  memset(p + 88, 0, 32);
+  put_both16(p + 120, 1);       /* volume set size */
+  put_both16(p + 124, 1);       /* volume sequence number */
+  put_both16(p + 128, ISO_SECTOR_SIZE);
+  put_both32(p + 132, pt_len);
+  put_le32(p + 140, PATH_TABLE_SECTOR);
+  put_le32(p + 144, 0);
+  put_be32(p + 148, PATH_TABLE_SECTOR + pt_sectors);
+  put_be32(p + 152, 0);
+  put_header(p + 156, 34, iso->dirs[0], "\0", 1);
+  /* Dates left unspecified, so that the image only depends on the tree */
+  for (int i = 0; i < 4; i++) {
+    memset(p + 813 + i * 17, '0', 16);
+    p[813 + i * 17 + 16] = 0;
+  }
+  p[881] = 1;                   /* file structure version */
+  memset(p + 882, 0, ISO_SECTOR_SIZE - 882);
+}
+
+static int data_order(const void *a, const void *b)
+{
+  const struct fs_inode *x = *(struct fs_inode *const *)a;
+  const struct fs_inode *y = *(struct fs_inode *const *)b;
+
+  if (x->layer != y->layer) {
+    return x->layer < y->layer ? -1 : 1;
+  }
+
+  return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/* Directories numbered breadth first, and files with data, each once */
+static int collect(struct iso *iso, struct fstree *t)
+{
+  struct fs_node *dir, *n;
+  struct fs_inode *ino;
+
+  iso->dirs = malloc(t->dirs * sizeof(struct fs_node *));
+  iso->files = malloc((t->files ? t->files : 1) * sizeof(struct fs_inode *));
+  if (iso->dirs == NULL || iso->files == NULL) {
+    fprintf(stderr, "Failed to allocate image metadata.\n");
+    return -1;
+  }
+  iso->dirs[iso->ndirs++] = t->root;
+  t->root->number = 1;
+  for (size_t k = 0; k < iso->ndirs; k++) {
+    dir = iso->dirs[k];
+    for (size_t i = 0; i < dir->nchildren; i++) {
+      n = dir->children[i];
+      ino = n->inode;
+      if (ino->type == TAR_DIR) {
+        iso->dirs[iso->ndirs++] = n;
+        n->number = iso->ndirs;
+      } else if (ino->type == TAR_REG && ino->size > 0 && ino->extent == 0) {
+        if (ino->size > UINT32_MAX) {
+          fprintf(stderr, "%s is too large for the image (4 GiB or more).\n",
+                  n->name);
+          return -1;
+        }
+        ino->extent = UINT32_MAX;       /* taken */
+        iso->files[iso->nfiles++] = ino;
+      }
+    }
+  }
+  qsort(iso->files, iso->nfiles, sizeof(struct fs_inode *), data_order);
+
+  return 0;
+}
+
+int iso_layout(struct iso *iso, struct fstree *t)
+{
+  struct emit em;
+  size_t pt_len, dirs_len, pool_len;
+  uint32_t pt_sectors, sector;
+  int ret = -1;
+
+  memset(iso, 0, sizeof(*iso));
+  memset(&em, 0, sizeof(em));
+  if (collect(iso, t)) {
+    goto out;
+  }
+  pt_len = put_path_tables(iso, NULL, NULL);
+  pt_sectors = (pt_len + ISO_SECTOR_SIZE - 1) / ISO_SECTOR_SIZE;
+
+  /* Sizes first, which don't depend on where things are */
+  if (emit_dirs(&em, iso)) {
+    goto out;
+  }
+  sector = PATH_TABLE_SECTOR + pt_sectors * 2;
+  for (size_t i = 0; i < iso->ndirs; i++) {
+    iso->dirs[i]->extent = sector;
+    sector += iso->dirs[i]->size / ISO_SECTOR_SIZE;
+  }
+  dirs_len = em.dirs.len;
+  pool_len = em.pool.len;
+  em.pool_sector = sector;
+  sector += (pool_len + ISO_SECTOR_SIZE - 1) / ISO_SECTOR_SIZE;
+  for (size_t i = 0; i < iso->nfiles; i++) {
+    if (sector > UINT32_MAX - iso->files[i]->size / ISO_SECTOR_SIZE - 1) {
+      fprintf(stderr, "Too large a rootfs for an image.\n");
+      goto out;
+    }
+    iso->files[i]->extent = sector;
+    sector += (iso->files[i]->size + ISO_SECTOR_SIZE - 1) / ISO_SECTOR_SIZE;
+  }
+  iso->size = (uint64_t)sector * ISO_SECTOR_SIZE;
+
+  /* Then the records, now that they know where things are */
+  memset(em.dirs.p, 0, em.dirs.cap);
+  memset(em.pool.p, 0, em.pool.cap);
+  em.dirs.len = em.pool.len = 0;
+  if (emit_dirs(&em, iso)) {
+    goto out;
+  }
+  if (em.dirs.len != dirs_len || em.pool.len != pool_len) {
+    fprintf(stderr, "Image metadata changed size while laid out.\n");
+    goto out;
+  }
+
+  iso->meta_len = (uint64_t)iso->dirs[0]->extent * ISO_SECTOR_SIZE
+    + dirs_len + (pool_len + ISO_SECTOR_SIZE - 1) / ISO_SECTOR_SIZE
+    * ISO_SECTOR_SIZE;
+  if ((iso->meta = calloc(1, iso->meta_len)) == NULL) {
+    fprintf(stderr, "Failed to allocate image metadata.\n");
+    goto out;
+  }
+  put_pvd(iso, iso->meta + SYSTEM_SECTORS * ISO_SECTOR_SIZE, pt_len,
+          pt_sectors);
+  iso->meta[(SYSTEM_SECTORS + 1) * ISO_SECTOR_SIZE] = 255;    /* terminator */
+  memcpy(iso->meta + (SYSTEM_SECTORS + 1) * ISO_SECTOR_SIZE + 1, "CD001", 5);
+  iso->meta[(SYSTEM_SECTORS + 1) * ISO_SECTOR_SIZE + 6] = 1;
+  put_path_tables(iso, iso->meta + PATH_TABLE_SECTOR * ISO_SECTOR_SIZE,
+                  iso->meta + (PATH_TABLE_SECTOR + pt_sectors)
+                  * ISO_SECTOR_SIZE);
+  memcpy(iso->meta + (uint64_t)iso->dirs[0]->extent * ISO_SECTOR_SIZE,
+         em.dirs.p, dirs_len);
+  if (pool_len) {
+    memcpy(iso->meta + (uint64_t)em.pool_sector * ISO_SECTOR_SIZE, em.pool.p,
+           pool_len);
+  }
+  ret = 0;
+
+  out:
+    free(em.dirs.p);
+    free(em.pool.p);
+    if (ret) {
+      iso_free(iso);
+    }
+    return ret;
+}
+
+int iso_write(const struct iso *iso, const struct blob *layers,
+              int (*out)(void *arg, const void *data, size_t len),
+              int (*cut)(void *arg, uint64_t size), void *arg)
+{
+  static const uint8_t zeros[ISO_SECTOR_SIZE];
+  const struct fs_inode *ino;
+  struct blob_reader r;
+  uint64_t left;
+  uint8_t *buf;
+  size_t k = 0, layer, pad;
+  ssize_t n;
+  int ret = -1;
+
+  if ((buf = malloc(COPY_BUF_SIZE)) == NULL) {
+    fprintf(stderr, "Failed to allocate a copy buffer.\n");
+    return -1;
+  }
+  if (out(arg, iso->meta, iso->meta_len)) {
+    goto out;
+  }
+  while (k < iso->nfiles) {
+    layer = iso->files[k]->layer;
+    if (blob_reader_open(&r, &layers[layer])) {
+      goto out;
+    }
+    for (; k < iso->nfiles && iso->files[k]->layer == layer; k++) {
+      ino = iso->files[k];
+      if (blob_read_full(&r, NULL, ino->offset - r.out)
+          || (cut && cut(arg, ino->size))) {
+        goto close;
+      }
+      for (left = ino->size; left > 0; left -= n) {
+        n = blob_read(&r, buf, left < COPY_BUF_SIZE ? left : COPY_BUF_SIZE);
+        if (n <= 0) {
+          fprintf(stderr, "Layer %zu ends in a file.\n", layer);
+          goto close;
+        }
+        if (out(arg, buf, n)) {
+          goto close;
+        }
+      }
+      pad = (ISO_SECTOR_SIZE - ino->size % ISO_SECTOR_SIZE) % ISO_SECTOR_SIZE;
+      if ((pad && out(arg, zeros, pad)) || (cut && cut(arg, ino->size))) {
+        goto close;
+      }
+    }
+    blob_reader_close(&r);
+  }
+  ret = 0;
+  goto out;
+
+  close:
+    blob_reader_close(&r);
+  out:
+    free(buf);
+    return ret;
+}
+
+void iso_free(struct iso *iso)
+{
+  free(iso->dirs);
+  free(iso->files);
+  free(iso->meta);
+  memset(iso, 0, sizeof(*iso));
+}
@@ -0,0 +1,52 @@
+/*******************************************************************************
+ *
+ * iso.h
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#ifndef BOOTFS_ISO_H
+#define BOOTFS_ISO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "fstree.h"
+#include "image.h"
+
+#define ISO_SECTOR_SIZE 2048
+
+/*
+ * An ISO 9660 image of a rootfs tree with Rock Ridge (RRIP 1.09)
+ * extensions, as "genisoimage -R" would write it for the kernel's isofs:
+ * names, modes, owners, times, symlinks and device numbers are Rock Ridge
+ * entries, and the ISO 9660 names are just counters. Everything but the
+ * data of files (descriptors, path tables, directories and continuation
+ * areas) is laid out first, in memory. The data of files follows in the
+ * order of layers and of files in them, so that it's written out reading
+ * each layer once.
+ */
+struct iso {
+  struct fs_node **dirs;        /* in the order of the path tables */
+  size_t ndirs;
+  struct fs_inode **files;      /* with data, in the order of the data */
+  size_t nfiles;
+  uint8_t *meta;                /* the image up to the data */
+  size_t meta_len;
+  uint64_t size;
+};
+
+int iso_layout(struct iso *iso, struct fstree *t);
+
+/*
+ * Write the image, reading the data of files from layers, to out. If cut
+ * isn't NULL, it's called with the size of each file where its data starts
+ * and where its last sector ends.
+ */
+int iso_write(const struct iso *iso, const struct blob *layers,
+              int (*out)(void *arg, const void *data, size_t len),
+              int (*cut)(void *arg, uint64_t size), void *arg);
+
+void iso_free(struct iso *iso);
+
+#endif
@@ -0,0 +1,629 @@
+/*******************************************************************************
+ *
+ * layer.c
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#include "layer.h"
+#include "tar.h"
+
+#define COPY_BUF_SIZE (256 * 1024)
+#define DIR_DEPTH_MAX 256
+#define SYMLINKS_MAX  40        /* as the kernel's */
+
+/* Paths written by the layer being applied, which opaque whiteouts keep */
+struct pathset {
+  char **slots;
+  size_t mask, n;
+};
+
+struct dir_time {
+  char *path;
+  struct timespec mtime;
+};
+
+struct layer_applier {
+  int rootfd;
+  int owners;
+  int warned;
+  char *cached;                 /* directory of the last entry */
+  int cached_fd;
+  struct pathset written;
+  struct dir_time *dirs;        /* mtimes to set once the layer is done */
+  size_t ndirs, dirs_cap;
+  uint8_t *buf;
+};
+
+static size_t str_hash(const char *s)
+{
+  size_t h = 14695981039346656037ULL;
+
+  for (; *s; s++) {
+    h = (h ^ (uint8_t)*s) * 1099511628211ULL;
+  }
+
+  return h;
+}
+
+static int pathset_has(const struct pathset *s, const char *path)
+{
+  size_t i;
+
+  if (s->slots == NULL) {
+    return 0;
+  }
+  for (i = str_hash(path) & s->mask; s->slots[i]; i = (i + 1) & s->mask) {
+    if (strcmp(s->slots[i], path) == 0) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static int pathset_add(struct pathset *s, const char *path)
+{
+  char **old = s->slots, *dup;
+  size_t cap = s->mask + 1, i;
+
+  if (old == NULL || (s->n + 1) * 2 > cap) {
+    cap = old ? cap * 2 : 1024;
+    if ((s->slots = calloc(cap, sizeof(char *))) == NULL) {
+      s->slots = old;
+      fprintf(stderr, "Failed to allocate the layer's paths.\n");
+      return -1;
+    }
+    s->mask = cap - 1;
+    for (size_t j = 0; old && j < cap / 2; j++) {
+      if (old[j]) {
+        for (i = str_hash(old[j]) & s->mask; s->slots[i];
+             i = (i + 1) & s->mask) {
+        }
+        s->slots[i] = old[j];
+      }
+    }
+    free(old);
+  }
+  if ((dup = strdup(path)) == NULL) {
+    fprintf(stderr, "Failed to allocate the layer's paths.\n");
+    return -1;
+  }
+  for (i = str_hash(path) & s->mask; s->slots[i]; i = (i + 1) & s->mask) {
+  }
+  s->slots[i] = dup;
+  s->n++;
+
+  return 0;
+}
+
+/* A path and the directories it's in, which it keeps too */
+static int add_written(struct layer_applier *a, const char *path)
+{
+  char buf[PATH_MAX], *slash;
+
+  snprintf(buf, sizeof(buf), "%s", path);
+  while (!pathset_has(&a->written, buf)) {
+    if (pathset_add(&a->written, buf)) {
+      return -1;
+    }
+    if ((slash = strrchr(buf, '/')) == NULL) {
+      break;
+    }
+    *slash = '\0';
+  }
+
+  return 0;
+}
+
+static void pathset_free(struct pathset *s)
+{
+  for (size_t i = 0; s->slots && i <= s->mask; i++) {
+    free(s->slots[i]);
+  }
+  free(s->slots);
+  memset(s, 0, sizeof(*s));
+}
+
+int layer_normalize(const char *path, char *out, size_t len)
+{
+  const char *p = path, *end;
+  size_t n = 0, l;
+
+  while (*p) {
+    for (; *p == '/'; p++) {
+    }
+    end = strchrnul(p, '/');
+    l = end - p;
+    if (l == 2 && p[0] == '.' && p[1] == '.') {
+      return -1;
+    }
+    if (l > 0 && !(l == 1 && p[0] == '.')) {
+      if (n + l + 2 > len) {
+        return -1;
+      }
+      if (n) {
+        out[n++] = '/';
+      }
+      memcpy(out + n, p, l);
+      n += l;
+    }
+    p = end;
+  }
+  out[n] = '\0';
+
+  return 0;
+}
+
+/*
+ * Directory at path in the rootfs, made if create is set. Symlinks on the
+ * way are followed as if rootfs were the root.
+ */
+static int resolve_dir(int rootfd, const char *path, int create)
+{
+  int stack[DIR_DEPTH_MAX], top = 0, links = 0, fd = -1;
+  char work[PATH_MAX], next[PATH_MAX], target[PATH_MAX];
+  char *p = work, *comp, *end;
+  ssize_t n;
+
+  stack[0] = rootfd;
+  if (snprintf(work, sizeof(work), "%s", path) >= (int)sizeof(work)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  while (*p) {
+    comp = p;
+    if ((end = strchr(p, '/'))) {
+      *end = '\0';
+      p = end + 1;
+    } else {
+      p += strlen(p);
+    }
+    if (comp[0] == '\0' || strcmp(comp, ".") == 0) {
+      continue;
+    }
+    if (strcmp(comp, "..") == 0) {
+      if (top > 0) {
+        close(stack[top--]);
+      }
+      continue;
+    }
+    fd = openat(stack[top], comp, O_RDONLY | O_DIRECTORY | O_NOFOLLOW
+                | O_CLOEXEC);
+    if (fd < 0 && errno == ENOENT && create) {
+      if (mkdirat(stack[top], comp, 0755) && errno != EEXIST) {
+        goto error;
+      }
+      fd = openat(stack[top], comp, O_RDONLY | O_DIRECTORY | O_NOFOLLOW
+                  | O_CLOEXEC);
+    }
+    if (fd < 0 && (errno == ELOOP || errno == ENOTDIR)) {
+      if ((n = readlinkat(stack[top], comp, target, sizeof(target) - 1)) < 0
+          || ++links > SYMLINKS_MAX) {
+        errno = n < 0 ? ENOTDIR : ELOOP;
+        goto error;
+      }
+      target[n] = '\0';
+      if (snprintf(next, sizeof(next), "%s/%s", target, p)
+          >= (int)sizeof(next)) {
+        errno = ENAMETOOLONG;
+        goto error;
+      }
+      strcpy(work, next);
+      p = work;
+      if (target[0] == '/') {
+        for (; top > 0; top--) {
+          close(stack[top]);
+        }
+      }
+      continue;
+    }
+    if (fd < 0) {
+      goto error;
+    }
+    if (top + 1 == DIR_DEPTH_MAX) {
+      close(fd);
+      errno = ENAMETOOLONG;
+      goto error;
+    }
+    stack[++top] = fd;
+  }
+  fd = top ? stack[top] : dup(rootfd);
+  for (; top > 1; top--) {
+    close(stack[top - 1]);
+  }
+
+  return fd;
+
+  error:
+    for (; top > 0; top--) {
+      close(stack[top]);
+    }
+    return -1;
+}
+
+/* Cached, as entries come directory by directory; not to be closed. */
+static int open_dir(struct layer_applier *a, const char *path, int create)
+{
+  int fd;
+
+  if (a->cached && strcmp(a->cached, path) == 0) {
+    return a->cached_fd;
+  }
+  if ((fd = resolve_dir(a->rootfd, path, create)) < 0) {
+    return -1;
+  }
+  if (a->cached) {
+    close(a->cached_fd);
+    free(a->cached);
+  }
+  if ((a->cached = strdup(path)) == NULL) {
+    close(fd);
+    errno = ENOMEM;
+    return -1;
+  }
+  a->cached_fd = fd;
+
+  return fd;
+}
+
+/* Remove name (a whole tree for a directory) if it's there. */
+static int remove_at(int dfd, const char *name)
+{
+  struct stat st;
+  struct dirent *de;
+  DIR *d;
+  int fd, ret = 0;
+
+  if (fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW)) {
+    return errno == ENOENT ? 0 : -1;
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    return unlinkat(dfd, name, 0);
+  }
+  if ((fd = openat(dfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW
+                   | O_CLOEXEC)) < 0 || (d = fdopendir(fd)) == NULL) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  while (ret == 0 && (de = readdir(d))) {
+    if (strcmp(de->d_name, ".") && strcmp(de->d_name, "..")) {
+      ret = remove_at(dirfd(d), de->d_name);
+    }
+  }
+  closedir(d);
+
+  return ret ? ret : unlinkat(dfd, name, AT_REMOVEDIR);
+}
+
+/* Everything in dir which this layer didn't write */
+static int remove_lower(struct layer_applier *a, const char *dir, int dfd)
+{
+  struct dirent *de;
+  char path[PATH_MAX];
+  DIR *d;
+  int fd, ret = 0;
+
+  if ((fd = dup(dfd)) < 0 || (d = fdopendir(fd)) == NULL) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  rewinddir(d);
+  while (ret == 0 && (de = readdir(d))) {
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+      continue;
+    }
+    snprintf(path, sizeof(path), "%s%s%s", dir, *dir ? "/" : "", de->d_name);
+    if (!pathset_has(&a->written, path)) {
+      ret = remove_at(dfd, de->d_name);
+    }
+  }
+  closedir(d);
+
+  return ret;
+}
+
+static int set_attrs(struct layer_applier *a, int dfd, const char *name,
+                     const struct tar_entry *e)
+{
+  struct timespec times[2] = { e->mtime, e->mtime };
+
+  /* Owners first, as chown clears set-ID bits */
+  if (a->owners && fchownat(dfd, name, e->uid, e->gid, AT_SYMLINK_NOFOLLOW)) {
+    return -1;
+  }
+  if (e->type != TAR_SYMLINK && fchmodat(dfd, name, e->mode, 0)) {
+    return -1;
+  }
+  if (e->type != TAR_DIR
+      && utimensat(dfd, name, times, AT_SYMLINK_NOFOLLOW)) {
+    return -1;
+  }
+
+  return 0;
+}
+
+static int write_file(struct layer_applier *a, struct tar *t, int dfd,
+                      const char *name)
+{
+  ssize_t n, w;
+  int fd;
+
+  if ((fd = openat(dfd, name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW
+                   | O_CLOEXEC, 0600)) < 0) {
+    return -1;
+  }
+  while ((n = tar_read(t, a->buf, COPY_BUF_SIZE)) > 0) {
+    for (ssize_t off = 0; off < n; off += w) {
+      if ((w = write(fd, a->buf + off, n - off)) < 0) {
+        close(fd);
+        return -1;
+      }
+    }
+  }
+  if (close(fd) || n < 0) {
+    return -1;
+  }
+
+  return 0;
+}
+
+static int add_dir_time(struct layer_applier *a, const char *path,
+                        const struct timespec *mtime)
+{
+  struct dir_time *dirs;
+
+  if (a->ndirs == a->dirs_cap) {
+    a->dirs_cap = a->dirs_cap ? a->dirs_cap * 2 : 256;
+    if ((dirs = realloc(a->dirs, a->dirs_cap * sizeof(*dirs))) == NULL) {
+      return -1;
+    }
+    a->dirs = dirs;
+  }
+  if ((a->dirs[a->ndirs].path = strdup(path)) == NULL) {
+    return -1;
+  }
+  a->dirs[a->ndirs++].mtime = *mtime;
+
+  return 0;
+}
+
+static void set_dir_times(struct layer_applier *a)
+{
+  struct timespec times[2];
+  char *slash, *name;
+  int dfd;
+
+  /* Deepest last written first, so that setting one doesn't touch others */
+  while (a->ndirs > 0) {
+    struct dir_time *d = &a->dirs[--a->ndirs];
+    times[0] = times[1] = d->mtime;
+    if ((slash = strrchr(d->path, '/'))) {
+      *slash = '\0';
+      name = slash + 1;
+    } else {
+      name = d->path;
+    }
+    dfd = open_dir(a, slash ? d->path : "", 0);
+    if (dfd >= 0) {
+      utimensat(dfd, name, times, AT_SYMLINK_NOFOLLOW);
+    }
+    free(d->path);
+  }
+}
+
+static void split(char *path, const char **dir, const char **name)
+{
+  char *slash = strrchr(path, '/');
+
+  if (slash) {
+    *slash = '\0';
+    *dir = path;
+    *name = slash + 1;
+  } else {
+    *dir = "";
+    *name = path;
+  }
+}
+
+static int apply_entry(struct layer_applier *a, struct tar *t, struct tar_entry *e)
+{
+  char path[PATH_MAX], target[PATH_MAX], full[PATH_MAX];
+  const char *dir, *name, *tdir, *tname;
+  struct stat st;
+  mode_t type;
+  int dfd, tfd;
+
+  if (layer_normalize(e->path, path, sizeof(path))) {
+    fprintf(stderr, "Bad path in the layer: %s\n", e->path);
+    errno = EINVAL;
+    return -1;
+  }
+  if (path[0] == '\0') {
+    return 0;                   /* the root itself */
+  }
+  strcpy(full, path);
+  split(path, &dir, &name);
+
+  if (strncmp(name, WHITEOUT_PREFIX, strlen(WHITEOUT_PREFIX)) == 0) {
+    if ((dfd = open_dir(a, dir, 0)) < 0) {
+      return errno == ENOENT ? 0 : -1;
+    }
+    if (strcmp(name, WHITEOUT_OPAQUE) == 0) {
+      return remove_lower(a, dir, dfd);
+    }
+    return remove_at(dfd, name + strlen(WHITEOUT_PREFIX));
+  }
+
+  if ((dfd = open_dir(a, dir, 1)) < 0 || add_written(a, full)) {
+    return -1;
+  }
+  switch (e->type) {
+  case TAR_DIR:
+    if (fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) || !S_ISDIR(st.st_mode)) {
+      if (remove_at(dfd, name) || mkdirat(dfd, name, 0755)) {
+        return -1;
+      }
+    }
+    if (add_dir_time(a, full, &e->mtime)) {
+      return -1;
+    }
+    break;
+  case TAR_REG:
+    if (remove_at(dfd, name) || write_file(a, t, dfd, name)) {
+      return -1;
+    }
+    break;
+  case TAR_SYMLINK:
+    if (remove_at(dfd, name) || symlinkat(e->link, dfd, name)) {
+      return -1;
+    }
+    break;
+  case TAR_LINK:
+    if (layer_normalize(e->link, target, sizeof(target))) {
+      fprintf(stderr, "Bad link target in the layer: %s\n", e->link);
+      errno = EINVAL;
+      return -1;
+    }
+    if (strcmp(target, full) == 0) {
+      return 0;
+    }
+    split(target, &tdir, &tname);
+    if ((tfd = resolve_dir(a->rootfd, tdir, 0)) < 0) {
+      return -1;
+    }
+    if (remove_at(dfd, name) || linkat(tfd, tname, dfd, name, 0)) {
+      close(tfd);
+      return -1;
+    }
+    close(tfd);
+    return 0;                   /* the target's attributes are the link's */
+  case TAR_CHR:
+  case TAR_BLK:
+  case TAR_FIFO:
+    type = e->type == TAR_CHR ? S_IFCHR : e->type == TAR_BLK ? S_IFBLK
+      : S_IFIFO;
+    if (remove_at(dfd, name)) {
+      return -1;
+    }
+    if (mknodat(dfd, name, type | e->mode,
+                makedev(e->devmajor, e->devminor))) {
+      if (errno != EPERM) {
+        return -1;
+      }
+      if (!a->warned) {
+        fprintf(stderr, "Warning: Device files are left out "
+                "(not permitted).\n");
+        a->warned = 1;
+      }
+      return 0;
+    }
+    break;
+  default:
+    return 0;
+  }
+
+  return set_attrs(a, dfd, name, e);
+}
+
+struct layer_applier *layer_applier_new(const char *rootfs)
+{
+  struct layer_applier *a;
+
+  if ((a = calloc(1, sizeof(*a))) == NULL
+      || (a->buf = malloc(COPY_BUF_SIZE)) == NULL) {
+    fprintf(stderr, "Failed to allocate a copy buffer.\n");
+    free(a);
+    return NULL;
+  }
+  a->owners = geteuid() == 0;
+  if ((a->rootfd = open(rootfs, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+    fprintf(stderr, "Failed to open %s: %s\n", rootfs, strerror(errno));
+    free(a->buf);
+    free(a);
+    return NULL;
+  }
+
+  return a;
+}
+
+int layer_applier_entry(struct layer_applier *a, struct tar *t,
+                        struct tar_entry *e)
+{
+  if (apply_entry(a, t, e)) {
+    fprintf(stderr, "Failed to apply %s: %s\n", e->path, strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+void layer_applier_end(struct layer_applier *a)
+{
+  set_dir_times(a);
+  pathset_free(&a->written);
+}
+
+void layer_applier_free(struct layer_applier *a)
+{
+  for (size_t i = 0; i < a->ndirs; i++) {
+    free(a->dirs[i].path);
+  }
+  free(a->dirs);
+  pathset_free(&a->written);
+  if (a->cached) {
+    close(a->cached_fd);
+    free(a->cached);
+  }
+  free(a->buf);
+  close(a->rootfd);
+  free(a);
+}
+
+int layer_apply(const char *rootfs, const struct blob *layer)
+{
+  struct layer_applier *a;
+  struct blob_reader r;
+  struct tar t;
+  struct tar_entry *e;
+  int ret;
+
+  if ((a = layer_applier_new(rootfs)) == NULL) {
+    return -1;
+  }
+  if (blob_reader_open(&r, layer)) {
+    layer_applier_free(a);
+    return -1;
+  }
+  tar_init(&t, &r);
+  while ((ret = tar_next(&t, &e)) > 0) {
+    if (layer_applier_entry(a, &t, e)) {
+      ret = -1;
+      break;
+    }
+  }
+  if (ret == 0) {
+    layer_applier_end(a);
+  }
+  tar_free(&t);
+  blob_reader_close(&r);
+  layer_applier_free(a);
+
+  return ret;
+}
@@ -0,0 +1,42 @@
+/*******************************************************************************
+ *
+ * layer.h
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#ifndef BOOTFS_LAYER_H
+#define BOOTFS_LAYER_H
+
+#include "image.h"
+#include "tar.h"
+
+#define WHITEOUT_PREFIX ".wh."
+#define WHITEOUT_OPAQUE ".wh..wh..opq"
+
+/*
+ * Apply a layer (a tar, maybe gzip'ed) onto rootfs as a container runtime
+ * does: ".wh.<name>" removes <name> of the layers below, and ".wh..wh..opq"
+ * everything they have in its directory. Paths resolve inside rootfs, even
+ * through symlinks. Owners are kept when run as root. Extended attributes
+ * are left out, as the archives made of the rootfs don't keep them.
+ */
+int layer_apply(const char *rootfs, const struct blob *layer);
+
+/* Archive path without "./", "." and empty components; ".." is refused. */
+int layer_normalize(const char *path, char *out, size_t len);
+
+/*
+ * The same, entry by entry, for callers reading the layers themselves: the
+ * entries of a layer, then layer_applier_end() before those of the next.
+ */
+struct layer_applier;
+
+struct layer_applier *layer_applier_new(const char *rootfs);
+int layer_applier_entry(struct layer_applier *a, struct tar *t,
+                        struct tar_entry *e);
+void layer_applier_end(struct layer_applier *a);
+void layer_applier_free(struct layer_applier *a);
+
+#endif
@@ -0,0 +1,87 @@
+/*******************************************************************************
+ *
+ * mntapi.c
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "mntapi.h"
+
+int bootfs_open_tree(int dfd, const char *path, unsigned int flags)
+{
+#ifdef SYS_open_tree
+  return (int)syscall(SYS_open_tree, dfd, path, flags);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+int bootfs_move_mount(int from_dfd, const char *from_path,
+                      int to_dfd, const char *to_path, unsigned int flags)
+{
+#ifdef SYS_move_mount
+  return (int)syscall(SYS_move_mount, from_dfd, from_path,
+                      to_dfd, to_path, flags);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+int send_fd_msg(int sock, const char *msg, int fd)
+{
+  char control[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = { .iov_base = (void *)msg, .iov_len = strlen(msg) };
+  struct msghdr mh;
+  struct cmsghdr *cmsg;
+
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  if (fd >= 0) {
+    memset(control, 0, sizeof(control));
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  }
+
+  return sendmsg(sock, &mh, 0) < 0 ? -1 : 0;
+}
+
+int recv_fd_msg(int sock, char *msg, size_t len, int *fd)
+{
+  char control[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = { .iov_base = msg, .iov_len = len - 1 };
+  struct msghdr mh;
+  struct cmsghdr *cmsg;
+  ssize_t n;
+
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = control;
+  mh.msg_controllen = sizeof(control);
+  *fd = -1;
+  if ((n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC)) < 0) {
+    return -1;
+  }
+  msg[n] = '\0';
+  for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+  }
+
+  return 0;
+}
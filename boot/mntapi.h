@@ -0,0 +1,37 @@
+/*******************************************************************************
+ *
+ * mntapi.h
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#ifndef BOOTFS_MNTAPI_H
+#define BOOTFS_MNTAPI_H
+
+/*
+ * The new mount API (Linux 5.2+). Called through syscall(2) so that we
+ * don't depend on the libc of the build host having the wrappers.
+ */
+#ifndef OPEN_TREE_CLONE
+#define OPEN_TREE_CLONE         1
+#endif
+#ifndef OPEN_TREE_CLOEXEC
+#define OPEN_TREE_CLOEXEC       02000000
+#endif
+#ifndef AT_RECURSIVE
+#define AT_RECURSIVE            0x8000
+#endif
+#ifndef MOVE_MOUNT_F_EMPTY_PATH
+#define MOVE_MOUNT_F_EMPTY_PATH 0x00000004
+#endif
+
+int bootfs_open_tree(int dfd, const char *path, unsigned int flags);
+int bootfs_move_mount(int from_dfd, const char *from_path,
+                      int to_dfd, const char *to_path, unsigned int flags);
+
+/* Unix socket helpers passing one fd along with a text message. */
+int send_fd_msg(int sock, const char *msg, int fd);
+int recv_fd_msg(int sock, char *msg, size_t len, int *fd);
+
+#endif
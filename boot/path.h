@@ -12,8 +12,9 @@
 #define DESYNC_BIN         "/bin/desync"
 #define DBCLIENT_BIN       "/bin/dbclient"
 #define DBCLIENT_Y_BIN     "/bin/dbclient_y"
+#define SSH_BIN            "/bin/ssh"
 #define FUSERMOUNT_BIN     "/bin/fusermount"
-#define PROC_MOUNTS        "/proc/mounts"
+#define PROC_MOUNTINFO     "/proc/self/mountinfo"
 #define DEV_FUSE           "/dev/fuse"
 #define ETC_PASSWD         "/etc/passwd"
 #define SYS_DEV_BLOCK      "/sys/block"
@@ -22,14 +23,27 @@
 #define CASTR_CACHE_DIR    "/.bootfs/rootfs.castr"
 #define ARCHIVE_MOUNT_DIR  "/.bootfs/rootfs.ar"
 #define CAIBX_FILE         "/.bootfs/rootfs.caibx"
-#define ENTRYPOINT_MEMO    "/.bootfs/entrypoint_memo"
+#define BIDX_FILE          "/.bootfs/rootfs.bidx"
+#define BOOT_MANIFEST      "/.bootfs/boot.bman"
+#define BOOTFSD_SOCK       "/.bootfs/bootfsd.sock"  /* optional, bind-mounted */
 
 /* Files generated during boot */
 #define MOUNTED_ARCHIVE    "/.bootfs/rootfs.ar/rootfs"
-#define MOVED_PROC_MOUNTS  "/.bootfs/rootfs/proc/mounts"
+#define SSH_CONTROL_DIR    "/.bootfs/rootfs.ssh"
+#define FUSECTL_DIR        "/.bootfs/rootfs.fusectl"
+#define SSH_CONTROL_LOCK   "/.bootfs/rootfs.ssh/lock"
+#define SSH_HOME_ENV       "BOOTFS_SSH_HOME"
+#define DESYNC_HOME_DIR    "/.bootfs/rootfs.desync"
+#define DESYNC_CONFIG_DIR  "/.bootfs/rootfs.desync/.config/desync"
+#define DESYNC_CONFIG_FILE "/.bootfs/rootfs.desync/.config/desync/config.json"
+#define WARM_CAIBX_TEMPLATE "/.bootfs/rootfs.warm.XXXXXX"
+#define LAYERS_ARCHIVE_DIR "/.bootfs/rootfs.ar.layers"  /* N/ per layer */
+#define LAYERS_MOUNT_DIR   "/.bootfs/rootfs.layers"     /* N/ per layer */
+#define DEV_LOOP_LAYER     "/.bootfs/rootfs.dev/loop%u"
 
 /* Archive information */
 #define ISO_FS_TYPE        "iso9660"
+#define OVERLAY_FS_TYPE    "overlay"
 
 /* Other */
 #define LOOP_DEV_MAJOR_NUM 7
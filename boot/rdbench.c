@@ -0,0 +1,169 @@
+/*******************************************************************************
+ *
+ * rdbench.c
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <linux/loop.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Read benchmark for the lazy archive (or any file on top of it). Prints
+ * one line of key=value, so sweeps can collect results with a shell loop.
+ */
+#define DEFAULT_BLOCK_SIZE   (128 * 1024)
+#define DEFAULT_RANDOM_READS 1000
+#define RANDOM_READ_SIZE     4096
+
+static double now_us()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static double cpu_us()
+{
+  struct rusage ru;
+
+  getrusage(RUSAGE_SELF, &ru);
+
+  return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e6
+    + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+static double percentile(double *lat, size_t n, double p)
+{
+  return n ? lat[(size_t)((n - 1) * p)] : 0.0;
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "Usage: %s [-b BLOCK_SIZE] [-l LIMIT] [-n RANDOM_READS] "
+          "[-r SEED] [-D on|off] FILE\n", name);
+  fprintf(stderr, "  -D switches direct I/O of FILE, a loop device, first.\n");
+}
+
+int main(int argc, char *argv[])
+{
+  size_t block_size = DEFAULT_BLOCK_SIZE, nrand = DEFAULT_RANDOM_READS;
+  size_t nseq = 0, cap;
+  uint64_t limit = 0, total = 0;
+  unsigned int seed = 1;
+  int direct_io = -1;
+  double *lat, begin, seq_us, seq_cpu, rand_us;
+  struct stat st;
+  char *buf;
+  ssize_t n;
+  int opt, fd;
+
+  while ((opt = getopt(argc, argv, "b:l:n:r:D:")) != -1) {
+    switch (opt) {
+    case 'b': block_size = strtoul(optarg, NULL, 0); break;
+    case 'l': limit = strtoull(optarg, NULL, 0); break;
+    case 'n': nrand = strtoul(optarg, NULL, 0); break;
+    case 'r': seed = strtoul(optarg, NULL, 0); break;
+    case 'D': direct_io = strcmp(optarg, "off") != 0; break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind != argc - 1 || block_size == 0) {
+    usage(argv[0]);
+    return 1;
+  }
+  if ((fd = open(argv[optind], O_RDONLY)) < 0 || fstat(fd, &st)) {
+    fprintf(stderr, "Failed to open %s: %s\n", argv[optind], strerror(errno));
+    return 1;
+  }
+  if (direct_io >= 0 && ioctl(fd, LOOP_SET_DIRECT_IO, direct_io)) {
+    fprintf(stderr, "Failed to switch direct I/O: %s\n", strerror(errno));
+    return 1;
+  }
+  if (S_ISBLK(st.st_mode) && ioctl(fd, BLKGETSIZE64, &st.st_size)) {
+    fprintf(stderr, "Failed to get size: %s\n", strerror(errno));
+    return 1;
+  }
+  if (limit == 0 || limit > (uint64_t)st.st_size) {
+    limit = st.st_size;
+  }
+  cap = limit / block_size + 1;
+  if (cap < nrand) {
+    cap = nrand;
+  }
+  if ((buf = malloc(block_size)) == NULL
+      || (lat = malloc(cap * sizeof(double))) == NULL) {
+    fprintf(stderr, "Failed to allocate buffers.\n");
+    return 1;
+  }
+
+  /* Sequential pass, cold as far as our own page cache goes. */
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  seq_cpu = cpu_us();
+  seq_us = now_us();
+  while (total < limit) {
+    begin = now_us();
+    if ((n = pread(fd, buf, block_size, total)) <= 0) {
+      break;
+    }
+    lat[nseq++] = now_us() - begin;
+    total += n;
+  }
+  seq_us = now_us() - seq_us;
+  seq_cpu = cpu_us() - seq_cpu;
+  qsort(lat, nseq, sizeof(double), compare_double);
+  printf("seq_bytes=%llu seq_mbps=%.1f seq_p50_us=%.0f seq_p99_us=%.0f "
+         "cpu_ms_per_gb=%.1f ",
+         (unsigned long long)total, total / seq_us,
+         percentile(lat, nseq, 0.5), percentile(lat, nseq, 0.99),
+         total ? seq_cpu / 1e3 / (total / 1e9) : 0.0);
+
+  /* Random small reads, as an app's startup does on the rootfs. */
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  srand(seed);
+  rand_us = now_us();
+  for (size_t i = 0; i < nrand; i++) {
+    uint64_t blocks = limit / RANDOM_READ_SIZE;
+    uint64_t offset = blocks ? ((uint64_t)rand() * RAND_MAX + rand())
+      % blocks * RANDOM_READ_SIZE : 0;
+    begin = now_us();
+    if (pread(fd, buf, RANDOM_READ_SIZE, offset) < 0) {
+      fprintf(stderr, "Failed to read %s: %s\n", argv[optind], strerror(errno));
+      return 1;
+    }
+    lat[i] = now_us() - begin;
+  }
+  rand_us = now_us() - rand_us;
+  qsort(lat, nrand, sizeof(double), compare_double);
+  printf("rand_iops=%.0f rand_p50_us=%.0f rand_p99_us=%.0f\n",
+         rand_us > 0 ? nrand / (rand_us / 1e6) : 0.0,
+         percentile(lat, nrand, 0.5), percentile(lat, nrand, 0.99));
+  free(lat);
+  free(buf);
+  close(fd);
+
+  return 0;
+}
@@ -0,0 +1,537 @@
+/*******************************************************************************
+ *
+ * sha.c
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#include <stdio.h>
+#include <string.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+#include "sha.h"
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define ROR64(x, n) (((x) >> (n)) | ((x) << (64 - (n))))
+
+static const uint32_t K256[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+  0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+  0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+  0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+  0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+  0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint64_t K512[80] = {
+  0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL,
+  0xe9b5dba58189dbbcULL, 0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL,
+  0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL, 0xd807aa98a3030242ULL,
+  0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+  0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL,
+  0xc19bf174cf692694ULL, 0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL,
+  0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL, 0x2de92c6f592b0275ULL,
+  0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+  0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL,
+  0xbf597fc7beef0ee4ULL, 0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL,
+  0x06ca6351e003826fULL, 0x142929670a0e6e70ULL, 0x27b70a8546d22ffcULL,
+  0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+  0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL,
+  0x92722c851482353bULL, 0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL,
+  0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL, 0xd192e819d6ef5218ULL,
+  0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+  0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL,
+  0x34b0bcb5e19b48a8ULL, 0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL,
+  0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL, 0x748f82ee5defb2fcULL,
+  0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+  0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL,
+  0xc67178f2e372532bULL, 0xca273eceea26619cULL, 0xd186b8c721c0c207ULL,
+  0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL, 0x06f067aa72176fbaULL,
+  0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+  0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL,
+  0x431d67c49c100d4cULL, 0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL,
+  0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL
+};
+
+static const uint32_t IV256[8] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+  0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const uint64_t IV512_256[8] = {
+  0x22312194fc2bf72cULL, 0x9f555fa3c84c64c2ULL,
+  0x2393b86b6f53b151ULL, 0x963877195940eabdULL,
+  0x96283ee2a88effe3ULL, 0xbe5e1e2553863992ULL,
+  0x2b0199fc2c85b8aaULL, 0x0eb72ddc81c52ca2ULL
+};
+
+static uint32_t load_be32(const uint8_t *p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16)
+    | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static uint64_t load_be64(const uint8_t *p)
+{
+  return ((uint64_t)load_be32(p) << 32) | load_be32(p + 4);
+}
+
+static void store_be32(uint8_t *p, uint32_t v)
+{
+  for (int i = 3; i >= 0; i--, v >>= 8) {
+    p[i] = (uint8_t)v;
+  }
+}
+
+static void store_be64(uint8_t *p, uint64_t v)
+{
+  for (int i = 7; i >= 0; i--, v >>= 8) {
+    p[i] = (uint8_t)v;
+  }
+}
+
+static void sha256_block(uint32_t h[8], const uint8_t *p)
+{
+  uint32_t w[64], a, b, c, d, e, f, g, k, t1, t2;
+
+  for (int i = 0; i < 16; i++) {
+    w[i] = load_be32(p + i * 4);
+  }
+  for (int i = 16; i < 64; i++) {
+    uint32_t s0 = ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+  a = h[0]; b = h[1]; c = h[2]; d = h[3];
+  e = h[4]; f = h[5]; g = h[6]; k = h[7];
+  for (int i = 0; i < 64; i++) {
+    t1 = k + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25))
+      + ((e & f) ^ (~e & g)) + K256[i] + w[i];
+    t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22))
+      + ((a & b) ^ (a & c) ^ (b & c));
+    k = g; g = f; f = e; e = d + t1;
+    d = c; c = b; b = a; a = t1 + t2;
+  }
+  h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+  h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+static void sha512_block(uint64_t h[8], const uint8_t *p)
+{
+  uint64_t w[80], a, b, c, d, e, f, g, k, t1, t2;
+
+  for (int i = 0; i < 16; i++) {
+    w[i] = load_be64(p + i * 8);
+  }
+  for (int i = 16; i < 80; i++) {
+    uint64_t s0 = ROR64(w[i - 15], 1) ^ ROR64(w[i - 15], 8) ^ (w[i - 15] >> 7);
+    uint64_t s1 = ROR64(w[i - 2], 19) ^ ROR64(w[i - 2], 61) ^ (w[i - 2] >> 6);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+  a = h[0]; b = h[1]; c = h[2]; d = h[3];
+  e = h[4]; f = h[5]; g = h[6]; k = h[7];
+  for (int i = 0; i < 80; i++) {
+    t1 = k + (ROR64(e, 14) ^ ROR64(e, 18) ^ ROR64(e, 41))
+      + ((e & f) ^ (~e & g)) + K512[i] + w[i];
+    t2 = (ROR64(a, 28) ^ ROR64(a, 34) ^ ROR64(a, 39))
+      + ((a & b) ^ (a & c) ^ (b & c));
+    k = g; g = f; f = e; e = d + t1;
+    d = c; c = b; b = a; a = t1 + t2;
+  }
+  h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+  h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+static void sha256_blocks_generic(uint32_t h[8], const uint8_t *p, size_t n)
+{
+  for (; n > 0; n--, p += 64) {
+    sha256_block(h, p);
+  }
+}
+
+#ifdef __x86_64__
+/* Four rounds at a time with the SHA extensions, state as ABEF/CDGH. */
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_shani(uint32_t h[8], const uint8_t *p, size_t n)
+{
+  const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+                                      0x0405060700010203ULL);
+  __m128i abef, cdgh, abef_save, cdgh_save, tmp, msg, m[4];
+
+  tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&h[0]), 0xb1);
+  cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&h[4]), 0x1b);
+  abef = _mm_alignr_epi8(tmp, cdgh, 8);
+  cdgh = _mm_blend_epi16(cdgh, tmp, 0xf0);
+
+  for (; n > 0; n--, p += 64) {
+    abef_save = abef;
+    cdgh_save = cdgh;
+    for (int j = 0; j < 16; j++) {
+      if (j < 4) {
+        m[j] = _mm_shuffle_epi8(
+          _mm_loadu_si128((const __m128i *)(p + j * 16)), mask);
+      } else {
+        /* W[t-16] + s0(W[t-15]) + W[t-7], then + s1(W[t-2]) */
+        tmp = _mm_add_epi32(_mm_sha256msg1_epu32(m[j & 3], m[(j + 1) & 3]),
+                            _mm_alignr_epi8(m[(j + 3) & 3], m[(j + 2) & 3], 4));
+        m[j & 3] = _mm_sha256msg2_epu32(tmp, m[(j + 3) & 3]);
+      }
+      msg = _mm_add_epi32(m[j & 3],
+                          _mm_loadu_si128((const __m128i *)&K256[j * 4]));
+      cdgh = _mm_sha256rnds2_epu32(cdgh, abef, msg);
+      abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(msg, 0x0e));
+    }
+    abef = _mm_add_epi32(abef, abef_save);
+    cdgh = _mm_add_epi32(cdgh, cdgh_save);
+  }
+
+  tmp = _mm_shuffle_epi32(abef, 0x1b);
+  cdgh = _mm_shuffle_epi32(cdgh, 0xb1);
+  _mm_storeu_si128((__m128i *)&h[0], _mm_blend_epi16(tmp, cdgh, 0xf0));
+  _mm_storeu_si128((__m128i *)&h[4], _mm_alignr_epi8(cdgh, tmp, 8));
+}
+
+#define MB_NAME   sha256_x8_avx2
+#define MB_TARGET "avx2"
+#define MB_LANES  8
+#define MB_WORD   32
+#include "sha_mb.h"
+
+#define MB_NAME   sha256_x16_avx512
+#define MB_TARGET "avx512f"
+#define MB_LANES  16
+#define MB_WORD   32
+#include "sha_mb.h"
+
+#define MB_NAME   sha512_x4_avx2
+#define MB_TARGET "avx2"
+#define MB_LANES  4
+#define MB_WORD   64
+#include "sha_mb.h"
+
+#define MB_NAME   sha512_x8_avx512
+#define MB_TARGET "avx512f"
+#define MB_LANES  8
+#define MB_WORD   64
+#include "sha_mb.h"
+#endif
+
+#define MB_LANES_MAX 16
+
+struct mb_impl {
+  void (*fn)(void *state, const uint8_t *const *blocks);
+  int lanes;                    /* 0 if none */
+  const char *name;
+};
+
+static void (*sha256_blocks)(uint32_t h[8], const uint8_t *p, size_t n)
+  = sha256_blocks_generic;
+static struct mb_impl mb256, mb512;
+static unsigned int cpu_features;
+static char impl_name[64] = "sha256=generic multi=none";
+
+unsigned int sha_cpu_features(void)
+{
+  return cpu_features;
+}
+
+void sha_use(unsigned int features)
+{
+  features &= cpu_features;
+  sha256_blocks = sha256_blocks_generic;
+  memset(&mb256, 0, sizeof(mb256));
+  memset(&mb512, 0, sizeof(mb512));
+#ifdef __x86_64__
+  if (features & SHA_SHANI) {
+    sha256_blocks = sha256_blocks_shani;
+  }
+  if (features & SHA_AVX512) {
+    mb256 = (struct mb_impl){ sha256_x16_avx512, 16, "avx512x16" };
+    mb512 = (struct mb_impl){ sha512_x8_avx512, 8, "avx512x8" };
+  } else if (features & SHA_AVX2) {
+    /* Eight lanes of AVX2 don't keep up with SHA-NI on one message. */
+    if (!(features & SHA_SHANI)) {
+      mb256 = (struct mb_impl){ sha256_x8_avx2, 8, "avx2x8" };
+    }
+    mb512 = (struct mb_impl){ sha512_x4_avx2, 4, "avx2x4" };
+  }
+#endif
+  snprintf(impl_name, sizeof(impl_name), "sha256=%s multi256=%s multi512=%s",
+           sha256_blocks == sha256_blocks_generic ? "generic" : "shani",
+           mb256.lanes ? mb256.name : "none", mb512.lanes ? mb512.name : "none");
+}
+
+const char *sha_impl(void)
+{
+  return impl_name;
+}
+
+__attribute__((constructor))
+static void sha_detect(void)
+{
+#ifdef __x86_64__
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1")) {
+    cpu_features |= SHA_SHANI;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    cpu_features |= SHA_AVX2;
+  }
+  if (__builtin_cpu_supports("avx512f")) {
+    cpu_features |= SHA_AVX512;
+  }
+#endif
+  sha_use(cpu_features);
+}
+
+void sha256_init(sha256_ctx *ctx)
+{
+  memcpy(ctx->h, IV256, sizeof(IV256));
+  ctx->len = 0;
+  ctx->buflen = 0;
+}
+
+void sha256_update(sha256_ctx *ctx, const void *data, size_t len)
+{
+  const uint8_t *p = data;
+
+  ctx->len += len;
+  if (ctx->buflen > 0) {
+    size_t n = 64 - ctx->buflen < len ? 64 - ctx->buflen : len;
+    memcpy(ctx->buf + ctx->buflen, p, n);
+    ctx->buflen += n;
+    p += n;
+    len -= n;
+    if (ctx->buflen < 64) {
+      return;
+    }
+    sha256_blocks(ctx->h, ctx->buf, 1);
+    ctx->buflen = 0;
+  }
+  if (len >= 64) {
+    sha256_blocks(ctx->h, p, len / 64);
+    p += len & ~(size_t)63;
+    len &= 63;
+  }
+  memcpy(ctx->buf, p, len);
+  ctx->buflen = len;
+}
+
+void sha256_final(sha256_ctx *ctx, uint8_t digest[SHA256_LEN])
+{
+  uint64_t bits = ctx->len * 8;
+
+  ctx->buf[ctx->buflen++] = 0x80;
+  if (ctx->buflen > 56) {
+    memset(ctx->buf + ctx->buflen, 0, 64 - ctx->buflen);
+    sha256_blocks(ctx->h, ctx->buf, 1);
+    ctx->buflen = 0;
+  }
+  memset(ctx->buf + ctx->buflen, 0, 56 - ctx->buflen);
+  store_be64(ctx->buf + 56, bits);
+  sha256_blocks(ctx->h, ctx->buf, 1);
+  for (int i = 0; i < 8; i++) {
+    store_be32(digest + i * 4, ctx->h[i]);
+  }
+}
+
+void sha512_256_init(sha512_ctx *ctx)
+{
+  memcpy(ctx->h, IV512_256, sizeof(IV512_256));
+  ctx->len = 0;
+  ctx->buflen = 0;
+}
+
+void sha512_update(sha512_ctx *ctx, const void *data, size_t len)
+{
+  const uint8_t *p = data;
+
+  ctx->len += len;
+  if (ctx->buflen > 0) {
+    size_t n = 128 - ctx->buflen < len ? 128 - ctx->buflen : len;
+    memcpy(ctx->buf + ctx->buflen, p, n);
+    ctx->buflen += n;
+    p += n;
+    len -= n;
+    if (ctx->buflen < 128) {
+      return;
+    }
+    sha512_block(ctx->h, ctx->buf);
+    ctx->buflen = 0;
+  }
+  for (; len >= 128; p += 128, len -= 128) {
+    sha512_block(ctx->h, p);
+  }
+  memcpy(ctx->buf, p, len);
+  ctx->buflen = len;
+}
+
+void sha512_256_final(sha512_ctx *ctx, uint8_t digest[SHA256_LEN])
+{
+  uint8_t out[64];
+
+  ctx->buf[ctx->buflen++] = 0x80;
+  if (ctx->buflen > 112) {
+    memset(ctx->buf + ctx->buflen, 0, 128 - ctx->buflen);
+    sha512_block(ctx->h, ctx->buf);
+    ctx->buflen = 0;
+  }
+  memset(ctx->buf + ctx->buflen, 0, 120 - ctx->buflen);
+  store_be64(ctx->buf + 120, ctx->len * 8);   /* upper 64 bits stay zero */
+  sha512_block(ctx->h, ctx->buf);
+  for (int i = 0; i < 8; i++) {
+    store_be64(out + i * 8, ctx->h[i]);
+  }
+  memcpy(digest, out, SHA256_LEN);
+}
+
+void chunk_digest(int sha512_256, const void *data, size_t len,
+                  uint8_t digest[SHA256_LEN])
+{
+  if (sha512_256) {
+    sha512_ctx ctx;
+    sha512_256_init(&ctx);
+    sha512_update(&ctx, data, len);
+    sha512_256_final(&ctx, digest);
+  } else {
+    sha256_ctx ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, data, len);
+    sha256_final(&ctx, digest);
+  }
+}
+
+/*
+ * A message in a lane of a multi-buffer function: its whole blocks, then
+ * the rest of it padded as the final functions do.
+ */
+struct mb_lane {
+  size_t msg;                   /* index of the message, n if idle */
+  const uint8_t *p;
+  size_t blocks;
+  uint8_t tail[256];
+  size_t tail_len, tail_off;
+};
+
+static void lane_start(struct mb_lane *l, size_t msg, const uint8_t *data,
+                       size_t len, size_t bs)
+{
+  size_t rest = len % bs;
+
+  l->msg = msg;
+  l->p = data;
+  l->blocks = len / bs;
+  l->tail_len = rest + 1 + bs / 8 <= bs ? bs : 2 * bs;
+  l->tail_off = 0;
+  memcpy(l->tail, data + len - rest, rest);
+  memset(l->tail + rest, 0, l->tail_len - rest);
+  l->tail[rest] = 0x80;
+  store_be64(l->tail + l->tail_len - 8, (uint64_t)len * 8);
+}
+
+static const uint8_t *lane_next(struct mb_lane *l, size_t bs)
+{
+  const uint8_t *p;
+
+  if (l->blocks > 0) {
+    p = l->p;
+    l->p += bs;
+    l->blocks--;
+  } else {
+    p = l->tail + l->tail_off;
+    l->tail_off += bs;
+  }
+
+  return p;
+}
+
+static void mb_hash(int sha512_256, const struct mb_impl *mb,
+                    const void *const *data, const size_t *len, size_t n,
+                    uint8_t (*digest)[SHA256_LEN])
+{
+  static const uint8_t idle[128];
+  struct mb_lane lanes[MB_LANES_MAX];
+  const uint8_t *blocks[MB_LANES_MAX];
+  uint32_t h256[MB_LANES_MAX][8];
+  uint64_t h512[MB_LANES_MAX][8];
+  size_t bs = sha512_256 ? 128 : 64, next = 0, active = 0;
+  struct mb_lane *l;
+  int i;
+
+  for (i = 0; i < mb->lanes; i++) {
+    lanes[i].msg = n;
+  }
+  while (next < n || active > 0) {
+    /* Refill the idle lanes */
+    for (i = 0; i < mb->lanes && next < n; i++) {
+      if (lanes[i].msg == n) {
+        lane_start(&lanes[i], next, data[next], len[next], bs);
+        memcpy(h256[i], IV256, sizeof(IV256));
+        memcpy(h512[i], IV512_256, sizeof(IV512_256));
+        next++;
+        active++;
+      }
+    }
+
+    /* The last message on its own is done faster by the single one. */
+    if (active == 1 && next == n) {
+      for (i = 0; lanes[i].msg == n; i++) {
+      }
+      l = &lanes[i];
+      if (sha512_256) {
+        for (; l->tail_off < l->tail_len; ) {
+          sha512_block(h512[i], lane_next(l, bs));
+        }
+      } else {
+        sha256_blocks(h256[i], l->p, l->blocks);
+        sha256_blocks(h256[i], l->tail + l->tail_off,
+                      (l->tail_len - l->tail_off) / bs);
+        l->blocks = 0;
+        l->tail_off = l->tail_len;
+      }
+    } else {
+      for (i = 0; i < mb->lanes; i++) {
+        blocks[i] = lanes[i].msg == n ? idle : lane_next(&lanes[i], bs);
+      }
+      mb->fn(sha512_256 ? (void *)h512 : (void *)h256, blocks);
+    }
+
+    for (i = 0; i < mb->lanes; i++) {
+      l = &lanes[i];
+      if (l->msg == n || l->blocks > 0 || l->tail_off < l->tail_len) {
+        continue;
+      }
+      for (int j = 0; j < 8; j++) {
+        if (!sha512_256) {
+          store_be32(digest[l->msg] + j * 4, h256[i][j]);
+        } else if (j < 4) {
+          store_be64(digest[l->msg] + j * 8, h512[i][j]);
+        }
+      }
+      l->msg = n;
+      active--;
+    }
+  }
+}
+
+void chunk_digest_many(int sha512_256, const void *const *data,
+                       const size_t *len, size_t n,
+                       uint8_t (*digest)[SHA256_LEN])
+{
+  const struct mb_impl *mb = sha512_256 ? &mb512 : &mb256;
+
+  if (mb->lanes == 0 || n < 2) {
+    for (size_t i = 0; i < n; i++) {
+      chunk_digest(sha512_256, data[i], len[i], digest[i]);
+    }
+    return;
+  }
+  mb_hash(sha512_256, mb, data, len, n, digest);
+}
@@ -0,0 +1,66 @@
+/*******************************************************************************
+ *
+ * sha.h
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#ifndef BOOTFS_SHA_H
+#define BOOTFS_SHA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_LEN 32
+
+typedef struct {
+  uint32_t h[8];
+  uint64_t len;
+  uint8_t buf[64];
+  size_t buflen;
+} sha256_ctx;
+
+typedef struct {
+  uint64_t h[8];
+  uint64_t len;
+  uint8_t buf[128];
+  size_t buflen;
+} sha512_ctx;
+
+void sha256_init(sha256_ctx *ctx);
+void sha256_update(sha256_ctx *ctx, const void *data, size_t len);
+void sha256_final(sha256_ctx *ctx, uint8_t digest[SHA256_LEN]);
+
+/* SHA-512/256: SHA-512 with its own IV, truncated to 256 bits. */
+void sha512_256_init(sha512_ctx *ctx);
+void sha512_update(sha512_ctx *ctx, const void *data, size_t len);
+void sha512_256_final(sha512_ctx *ctx, uint8_t digest[SHA256_LEN]);
+
+/* Chunk ID as casync computes it, depending on the index feature flags. */
+void chunk_digest(int sha512_256, const void *data, size_t len,
+                  uint8_t digest[SHA256_LEN]);
+
+/*
+ * chunk_digest() of n chunks, hashing several of them at once in the lanes
+ * of the vector unit where the CPU has one (SHA-512 has no instructions of
+ * its own on most x86 CPUs, so this is where casync indexes gain most).
+ */
+void chunk_digest_many(int sha512_256, const void *const *data,
+                       const size_t *len, size_t n,
+                       uint8_t (*digest)[SHA256_LEN]);
+
+/*
+ * CPU features the block functions are picked by at startup. sha_use()
+ * restricts them to a subset (e.g. 0 for the portable code), for
+ * benchmarks and for ruling out a faulty path.
+ */
+#define SHA_SHANI  0x1
+#define SHA_AVX2   0x2
+#define SHA_AVX512 0x4
+
+unsigned int sha_cpu_features(void);
+void sha_use(unsigned int features);
+const char *sha_impl(void);        /* e.g. "sha256=shani multi256=..." */
+
+#endif
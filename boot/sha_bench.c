@@ -0,0 +1,152 @@
+/*******************************************************************************
+ *
+ * sha_bench.c
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "sha.h"
+
+/*
+ * Chunk hashing benchmark. Hashes the same set of chunks (sized like a
+ * casync store's by default, between a quarter and four times the average)
+ * one at a time and with chunk_digest_many(), for each subset of the CPU's
+ * features, and checks that every one gets the digests of the portable
+ * code. Prints one line of key=value per algorithm and feature set.
+ */
+#define DEFAULT_SIZE   (64 * 1024)
+#define DEFAULT_COUNT  256
+#define DEFAULT_PASSES 3
+
+static double now_us()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static const char *features_name(unsigned int f)
+{
+  static char name[32];
+
+  snprintf(name, sizeof(name), "%s%s%s%s", f == 0 ? "none" : "",
+           f & SHA_SHANI ? "shani," : "", f & SHA_AVX2 ? "avx2," : "",
+           f & SHA_AVX512 ? "avx512," : "");
+  if (f) {
+    name[strlen(name) - 1] = '\0';
+  }
+
+  return name;
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "Usage: %s [-s AVG_SIZE] [-n CHUNKS] [-p PASSES] [-f]\n"
+          "  -f  all chunks of AVG_SIZE bytes\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+  size_t size = DEFAULT_SIZE, count = DEFAULT_COUNT, *len, total = 0;
+  uint8_t *data, (*ref)[SHA256_LEN], (*got)[SHA256_LEN];
+  const void **ptrs;
+  unsigned int cpu = sha_cpu_features(), f;
+  int opt, passes = DEFAULT_PASSES, fixed = 0, failed = 0;
+  double single, multi;
+
+  while ((opt = getopt(argc, argv, "s:n:p:f")) != -1) {
+    switch (opt) {
+    case 's': size = strtoull(optarg, NULL, 0); break;
+    case 'n': count = strtoull(optarg, NULL, 0); break;
+    case 'p': passes = atoi(optarg); break;
+    case 'f': fixed = 1; break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind != argc || size == 0 || count == 0 || passes <= 0) {
+    usage(argv[0]);
+    return 1;
+  }
+  len = malloc(count * sizeof(size_t));
+  ptrs = malloc(count * sizeof(void *));
+  ref = malloc(count * SHA256_LEN);
+  got = malloc(count * SHA256_LEN);
+  if (len == NULL || ptrs == NULL || ref == NULL || got == NULL) {
+    fprintf(stderr, "Failed to allocate chunks.\n");
+    return 1;
+  }
+  srand(1);
+  for (size_t i = 0; i < count; i++) {
+    len[i] = fixed ? size : size / 4 + (size_t)rand() % (size * 4 - size / 4);
+    total += len[i];
+  }
+  if ((data = malloc(total)) == NULL) {
+    fprintf(stderr, "Failed to allocate chunks.\n");
+    return 1;
+  }
+  for (size_t i = 0; i < total; i++) {
+    data[i] = (uint8_t)rand();
+  }
+  for (size_t i = 0, off = 0; i < count; off += len[i++]) {
+    ptrs[i] = data + off;
+  }
+
+  for (int sha512_256 = 1; sha512_256 >= 0; sha512_256--) {
+    sha_use(0);
+    for (size_t i = 0; i < count; i++) {
+      chunk_digest(sha512_256, ptrs[i], len[i], ref[i]);
+    }
+    /* Every subset of the features the CPU has, the portable code first */
+    for (f = 0; f <= cpu; f++) {
+      if ((f & cpu) != f) {
+        continue;
+      }
+      sha_use(f);
+      single = now_us();
+      for (int p = 0; p < passes; p++) {
+        for (size_t i = 0; i < count; i++) {
+          chunk_digest(sha512_256, ptrs[i], len[i], got[i]);
+        }
+      }
+      single = now_us() - single;
+      if (memcmp(got, ref, count * SHA256_LEN)) {
+        fprintf(stderr, "Digests differ with %s.\n", features_name(f));
+        failed = 1;
+      }
+      memset(got, 0, count * SHA256_LEN);
+      multi = now_us();
+      for (int p = 0; p < passes; p++) {
+        chunk_digest_many(sha512_256, ptrs, len, count, got);
+      }
+      multi = now_us() - multi;
+      if (memcmp(got, ref, count * SHA256_LEN)) {
+        fprintf(stderr, "Multi-buffer digests differ with %s.\n",
+                features_name(f));
+        failed = 1;
+      }
+      printf("algo=%s features=%s %s chunks=%zu bytes=%zu "
+             "single_mbps=%.1f multi_mbps=%.1f\n",
+             sha512_256 ? "sha512-256" : "sha256", features_name(f),
+             sha_impl(), count, total, total * passes / single,
+             total * passes / multi);
+    }
+  }
+  sha_use(cpu);
+  free(data);
+  free(got);
+  free(ref);
+  free(ptrs);
+  free(len);
+
+  return failed;
+}
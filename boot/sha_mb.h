@@ -0,0 +1,99 @@
+/*******************************************************************************
+ *
+ * sha_mb.h
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+
+/*
+ * Multi-buffer block function: one block of a different message in each
+ * lane of a vector. sha.c includes this once per instance, defining
+ *   MB_NAME   name of the function
+ *   MB_TARGET target of the function (e.g. "avx2")
+ *   MB_LANES  messages per call
+ *   MB_WORD   32 for SHA-256, 64 for SHA-512
+ * The state is h[lane][8] and blocks[lane] points to the block of a lane.
+ */
+#define MB_CAT2(a, b) a##b
+#define MB_CAT(a, b)  MB_CAT2(a, b)
+#define MB_VEC        MB_CAT(MB_NAME, _vec)
+#define MB_ROTR(x, n) (((x) >> (n)) | ((x) << (MB_WORD - (n))))
+
+#if MB_WORD == 32
+#define MB_T          uint32_t
+#define MB_ROUNDS     64
+#define MB_K          K256
+#define MB_LOAD       load_be32
+#define MB_S0(x)      (MB_ROTR(x, 2) ^ MB_ROTR(x, 13) ^ MB_ROTR(x, 22))
+#define MB_S1(x)      (MB_ROTR(x, 6) ^ MB_ROTR(x, 11) ^ MB_ROTR(x, 25))
+#define MB_s0(x)      (MB_ROTR(x, 7) ^ MB_ROTR(x, 18) ^ ((x) >> 3))
+#define MB_s1(x)      (MB_ROTR(x, 17) ^ MB_ROTR(x, 19) ^ ((x) >> 10))
+#else
+#define MB_T          uint64_t
+#define MB_ROUNDS     80
+#define MB_K          K512
+#define MB_LOAD       load_be64
+#define MB_S0(x)      (MB_ROTR(x, 28) ^ MB_ROTR(x, 34) ^ MB_ROTR(x, 39))
+#define MB_S1(x)      (MB_ROTR(x, 14) ^ MB_ROTR(x, 18) ^ MB_ROTR(x, 41))
+#define MB_s0(x)      (MB_ROTR(x, 1) ^ MB_ROTR(x, 8) ^ ((x) >> 7))
+#define MB_s1(x)      (MB_ROTR(x, 19) ^ MB_ROTR(x, 61) ^ ((x) >> 6))
+#endif
+
+typedef MB_T MB_VEC __attribute__((vector_size(MB_LANES * sizeof(MB_T))));
+
+__attribute__((target(MB_TARGET)))
+static void MB_NAME(void *state, const uint8_t *const *blocks)
+{
+  MB_T (*h)[8] = state;
+  MB_VEC w[16], s[8], a, b, c, d, e, f, g, k, t1, t2;
+
+  for (int i = 0; i < 8; i++) {
+    for (int l = 0; l < MB_LANES; l++) {
+      s[i][l] = h[l][i];
+    }
+  }
+  for (int i = 0; i < 16; i++) {
+    for (int l = 0; l < MB_LANES; l++) {
+      w[i][l] = MB_LOAD(blocks[l] + i * sizeof(MB_T));
+    }
+  }
+  a = s[0]; b = s[1]; c = s[2]; d = s[3];
+  e = s[4]; f = s[5]; g = s[6]; k = s[7];
+  for (int i = 0; i < MB_ROUNDS; i++) {
+    /* The schedule in a window of 16 words */
+    if (i >= 16) {
+      w[i & 15] += MB_s0(w[(i - 15) & 15]) + w[(i - 7) & 15]
+        + MB_s1(w[(i - 2) & 15]);
+    }
+    t1 = k + MB_S1(e) + ((e & f) ^ (~e & g)) + MB_K[i] + w[i & 15];
+    t2 = MB_S0(a) + ((a & b) ^ (a & c) ^ (b & c));
+    k = g; g = f; f = e; e = d + t1;
+    d = c; c = b; b = a; a = t1 + t2;
+  }
+  s[0] += a; s[1] += b; s[2] += c; s[3] += d;
+  s[4] += e; s[5] += f; s[6] += g; s[7] += k;
+  for (int i = 0; i < 8; i++) {
+    for (int l = 0; l < MB_LANES; l++) {
+      h[l][i] = s[i][l];
+    }
+  }
+}
+
+#undef MB_CAT2
+#undef MB_CAT
+#undef MB_VEC
+#undef MB_ROTR
+#undef MB_T
+#undef MB_ROUNDS
+#undef MB_K
+#undef MB_LOAD
+#undef MB_S0
+#undef MB_S1
+#undef MB_s0
+#undef MB_s1
+#undef MB_NAME
+#undef MB_TARGET
+#undef MB_LANES
+#undef MB_WORD
@@ -0,0 +1,173 @@
+/*******************************************************************************
+ *
+ * stage.c
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include "stage.h"
+
+#define STAGE_PENDING 0
+#define STAGE_RUNNING 1
+#define STAGE_DONE    2
+
+struct graph {
+  struct stage *stages;
+  int n;
+  void *ctx;
+  int state[STAGE_MAX];
+  unsigned int done;            /* stages succeeded */
+  int running;
+  int failed;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+static double msec_between(const struct timespec *a, const struct timespec *b)
+{
+  return (b->tv_sec - a->tv_sec) * 1e3 + (b->tv_nsec - a->tv_nsec) / 1e6;
+}
+
+/* Next stage whose deps have all succeeded, or -1. Called locked. */
+static int next_ready(struct graph *g)
+{
+  for (int i = 0; i < g->n; i++) {
+    if (g->state[i] == STAGE_PENDING
+        && (g->stages[i].deps & g->done) == g->stages[i].deps) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+static int all_settled(struct graph *g)
+{
+  for (int i = 0; i < g->n; i++) {
+    if (g->state[i] != STAGE_DONE) {
+      return g->failed && g->running == 0;
+    }
+  }
+
+  return 1;
+}
+
+static void *worker(void *arg)
+{
+  struct graph *g = arg;
+  struct stage *s;
+  int i;
+
+  pthread_mutex_lock(&g->lock);
+  while (!all_settled(g)) {
+    if (g->failed || (i = next_ready(g)) < 0) {
+      pthread_cond_wait(&g->cond, &g->lock);
+      continue;
+    }
+    s = &g->stages[i];
+    g->state[i] = STAGE_RUNNING;
+    g->running++;
+    pthread_mutex_unlock(&g->lock);
+
+    clock_gettime(CLOCK_MONOTONIC, &s->begin);
+    s->status = s->run(g->ctx);
+    clock_gettime(CLOCK_MONOTONIC, &s->end);
+
+    pthread_mutex_lock(&g->lock);
+    g->state[i] = STAGE_DONE;
+    g->running--;
+    if (s->status == 0) {
+      g->done |= STAGE_DEP(i);
+    } else {
+      fprintf(stderr, "Stage %s failed.\n", s->name);
+      g->failed = 1;
+    }
+    pthread_cond_broadcast(&g->cond);
+  }
+  pthread_mutex_unlock(&g->lock);
+
+  return NULL;
+}
+
+int run_stages(struct stage *stages, int n, int workers, void *ctx)
+{
+  pthread_t threads[STAGE_MAX];
+  struct graph g;
+  int started = 0;
+
+  if (n > STAGE_MAX) {
+    fprintf(stderr, "Too many stages.\n");
+    return -1;
+  }
+  memset(&g, 0, sizeof(g));
+  g.stages = stages;
+  g.n = n;
+  g.ctx = ctx;
+  pthread_mutex_init(&g.lock, NULL);
+  pthread_cond_init(&g.cond, NULL);
+  for (int i = 0; i < n; i++) {
+    memset(&stages[i].begin, 0, sizeof(struct timespec));
+    memset(&stages[i].end, 0, sizeof(struct timespec));
+    stages[i].status = -1;
+  }
+  if (workers > STAGE_MAX) {
+    workers = STAGE_MAX;
+  }
+  for (int i = 1; i < workers; i++) {
+    if (pthread_create(&threads[started], NULL, worker, &g) == 0) {
+      started++;
+    }
+  }
+
+  /* The calling thread works too, so this completes even without threads. */
+  worker(&g);
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  pthread_cond_destroy(&g.cond);
+  pthread_mutex_destroy(&g.lock);
+
+  return g.failed ? -1 : 0;
+}
+
+void report_critical_path(const struct stage *stages, int n,
+                          const struct timespec *start)
+{
+  int path[STAGE_MAX], len = 0, last = -1;
+
+  /* Walk back from the last stage through the dep which finished last. */
+  for (int i = 0; i < n; i++) {
+    if (last < 0 || msec_between(&stages[last].end, &stages[i].end) > 0) {
+      last = i;
+    }
+  }
+  while (last >= 0 && len < STAGE_MAX) {
+    int prev = -1;
+    path[len++] = last;
+    for (int i = 0; i < n; i++) {
+      if ((stages[last].deps & STAGE_DEP(i))
+          && (prev < 0
+              || msec_between(&stages[prev].end, &stages[i].end) > 0)) {
+        prev = i;
+      }
+    }
+    last = prev;
+  }
+  fprintf(stderr, "Trace: critical path");
+  for (int i = len - 1; i >= 0; i--) {
+    const struct stage *s = &stages[path[i]];
+    fprintf(stderr, "%s %s %.3f ms", i == len - 1 ? ":" : " ->",
+            s->name, msec_between(&s->begin, &s->end));
+  }
+  fprintf(stderr, ", %.3f ms in total.\n",
+          len ? msec_between(start, &stages[path[0]].end) : 0.0);
+  for (int i = 0; i < n; i++) {
+    fprintf(stderr, "Trace: stage %s ran %.3f-%.3f ms.\n", stages[i].name,
+            msec_between(start, &stages[i].begin),
+            msec_between(start, &stages[i].end));
+  }
+}
@@ -0,0 +1,39 @@
+/*******************************************************************************
+ *
+ * stage.h
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#ifndef BOOTFS_STAGE_H
+#define BOOTFS_STAGE_H
+
+#include <time.h>
+
+/*
+ * A small dependency graph of boot stages, run by a fixed pool of threads.
+ * A stage starts as soon as all stages in its deps mask have succeeded; on
+ * the first failure nothing new is started.
+ */
+#define STAGE_MAX  32
+#define STAGE_DEP(i) (1U << (i))
+
+struct stage {
+  const char *name;
+  int (*run)(void *ctx);
+  unsigned int deps;
+
+  /* Results */
+  int status;
+  struct timespec begin;
+  struct timespec end;
+};
+
+int run_stages(struct stage *stages, int n, int workers, void *ctx);
+
+/* Print the chain of stages which determined when the last one finished. */
+void report_critical_path(const struct stage *stages, int n,
+                          const struct timespec *start);
+
+#endif
@@ -0,0 +1,673 @@
+/*******************************************************************************
+ *
+ * tar.c
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#include "tar.h"
+
+#define TAR_GNU_LONGNAME 'L'
+#define TAR_GNU_LONGLINK 'K'
+#define TAR_PAX          'x'
+#define TAR_PAX_GLOBAL   'g'
+#define TAR_EXT_MAX      (1024 * 1024)     /* long names and pax records */
+#define TAR_WRITE_BUF    (64 * 1024)
+#define TAR_PAX_NAME     "././@PaxHeader"
+
+/* Header fields */
+#define H_NAME     0
+#define H_MODE     100
+#define H_UID      108
+#define H_GID      116
+#define H_SIZE     124
+#define H_MTIME    136
+#define H_CHKSUM   148
+#define H_TYPE     156
+#define H_LINKNAME 157
+#define H_MAGIC    257
+#define H_DEVMAJOR 329
+#define H_DEVMINOR 337
+#define H_PREFIX   345
+
+/* Overrides from extension entries for the next header */
+struct tar_ext {
+  char *path, *link;
+  int has_size, has_mtime;
+  uint64_t size;
+  struct timespec mtime;
+};
+
+void tar_init(struct tar *t, struct blob_reader *r)
+{
+  memset(t, 0, sizeof(*t));
+  t->r = r;
+}
+
+void tar_free(struct tar *t)
+{
+  free(t->e.path);
+  free(t->e.link);
+  t->e.path = t->e.link = NULL;
+}
+
+/*
+ * Octal, or base-256 with the high bit of the first byte set (GNU), which
+ * is two's complement if it's all set (times before 1970)
+ */
+static uint64_t tar_number(const uint8_t *field, size_t len)
+{
+  uint64_t v = 0;
+  size_t i = 0;
+
+  if (field[0] & 0x80) {
+    v = field[0] == 0xff ? UINT64_MAX : field[0] & 0x3f;
+    for (i = 1; i < len; i++) {
+      v = (v << 8) | field[i];
+    }
+    return v;
+  }
+  for (; i < len && (field[i] == ' ' || field[i] == '\0'); i++) {
+  }
+  for (; i < len && field[i] >= '0' && field[i] <= '7'; i++) {
+    v = (v << 3) | (field[i] - '0');
+  }
+
+  return v;
+}
+
+static char *tar_string(const uint8_t *field, size_t len)
+{
+  return strndup((const char *)field, len);
+}
+
+static int checksum_ok(const uint8_t *h)
+{
+  uint64_t sum = 0;
+
+  for (int i = 0; i < TAR_BLOCK_SIZE; i++) {
+    sum += (i >= H_CHKSUM && i < H_CHKSUM + 8) ? ' ' : h[i];
+  }
+
+  return sum == tar_number(h + H_CHKSUM, 8);
+}
+
+static int skip_data(struct tar *t)
+{
+  if (blob_read_full(t->r, NULL, t->left + t->pad)) {
+    return -1;
+  }
+  t->left = t->pad = 0;
+
+  return 0;
+}
+
+/* Data of an extension entry, NUL-terminated */
+static char *read_ext(struct tar *t, uint64_t size)
+{
+  char *buf;
+
+  if (size > TAR_EXT_MAX || (buf = malloc(size + 1)) == NULL) {
+    fprintf(stderr, "Failed to read a tar extension of %llu bytes.\n",
+            (unsigned long long)size);
+    return NULL;
+  }
+  if (blob_read_full(t->r, buf, size)
+      || blob_read_full(t->r, NULL, -size & (TAR_BLOCK_SIZE - 1))) {
+    free(buf);
+    return NULL;
+  }
+  buf[size] = '\0';
+
+  return buf;
+}
+
+/* pax records: "<len> <key>=<value>\n" */
+static int parse_pax(char *buf, uint64_t size, struct tar_ext *ext)
+{
+  char *p = buf, *key, *value, *end;
+  unsigned long len;
+
+  while (p < buf + size) {
+    len = strtoul(p, &key, 10);
+    if (len == 0 || p + len > buf + size || *key != ' '
+        || (value = memchr(key, '=', p + len - key)) == NULL) {
+      fprintf(stderr, "Malformed pax record.\n");
+      return -1;
+    }
+    end = p + len - 1;          /* the newline */
+    *end = '\0';
+    *value++ = '\0';
+    key++;
+    if (strcmp(key, "path") == 0) {
+      free(ext->path);
+      ext->path = strdup(value);
+    } else if (strcmp(key, "linkpath") == 0) {
+      free(ext->link);
+      ext->link = strdup(value);
+    } else if (strcmp(key, "size") == 0) {
+      ext->has_size = 1;
+      ext->size = strtoull(value, NULL, 10);
+    } else if (strcmp(key, "mtime") == 0) {
+      double mtime = strtod(value, NULL);
+      ext->has_mtime = 1;
+      ext->mtime.tv_sec = (time_t)mtime;
+      ext->mtime.tv_nsec = (long)((mtime - ext->mtime.tv_sec) * 1e9);
+    }
+    p += len;
+  }
+
+  return 0;
+}
+
+int tar_next(struct tar *t, struct tar_entry **e)
+{
+  struct tar_ext ext;
+  uint8_t h[TAR_BLOCK_SIZE];
+  char *buf;
+  int ret = -1;
+
+  tar_free(t);
+  memset(&ext, 0, sizeof(ext));
+  if (skip_data(t)) {
+    return -1;
+  }
+  for (;;) {
+    if (blob_read_full(t->r, h, sizeof(h))) {
+      /* Some writers leave out the end-of-archive blocks. */
+      ret = t->r->end && !ext.path && !ext.link ? 0 : -1;
+      goto out;
+    }
+    if (h[0] == '\0') {
+      ret = 0;
+      goto out;
+    }
+    if (!checksum_ok(h)) {
+      fprintf(stderr, "Bad tar header checksum.\n");
+      goto out;
+    }
+    if (h[H_TYPE] == TAR_GNU_LONGNAME || h[H_TYPE] == TAR_GNU_LONGLINK
+        || h[H_TYPE] == TAR_PAX || h[H_TYPE] == TAR_PAX_GLOBAL) {
+      uint64_t size = tar_number(h + H_SIZE, 12);
+      if ((buf = read_ext(t, size)) == NULL) {
+        goto out;
+      }
+      if (h[H_TYPE] == TAR_GNU_LONGNAME) {
+        free(ext.path);
+        ext.path = buf;
+      } else if (h[H_TYPE] == TAR_GNU_LONGLINK) {
+        free(ext.link);
+        ext.link = buf;
+      } else {
+        /* Global records are left out: they're about the writer. */
+        if (h[H_TYPE] == TAR_PAX && parse_pax(buf, size, &ext)) {
+          free(buf);
+          goto out;
+        }
+        free(buf);
+      }
+      continue;
+    }
+    break;
+  }
+
+  t->e.type = h[H_TYPE] == '\0' || h[H_TYPE] == '7' ? TAR_REG : h[H_TYPE];
+  if (ext.path) {
+    t->e.path = ext.path;
+    ext.path = NULL;
+  } else if (memcmp(h + H_MAGIC, "ustar\0", 6) == 0 && h[H_PREFIX]) {
+    char *prefix = tar_string(h + H_PREFIX, 155), *name = tar_string(h, 100);
+    if (prefix && name && asprintf(&t->e.path, "%s/%s", prefix, name) < 0) {
+      t->e.path = NULL;
+    }
+    free(prefix);
+    free(name);
+  } else {
+    t->e.path = tar_string(h + H_NAME, 100);
+  }
+  if (ext.link) {
+    t->e.link = ext.link;
+    ext.link = NULL;
+  } else {
+    t->e.link = tar_string(h + H_LINKNAME, 100);
+  }
+  if (t->e.path == NULL || t->e.link == NULL) {
+    fprintf(stderr, "Failed to allocate tar entry names.\n");
+    goto out;
+  }
+  t->e.mode = tar_number(h + H_MODE, 8) & 07777;
+  t->e.uid = tar_number(h + H_UID, 8);
+  t->e.gid = tar_number(h + H_GID, 8);
+  t->e.size = ext.has_size ? ext.size : tar_number(h + H_SIZE, 12);
+  if (ext.has_mtime) {
+    t->e.mtime = ext.mtime;
+  } else {
+    t->e.mtime.tv_sec = tar_number(h + H_MTIME, 12);
+    t->e.mtime.tv_nsec = 0;
+  }
+  t->e.devmajor = tar_number(h + H_DEVMAJOR, 8);
+  t->e.devminor = tar_number(h + H_DEVMINOR, 8);
+  t->e.offset = t->r->out;
+  /* Only regular files carry data (a hard link's is its target's). */
+  if (t->e.type != TAR_REG) {
+    t->e.size = 0;
+  }
+  t->left = t->e.size;
+  t->pad = -t->left & (TAR_BLOCK_SIZE - 1);
+  *e = &t->e;
+  ret = 1;
+
+  out:
+    free(ext.path);
+    free(ext.link);
+    return ret;
+}
+
+ssize_t tar_read(struct tar *t, void *buf, size_t len)
+{
+  ssize_t n;
+
+  if (len > t->left) {
+    len = t->left;
+  }
+  if (len == 0) {
+    return 0;
+  }
+  if ((n = blob_read(t->r, buf, len)) <= 0) {
+    fprintf(stderr, "Truncated tar entry %s.\n", t->e.path);
+    return -1;
+  }
+  t->left -= n;
+
+  return n;
+}
+
+/* First path of a file with several links, for the ones after it */
+struct tar_link {
+  dev_t dev;
+  ino_t ino;
+  char *path;
+};
+
+struct tar_writer {
+  time_t mtime;
+  tar_out_fn out;
+  void *arg;
+  uint8_t *buf, *data;
+  size_t len;
+  struct tar_link *links;
+  size_t nlinks, cap;
+};
+
+/* Buffered, zeros if data is NULL */
+static int put(struct tar_writer *w, const void *data, size_t len)
+{
+  const uint8_t *p = data;
+  size_t n;
+
+  while (len > 0) {
+    if (w->len == TAR_WRITE_BUF) {
+      if (w->out(w->arg, w->buf, w->len)) {
+        return -1;
+      }
+      w->len = 0;
+    }
+    n = TAR_WRITE_BUF - w->len < len ? TAR_WRITE_BUF - w->len : len;
+    if (p) {
+      memcpy(w->buf + w->len, p, n);
+      p += n;
+    } else {
+      memset(w->buf + w->len, 0, n);
+    }
+    w->len += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+/* Octal if it fits, or base-256 as tar_number reads it */
+static void put_number(uint8_t *field, size_t len, int64_t v)
+{
+  uint64_t u = v;
+  size_t i;
+
+  if (v >= 0 && u < 1ULL << (3 * (len - 1))) {
+    snprintf((char *)field, len, "%0*llo", (int)len - 1,
+             (unsigned long long)u);
+    return;
+  }
+  for (i = len; i-- > 0;) {
+    field[i] = len - 1 - i < 8 ? u >> (8 * (len - 1 - i)) & 0xff
+      : v < 0 ? 0xff : 0;
+  }
+  field[0] |= 0x80;
+}
+
+/* "LEN key=value\n", LEN counting itself */
+static size_t pax_record(char *buf, const char *key, const char *value)
+{
+  size_t base = strlen(key) + strlen(value) + 3, len = base, d;
+  char digits[24];
+
+  for (d = 1; (size_t)snprintf(digits, sizeof(digits), "%zu", base + d) != d;
+       d++) {
+  }
+  len = base + d;
+  if (buf) {
+    sprintf(buf, "%zu %s=%s\n", len, key, value);
+  }
+
+  return len;
+}
+
+static int put_header(struct tar_writer *w, const char *path, char type,
+                      mode_t mode, uint64_t size, const char *link, dev_t dev)
+{
+  uint8_t h[TAR_BLOCK_SIZE];
+  size_t plen = strlen(path), len = 0, sum = 0, i;
+  const char *name = path;
+  char *pax;
+
+  memset(h, 0, sizeof(h));
+  /* Long paths split into the ustar prefix if they can, or go in pax */
+  if (plen > 100) {
+    for (i = plen - 1; i > 0; i--) {
+      if (path[i] == '/' && i <= 155 && plen - i - 1 <= 100
+          && plen - i - 1 > 0) {
+        memcpy(h + H_PREFIX, path, i);
+        name = path + i + 1;
+        break;
+      }
+    }
+    if (name == path) {
+      len += pax_record(NULL, "path", path);
+    }
+  }
+  if (strlen(link) > 100) {
+    len += pax_record(NULL, "linkpath", link);
+  }
+  if (len > 0) {
+    if ((pax = malloc(len + 1)) == NULL) {
+      fprintf(stderr, "Failed to allocate pax records of %s.\n", path);
+      return -1;
+    }
+    i = 0;
+    if (plen > 100 && name == path) {
+      i += pax_record(pax + i, "path", path);
+    }
+    if (strlen(link) > 100) {
+      i += pax_record(pax + i, "linkpath", link);
+    }
+    if (put_header(w, TAR_PAX_NAME, TAR_PAX, 0644, len, "", 0)
+        || put(w, pax, len) || put(w, NULL, -len & (TAR_BLOCK_SIZE - 1))) {
+      free(pax);
+      return -1;
+    }
+    free(pax);
+  }
+
+  memcpy(h + H_NAME, name, strlen(name) < 100 ? strlen(name) : 100);
+  put_number(h + H_MODE, 8, mode & 07777);
+  put_number(h + H_UID, 8, 0);
+  put_number(h + H_GID, 8, 0);
+  put_number(h + H_SIZE, 12, size);
+  put_number(h + H_MTIME, 12, type == TAR_PAX ? 0 : w->mtime);
+  h[H_TYPE] = type;
+  memcpy(h + H_LINKNAME, link, strlen(link) < 100 ? strlen(link) : 100);
+  memcpy(h + H_MAGIC, "ustar\0" "00", 8);
+  if (type == TAR_CHR || type == TAR_BLK) {
+    put_number(h + H_DEVMAJOR, 8, major(dev));
+    put_number(h + H_DEVMINOR, 8, minor(dev));
+  }
+  memset(h + H_CHKSUM, ' ', 8);
+  for (i = 0; i < sizeof(h); i++) {
+    sum += h[i];
+  }
+  snprintf((char *)h + H_CHKSUM, 8, "%06zo", sum);
+
+  return put(w, h, sizeof(h));
+}
+
+static int compare_names(const void *a, const void *b)
+{
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Sorted names of a directory, or NULL */
+static char **read_names(const char *path, size_t *n)
+{
+  DIR *d;
+  struct dirent *de;
+  char **names = NULL, **p;
+  size_t cap = 0;
+
+  *n = 0;
+  if ((d = opendir(path)) == NULL) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  for (errno = 0; (de = readdir(d)) != NULL; errno = 0) {
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+      continue;
+    }
+    if (*n == cap) {
+      cap = cap ? 2 * cap : 16;
+      if ((p = realloc(names, cap * sizeof(*names))) == NULL) {
+        goto fail;
+      }
+      names = p;
+    }
+    if ((names[*n] = strdup(de->d_name)) == NULL) {
+      goto fail;
+    }
+    (*n)++;
+  }
+  if (errno) {
+    goto fail;
+  }
+  closedir(d);
+  if (names == NULL && (names = malloc(sizeof(*names))) == NULL) {
+    fprintf(stderr, "Failed to allocate names of %s.\n", path);
+    return NULL;
+  }
+  qsort(names, *n, sizeof(*names), compare_names);
+
+  return names;
+
+  fail:
+    fprintf(stderr, "Failed to read %s: %s\n", path, strerror(errno));
+    closedir(d);
+    for (; *n > 0; (*n)--) {
+      free(names[*n - 1]);
+    }
+    free(names);
+    return NULL;
+}
+
+/* Path of the first link to a file with several, or NULL and records it */
+static const char *first_link(struct tar_writer *w, const struct stat *st,
+                              const char *path, int *err)
+{
+  struct tar_link *l;
+  size_t i;
+
+  *err = 0;
+  for (i = 0; i < w->nlinks; i++) {
+    if (w->links[i].dev == st->st_dev && w->links[i].ino == st->st_ino) {
+      return w->links[i].path;
+    }
+  }
+  if (w->nlinks == w->cap) {
+    w->cap = w->cap ? 2 * w->cap : 16;
+    if ((l = realloc(w->links, w->cap * sizeof(*l))) == NULL) {
+      goto fail;
+    }
+    w->links = l;
+  }
+  l = &w->links[w->nlinks];
+  if ((l->path = strdup(path)) == NULL) {
+    goto fail;
+  }
+  l->dev = st->st_dev;
+  l->ino = st->st_ino;
+  w->nlinks++;
+
+  return NULL;
+
+  fail:
+    fprintf(stderr, "Failed to record the links of %s.\n", path);
+    *err = 1;
+    return NULL;
+}
+
+static int put_data(struct tar_writer *w, const char *path, uint64_t size)
+{
+  uint64_t left = size;
+  ssize_t n;
+  int fd, ret = -1;
+
+  if ((fd = open(path, O_RDONLY)) == -1) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  while (left > 0) {
+    n = read(fd, w->data, left < TAR_WRITE_BUF ? left : TAR_WRITE_BUF);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      fprintf(stderr, "Failed to read %s: %s\n", path,
+              n ? strerror(errno) : "it shrank while written");
+      goto out;
+    }
+    if (put(w, w->data, n)) {
+      goto out;
+    }
+    left -= n;
+  }
+  ret = put(w, NULL, -size & (TAR_BLOCK_SIZE - 1));
+
+  out:
+    close(fd);
+    return ret;
+}
+
+static int put_entry(struct tar_writer *w, const char *root, const char *rel)
+{
+  char path[PATH_MAX], name[PATH_MAX], link[PATH_MAX];
+  const char *first;
+  struct stat st;
+  char **names;
+  size_t n, i;
+  ssize_t len;
+  int ret = 0, err;
+
+  if ((size_t)snprintf(path, sizeof(path), "%s/%s", root, rel)
+      >= sizeof(path)) {
+    fprintf(stderr, "Too long path %s/%s.\n", root, rel);
+    return -1;
+  }
+  if (lstat(path, &st)) {
+    fprintf(stderr, "Failed to stat %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  switch (st.st_mode & S_IFMT) {
+  case S_IFDIR:
+    if ((size_t)snprintf(name, sizeof(name), "%s/", rel) >= sizeof(name)
+        || put_header(w, name, TAR_DIR, st.st_mode, 0, "", 0)
+        || (names = read_names(path, &n)) == NULL) {
+      return -1;
+    }
+    for (i = 0; i < n; i++) {
+      if (ret == 0 && ((size_t)snprintf(name, sizeof(name), "%s/%s", rel,
+                                        names[i]) >= sizeof(name)
+                       || put_entry(w, root, name))) {
+        ret = -1;
+      }
+      free(names[i]);
+    }
+    free(names);
+    return ret;
+  case S_IFREG:
+    first = st.st_nlink > 1 ? first_link(w, &st, rel, &err) : NULL;
+    if (first) {
+      return put_header(w, rel, TAR_LINK, st.st_mode, 0, first, 0);
+    }
+    if (st.st_nlink > 1 && err) {
+      return -1;
+    }
+    return put_header(w, rel, TAR_REG, st.st_mode, st.st_size, "", 0)
+      || put_data(w, path, st.st_size);
+  case S_IFLNK:
+    if ((len = readlink(path, link, sizeof(link) - 1)) == -1) {
+      fprintf(stderr, "Failed to read link %s: %s\n", path, strerror(errno));
+      return -1;
+    }
+    link[len] = '\0';
+    return put_header(w, rel, TAR_SYMLINK, st.st_mode, 0, link, 0);
+  case S_IFCHR:
+    return put_header(w, rel, TAR_CHR, st.st_mode, 0, "", st.st_rdev);
+  case S_IFBLK:
+    return put_header(w, rel, TAR_BLK, st.st_mode, 0, "", st.st_rdev);
+  case S_IFIFO:
+    return put_header(w, rel, TAR_FIFO, st.st_mode, 0, "", 0);
+  default:
+    fprintf(stderr, "Skipping socket %s.\n", path);
+    return 0;
+  }
+}
+
+int tar_write_dir(const char *dir, time_t mtime, tar_out_fn out, void *arg)
+{
+  struct tar_writer w;
+  char **names;
+  size_t n, i;
+  int ret = -1;
+
+  memset(&w, 0, sizeof(w));
+  w.mtime = mtime;
+  w.out = out;
+  w.arg = arg;
+  if ((w.buf = malloc(TAR_WRITE_BUF)) == NULL
+      || (w.data = malloc(TAR_WRITE_BUF)) == NULL) {
+    fprintf(stderr, "Failed to allocate tar buffers.\n");
+    goto out;
+  }
+  if ((names = read_names(dir, &n)) == NULL) {
+    goto out;
+  }
+  ret = 0;
+  for (i = 0; i < n; i++) {
+    if (ret == 0 && put_entry(&w, dir, names[i])) {
+      ret = -1;
+    }
+    free(names[i]);
+  }
+  free(names);
+  if (ret == 0 && (put(&w, NULL, 2 * TAR_BLOCK_SIZE)
+                   || w.out(w.arg, w.buf, w.len))) {
+    ret = -1;
+  }
+
+  out:
+    for (i = 0; i < w.nlinks; i++) {
+      free(w.links[i].path);
+    }
+    free(w.links);
+    free(w.buf);
+    free(w.data);
+    return ret;
+}
@@ -0,0 +1,74 @@
+/*******************************************************************************
+ *
+ * tar.h
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#ifndef BOOTFS_TAR_H
+#define BOOTFS_TAR_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+#include "image.h"
+
+#define TAR_BLOCK_SIZE 512
+
+/* Entry types */
+#define TAR_REG     '0'
+#define TAR_LINK    '1'
+#define TAR_SYMLINK '2'
+#define TAR_CHR     '3'
+#define TAR_BLK     '4'
+#define TAR_DIR     '5'
+#define TAR_FIFO    '6'
+
+/*
+ * An entry of a ustar, GNU (long names) or pax (path, linkpath, size and
+ * mtime records) archive, with those extensions already applied.
+ */
+struct tar_entry {
+  char type;
+  char *path, *link;
+  mode_t mode;                  /* permission bits */
+  uid_t uid;
+  gid_t gid;
+  uint64_t size;
+  uint64_t offset;              /* of the data in the stream */
+  struct timespec mtime;
+  unsigned int devmajor, devminor;
+};
+
+struct tar {
+  struct blob_reader *r;
+  uint64_t left, pad;           /* of the data of the current entry */
+  struct tar_entry e;
+};
+
+void tar_init(struct tar *t, struct blob_reader *r);
+void tar_free(struct tar *t);
+
+/*
+ * Next entry, skipping what's left of the data of the last one. Returns 1,
+ * 0 at the end of the archive, or -1.
+ */
+int tar_next(struct tar *t, struct tar_entry **e);
+
+/* Data of the current entry. Returns bytes read, 0 at its end, or -1. */
+ssize_t tar_read(struct tar *t, void *buf, size_t len);
+
+/* Takes the archive as it's written, returning 0 or -1. */
+typedef int (*tar_out_fn)(void *arg, const void *data, size_t len);
+
+/*
+ * Writes the tree under dir as a ustar archive (pax records for the names
+ * too long for it) that depends only on what's in the tree: each directory
+ * before its entries, which are in byte order of their names, all owned by
+ * root and with the given mtime. The root itself has no entry, files with several
+ * links are hard links to the first of them, and sockets are left out.
+ */
+int tar_write_dir(const char *dir, time_t mtime, tar_out_fn out, void *arg);
+
+#endif
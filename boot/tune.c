@@ -0,0 +1,92 @@
+/*******************************************************************************
+ *
+ * tune.c
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include "path.h"
+#include "tune.h"
+
+#define SYS_CLASS_BDI "/sys/class/bdi"
+#define FUSECTL_TYPE  "fusectl"
+
+static int write_knob(const char *path, unsigned int value)
+{
+  FILE *fp;
+
+  if ((fp = fopen(path, "w")) == NULL) {
+    fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  fprintf(fp, "%u\n", value);
+  if (fclose(fp)) {
+    fprintf(stderr, "Failed to write %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+int tune_read_ahead(dev_t dev, unsigned int read_ahead_kb)
+{
+  char path[PATH_MAX];
+
+  if (read_ahead_kb == 0) {
+    return 0;
+  }
+  snprintf(path, sizeof(path), "%s/%u:%u/read_ahead_kb",
+           SYS_CLASS_BDI, major(dev), minor(dev));
+
+  return write_knob(path, read_ahead_kb);
+}
+
+int tune_fuse_mount(const char *path, const struct fuse_tuning *t)
+{
+  char knob[PATH_MAX];
+  struct stat st;
+  unsigned int kdev;
+  int ret = 0;
+
+  if (stat(path, &st)) {
+    fprintf(stderr, "Failed to stat %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  kdev = major(st.st_dev) << 20 | minor(st.st_dev);
+  if (tune_read_ahead(st.st_dev, t->read_ahead_kb)) {
+    ret = -1;
+  }
+  if (t->max_background == 0 && t->congestion_threshold == 0) {
+    return ret;
+  }
+
+  /* Connections are named by the kernel's device number in fusectl. */
+  if ((mkdir(FUSECTL_DIR, 0755) && errno != EEXIST)
+      || mount(FUSECTL_TYPE, FUSECTL_DIR, FUSECTL_TYPE, 0, NULL)) {
+    fprintf(stderr, "Failed to mount %s: %s\n", FUSECTL_DIR, strerror(errno));
+    return -1;
+  }
+  if (t->max_background) {
+    snprintf(knob, sizeof(knob), "%s/%u/max_background",
+             FUSECTL_DIR, kdev);
+    ret |= write_knob(knob, t->max_background);
+  }
+  if (t->congestion_threshold) {
+    snprintf(knob, sizeof(knob), "%s/%u/congestion_threshold",
+             FUSECTL_DIR, kdev);
+    ret |= write_knob(knob, t->congestion_threshold);
+  }
+  if (umount2(FUSECTL_DIR, MNT_DETACH)) {
+    fprintf(stderr, "Failed to unmount %s: %s\n", FUSECTL_DIR, strerror(errno));
+  }
+
+  return ret ? -1 : 0;
+}
@@ -0,0 +1,30 @@
+/*******************************************************************************
+ *
+ * tune.h
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#ifndef BOOTFS_TUNE_H
+#define BOOTFS_TUNE_H
+
+#include <sys/types.h>
+
+/*
+ * Kernel-side knobs of the lazy archive mount, which we can change from
+ * outside of the FUSE server. 0 keeps the kernel's default.
+ */
+struct fuse_tuning {
+  unsigned int max_background;       /* outstanding async (readahead) reqs */
+  unsigned int congestion_threshold; /* async reqs before congested */
+  unsigned int read_ahead_kb;        /* bdi of the FUSE mount */
+};
+
+/* Apply to the FUSE connection which serves path. */
+int tune_fuse_mount(const char *path, const struct fuse_tuning *t);
+
+/* read_ahead_kb of the bdi of a device (e.g. the loop device on top). */
+int tune_read_ahead(dev_t dev, unsigned int read_ahead_kb);
+
+#endif
@@ -0,0 +1,923 @@
+/*******************************************************************************
+ *
+ * zindex.c
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "zindex.h"
+
+#define ZSTD_MAGIC 0xfd2fb528
+#define ZSTD_SKIPPABLE_MAGIC 0x184d2a50 /* to 0x184d2a5f */
+#define ZSTD_HEADER_MAX 18
+#define SKIP_BUF_SIZE (64 * 1024)
+
+static int read_at(const struct blob *b, void *buf, size_t len, uint64_t off)
+{
+  size_t got = 0;
+  ssize_t ret;
+
+  while (got < len) {
+    ret = pread(b->fd, (uint8_t *)buf + got, len - got, b->offset + off + got);
+    if (ret <= 0) {
+      if (ret < 0 && errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "Failed to read a blob: %s\n",
+              ret < 0 ? strerror(errno) : "truncated");
+      return -1;
+    }
+    got += ret;
+  }
+
+  return 0;
+}
+
+int zindex_format(const struct blob *b)
+{
+  uint8_t magic[4] = { 0 };
+
+  if (b->size >= sizeof(magic) && read_at(b, magic, sizeof(magic), 0)) {
+    return -1;
+  }
+  if (magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f
+      && magic[3] == 0xfd) {
+    return ZINDEX_ZSTD;
+  }
+  if (magic[0] == 0x1f && magic[1] == 0x8b) {
+    return ZINDEX_GZIP;
+  }
+
+  return ZINDEX_NONE;
+}
+
+/* Refill the input; 0 at the end of the blob */
+static ssize_t fill(struct zdec *d)
+{
+  uint64_t left = d->b->size - d->pos;
+  size_t n = left < BLOB_READ_SIZE ? left : BLOB_READ_SIZE;
+
+  if (n && read_at(d->b, d->in, n, d->pos)) {
+    return -1;
+  }
+  d->pos += n;
+  d->z.next_in = d->in;
+  d->z.avail_in = n;
+#ifdef WITH_ZSTD
+  d->zin.size = n;
+  d->zin.pos = 0;
+#endif
+
+  return n;
+}
+
+int zdec_open(struct zdec *d, const struct blob *b, int format,
+              const struct zpoint *p)
+{
+  uint8_t byte;
+
+  memset(d, 0, sizeof(*d));
+  d->b = b;
+  d->format = format;
+  d->pos = p ? p->in : 0;
+#ifndef WITH_ZSTD
+  if (format == ZINDEX_ZSTD) {
+    fprintf(stderr, "zstd-compressed layers need a build WITH_ZSTD=1.\n");
+    return -1;
+  }
+#endif
+  if ((d->in = malloc(BLOB_READ_SIZE)) == NULL) {
+    fprintf(stderr, "Failed to allocate a blob buffer.\n");
+    return -1;
+  }
+#ifdef WITH_ZSTD
+  if (format == ZINDEX_ZSTD) {
+    if ((d->zs = ZSTD_createDStream()) == NULL) {
+      fprintf(stderr, "Failed to initialize zstd.\n");
+      free(d->in);
+      return -1;
+    }
+    d->zin.src = d->in;
+    return 0;
+  }
+#endif
+  /* Mid-member, as raw deflate with the history before the point */
+  d->raw = p && p->window;
+  if (inflateInit2(&d->z, d->raw ? -15 : 15 + 16) != Z_OK) {
+    fprintf(stderr, "Failed to initialize zlib.\n");
+    free(d->in);
+    return -1;
+  }
+  if (d->raw && ((p->bits && read_at(b, &byte, 1, p->in - 1))
+                 || (p->bits && inflatePrime(&d->z, p->bits,
+                                             byte >> (8 - p->bits)) != Z_OK)
+                 || inflateSetDictionary(&d->z, p->window,
+                                         ZINDEX_WINDOW) != Z_OK)) {
+    fprintf(stderr, "Failed to start inflating a layer mid-way.\n");
+    zdec_close(d);
+    return -1;
+  }
+
+  return 0;
+}
+
+void zdec_close(struct zdec *d)
+{
+#ifdef WITH_ZSTD
+  if (d->format == ZINDEX_ZSTD) {
+    ZSTD_freeDStream(d->zs);
+  } else
+#endif
+  {
+    inflateEnd(&d->z);
+  }
+  free(d->in);
+  d->in = NULL;
+}
+
+/* Past the trailer of a member inflated raw */
+static int skip_trailer(struct zdec *d)
+{
+  size_t n;
+  ssize_t ret;
+
+  for (size_t left = 8; left > 0; left -= n) {
+    if (d->z.avail_in == 0 && (ret = fill(d)) <= 0) {
+      if (ret == 0) {
+        fprintf(stderr, "Truncated gzip stream.\n");
+      }
+      return -1;
+    }
+    n = d->z.avail_in < left ? d->z.avail_in : left;
+    d->z.next_in += n;
+    d->z.avail_in -= n;
+  }
+
+  return 0;
+}
+
+/* 1 if another member follows (not zeros padding the blob), 0, or -1 */
+static int next_member(struct zdec *d)
+{
+  if (d->z.avail_in == 0 && d->pos < d->b->size && fill(d) < 0) {
+    return -1;
+  }
+
+  return d->z.avail_in > 0 && d->z.next_in[0] == 0x1f;
+}
+
+static ssize_t read_gzip(struct zdec *d, void *buf, size_t len)
+{
+  ssize_t n;
+  int ret;
+
+  d->z.next_out = buf;
+  d->z.avail_out = len;
+  while (d->z.avail_out == len) {
+    if (d->z.avail_in == 0 && (n = fill(d)) <= 0) {
+      if (n == 0) {
+        fprintf(stderr, "Truncated gzip stream.\n");
+      }
+      return -1;
+    }
+    ret = inflate(&d->z, Z_NO_FLUSH);
+    if (ret == Z_STREAM_END) {
+      if ((d->raw && skip_trailer(d)) || (ret = next_member(d)) < 0) {
+        return -1;
+      }
+      if (ret == 0) {
+        d->end = 1;
+        break;
+      }
+      d->raw = 0;
+      inflateReset2(&d->z, 15 + 16);
+    } else if (ret != Z_OK) {
+      fprintf(stderr, "Failed to inflate a layer: %s\n",
+              d->z.msg ? d->z.msg : "corrupt");
+      return -1;
+    }
+  }
+
+  return len - d->z.avail_out;
+}
+
+#ifdef WITH_ZSTD
+static ssize_t read_zstd(struct zdec *d, void *buf, size_t len)
+{
+  ZSTD_outBuffer out = { buf, len, 0 };
+  size_t ret;
+
+  while (out.pos == 0) {
+    if (d->zin.pos == d->zin.size && d->pos < d->b->size && fill(d) < 0) {
+      return -1;
+    }
+    if (d->zin.pos == d->zin.size && !d->inframe) {
+      d->end = 1;
+      break;
+    }
+    ret = ZSTD_decompressStream(d->zs, &out, &d->zin);
+    if (ZSTD_isError(ret)) {
+      fprintf(stderr, "Failed to decompress a layer: %s\n",
+              ZSTD_getErrorName(ret));
+      return -1;
+    }
+    d->inframe = ret != 0;
+    if (out.pos == 0 && d->zin.pos == d->zin.size
+        && d->pos == d->b->size && d->inframe) {
+      fprintf(stderr, "Truncated zstd stream.\n");
+      return -1;
+    }
+  }
+
+  return out.pos;
+}
+#endif
+
+ssize_t zdec_read(struct zdec *d, void *buf, size_t len)
+{
+  if (d->end || len == 0) {
+    return 0;
+  }
+#ifdef WITH_ZSTD
+  if (d->format == ZINDEX_ZSTD) {
+    return read_zstd(d, buf, len);
+  }
+#endif
+
+  return read_gzip(d, buf, len);
+}
+
+static int stopped(struct zindex *ix)
+{
+  int stop;
+
+  pthread_mutex_lock(&ix->lock);
+  stop = ix->stop;
+  pthread_mutex_unlock(&ix->lock);
+
+  return stop;
+}
+
+/* Publish a point, with the window ending at have of the circular win */
+static int add_point(struct zindex *ix, uint64_t in, uint64_t out, int bits,
+                     const uint8_t *win, size_t have)
+{
+  struct zpoint *points;
+  uint8_t *window = NULL;
+
+  if (win) {
+    if ((window = malloc(ZINDEX_WINDOW)) == NULL) {
+      fprintf(stderr, "Failed to allocate a layer index.\n");
+      return -1;
+    }
+    memcpy(window, win + have, ZINDEX_WINDOW - have);
+    memcpy(window + ZINDEX_WINDOW - have, win, have);
+  }
+  pthread_mutex_lock(&ix->lock);
+  if (ix->npoints == ix->cap) {
+    if ((points = realloc(ix->points, (ix->cap ? ix->cap * 2 : 64)
+                          * sizeof(*points))) == NULL) {
+      pthread_mutex_unlock(&ix->lock);
+      fprintf(stderr, "Failed to allocate a layer index.\n");
+      free(window);
+      return -1;
+    }
+    ix->points = points;
+    ix->cap = ix->cap ? ix->cap * 2 : 64;
+  }
+  ix->points[ix->npoints].in = in;
+  ix->points[ix->npoints].out = out;
+  ix->points[ix->npoints].bits = bits;
+  ix->points[ix->npoints].window = window;
+  ix->npoints++;
+  pthread_cond_broadcast(&ix->cond);
+  pthread_mutex_unlock(&ix->lock);
+
+  return 0;
+}
+
+static void finish(struct zindex *ix, uint64_t size)
+{
+  pthread_mutex_lock(&ix->lock);
+  ix->size = size;
+  ix->done = 1;
+  pthread_cond_broadcast(&ix->cond);
+  pthread_mutex_unlock(&ix->lock);
+}
+
+/*
+ * Inflate a gzip'ed blob block by block into a circular window, as zran
+ * does, taking a point at the first block (or member) boundary after each
+ * ZINDEX_SPAN bytes of output.
+ */
+static int index_gzip(struct zindex *ix)
+{
+  struct zdec d;
+  uint8_t *win;
+  uint64_t out = 0, last = 0;
+  size_t have = 0, before;
+  ssize_t n;
+  int ret = -1, z;
+
+  if (zdec_open(&d, ix->b, ZINDEX_GZIP, NULL)) {
+    return -1;
+  }
+  if ((win = calloc(1, ZINDEX_WINDOW)) == NULL) {
+    fprintf(stderr, "Failed to allocate a layer index.\n");
+    goto out;
+  }
+  if (add_point(ix, 0, 0, 0, NULL, 0)) {
+    goto out;
+  }
+  for (;;) {
+    if (d.z.avail_in == 0) {
+      if (stopped(ix) || (n = fill(&d)) < 0) {
+        goto out;
+      }
+      if (n == 0) {
+        fprintf(stderr, "Truncated gzip stream.\n");
+        goto out;
+      }
+    }
+    if (have == ZINDEX_WINDOW) {
+      have = 0;
+    }
+    d.z.next_out = win + have;
+    d.z.avail_out = ZINDEX_WINDOW - have;
+    before = d.z.avail_out;
+    z = inflate(&d.z, Z_BLOCK);
+    have += before - d.z.avail_out;
+    out += before - d.z.avail_out;
+    if (z == Z_STREAM_END) {
+      if ((z = next_member(&d)) < 0) {
+        goto out;
+      }
+      if (z == 0) {
+        break;
+      }
+      inflateReset(&d.z);
+      if (out - last >= ZINDEX_SPAN) {
+        if (add_point(ix, d.pos - d.z.avail_in, out, 0, NULL, 0)) {
+          goto out;
+        }
+        last = out;
+      }
+    } else if (z != Z_OK) {
+      fprintf(stderr, "Failed to inflate a layer: %s\n",
+              d.z.msg ? d.z.msg : "corrupt");
+      goto out;
+    } else if ((d.z.data_type & 128) && !(d.z.data_type & 64)
+               && out - last >= ZINDEX_SPAN) {
+      if (add_point(ix, d.pos - d.z.avail_in, out, d.z.data_type & 7, win,
+                    have)) {
+        goto out;
+      }
+      last = out;
+    }
+  }
+  finish(ix, out);
+  ret = 0;
+
+  out:
+    free(win);
+    zdec_close(&d);
+    return ret;
+}
+
+#ifdef WITH_ZSTD
+static uint64_t get_le(const uint8_t *p, size_t len)
+{
+  uint64_t v = 0;
+
+  while (len-- > 0) {
+    v = v << 8 | p[len];
+  }
+
+  return v;
+}
+
+/* Output of a frame which doesn't tell its size, decompressing it */
+static int frame_size(const struct blob *b, uint64_t pos, uint64_t end,
+                      uint64_t *size)
+{
+  ZSTD_DStream *zs = ZSTD_createDStream();
+  uint8_t *in = malloc(BLOB_READ_SIZE), *buf = malloc(ZSTD_DStreamOutSize());
+  ZSTD_inBuffer zin = { in, 0, 0 };
+  ZSTD_outBuffer zout;
+  size_t ret = 1, n;
+  int err = -1;
+
+  if (zs == NULL || in == NULL || buf == NULL) {
+    fprintf(stderr, "Failed to initialize zstd.\n");
+    goto out;
+  }
+  for (*size = 0; ret != 0; *size += zout.pos) {
+    if (zin.pos == zin.size) {
+      if (pos == end) {
+        fprintf(stderr, "Truncated zstd stream.\n");
+        goto out;
+      }
+      n = end - pos < BLOB_READ_SIZE ? end - pos : BLOB_READ_SIZE;
+      if (read_at(b, in, n, pos)) {
+        goto out;
+      }
+      pos += n;
+      zin.size = n;
+      zin.pos = 0;
+    }
+    zout.dst = buf;
+    zout.size = ZSTD_DStreamOutSize();
+    zout.pos = 0;
+    ret = ZSTD_decompressStream(zs, &zout, &zin);
+    if (ZSTD_isError(ret)) {
+      fprintf(stderr, "Failed to decompress a layer: %s\n",
+              ZSTD_getErrorName(ret));
+      goto out;
+    }
+  }
+  err = 0;
+
+  out:
+    ZSTD_freeDStream(zs);
+    free(in);
+    free(buf);
+    return err;
+}
+
+/*
+ * Frames of zstd decompress on their own: walk their headers and blocks
+ * (without decompressing them, as long as they have their content size),
+ * taking a point at the first frame after each ZINDEX_SPAN bytes.
+ */
+static int index_zstd(struct zindex *ix)
+{
+  static const size_t did_len[] = { 0, 1, 2, 4 };
+  const struct blob *b = ix->b;
+  uint8_t h[ZSTD_HEADER_MAX];
+  uint64_t pos = 0, end, out = 0, last = 0, size;
+  uint32_t magic, block;
+  size_t n, off, fcs_len;
+  uint8_t fhd;
+
+  if (add_point(ix, 0, 0, 0, NULL, 0)) {
+    return -1;
+  }
+  while (pos < b->size) {
+    n = b->size - pos < sizeof(h) ? b->size - pos : sizeof(h);
+    if (stopped(ix) || n < 8 || read_at(b, h, n, pos)) {
+      goto bad;
+    }
+    magic = get_le(h, 4);
+    if ((magic & 0xfffffff0) == ZSTD_SKIPPABLE_MAGIC) {
+      pos += 8 + get_le(h + 4, 4);
+      continue;
+    }
+    fhd = h[4];
+    if (magic != ZSTD_MAGIC || (fhd & 0x08)) {
+      goto bad;
+    }
+    if (out - last >= ZINDEX_SPAN) {
+      if (add_point(ix, pos, out, 0, NULL, 0)) {
+        return -1;
+      }
+      last = out;
+    }
+    /* Frame_Header_Descriptor: FCS size, single segment, checksum, dict */
+    fcs_len = fhd >> 6 ? 1 << (fhd >> 6) : (fhd >> 5 & 1);
+    off = 5 + !(fhd >> 5 & 1) + did_len[fhd & 3];
+    if (off + fcs_len > n) {
+      goto bad;
+    }
+    size = get_le(h + off, fcs_len) + (fcs_len == 2 ? 256 : 0);
+    for (end = pos + off + fcs_len; ; ) {
+      if (end + 3 > b->size || read_at(b, h, 3, end)) {
+        goto bad;
+      }
+      block = get_le(h, 3);
+      if ((block >> 1 & 3) == 3) {
+        goto bad;
+      }
+      end += 3 + ((block >> 1 & 3) == 1 ? 1 : block >> 3);
+      if (block & 1) {
+        break;
+      }
+    }
+    end += fhd & 0x04 ? 4 : 0;
+    if (end > b->size) {
+      goto bad;
+    }
+    if (fcs_len == 0 && frame_size(b, pos, end, &size)) {
+      return -1;
+    }
+    out += size;
+    pos = end;
+  }
+  finish(ix, out);
+
+  return 0;
+
+  bad:
+    if (!stopped(ix)) {
+      fprintf(stderr, "Bad zstd frame in a layer.\n");
+    }
+    return -1;
+}
+#endif
+
+static void *build_indexes(void *arg)
+{
+  struct zindexer *zi = arg;
+  struct zindex *ix;
+  int ret;
+
+  for (;;) {
+    pthread_mutex_lock(&zi->lock);
+    ix = zi->next < zi->n ? &zi->ix[zi->next++] : NULL;
+    pthread_mutex_unlock(&zi->lock);
+    if (ix == NULL) {
+      break;
+    }
+    if (ix->format == ZINDEX_NONE) {
+      continue;
+    }
+#ifdef WITH_ZSTD
+    if (ix->format == ZINDEX_ZSTD) {
+      ret = index_zstd(ix);
+    } else
+#endif
+    {
+      ret = index_gzip(ix);
+    }
+    if (ret) {
+      pthread_mutex_lock(&ix->lock);
+      ix->failed = 1;
+      pthread_cond_broadcast(&ix->cond);
+      pthread_mutex_unlock(&ix->lock);
+    }
+  }
+
+  return NULL;
+}
+
+struct zindexer *zindexer_start(const struct blob *blobs, size_t n,
+                                int threads)
+{
+  struct zindexer *zi;
+  size_t compressed = 0;
+  int format;
+
+  if ((zi = calloc(1, sizeof(*zi))) == NULL
+      || (zi->ix = calloc(n, sizeof(*zi->ix))) == NULL
+      || (zi->tids = calloc(threads, sizeof(*zi->tids))) == NULL) {
+    fprintf(stderr, "Failed to allocate layer indexes.\n");
+    if (zi) {
+      free(zi->ix);
+      free(zi);
+    }
+    return NULL;
+  }
+  pthread_mutex_init(&zi->lock, NULL);
+  for (; zi->n < n; zi->n++) {
+    struct zindex *ix = &zi->ix[zi->n];
+
+    if ((format = zindex_format(&blobs[zi->n])) < 0) {
+      goto err;
+    }
+#ifndef WITH_ZSTD
+    if (format == ZINDEX_ZSTD) {
+      format = ZINDEX_NONE;     /* the reader tells it's unsupported */
+    }
+#endif
+    compressed += format != ZINDEX_NONE;
+    ix->b = &blobs[zi->n];
+    ix->format = format;
+    ix->threads = threads;
+    pthread_mutex_init(&ix->lock, NULL);
+    pthread_cond_init(&ix->cond, NULL);
+  }
+  while ((size_t)zi->nthreads < compressed && zi->nthreads < threads) {
+    if (pthread_create(&zi->tids[zi->nthreads], NULL, build_indexes, zi)) {
+      fprintf(stderr, "Failed to start indexing layers.\n");
+      goto err;
+    }
+    zi->nthreads++;
+  }
+
+  return zi;
+
+  err:
+    zindexer_free(zi);
+    return NULL;
+}
+
+void zindexer_free(struct zindexer *zi)
+{
+  struct zindex *ix;
+
+  for (size_t i = 0; i < zi->n; i++) {
+    ix = &zi->ix[i];
+    pthread_mutex_lock(&ix->lock);
+    ix->stop = 1;
+    pthread_mutex_unlock(&ix->lock);
+  }
+  for (int i = 0; i < zi->nthreads; i++) {
+    pthread_join(zi->tids[i], NULL);
+  }
+  for (size_t i = 0; i < zi->n; i++) {
+    ix = &zi->ix[i];
+    for (size_t j = 0; j < ix->npoints; j++) {
+      free(ix->points[j].window);
+    }
+    free(ix->points);
+    pthread_mutex_destroy(&ix->lock);
+    pthread_cond_destroy(&ix->cond);
+  }
+  pthread_mutex_destroy(&zi->lock);
+  free(zi->ix);
+  free(zi->tids);
+  free(zi);
+}
+
+/* 1 with span s from p to end, 0 if not indexed yet, -1 if there's none */
+static int span_bounds(const struct zindex *ix, size_t s, struct zpoint *p,
+                       uint64_t *end)
+{
+  if (s + 1 < ix->npoints || (ix->done && s < ix->npoints)) {
+    *p = ix->points[s];
+    *end = s + 1 < ix->npoints ? ix->points[s + 1].out : ix->size;
+    return 1;
+  }
+
+  return ix->done || ix->failed ? -1 : 0;
+}
+
+static int decode_span(const struct zindex *ix, const struct zpoint *p,
+                       size_t len, struct zspan *z)
+{
+  struct zdec d;
+  uint8_t *data;
+  ssize_t n = 0;
+
+  z->len = 0;
+  if (len > z->cap) {
+    if ((data = realloc(z->data, len)) == NULL) {
+      fprintf(stderr, "Failed to allocate a layer span.\n");
+      return -1;
+    }
+    z->data = data;
+    z->cap = len;
+  }
+  if (zdec_open(&d, ix->b, ix->format, p)) {
+    return -1;
+  }
+  while (z->len < len && (n = zdec_read(&d, z->data + z->len,
+                                        len - z->len)) > 0) {
+    z->len += n;
+  }
+  zdec_close(&d);
+  if (n == 0 && z->len < len) {
+    fprintf(stderr, "Truncated layer.\n");
+  }
+
+  return z->len < len ? -1 : 0;
+}
+
+/* A worker decompressing spans ahead of the reader into its slots */
+static void *decode_spans(void *arg)
+{
+  struct zreader *zr = arg;
+  struct zindex *ix = zr->ix;
+  struct zspan own = { 0 }, tmp, *slot;
+  struct zpoint p;
+  uint64_t end;
+  size_t s;
+
+  pthread_mutex_lock(&ix->lock);
+  while (!zr->stop) {
+    if (zr->next < zr->cur) {
+      zr->next = zr->cur;
+    }
+    s = zr->next;
+    if (s >= zr->cur + zr->nslots || span_bounds(ix, s, &p, &end) <= 0) {
+      pthread_cond_wait(&ix->cond, &ix->lock);
+      continue;
+    }
+    zr->next++;
+    if (end - p.out > ZINDEX_SPAN_MAX) {
+      continue;                 /* for the reader */
+    }
+    pthread_mutex_unlock(&ix->lock);
+    own.span = s;
+    own.failed = decode_span(ix, &p, end - p.out, &own) != 0;
+    pthread_mutex_lock(&ix->lock);
+    slot = &zr->slots[s % zr->nslots];
+    if (s >= zr->cur && slot->span != s) {
+      tmp = *slot;
+      *slot = own;
+      own = tmp;
+      pthread_cond_broadcast(&ix->cond);
+    }
+  }
+  pthread_mutex_unlock(&ix->lock);
+  free(own.data);
+
+  return NULL;
+}
+
+int zreader_open(struct zreader *zr, struct zindex *ix)
+{
+  memset(zr, 0, sizeof(*zr));
+  zr->ix = ix;
+  zr->nslots = 2 * ix->threads;
+  if ((zr->slots = calloc(zr->nslots, sizeof(*zr->slots))) == NULL
+      || (zr->tids = calloc(ix->threads, sizeof(*zr->tids))) == NULL) {
+    fprintf(stderr, "Failed to allocate a layer reader.\n");
+    free(zr->slots);
+    return -1;
+  }
+  for (size_t i = 0; i < zr->nslots; i++) {
+    zr->slots[i].span = SIZE_MAX;
+  }
+  while (zr->nthreads < ix->threads) {
+    if (pthread_create(&zr->tids[zr->nthreads], NULL, decode_spans, zr)) {
+      fprintf(stderr, "Failed to start reading a layer.\n");
+      zreader_close(zr);
+      return -1;
+    }
+    zr->nthreads++;
+  }
+
+  return 0;
+}
+
+void zreader_close(struct zreader *zr)
+{
+  pthread_mutex_lock(&zr->ix->lock);
+  zr->stop = 1;
+  pthread_cond_broadcast(&zr->ix->cond);
+  pthread_mutex_unlock(&zr->ix->lock);
+  for (int i = 0; i < zr->nthreads; i++) {
+    pthread_join(zr->tids[i], NULL);
+  }
+  if (zr->loaded == 2) {
+    zdec_close(&zr->dec);
+  }
+  for (size_t i = 0; i < zr->nslots; i++) {
+    free(zr->slots[i].data);
+  }
+  free(zr->slots);
+  free(zr->tids);
+}
+
+/* Wait for span cur: 1 in its slot, 2 to read in order, 0 past the end */
+static int load(struct zreader *zr)
+{
+  struct zindex *ix = zr->ix;
+  struct zspan *slot = &zr->slots[zr->cur % zr->nslots];
+  struct zpoint p;
+  uint64_t end;
+  int ret;
+
+  pthread_mutex_lock(&ix->lock);
+  for (;;) {
+    if (slot->span == zr->cur) {
+      ret = slot->failed ? -1 : 1;
+      break;
+    }
+    if ((ret = span_bounds(ix, zr->cur, &p, &end)) < 0) {
+      ret = ix->failed ? -1 : 0;
+      break;
+    }
+    if (ret > 0 && end - p.out > ZINDEX_SPAN_MAX) {
+      ret = 2;
+      break;
+    }
+    pthread_cond_wait(&ix->cond, &ix->lock);
+  }
+  pthread_mutex_unlock(&ix->lock);
+  if (ret == 2) {
+    if (zdec_open(&zr->dec, ix->b, ix->format, &p)) {
+      return -1;
+    }
+    zr->left = end - p.out;
+  }
+  zr->loaded = ret > 0 ? ret : 0;
+
+  return ret;
+}
+
+static void next_span(struct zreader *zr, size_t span)
+{
+  if (zr->loaded == 2) {
+    zdec_close(&zr->dec);
+  }
+  zr->loaded = 0;
+  zr->pos = 0;
+  pthread_mutex_lock(&zr->ix->lock);
+  zr->cur = span;
+  pthread_cond_broadcast(&zr->ix->cond);
+  pthread_mutex_unlock(&zr->ix->lock);
+}
+
+/* Read (or skip if buf is NULL) up to len bytes of the current span */
+static ssize_t advance(struct zreader *zr, void *buf, size_t len)
+{
+  uint8_t skip[SKIP_BUF_SIZE];
+  struct zspan *slot;
+  ssize_t n;
+  int ret;
+
+  while (!zr->loaded) {
+    if (zr->end) {
+      return 0;
+    }
+    if ((ret = load(zr)) <= 0) {
+      zr->end = ret == 0;
+      return ret;
+    }
+    if (ret == 1 && zr->slots[zr->cur % zr->nslots].len == 0) {
+      next_span(zr, zr->cur + 1);
+    }
+  }
+  if (zr->loaded == 2) {
+    if (len > zr->left) {
+      len = zr->left;
+    }
+    if (buf == NULL && len > sizeof(skip)) {
+      len = sizeof(skip);
+    }
+    if ((n = zdec_read(&zr->dec, buf ? buf : skip, len)) <= 0) {
+      if (n == 0) {
+        fprintf(stderr, "Truncated layer.\n");
+      }
+      return -1;
+    }
+    if ((zr->left -= n) == 0) {
+      next_span(zr, zr->cur + 1);
+    }
+  } else {
+    slot = &zr->slots[zr->cur % zr->nslots];
+    n = len < slot->len - zr->pos ? len : slot->len - zr->pos;
+    if (buf) {
+      memcpy(buf, slot->data + zr->pos, n);
+    }
+    if ((zr->pos += n) == slot->len) {
+      next_span(zr, zr->cur + 1);
+    }
+  }
+  zr->out += n;
+
+  return n;
+}
+
+ssize_t zreader_read(struct zreader *zr, void *buf, size_t len)
+{
+  return len ? advance(zr, buf, len) : 0;
+}
+
+/* Jump to the last span starting by target, if it's past the current one */
+static void seek_span(struct zreader *zr, uint64_t target)
+{
+  struct zindex *ix = zr->ix;
+  size_t lo = zr->cur + 1, hi, mid;
+  uint64_t out = 0;
+
+  pthread_mutex_lock(&ix->lock);
+  for (hi = ix->npoints; lo < hi; ) {
+    mid = lo + (hi - lo) / 2;
+    if (ix->points[mid].out <= target) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo > zr->cur + 1) {
+    out = ix->points[lo - 1].out;
+  }
+  pthread_mutex_unlock(&ix->lock);
+  if (lo > zr->cur + 1) {
+    next_span(zr, lo - 1);
+    zr->out = out;
+  }
+}
+
+int zreader_skip(struct zreader *zr, uint64_t len)
+{
+  uint64_t target = zr->out + len, left;
+  ssize_t n;
+
+  for (seek_span(zr, target); zr->out < target; seek_span(zr, target)) {
+    left = target - zr->out;
+    if ((n = advance(zr, NULL, left < SIZE_MAX ? left : SIZE_MAX)) <= 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
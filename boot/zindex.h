@@ -0,0 +1,136 @@
+/*******************************************************************************
+ *
+ * zindex.h
+ *
+ * Copyright 2019, Kohei Tokunaga
+ * Licensed under Apache License, Version 2.0
+ *
+ ******************************************************************************/
+#ifndef BOOTFS_ZINDEX_H
+#define BOOTFS_ZINDEX_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <zlib.h>
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+#include "image.h"
+
+enum {
+  ZINDEX_NONE,
+  ZINDEX_GZIP,
+  ZINDEX_ZSTD,
+};
+
+#define ZINDEX_SPAN (4 << 20)             /* output between access points */
+#define ZINDEX_SPAN_MAX (4 * ZINDEX_SPAN) /* longer ones are read in order */
+#define ZINDEX_WINDOW 32768
+
+/* Format of a blob by its magic, or -1 */
+int zindex_format(const struct blob *b);
+
+/*
+ * A point of a compressed blob to start decompressing from: the start of
+ * a gzip member or of a zstd frame, or a deflate block in a gzip member
+ * with the bits of its first byte and the 32 KiB of output before it
+ * (the history its back-references may reach), as zlib's zran keeps them.
+ */
+struct zpoint {
+  uint64_t in;                  /* in the blob */
+  uint64_t out;                 /* decompressed */
+  int bits;
+  uint8_t *window;              /* or NULL at a member or frame */
+};
+
+/* Decompresses a blob from a point, over members and frames, to its end. */
+struct zdec {
+  const struct blob *b;
+  int format;
+  uint64_t pos;                 /* in the blob */
+  int raw;                      /* deflate without a gzip header */
+  int inframe, end;
+  uint8_t *in;
+  z_stream z;
+#ifdef WITH_ZSTD
+  ZSTD_DStream *zs;
+  ZSTD_inBuffer zin;
+#endif
+};
+
+/* From the start of the blob if p is NULL */
+int zdec_open(struct zdec *d, const struct blob *b, int format,
+              const struct zpoint *p);
+void zdec_close(struct zdec *d);
+
+/* Returns bytes read, 0 at the end, or -1. */
+ssize_t zdec_read(struct zdec *d, void *buf, size_t len);
+
+/*
+ * Access points of a compressed blob, about every ZINDEX_SPAN bytes of its
+ * output: it's decompressed once by a builder thread which publishes them
+ * as it goes, and spans between them decompress on their own, so that a
+ * reader can have several threads decompress the spans ahead of it while
+ * the blob is still being indexed.
+ */
+struct zindex {
+  const struct blob *b;
+  int format, threads;          /* of the readers */
+  struct zpoint *points;
+  size_t npoints, cap;
+  uint64_t size;                /* decompressed, once done */
+  int done, failed, stop;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+/* Builds the indexes of compressed blobs, the lowest first, a blob each. */
+struct zindexer {
+  struct zindex *ix;
+  size_t n, next;
+  pthread_t *tids;
+  int nthreads;
+  pthread_mutex_t lock;
+};
+
+/* NULL with an error, or if there's nothing to index. */
+struct zindexer *zindexer_start(const struct blob *blobs, size_t n,
+                                int threads);
+
+/* Stops building, and frees the indexes. */
+void zindexer_free(struct zindexer *zi);
+
+/* Reads an indexed blob in order, the spans ahead decompressed in threads */
+struct zspan {
+  size_t span;
+  uint8_t *data;
+  size_t len, cap;
+  int failed;
+};
+
+struct zreader {
+  struct zindex *ix;
+  struct zspan *slots;          /* span s in s % nslots */
+  size_t nslots;
+  size_t cur, next;             /* span read, and next to decompress */
+  size_t pos;                   /* in cur */
+  int loaded, end, stop;
+  struct zdec dec;              /* of cur if it's too long for a slot */
+  uint64_t left;
+  uint64_t out;
+  pthread_t *tids;
+  int nthreads;
+};
+
+int zreader_open(struct zreader *zr, struct zindex *ix);
+void zreader_close(struct zreader *zr);
+
+/* Returns bytes read, 0 at the end, or -1. */
+ssize_t zreader_read(struct zreader *zr, void *buf, size_t len);
+
+/* Skip exactly len bytes, over whole spans without decompressing them. */
+int zreader_skip(struct zreader *zr, uint64_t len);
+
+#endif
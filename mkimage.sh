@@ -28,75 +28,83 @@ function genarchive {
     genisoimage -Ro "${ARCHIVE_FILE}" "${ORG_ROOTFS_DIR}" > /dev/null 2>&1
 }
 
-function import_so_dependency {
-    local TARGET_BIN="${1}"
-    local TARGET_DIR="${2}"
-
-    ldd "${TARGET_BIN}" \
-        | grep so \
-        | sed -e '/^[^\t]/ d' \
-        | sed -e 's/\t//' \
-        | sed -e 's/.*=..//' \
-        | sed -e 's/ (0.*)//' \
-        | sort \
-        | uniq \
-        | while read TARGET_SO
-    do
-        local ORG_TARGET_SO_DIR=$(dirname "${TARGET_SO}")
-        local NEW_TARGET_SO_DIR="${TARGET_DIR}/${ORG_TARGET_SO_DIR}"
-        mkdir -p "${NEW_TARGET_SO_DIR}"
-        cp "${TARGET_SO}" "${NEW_TARGET_SO_DIR}"
-    done
-}
+# Lists type, mode, owners, mtime, size and link target of every file, then
+# the digest of every regular file's content: rootfs trees with the same list
+# make the same archive. Directories go without mtimes, as mountpoints are
+# made in them on each conversion.
+function digest_files {
+    local ROOTFS_DIR="${1}"
+    local FILES_FILE="${2}"
 
-function install_layer {
-    local LAYER_DIR="${1}"
-    local IMAGE_DIR="${2}"
-    local MANIFEST_JSON="${3}"
-    local CONFIG_JSON="${4}"
-
-    local TMPFILE=$(mktemp)
-    local LAYER_NAME=layer.tar
-    find "${LAYER_DIR}" | xargs -I{} touch -d "1955/11/5 00:00:00" {}
-    tar cf "${IMAGE_DIR}/${LAYER_NAME}" --directory="${LAYER_DIR}" .
-    local LAYER_HASH=""
-    LAYER_HASH=$(sha256sum "${IMAGE_DIR}/${LAYER_NAME}" | sed -E 's/^([^ ]*).+$/\1/g')
-    mkdir "${IMAGE_DIR}/${LAYER_HASH}"
-    mv "${IMAGE_DIR}/${LAYER_NAME}" \
-       "${IMAGE_DIR}/${LAYER_HASH}/${LAYER_NAME}"
-    jq '.[0].Layers |= . + [ "'"${LAYER_HASH}/${LAYER_NAME}"'" ]' \
-       "${MANIFEST_JSON}" > "${TMPFILE}"
-    cat "${TMPFILE}" > "${MANIFEST_JSON}"
-    jq '.rootfs.diff_ids |= . + [ "sha256:'"${LAYER_HASH}"'" ]' \
-       "${CONFIG_JSON}" > "${TMPFILE}"
-    cat "${TMPFILE}" > "${CONFIG_JSON}"
-    rm "${TMPFILE}"
+    ( cd "${ROOTFS_DIR}" \
+          && ( find . -type d -printf '%y %m %U %G %P\n' \
+                   && find . ! -type d -printf '%y %m %U %G %T@ %s %P -> %l\n' ) \
+              | LC_ALL=C sort \
+          && find . -type f -print0 | LC_ALL=C sort -z | xargs -0 -r sha256sum ) \
+        > "${FILES_FILE}"
 }
 
-
 if [ $# -lt 2 ] ; then
     echo "Specify args."
-    echo "${0} ORG_IMAGE_TAG NEW_IMAGE_TAG"
+    echo "${0} ORG_IMAGE NEW_IMAGE_TAG [PROFILE]"
+    echo "  ORG_IMAGE: tag of an image on Docker, or path to a docker-archive"
+    echo "             or OCI image layout (directory or tarball)"
     exit 1
 fi
 ORG_IMAGE_TAG="${1}"
 NEW_IMAGE_TAG="${2}"
+PROFILE_FILE="${3}"
 
 # Path information of mkimage container.
 BUSYBOX_BIN=/busybox
 DROPBEAR_BIN=/dbclient
+SSH_BIN=$(which ssh)
 CASYNC_BIN=$(which casync)
 DESYNC_BIN=$(which desync)
 FUSERMOUNT_BIN=$(which fusermount)
 BOOT_BIN=/boot.src/boot
 DBCLIENT_Y_BIN=/boot.src/dbclient_y
+CAIBX_UTIL_BIN=/boot.src/caibx_util
+BMAN_UTIL_BIN=/boot.src/bman_util
+IMAGE_UTIL_BIN=/boot.src/image_util
 # Uncomment and switch if use casync as mount wrapper.
 # ARCHIVE_FILE=/rootfs.catar
 ARCHIVE_FILE=/rootfs.ar
 CAIBX_FILE=/rootfs.caibx
-ORG_ROOTFS_TAR=/org-rootfs.tar
+LAYERS_DIR=/rootfs.layers
+BIDX_FILE=/rootfs.bidx
 ORG_IMAGE_TAR=/org-image.tar
 
+# Format of the new image besides the docker-archive tarball: "oci" also
+# writes it as an OCI image layout.
+OUTPUT_FORMAT="${OUTPUT_FORMAT:-docker-archive}"
+
+# Conversion state of a previous version of the image (its output's state
+# directory), if given: chunks of its archive aren't written again.
+BASE_STATE_DIR="${BASE_STATE_DIR:-}"
+
+# How the rootfs gets into chunks: "stream" converts the layers straight
+# into chunks of the archive, writing out only /etc of the rootfs;
+# "extract" writes out the whole rootfs, then its archive with genisoimage,
+# then chunks of it.
+CONVERT_MODE="${CONVERT_MODE:-stream}"
+
+# What cuts the archive into chunks with CONVERT_MODE=extract: "native"
+# (caibx_util make, on all cores, checked against casync when the converter
+# is built) or "casync" (casync make). Both make the same chunks; streaming
+# always uses the native chunker.
+CHUNKER="${CHUNKER:-native}"
+
+# "1" keeps the layers of the original image when streaming: each becomes
+# an archive and index of its own, overlaid at boot, so images sharing
+# layers share their chunks (and their mounts, with bootfsd). Bases,
+# sidecars and profiles are for single archives and go unused.
+LAYERED="${LAYERED:-}"
+
+# "1" gives each file of 16 KiB or more chunk boundaries of its own when
+# streaming, so the same file makes the same chunks in unrelated images.
+CHUNK_BY_FILE="${CHUNK_BY_FILE:-}"
+
 # Path information of output directory.
 OUTPUT_DIR=/output
 ORG_ROOTFS_DIR="${OUTPUT_DIR}"/org-rootfs
@@ -104,7 +112,12 @@ ORG_IMAGE_DIR="${OUTPUT_DIR}"/org-image
 NEW_ROOTFS_DIR="${OUTPUT_DIR}"/new-rootfs
 NEW_IMAGE_DIR="${OUTPUT_DIR}"/new-image
 NEW_IMAGE_TAR="${OUTPUT_DIR}"/new-image.tar
+NEW_IMAGE_OCI_DIR="${OUTPUT_DIR}"/new-image.oci
 OUT_ROOTFS_STORE="${OUTPUT_DIR}"/rootfs.castr
+STATE_DIR="${OUTPUT_DIR}"/state
+STATE_ARCHIVE_FILE="${STATE_DIR}"/rootfs.ar
+STATE_CAIBX_FILE="${STATE_DIR}"/rootfs.caibx
+STATE_FILES_FILE="${STATE_DIR}"/rootfs.files
 
 # Path information of new rootfs.
 ROOTFS_LOWER_DIR="${NEW_ROOTFS_DIR}"/lower
@@ -116,16 +129,40 @@ ROOTFS_MOUNT_BOOTFS_DIR="${ROOTFS_LOWER_BOOTFS_DIR}"/rootfs
 ROOTFS_DEV_BOOTFS_DIR="${ROOTFS_LOWER_BOOTFS_DIR}"/rootfs.dev
 ROOTFS_CACHE_BOOTFS_DIR="${ROOTFS_LOWER_BOOTFS_DIR}"/rootfs.castr
 ROOTFS_ARCHIVE_BOOTFS_DIR="${ROOTFS_LOWER_BOOTFS_DIR}"/rootfs.ar
+ROOTFS_LAYERS_ARCHIVE_BOOTFS_DIR="${ROOTFS_LOWER_BOOTFS_DIR}"/rootfs.ar.layers
+ROOTFS_LAYERS_MOUNT_BOOTFS_DIR="${ROOTFS_LOWER_BOOTFS_DIR}"/rootfs.layers
+ROOTFS_LAYERS_BOOTFS_DIR="${ROOTFS_UPPER_BOOTFS_DIR}"/layers
 ROOTFS_CAIBX_BOOTFS_FILE="${ROOTFS_UPPER_BOOTFS_DIR}"/rootfs.caibx
-ROOTFS_ENTRYPOINT_MEMO_FILE="${ROOTFS_UPPER_BOOTFS_DIR}"/entrypoint_memo
+ROOTFS_BIDX_BOOTFS_FILE="${ROOTFS_UPPER_BOOTFS_DIR}"/rootfs.bidx
+ROOTFS_PROFILE_BOOTFS_FILE="${ROOTFS_UPPER_BOOTFS_DIR}"/rootfs.profile
+ROOTFS_BOOT_MANIFEST_FILE="${ROOTFS_UPPER_BOOTFS_DIR}"/boot.bman
+ROOTFS_CAIBX_ROOT_RELATIVE=/.bootfs/rootfs.caibx
+ROOTFS_BIDX_ROOT_RELATIVE=/.bootfs/rootfs.bidx
+ROOTFS_PROFILE_ROOT_RELATIVE=/.bootfs/rootfs.profile
+ROOTFS_LAYERS_ROOT_RELATIVE=/.bootfs/layers
 ROOTFS_BOOT_BIN_ROOT_RELATIVE=/bin/boot
 
-# Check Docker existance and original image pulled.
-docker -v
-check "Checking Docker existance."
-ORG_IMAGE_INFO=$(docker image ls "${ORG_IMAGE_TAG}" | sed "1d")
-if [ "${ORG_IMAGE_INFO}" == "" ] ; then
-    (>&2 echo "Fatal: Image \"${ORG_IMAGE_TAG}\" not found on your Docker. Pull it in advance.")
+# Check Docker existance and original image pulled, unless it's given as a
+# file.
+if [ -e "${ORG_IMAGE_TAG}" ] ; then
+    ORG_IMAGE_SRC="${ORG_IMAGE_TAG}"
+else
+    ORG_IMAGE_SRC="${ORG_IMAGE_TAR}"
+    docker -v
+    check "Checking Docker existance."
+    ORG_IMAGE_INFO=$(docker image ls "${ORG_IMAGE_TAG}" | sed "1d")
+    if [ "${ORG_IMAGE_INFO}" == "" ] ; then
+        (>&2 echo "Fatal: Image \"${ORG_IMAGE_TAG}\" not found on your Docker. Pull it in advance.")
+        exit 1;
+    fi
+fi
+
+if [ "${LAYERED}" == "1" ] && [ "${CONVERT_MODE}" != "stream" ] ; then
+    (>&2 echo "Fatal: LAYERED=1 needs CONVERT_MODE=stream.")
+    exit 1;
+fi
+if [ "${CHUNKER}" == "casync" ] && [ "${CONVERT_MODE}" != "extract" ] ; then
+    (>&2 echo "Fatal: CHUNKER=casync needs CONVERT_MODE=extract.")
     exit 1;
 fi
 
@@ -140,6 +177,7 @@ mkdir -p \
       "${NEW_ROOTFS_DIR}" \
       "${NEW_IMAGE_DIR}" \
       "${OUT_ROOTFS_STORE}" \
+      "${STATE_DIR}" \
       "${ROOTFS_LOWER_DIR}" \
       "${ROOTFS_UPPER_DIR}" \
       "${ROOTFS_BIN_DIR}" \
@@ -149,30 +187,107 @@ mkdir -p \
       "${ROOTFS_CACHE_BOOTFS_DIR}" \
       "${ROOTFS_ARCHIVE_BOOTFS_DIR}" \
       "${ROOTFS_MOUNT_BOOTFS_DIR}"
+if [ "${LAYERED}" == "1" ] ; then
+    mkdir -p \
+          "${LAYERS_DIR}" \
+          "${ROOTFS_LAYERS_BOOTFS_DIR}" \
+          "${ROOTFS_LAYERS_ARCHIVE_BOOTFS_DIR}" \
+          "${ROOTFS_LAYERS_MOUNT_BOOTFS_DIR}"
+fi
 
-# Extract original image and rootfs.
-echo "Saving original image..."
-docker save "${ORG_IMAGE_TAG}" -o "${ORG_IMAGE_TAR}"
-ORG_CONTAINER_ID=$(docker create "${ORG_IMAGE_TAG}")
-check "Creating target container."
-docker export "${ORG_CONTAINER_ID}" -o "${ORG_ROOTFS_TAR}"
-check "Exporting target rootfs."
-docker rm "${ORG_CONTAINER_ID}"
-check "Removing target container."
-tar xf "${ORG_IMAGE_TAR}" -C "${ORG_IMAGE_DIR}"
-check "Extracting original image."
-tar xf "${ORG_ROOTFS_TAR}" -C "${ORG_ROOTFS_DIR}"
-check "Extracting original rootfs."
-mkdir "${ORG_ROOTFS_DIR}"/dev \
-      "${ORG_ROOTFS_DIR}"/proc \
-      "${ORG_ROOTFS_DIR}"/sys
+# Extract original rootfs, applying layers straight out of the image, or
+# only its config and /etc when streaming.
+if [ "${ORG_IMAGE_SRC}" == "${ORG_IMAGE_TAR}" ] ; then
+    echo "Saving original image..."
+    docker save "${ORG_IMAGE_TAG}" -o "${ORG_IMAGE_TAR}"
+    check "Saving original image."
+fi
+ORG_IMAGE_CONFIG_JSON="${ORG_IMAGE_DIR}"/config.json
+MOUNTPOINTS=( /dev /proc /sys )
+if [ "${CONVERT_MODE}" == "stream" ] ; then
+    "${IMAGE_UTIL_BIN}" config "${ORG_IMAGE_SRC}" "${ORG_IMAGE_CONFIG_JSON}"
+    check "Reading original image config."
+else
+    "${IMAGE_UTIL_BIN}" flatten "${ORG_IMAGE_SRC}" "${ORG_ROOTFS_DIR}" \
+                        "${ORG_IMAGE_CONFIG_JSON}"
+    check "Extracting original rootfs."
+fi
+while read VOLUME_DIR ; do
+    MOUNTPOINTS+=( "${VOLUME_DIR}" ) # mountpoints in read-only rootfs
+done < <(jq -r '.config.Volumes // {} | keys[]' "${ORG_IMAGE_CONFIG_JSON}")
 
 # Generating archive file, caibx, castr from rootfs.
 echo "Generating casync related files..."
-genarchive "${ARCHIVE_FILE}" "${ORG_ROOTFS_DIR}"
-check "Generating rootfs archive."
-casync make --store="${OUT_ROOTFS_STORE}" "${CAIBX_FILE}" "${ARCHIVE_FILE}"
-check "Generating castr and caibx."
+BASE_OPTION=()
+if [ "${BASE_STATE_DIR}" != "" ] ; then
+    BASE_OPTION=( -i "${BASE_STATE_DIR}"/rootfs.caibx )
+fi
+CHUNK_OPTION=()
+if [ "${CHUNK_BY_FILE}" == "1" ] ; then
+    CHUNK_OPTION=( -f )
+fi
+if [ "${LAYERED}" == "1" ] ; then
+    MOUNTPOINT_OPTION=()
+    for MOUNTPOINT in "${MOUNTPOINTS[@]}" ; do
+        MOUNTPOINT_OPTION+=( -m "${MOUNTPOINT}" )
+    done
+    # N.caibx of each layer, lowest first, and one of the mountpoints on top.
+    "${IMAGE_UTIL_BIN}" convert -L "${CHUNK_OPTION[@]}" \
+                        -e "${ORG_ROOTFS_DIR}" "${MOUNTPOINT_OPTION[@]}" \
+                        "${ORG_IMAGE_SRC}" "${LAYERS_DIR}" "${OUT_ROOTFS_STORE}"
+    check "Generating castr and caibx of each layer from the image."
+elif [ "${CONVERT_MODE}" == "stream" ] ; then
+    MOUNTPOINT_OPTION=()
+    for MOUNTPOINT in "${MOUNTPOINTS[@]}" ; do
+        MOUNTPOINT_OPTION+=( -m "${MOUNTPOINT}" )
+    done
+    # Chunks of a base are matched by their IDs, as its archive isn't kept.
+    "${IMAGE_UTIL_BIN}" convert "${BASE_OPTION[@]}" "${CHUNK_OPTION[@]}" \
+                        -e "${ORG_ROOTFS_DIR}" "${MOUNTPOINT_OPTION[@]}" \
+                        "${ORG_IMAGE_SRC}" "${CAIBX_FILE}" "${OUT_ROOTFS_STORE}"
+    check "Generating castr and caibx from the image layers."
+    cp "${CAIBX_FILE}" "${STATE_CAIBX_FILE}"
+    check "Saving conversion state."
+else
+    for MOUNTPOINT in "${MOUNTPOINTS[@]}" ; do
+        mkdir -p "${ORG_ROOTFS_DIR}/${MOUNTPOINT}"
+    done
+    digest_files "${ORG_ROOTFS_DIR}" "${STATE_FILES_FILE}"
+    check "Digesting rootfs files."
+    if [ "${BASE_STATE_DIR}" != "" ] \
+           && cmp -s "${BASE_STATE_DIR}"/rootfs.files "${STATE_FILES_FILE}" ; then
+        echo "Rootfs unchanged, reusing the previous archive and index..."
+        cp "${BASE_STATE_DIR}"/rootfs.ar "${ARCHIVE_FILE}" \
+            && cp "${BASE_STATE_DIR}"/rootfs.caibx "${CAIBX_FILE}"
+        check "Reusing rootfs archive, castr and caibx."
+    else
+        genarchive "${ARCHIVE_FILE}" "${ORG_ROOTFS_DIR}"
+        check "Generating rootfs archive."
+        if [ "${CHUNKER}" == "casync" ] ; then
+            casync make --store="${OUT_ROOTFS_STORE}" "${CAIBX_FILE}" "${ARCHIVE_FILE}"
+        else
+            # Chunks on all cores.
+            if [ -e "${BASE_STATE_DIR}"/rootfs.ar ] ; then
+                BASE_OPTION=( -b "${BASE_STATE_DIR}"/rootfs.ar "${BASE_OPTION[@]}" )
+            fi
+            "${CAIBX_UTIL_BIN}" make "${BASE_OPTION[@]}" \
+                                "${ARCHIVE_FILE}" "${CAIBX_FILE}" "${OUT_ROOTFS_STORE}"
+        fi
+        check "Generating castr and caibx."
+    fi
+    cp "${ARCHIVE_FILE}" "${STATE_ARCHIVE_FILE}" \
+        && cp "${CAIBX_FILE}" "${STATE_CAIBX_FILE}"
+    check "Saving conversion state."
+fi
+if [ "${ORG_IMAGE_SRC}" == "${ORG_IMAGE_TAR}" ] ; then
+    rm "${ORG_IMAGE_TAR}"
+fi
+if [ "${LAYERED}" != "1" ] ; then
+    "${CAIBX_UTIL_BIN}" zero "${CAIBX_FILE}" \
+        || (>&2 echo "Warning: Failed to count zero chunks.")
+    "${CAIBX_UTIL_BIN}" sidecar "${CAIBX_FILE}" "${BIDX_FILE}"
+    check "Generating sidecar index."
+fi
 
 # Construct lower layer of rootfs.
 echo "Constructing rootfs lower layer..."
@@ -184,57 +299,63 @@ cp "${BUSYBOX_BIN}"    "${ROOTFS_BIN_DIR}"
 cp "${DESYNC_BIN}"     "${ROOTFS_BIN_DIR}"
 cp "${DROPBEAR_BIN}"   "${ROOTFS_BIN_DIR}"
 cp "${DBCLIENT_Y_BIN}" "${ROOTFS_BIN_DIR}"
-import_so_dependency "${FUSERMOUNT_BIN}" "${ROOTFS_LOWER_DIR}"
-# Uncomment if use casync as mount wrapper.
-# import_so_dependency "${CASYNC_BIN}"     "${ROOTFS_LOWER_DIR}" 
-import_so_dependency "${DESYNC_BIN}"     "${ROOTFS_LOWER_DIR}"
-import_so_dependency "${DROPBEAR_BIN}"   "${ROOTFS_LOWER_DIR}"
-find /lib -name "libnss*" | while read TARGET_SO  # for getpwuid() in SSH client
-do
-    ORG_TARGET_SO_DIR=$(dirname "${TARGET_SO}")
-    NEW_TARGET_SO_DIR="${ROOTFS_LOWER_DIR}/${ORG_TARGET_SO_DIR}"
-    mkdir -p "${NEW_TARGET_SO_DIR}"
-    cp "${TARGET_SO}" "${NEW_TARGET_SO_DIR}"
-done
+cp "${SSH_BIN}"        "${ROOTFS_BIN_DIR}"
+# Shared libraries of the dynamic binaries (with the NSS modules the
+# original image's nsswitch.conf names, for getpwuid() in SSH client).
+# Add "${CASYNC_BIN}" if use casync as mount wrapper.
+"${IMAGE_UTIL_BIN}" libs -n "${ORG_ROOTFS_DIR}"/etc/nsswitch.conf \
+                    "${ROOTFS_LOWER_DIR}" \
+                    "${FUSERMOUNT_BIN}" "${DESYNC_BIN}" "${DROPBEAR_BIN}" \
+                    "${SSH_BIN}"
+check "Importing shared libraries."
 
 # Construct upper layer of rootfs.
 echo "Constructing rootfs upper layer..."
 cp -r "${ORG_ROOTFS_DIR}"/etc "${ROOTFS_UPPER_DIR}" # for getpwuid() in SSH client
-ORG_IMAGE_MANIFEST_JSON="${ORG_IMAGE_DIR}"/manifest.json
-ORG_IMAGE_CONFIG_JSON="${ORG_IMAGE_DIR}"/$(jq -r '.[0].Config' "${ORG_IMAGE_MANIFEST_JSON}")
-cp "${CAIBX_FILE}" "${ROOTFS_CAIBX_BOOTFS_FILE}"
-jq '.config.Entrypoint' "${ORG_IMAGE_CONFIG_JSON}" > "${ROOTFS_ENTRYPOINT_MEMO_FILE}"
-check "Memorize entrypoint bin."
+if [ "${LAYERED}" == "1" ] ; then
+    INDEX_OPTION=()
+    for LAYER_CAIBX in $(ls "${LAYERS_DIR}" | sort -n) ; do
+        cp "${LAYERS_DIR}/${LAYER_CAIBX}" "${ROOTFS_LAYERS_BOOTFS_DIR}"
+        check "Copying caibx of layer ${LAYER_CAIBX}."
+        INDEX_OPTION+=( -l "${ROOTFS_LAYERS_ROOT_RELATIVE}/${LAYER_CAIBX}" )
+    done
+else
+    cp "${CAIBX_FILE}" "${ROOTFS_CAIBX_BOOTFS_FILE}"
+    cp "${BIDX_FILE}" "${ROOTFS_BIDX_BOOTFS_FILE}"
+    INDEX_OPTION=( -i "${ROOTFS_CAIBX_ROOT_RELATIVE}"
+                   -b "${ROOTFS_BIDX_ROOT_RELATIVE}" )
+    if [ "${PROFILE_FILE}" != "" ] ; then
+        cp "${PROFILE_FILE}" "${ROOTFS_PROFILE_BOOTFS_FILE}"
+        check "Copying startup profile."
+        INDEX_OPTION+=( -p "${ROOTFS_PROFILE_ROOT_RELATIVE}" )
+    fi
+fi
+"${BMAN_UTIL_BIN}" make "${ORG_IMAGE_CONFIG_JSON}" "${ORG_ROOTFS_DIR}" \
+                   "${ROOTFS_BOOT_MANIFEST_FILE}" \
+                   -a iso9660 \
+                   "${INDEX_OPTION[@]}"
+check "Generating boot manifest."
 
 # Generate new image.
 echo "Generating new image..."
-NEW_IMAGE_MANIFEST_JSON="${NEW_IMAGE_DIR}"/manifest.json
-NEW_IMAGE_CONFIG_JSON="${NEW_IMAGE_DIR}"/org-config.json
-cat "${ORG_IMAGE_CONFIG_JSON}" \
-    | jq '.config.Entrypoint = [ "'"${ROOTFS_BOOT_BIN_ROOT_RELATIVE}"'" ]' \
-    | jq '.history = []' \
-    | jq '.rootfs.diff_ids = []' > "${NEW_IMAGE_CONFIG_JSON}"
-check "Generating new image config json."
-cat "${ORG_IMAGE_MANIFEST_JSON}" \
-    | jq '.[0].Layers = []' > "${NEW_IMAGE_MANIFEST_JSON}"
-check "Generating new image manifest json."
-install_layer "${ROOTFS_LOWER_DIR}" \
-              "${NEW_IMAGE_DIR}" \
-              "${NEW_IMAGE_MANIFEST_JSON}" \
-              "${NEW_IMAGE_CONFIG_JSON}"
-install_layer "${ROOTFS_UPPER_DIR}" \
-              "${NEW_IMAGE_DIR}" \
-              "${NEW_IMAGE_MANIFEST_JSON}" \
-              "${NEW_IMAGE_CONFIG_JSON}"
-CONFIG_HASH=$(sha256sum "${NEW_IMAGE_CONFIG_JSON}" | sed -E 's/^([^ ]*).+$/\1/g')
-mv "${NEW_IMAGE_CONFIG_JSON}" "${NEW_IMAGE_DIR}/${CONFIG_HASH}.json"
-TMPFILE=$(mktemp)
-jq '.[0].Config = "'"${CONFIG_HASH}.json"'" | .[0].RepoTags = [ "'"${NEW_IMAGE_TAG}"'" ]' \
-   "${NEW_IMAGE_MANIFEST_JSON}" > "${TMPFILE}"
-cat "${TMPFILE}" > "${NEW_IMAGE_MANIFEST_JSON}"
+OCI_OPTION=()
+if [ "${OUTPUT_FORMAT}" == "oci" ] ; then
+    OCI_OPTION=( -o "${NEW_IMAGE_OCI_DIR}" )
+fi
+# Layers (deterministic tarballs of the rootfs dirs), config and manifests
+# of the new image, also as an OCI layout if asked.
+"${IMAGE_UTIL_BIN}" write -t "${NEW_IMAGE_TAG}" "${OCI_OPTION[@]}" \
+                    "${ORG_IMAGE_CONFIG_JSON}" "${ROOTFS_BOOT_BIN_ROOT_RELATIVE}" \
+                    "${NEW_IMAGE_DIR}" \
+                    "${ROOTFS_LOWER_DIR}" "${ROOTFS_UPPER_DIR}"
+check "Generating new image."
 tar cf "${NEW_IMAGE_TAR}" --directory="${NEW_IMAGE_DIR}" .
 check "Generating new image tarball."
 
-# Load new image.
-docker load -i "${NEW_IMAGE_TAR}"
-check "Loading new image."
+# Load new image, where there's a Docker daemon.
+if docker info > /dev/null 2>&1 ; then
+    docker load -i "${NEW_IMAGE_TAR}"
+    check "Loading new image."
+else
+    echo "No Docker daemon; the new image is at ${NEW_IMAGE_TAR}."
+fi